@@ -60,16 +60,19 @@ do_nameonly(struct lu_context *ctx, const char *name,
 static void
 do_full(struct lu_context *ctx, const char *name,
 	GPtrArray *(*enumerate_full) (struct lu_context *, const char *,
-				   struct lu_error **),
+				      struct lu_ent_arena *,
+				      struct lu_error **),
 	const char *name_attribute, const char *id_attribute,
 	const char *id_descr)
 {
+	struct lu_ent_arena *arena;
 	GPtrArray *entities;
 	struct lu_error *error;
 
 	error = NULL;
 
-	entities = enumerate_full(ctx, name, &error);
+	arena = lu_ent_arena_new();
+	entities = enumerate_full(ctx, name, arena, &error);
 	if (error != NULL) {
 		fprintf(stderr, _("Error looking up %s: %s\n"), name,
 			lu_strerror(error));
@@ -93,10 +96,10 @@ do_full(struct lu_context *ctx, const char *name,
 					id_descr, (intmax_t)id);
 			else
 				g_print(" %s\n", ent_name);
-			lu_ent_free(ent);
 		}
 		g_ptr_array_free(entities, TRUE);
 	}
+	lu_ent_arena_free(arena);
 }
 
 int
@@ -203,10 +206,12 @@ main(int argc, const char **argv)
 			    : lu_groups_enumerate_by_user);
 	else {
 		if (groupflag)
-			do_full(ctx, name, lu_users_enumerate_by_group_full,
+			do_full(ctx, name,
+				lu_users_enumerate_by_group_full_arena,
 				LU_USERNAME, LU_UIDNUMBER, "uid");
 		else
-			do_full(ctx, name, lu_groups_enumerate_by_user_full,
+			do_full(ctx, name,
+				lu_groups_enumerate_by_user_full_arena,
 				LU_GROUPNAME, LU_GIDNUMBER, "gid");
 	}
 
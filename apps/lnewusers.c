@@ -28,14 +28,598 @@
 #include "../lib/user.h"
 #include "apputil.h"
 
+/* A parsed input line. */
+struct record {
+	char **fields;
+	uid_t uid;
+	/* The group field, or the user name if it is empty */
+	const char *gidstring;
+	/* The GID in gidstring, or LU_VALUE_INVALID_ID if it is a group name */
+	gid_t gid;
+	char *homedir;
+	struct lu_ent *ent;
+};
+
+/* Parse and validate BUF (modifying it), and store the result in REC.
+   Return TRUE if the line is valid, report an error and return FALSE
+   otherwise. */
+static gboolean
+parse_line(char *buf, struct record *rec)
+{
+	char **fields, *p;
+	intmax_t imax;
+
+	/* Strip off the end-of-line terminators. */
+	p = strchr(buf, '\r');
+	if (p != NULL)
+		*p = '\0';
+	p = strchr(buf, '\n');
+	if (p != NULL)
+		*p = '\0';
+
+	/* Make sure the line splits into *exactly* seven fields. */
+	fields = g_strsplit(buf, ":", 7);
+	if (g_strv_length(fields) != 7) {
+		fprintf(stderr,
+			_("Error creating account for `%s': line improperly "
+			  "formatted.\n"), buf);
+		goto err_fields;
+	}
+
+	errno = 0;
+	imax = strtoimax(fields[2], &p, 10);
+	if (errno != 0 || *p != 0 || p == fields[2] || (uid_t)imax != imax
+	    || (uid_t)imax == LU_VALUE_INVALID_ID) {
+		g_print(_("Invalid user ID %s\n"), fields[2]);
+		goto err_fields;
+	}
+	/* Sorry, but we're bastards here.  No root accounts. */
+	rec->uid = imax;
+	if (rec->uid == 0) {
+		g_print(_("Refusing to create account with UID 0.\n"));
+		goto err_fields;
+	}
+
+	/* Try to figure out if the field is the name of a group, or a gid.
+	 * If it's just empty, make it the same as the user's name.  FIXME:
+	 * provide some way to set a default other than the user's own name,
+	 * like "users" or something. */
+	if (strlen(fields[3]) > 0)
+		rec->gidstring = fields[3];
+	else
+		rec->gidstring = fields[0];
+
+	/* Try to convert the field to a number. */
+	errno = 0;
+	imax = strtoimax(rec->gidstring, &p, 10);
+	rec->gid = LU_VALUE_INVALID_ID;
+	if (errno == 0 && *p == '\0' && p != rec->gidstring
+	    && (gid_t)imax == imax) {
+		rec->gid = imax;
+		if (rec->gid == LU_VALUE_INVALID_ID) {
+			g_print(_("Invalid group ID %s\n"), rec->gidstring);
+			goto err_fields;
+		}
+	}
+	rec->fields = fields;
+	rec->homedir = NULL;
+	rec->ent = NULL;
+	return TRUE;
+
+err_fields:
+	g_strfreev(fields);
+	return FALSE;
+}
+
+/* Fill ENT with a new user record for REC, except for the primary GID, and
+   set REC->homedir.  Return FALSE (after reporting an error) if the home
+   directory is unsafe. */
+static gboolean
+prepare_user(struct lu_context *ctx, struct record *rec, struct lu_ent *ent)
+{
+	char **fields;
+
+	fields = rec->fields;
+	lu_user_default(ctx, fields[0], FALSE, ent);
+	lu_ent_set_id(ent, LU_UIDNUMBER, rec->uid);
+
+	/* Set other fields if we've got them. */
+	if (strlen(fields[4]) > 0)
+		lu_ent_set_string(ent, LU_GECOS, fields[4]);
+	if (strlen(fields[5]) > 0) {
+		rec->homedir = g_strdup(fields[5]);
+		lu_ent_set_string(ent, LU_HOMEDIRECTORY, rec->homedir);
+	} else {
+		const char *home;
+
+		home = lu_ent_get_first_string(ent, LU_HOMEDIRECTORY);
+		if (home != NULL)
+			rec->homedir = g_strdup(home);
+		else {
+			rec->homedir = g_strconcat("/home/", fields[0],
+						   (const gchar *)NULL);
+			if (strcmp(fields[0], ".") == 0
+			    || strcmp(fields[0], "..") == 0) {
+				fprintf(stderr,
+					_("Refusing to use dangerous home "
+					  "directory `%s' for %s by "
+					  "default\n"), rec->homedir,
+					fields[0]);
+				return FALSE;
+			}
+		}
+	}
+	if (strlen(fields[6]) > 0)
+		lu_ent_set_string(ent, LU_LOGINSHELL, fields[6]);
+	return TRUE;
+}
+
+/* Create a home directory and a mail spool for a newly added user ENT
+   described by REC, unless disabled. */
+static void
+create_home_and_mail(struct lu_context *ctx, const struct record *rec,
+		     struct lu_ent *ent, gboolean nocreatehome,
+		     gboolean nocreatemail)
+{
+	struct lu_error *error = NULL;
+
+	/* Unless the nocreatehomedirs flag was given, attempt to create the
+	 * user's home directory. */
+	if (!nocreatehome) {
+		if (lu_homedir_populate(ctx, NULL, rec->homedir, rec->uid,
+					lu_ent_get_first_id(ent,
+							    LU_GIDNUMBER),
+					0700, &error) == FALSE) {
+			fprintf(stderr,
+				_("Error creating home directory for %s: "
+				  "%s\n"), rec->fields[0], lu_strerror(error));
+			if (error) {
+				lu_error_free(&error);
+			}
+		}
+	}
+	/* Unless the nocreatemail flag was given, give the user a mail
+	 * spool. */
+	if (!nocreatemail) {
+		if (!lu_mail_spool_create(ctx, ent, &error)) {
+			fprintf(stderr,
+				_("Error creating mail spool for %s: %s\n"),
+				rec->fields[0], lu_strerror(error));
+			if (error) {
+				lu_error_free(&error);
+			}
+		}
+	}
+}
+
+/* Set the initial password of a newly added user ENT described by REC to
+   PASSWORD, which is already encrypted if CRYPTED. */
+static void
+set_initial_password(struct lu_context *ctx, const struct record *rec,
+		     struct lu_ent *ent, const char *password,
+		     gboolean crypted)
+{
+	struct lu_error *error = NULL;
+
+	if (!lu_user_setpass(ctx, ent, password, crypted, &error)) {
+		fprintf(stderr,
+			_("Error setting initial password for %s: %s\n"),
+			rec->fields[0], lu_strerror(error));
+		if (error) {
+			lu_error_free(&error);
+		}
+	}
+}
+
+/* Create a group for REC using GROUP_ENT, which is overwritten.  Return the
+   new group's GID, or LU_VALUE_INVALID_ID (after reporting an error). */
+static gid_t
+create_group(struct lu_context *ctx, const struct record *rec,
+	     struct lu_ent *group_ent)
+{
+	struct lu_error *error = NULL;
+	gid_t gid;
+
+	/* If we got a GID, then we need to use the user's name, otherwise we
+	 * need to use the default group name. */
+	if (rec->gid != LU_VALUE_INVALID_ID) {
+		lu_group_default(ctx, rec->fields[0], FALSE, group_ent);
+		lu_ent_set_id(group_ent, LU_GIDNUMBER, rec->gid);
+	} else {
+		lu_group_default(ctx, rec->gidstring, FALSE, group_ent);
+	}
+	/* Try to create the group, and if it works, get its GID, which we
+	 * need to give to this user. */
+	if (!lu_group_add(ctx, group_ent, &error)) {
+		/* Aargh!  Abandon all hope. */
+		fprintf(stderr,
+			_("Error creating group for `%s' with GID %jd: %s\n"),
+			rec->fields[0], (intmax_t)rec->gid,
+			lu_strerror(error));
+		if (error) {
+			lu_error_free(&error);
+		}
+		return LU_VALUE_INVALID_ID;
+	}
+	gid = lu_ent_get_first_id(group_ent, LU_GIDNUMBER);
+	g_assert(gid != LU_VALUE_INVALID_ID);
+	return gid;
+}
+
+/* Create an account for a single line in BUF, writing it out immediately. */
+static void
+process_line(struct lu_context *ctx, char *buf, struct lu_ent *ent,
+	     gboolean nocreatehome, gboolean nocreatemail)
+{
+	struct lu_error *error = NULL;
+	struct record rec;
+	gboolean creategroup;
+	gid_t gid;
+
+	if (!parse_line(buf, &rec))
+		return;
+
+	if (rec.gid == LU_VALUE_INVALID_ID) {
+		/* It's not a number, so it's a group name -- see if it's being
+		 * used. */
+		creategroup = !lu_group_lookup_name(ctx, rec.gidstring, ent,
+						    &error);
+	} else {
+		/* It's a group number -- see if it's being used. */
+		creategroup = !lu_group_lookup_id(ctx, rec.gid, ent, &error);
+	}
+	if (error) {
+		lu_error_free(&error);
+	}
+	if (creategroup) {
+		gid = create_group(ctx, &rec, ent);
+		if (gid == LU_VALUE_INVALID_ID)
+			goto done;
+		lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
+	} else
+		/* Retrieve the group's GID. */
+		gid = lu_ent_get_first_id(ent, LU_GIDNUMBER);
+
+	/* Create a new user record, and set the user's primary GID. */
+	if (!prepare_user(ctx, &rec, ent))
+		goto done;
+	lu_ent_set_id(ent, LU_GIDNUMBER, gid);
+
+	/* Now try to add the user's account. */
+	if (lu_user_add(ctx, ent, &error)) {
+		lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
+		create_home_and_mail(ctx, &rec, ent, nocreatehome,
+				     nocreatemail);
+		/* Set the password after creating the home directory to
+		   prevent the user from seeing an incomplete home, and to
+		   prevent the user from interfering with the creation of the
+		   home directory. */
+		set_initial_password(ctx, &rec, ent, rec.fields[1], FALSE);
+		lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
+	} else {
+		fprintf(stderr, _("Error creating user account for %s: %s\n"),
+			rec.fields[0], lu_strerror(error));
+		if (error) {
+			lu_error_free(&error);
+		}
+	}
+
+done:
+	g_free(rec.homedir);
+	g_strfreev(rec.fields);
+	lu_ent_clear_all(ent);
+}
+
+/* Record that group NAME with GID exists in the snapshot in NAMES and GIDS. */
+static void
+group_snapshot_add(GHashTable *names, GHashTable *gids, const char *name,
+		   gid_t gid)
+{
+	g_hash_table_insert(names, g_strdup(name), GUINT_TO_POINTER(gid));
+	g_hash_table_insert(gids, GUINT_TO_POINTER(gid), NULL);
+}
+
+/* Load all existing groups into NAMES and GIDS. */
+static gboolean
+group_snapshot_load(struct lu_context *ctx, GHashTable *names,
+		    GHashTable *gids, struct lu_error **error)
+{
+	GPtrArray *groups;
+	size_t i;
+
+	groups = lu_groups_enumerate_full(ctx, "*", error);
+	if (*error != NULL) {
+		if (groups != NULL) {
+			for (i = 0; i < groups->len; i++)
+				lu_ent_free(g_ptr_array_index(groups, i));
+			g_ptr_array_free(groups, TRUE);
+		}
+		return FALSE;
+	}
+	if (groups == NULL)
+		return TRUE;
+	for (i = 0; i < groups->len; i++) {
+		struct lu_ent *group;
+		const char *name;
+		gid_t gid;
+
+		group = g_ptr_array_index(groups, i);
+		name = lu_ent_get_first_string(group, LU_GROUPNAME);
+		gid = lu_ent_get_first_id(group, LU_GIDNUMBER);
+		if (name != NULL && gid != LU_VALUE_INVALID_ID
+		    && !g_hash_table_lookup_extended(names, name, NULL, NULL))
+			group_snapshot_add(names, gids, name, gid);
+		lu_ent_free(group);
+	}
+	g_ptr_array_free(groups, TRUE);
+	return TRUE;
+}
+
+/* After a failed commit described by COMMIT_ERROR, find out which of the
+   users in RECORDS were added anyway.  Replace their entities by the stored
+   ones, and report and forget the rest. */
+static void
+keep_committed_users(struct lu_context *ctx, GArray *records,
+		     struct lu_error *commit_error)
+{
+	struct lu_error *error = NULL;
+	GValueArray *names;
+	GPtrArray *found;
+	GHashTable *users;
+	GHashTableIter iter;
+	gpointer ent_value;
+	GValue value;
+	size_t i;
+
+	names = g_value_array_new(records->len);
+	memset(&value, 0, sizeof(value));
+	g_value_init(&value, G_TYPE_STRING);
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent == NULL)
+			continue;
+		g_value_set_string(&value, rec->fields[0]);
+		g_value_array_append(names, &value);
+	}
+	g_value_unset(&value);
+	found = lu_users_lookup_names(ctx, names, &error);
+	g_value_array_free(names);
+	if (error != NULL)
+		lu_error_free(&error);
+
+	/* User name -> entity not yet claimed by a record */
+	users = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; found != NULL && i < found->len; i++) {
+		struct lu_ent *ent;
+		const char *name;
+
+		ent = g_ptr_array_index(found, i);
+		name = lu_ent_get_first_string(ent, LU_USERNAME);
+		if (name != NULL && g_hash_table_lookup(users, name) == NULL)
+			g_hash_table_insert(users, (char *)name, ent);
+		else
+			lu_ent_free(ent);
+	}
+	if (found != NULL)
+		g_ptr_array_free(found, TRUE);
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+		struct lu_ent *ent;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent == NULL)
+			continue;
+		lu_ent_free(rec->ent);
+		ent = g_hash_table_lookup(users, rec->fields[0]);
+		if (ent != NULL)
+			g_hash_table_remove(users, rec->fields[0]);
+		else
+			fprintf(stderr,
+				_("Error creating user account for %s: %s\n"),
+				rec->fields[0], lu_strerror(commit_error));
+		rec->ent = ent;
+	}
+	g_hash_table_iter_init(&iter, users);
+	while (g_hash_table_iter_next(&iter, NULL, &ent_value))
+		lu_ent_free(ent_value);
+	g_hash_table_destroy(users);
+}
+
+/* Read all of FP, then create all valid accounts, writing out the account
+   database only once.  Return the exit status. */
+static int
+process_batch(struct lu_context *ctx, FILE *fp, gboolean nocreatehome,
+	      gboolean nocreatemail)
+{
+	struct lu_error *error = NULL;
+	struct lu_ent *group_ent;
+	GArray *records;
+	GHashTable *group_names, *group_ids;
+	GPtrArray *passwords;
+	char buf[LINE_MAX], **crypted;
+	size_t i, j;
+	gboolean failed;
+	int result;
+
+	/* Parse and validate everything first. */
+	records = g_array_new(FALSE, FALSE, sizeof(struct record));
+	while (fgets(buf, sizeof(buf), fp)) {
+		struct record rec;
+
+		if (parse_line(buf, &rec))
+			g_array_append_val(records, rec);
+	}
+
+	result = 1;
+	failed = FALSE;
+	group_names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					    NULL);
+	group_ids = g_hash_table_new(g_direct_hash, g_direct_equal);
+	if (!group_snapshot_load(ctx, group_names, group_ids, &error)) {
+		fprintf(stderr, _("Error reading group list: %s\n"),
+			lu_strerror(error));
+		lu_error_free(&error);
+		goto err_snapshot;
+	}
+
+	/* Add all groups and users. */
+	if (!lu_transaction_begin(ctx, &error)) {
+		fprintf(stderr, _("Error starting a transaction: %s\n"),
+			lu_strerror(error));
+		lu_error_free(&error);
+		goto err_snapshot;
+	}
+	group_ent = lu_ent_new();
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+		gpointer value;
+		gid_t gid;
+
+		rec = &g_array_index(records, struct record, i);
+		rec->ent = lu_ent_new();
+		if (!prepare_user(ctx, rec, rec->ent))
+			goto err_ent;
+
+		if (rec->gid == LU_VALUE_INVALID_ID) {
+			if (g_hash_table_lookup_extended(group_names,
+							 rec->gidstring, NULL,
+							 &value))
+				gid = GPOINTER_TO_UINT(value);
+			else
+				gid = LU_VALUE_INVALID_ID;
+		} else if (g_hash_table_lookup_extended
+			   (group_ids, GUINT_TO_POINTER(rec->gid), NULL, NULL))
+			gid = rec->gid;
+		else
+			gid = LU_VALUE_INVALID_ID;
+		if (gid == LU_VALUE_INVALID_ID) {
+			gid = create_group(ctx, rec, group_ent);
+			if (gid == LU_VALUE_INVALID_ID)
+				goto err_ent;
+			group_snapshot_add(group_names, group_ids,
+					   lu_ent_get_first_string
+					   (group_ent, LU_GROUPNAME), gid);
+			lu_ent_clear_all(group_ent);
+		}
+
+		lu_ent_set_id(rec->ent, LU_GIDNUMBER, gid);
+		if (!lu_user_add(ctx, rec->ent, &error)) {
+			fprintf(stderr,
+				_("Error creating user account for %s: %s\n"),
+				rec->fields[0], lu_strerror(error));
+			if (error) {
+				lu_error_free(&error);
+			}
+			goto err_ent;
+		}
+		continue;
+
+	err_ent:
+		lu_ent_free(rec->ent);
+		rec->ent = NULL;
+	}
+	lu_ent_free(group_ent);
+	if (!lu_transaction_commit(ctx, &error)) {
+		fprintf(stderr, _("Error writing account data: %s\n"),
+			lu_strerror(error));
+		/* Some modules may have committed their changes anyway;
+		   finish setting up the users that exist. */
+		keep_committed_users(ctx, records, error);
+		lu_error_free(&error);
+		failed = TRUE;
+	}
+
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent != NULL)
+			create_home_and_mail(ctx, rec, rec->ent, nocreatehome,
+					     nocreatemail);
+	}
+
+	/* Set the passwords after creating the home directories, see
+	   process_line(). */
+	/* Hashing is by far the slowest part, so do it for all users at
+	   once. */
+	passwords = g_ptr_array_new();
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent != NULL)
+			g_ptr_array_add(passwords, rec->fields[1]);
+	}
+	crypted = lu_crypt_passwords(ctx, (const char *const *)passwords->pdata,
+				     passwords->len, &error);
+	g_ptr_array_free(passwords, TRUE);
+	if (crypted == NULL) {
+		/* Fall back to setting the passwords one by one. */
+		fprintf(stderr, _("Error encrypting passwords: %s\n"),
+			lu_strerror(error));
+		lu_error_free(&error);
+	}
+	if (!lu_transaction_begin(ctx, &error)) {
+		fprintf(stderr, _("Error starting a transaction: %s\n"),
+			lu_strerror(error));
+		lu_error_free(&error);
+		g_strfreev(crypted);
+		goto err_nscd;
+	}
+	j = 0;
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent == NULL)
+			continue;
+		if (crypted != NULL)
+			set_initial_password(ctx, rec, rec->ent, crypted[j],
+					     TRUE);
+		else
+			set_initial_password(ctx, rec, rec->ent,
+					     rec->fields[1], FALSE);
+		j++;
+	}
+	g_strfreev(crypted);
+	if (!lu_transaction_commit(ctx, &error)) {
+		fprintf(stderr, _("Error writing account data: %s\n"),
+			lu_strerror(error));
+		lu_error_free(&error);
+		goto err_nscd;
+	}
+	if (!failed)
+		result = 0;
+
+err_nscd:
+	lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
+	lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
+	for (i = 0; i < records->len; i++) {
+		struct record *rec;
+
+		rec = &g_array_index(records, struct record, i);
+		if (rec->ent != NULL)
+			lu_ent_free(rec->ent);
+		g_free(rec->homedir);
+		g_strfreev(rec->fields);
+	}
+err_snapshot:
+	g_hash_table_destroy(group_ids);
+	g_hash_table_destroy(group_names);
+	g_array_free(records, TRUE);
+	return result;
+}
+
 int
 main(int argc, const char **argv)
 {
 	struct lu_context *ctx = NULL;
 	struct lu_error *error = NULL;
 	struct lu_ent *ent = NULL;
-	struct lu_ent *groupEnt = NULL;
 	int interactive = FALSE, nocreatehome = FALSE, nocreatemail = FALSE;
+	int batch = FALSE;
 	int c;
 	int result;
 	char *file = NULL;
@@ -43,6 +627,9 @@ main(int argc, const char **argv)
 	char buf[LINE_MAX];
 	poptContext popt;
 	struct poptOption options[] = {
+		{"batch", 'b', POPT_ARG_NONE, &batch, 0,
+		 N_("read all records first and write account data once"),
+		 NULL},
 		{"interactive", 'i', POPT_ARG_NONE, &interactive, 0,
 		 N_("prompt for all information"), NULL},
 		{"file", 'f', POPT_ARG_STRING, &file, 0,
@@ -96,222 +683,18 @@ main(int argc, const char **argv)
 		fp = stdin;
 	}
 
-	ent = lu_ent_new();
-	groupEnt = lu_ent_new();
-
-	while (fgets(buf, sizeof(buf), fp)) {
-		gboolean creategroup, dubious_homedir;
-		char **fields, *homedir, *gidstring, *p;
-		intmax_t imax;
-		uid_t uid;
-		gid_t gid;
-
-		/* Strip off the end-of-line terminators. */
-		p = strchr(buf, '\r');
-		if (p != NULL)
-			*p = '\0';
-		p = strchr(buf, '\n');
-		if (p != NULL)
-			*p = '\0';
-
-		/* Make sure the line splits into *exactly* seven fields. */
-		fields = g_strsplit(buf, ":", 7);
-		if (g_strv_length(fields) != 7) {
-			fprintf(stderr,
-				_("Error creating account for `%s': line "
-				  "improperly formatted.\n"), buf);
-			g_strfreev(fields);
-			continue;
-		}
-
-		errno = 0;
-		imax = strtoimax(fields[2], &p, 10);
-		if (errno != 0 || *p != 0 || p == fields[2]
-		    || (uid_t)imax != imax
-		    || (uid_t)imax == LU_VALUE_INVALID_ID) {
-			g_print(_("Invalid user ID %s\n"), fields[2]);
-			g_strfreev(fields);
-			continue;
-		}
-		/* Sorry, but we're bastards here.  No root accounts. */
-		uid = imax;
-		if (uid == 0) {
-			g_print(_("Refusing to create account with UID 0.\n"));
-			g_strfreev(fields);
-			continue;
-		}
-
-		/* Try to figure out if the field is the name of a group, or
-		 * a gid.  If it's just empty, make it the same as the user's
-		 * name.  FIXME: provide some way to set a default other than
-		 * the user's own name, like "users" or something. */
-		if (strlen(fields[3]) > 0) {
-			gidstring = fields[3];
-		} else {
-			gidstring = fields[0];
-		}
-
-		/* Try to convert the field to a number. */
-		errno = 0;
-		imax = strtoimax(gidstring, &p, 10);
-		gid = LU_VALUE_INVALID_ID;
-		if (errno != 0 || *p != '\0' || p == gidstring
-		    || (gid_t)imax != imax) {
-			/* It's not a number, so it's a group name --
-			 * see if it's being used. */
-			if (lu_group_lookup_name(ctx, gidstring, ent, &error)) {
-				/* Retrieve the group's GID. */
-				gid = lu_ent_get_first_id(ent, LU_GIDNUMBER);
-				creategroup = FALSE;
-			} else {
-				/* Mark that we need to create a group for the
-				 * user to be in. */
-				creategroup = TRUE;
-			}
-		} else {
-			/* It's a group number -- see if it's being used. */
-			gid = imax;
-			if (gid == LU_VALUE_INVALID_ID) {
-				g_print(_("Invalid group ID %s\n"), gidstring);
-				g_strfreev(fields);
-				continue;
-			}
-			if (lu_group_lookup_id(ctx, gid, ent, &error)) {
-				/* Retrieve the group's GID. */
-				gid = lu_ent_get_first_id(ent, LU_GIDNUMBER);
-				creategroup = FALSE;
-			} else {
-				/* Mark that we need to create a group for the
-				 * user to be in. */
-				creategroup = TRUE;
-			}
-		}
-		/* If we need to create a group, create a template group and
-		 * try to apply what the user has asked us to. */
-		if (creategroup) {
-			/* If we got a GID, then we need to use the user's name,
-			 * otherwise we need to use the default group name. */
-			if (gid != LU_VALUE_INVALID_ID) {
-				lu_group_default(ctx, fields[0], FALSE, ent);
-				lu_ent_set_id(ent, LU_GIDNUMBER, gid);
-			} else {
-				lu_group_default(ctx, gidstring, FALSE, ent);
-			}
-			/* Try to create the group, and if it works, get its
-			 * GID, which we need to give to this user. */
-			if (lu_group_add(ctx, ent, &error)) {
-				lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
-				gid = lu_ent_get_first_id(ent, LU_GIDNUMBER);
-				g_assert(gid != LU_VALUE_INVALID_ID);
-			} else {
-				/* Aargh!  Abandon all hope. */
-				fprintf(stderr,
-					_("Error creating group for `%s' with "
-					  "GID %jd: %s\n"), fields[0], imax,
-					lu_strerror(error));
-				g_strfreev(fields);
-				continue;
-			}
-		}
-
-		/* Create a new user record, and set the user's primary GID. */
-		lu_user_default(ctx, fields[0], FALSE, ent);
-		lu_ent_set_id(ent, LU_UIDNUMBER, uid);
-		lu_ent_set_id(ent, LU_GIDNUMBER, gid);
-
-		/* Set other fields if we've got them. */
-		if (strlen(fields[4]) > 0)
-			lu_ent_set_string(ent, LU_GECOS, fields[4]);
-		dubious_homedir = 0;
-		if (strlen(fields[5]) > 0) {
-			homedir = g_strdup(fields[5]);
-			lu_ent_set_string(ent, LU_HOMEDIRECTORY, homedir);
-		} else {
-			const char *home;
-
-			home = lu_ent_get_first_string(ent, LU_HOMEDIRECTORY);
-			if (home != NULL)
-				homedir = g_strdup(home);
-			else {
-				homedir = g_strconcat("/home/", fields[0],
-						      (const gchar *)NULL);
-				if (strcmp(fields[0], ".") == 0
-				    || strcmp(fields[0], "..") == 0)
-					dubious_homedir = 1;
-			}
-		}
-		if (strlen(fields[6]) > 0)
-			lu_ent_set_string(ent, LU_LOGINSHELL, fields[6]);
-
-		/* Now try to add the user's account. */
-		if (dubious_homedir)
-			fprintf(stderr,
-				_("Refusing to use dangerous home directory `%s' "
-				  "for %s by default\n"), homedir, fields[0]);
-		else if (lu_user_add(ctx, ent, &error)) {
-			lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
-			/* Unless the nocreatehomedirs flag was given, attempt
-			 * to create the user's home directory. */
-			if (!nocreatehome) {
-				if (lu_homedir_populate(ctx, NULL, homedir,
-							uid, gid, 0700, &error)
-				    == FALSE) {
-					fprintf(stderr,
-						_("Error creating home "
-						  "directory for %s: %s\n"),
-						fields[0], lu_strerror(error));
-					if (error) {
-						lu_error_free(&error);
-					}
-				}
-			}
-			/* Unless the nocreatemail flag was given, give the
-			 * user a mail spool. */
-			if (!nocreatemail) {
-				if (!lu_mail_spool_create(ctx, ent, &error)) {
-					fprintf(stderr,
-						_("Error creating mail spool "
-						  "for %s: %s\n"), fields[0],
-						lu_strerror(error));
-					if (error) {
-						lu_error_free(&error);
-					}
-				}
-			}
-			/* Set the password after creating the home directory
-			   to prevent the user from seeing an incomplete
-			   home, and to prevent the user from interfering with
-			   the creation of the home directory. */
-			if (!lu_user_setpass(ctx, ent, fields[1], FALSE,
-					     &error)) {
-				fprintf(stderr,
-					_("Error setting initial password for "
-					  "%s: %s\n"), fields[0],
-					lu_strerror(error));
-				if (error) {
-					lu_error_free(&error);
-				}
-			}
-			lu_nscd_flush_cache(LU_NSCD_CACHE_PASSWD);
-		} else {
-			fprintf(stderr,
-				_("Error creating user account for %s: %s\n"),
-				fields[0], lu_strerror(error));
-			if (error) {
-				lu_error_free(&error);
-			}
-		}
-
-		g_free(homedir);
-		g_strfreev(fields);
-		lu_ent_clear_all(ent);
-		lu_ent_clear_all(groupEnt);
+	if (batch) {
+		result = process_batch(ctx, fp, nocreatehome, nocreatemail);
+		goto done;
 	}
 
+	ent = lu_ent_new();
+	while (fgets(buf, sizeof(buf), fp))
+		process_line(ctx, buf, ent, nocreatehome, nocreatemail);
+
 	result = 0;
 
  done:
-	if (groupEnt) lu_ent_free(groupEnt);
 	if (ent) lu_ent_free(ent);
 
 	if (ctx) lu_end(ctx);
@@ -319,6 +319,8 @@ main(int argc, const char **argv)
 	if (change && (old_uid != NULL)) {
 		size_t i;
 
+		/* Each group is modified on its own, so that a failure to
+		 * update one of them does not discard the others. */
 		for (i = 0; groups != NULL && i < groups->len; i++) {
 			struct lu_ent *group;
 			const char *username;
@@ -364,6 +366,8 @@ main(int argc, const char **argv)
 					lu_ent_get_first_string(group,
 								LU_GROUPNAME),
 					lu_strerror(error));
+				if (error)
+					lu_error_free(&error);
 				lu_audit_logger_with_group(AUDIT_USER_MGMT,
 						    "update-member-in-group", user, uidNumber,
 						    lu_ent_get_first_string(group, LU_GROUPNAME),0);
@@ -373,7 +377,8 @@ main(int argc, const char **argv)
 						    lu_ent_get_first_string(group, LU_GROUPNAME),1);
 			lu_ent_free(group);
 		}
-		g_ptr_array_free(groups, TRUE);
+		if (groups != NULL)
+			g_ptr_array_free(groups, TRUE);
 
        		lu_nscd_flush_cache(LU_NSCD_CACHE_GROUP);
 	}
@@ -53,6 +53,10 @@ struct config_config {
 	GTree *sections; /* GList of "struct config_key" for each section */
 };
 
+/* Protects the string cache of the library context; modules may read the
+   configuration from several threads. */
+G_LOCK_DEFINE_STATIC(scache);
+
 /* A (key, values) pair. */
 struct config_key {
 	char *key;
@@ -404,8 +408,10 @@ lu_cfg_read(struct lu_context *context, const char *key,
 		if (default_value != NULL) {
 			char *def;
 
+			G_LOCK(scache);
 			def = context->scache->cache(context->scache,
 						     default_value);
+			G_UNLOCK(scache);
 			ret = g_list_append(ret, def);
 		}
 	}
@@ -478,12 +484,14 @@ lu_cfg_read_single(struct lu_context *context, const char *key,
 
 	/* Read the whole list. */
 	answers = lu_cfg_read(context, key, NULL);
+	G_LOCK(scache);
 	if (answers && answers->data) {
 		/* Save the first value, and free the list. */
 		ret = context->scache->cache(context->scache, answers->data);
 		g_list_free(answers);
 	} else
 		ret = context->scache->cache(context->scache, default_value);
+	G_UNLOCK(scache);
 
 	return ret;
 }
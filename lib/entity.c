@@ -37,6 +37,617 @@
  */
 
 
+/* Names of attributes with a fixed slot, indexed by enum lu_ent_slot. */
+static const char *const slot_attributes[] = {
+	LU_USERNAME, LU_USERPASSWORD, LU_UIDNUMBER, LU_GIDNUMBER, LU_GECOS,
+	LU_HOMEDIRECTORY, LU_LOGINSHELL, LU_GROUPNAME, LU_GROUPPASSWORD,
+	LU_MEMBERNAME, LU_ADMINISTRATORNAME, LU_SHADOWPASSWORD,
+	LU_SHADOWLASTCHANGE, LU_SHADOWMIN, LU_SHADOWMAX, LU_SHADOWWARNING,
+	LU_SHADOWINACTIVE, LU_SHADOWEXPIRE, LU_SHADOWFLAG, LU_COMMONNAME,
+	LU_GIVENNAME, LU_SN, LU_ROOMNUMBER, LU_TELEPHONENUMBER, LU_HOMEPHONE,
+	LU_EMAIL
+};
+G_STATIC_ASSERT(G_N_ELEMENTS(slot_attributes) == LU_ENT_SLOT_COUNT);
+
+/* Slot + 1 of attribute names (both as defined and lower-cased) and of
+   attribute quarks */
+static GHashTable *slot_by_name, *slot_by_quark;
+/* Quarks of the attributes with a fixed slot */
+static GQuark slot_quarks[LU_ENT_SLOT_COUNT];
+
+/* Set up the slot tables, if not done yet. */
+static void
+slots_init(void)
+{
+	static gsize initialized;
+
+	if (g_once_init_enter(&initialized)) {
+		size_t i;
+
+		slot_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+		slot_by_quark = g_hash_table_new(NULL, NULL);
+		for (i = 0; i < LU_ENT_SLOT_COUNT; i++) {
+			char *lower;
+
+			lower = g_ascii_strdown(slot_attributes[i], -1);
+			slot_quarks[i] = g_quark_from_string(lower);
+			g_free(lower);
+			g_hash_table_insert(slot_by_name,
+					    (char *)slot_attributes[i],
+					    GSIZE_TO_POINTER(i + 1));
+			g_hash_table_insert(slot_by_name,
+					    (char *)g_quark_to_string
+					    (slot_quarks[i]),
+					    GSIZE_TO_POINTER(i + 1));
+			g_hash_table_insert(slot_by_quark,
+					    GUINT_TO_POINTER(slot_quarks[i]),
+					    GSIZE_TO_POINTER(i + 1));
+		}
+		g_once_init_leave(&initialized, 1);
+	}
+}
+
+/* Return a GQuark for lower-cased ATTRIBUTE, or 0 if it does not exist yet
+   and !CREATE. */
+static GQuark
+quark_from_attribute(const char *attribute, gboolean create)
+{
+	const char *p;
+	GQuark quark;
+	char *lower;
+
+	for (p = attribute; *p != '\0' && !g_ascii_isupper(*p); p++)
+		;
+	if (*p == '\0')
+		return create ? g_quark_from_string(attribute)
+			: g_quark_try_string(attribute);
+	lower = g_ascii_strdown(attribute, -1);
+	quark = create ? g_quark_from_string(lower) : g_quark_try_string(lower);
+	g_free(lower);
+	return quark;
+}
+
+/* An identification of an attribute within an entity. */
+struct attribute_key {
+	GQuark quark;
+	int slot;		/* -1 if the attribute does not have a slot */
+};
+
+/* Set up KEY for ATTRIBUTE.  Return FALSE if ATTRIBUTE was never used and
+   !CREATE (so it can't be present in any entity). */
+static gboolean
+attribute_key_init(struct attribute_key *key, const char *attribute,
+		   gboolean create)
+{
+	gpointer slot;
+
+	slot = g_hash_table_lookup(slot_by_name, attribute);
+	if (slot == NULL) {
+		key->quark = quark_from_attribute(attribute, create);
+		if (key->quark == 0)
+			return FALSE;
+		slot = g_hash_table_lookup(slot_by_quark,
+					   GUINT_TO_POINTER(key->quark));
+	}
+	if (slot != NULL) {
+		key->slot = (int)GPOINTER_TO_SIZE(slot) - 1;
+		key->quark = slot_quarks[key->slot];
+	} else
+		key->slot = -1;
+	return TRUE;
+}
+
+/* Set up KEY for an attribute QUARK. */
+static void
+attribute_key_init_q(struct attribute_key *key, GQuark quark)
+{
+	gpointer slot;
+
+	key->quark = quark;
+	slot = g_hash_table_lookup(slot_by_quark, GUINT_TO_POINTER(quark));
+	key->slot = slot != NULL ? (int)GPOINTER_TO_SIZE(slot) - 1 : -1;
+}
+
+/* Return the number of values of ATTR. */
+static guint
+attribute_n_values(const struct lu_attribute *attr)
+{
+	return attr->v->values != NULL ? attr->v->values->n_values : 1;
+}
+
+/* Return value I of ATTR, for reading only. */
+static GValue *
+attribute_nth(struct lu_attribute *attr, guint i)
+{
+	if (attr->v->values != NULL)
+		return g_value_array_get_nth(attr->v->values, i);
+	g_assert(i == 0);
+	return &attr->v->value;
+}
+
+/* Size of memory blocks allocated by an arena */
+#define ARENA_BLOCK_SIZE 65536
+
+/* Allocate SIZE zero-filled bytes from ARENA. */
+static gpointer
+arena_alloc(struct lu_ent_arena *arena, size_t size)
+{
+	char *p;
+
+	size = (size + G_MEM_ALIGN - 1) & ~(size_t)(G_MEM_ALIGN - 1);
+	g_mutex_lock(&arena->lock);
+	if ((size_t)(arena->end - arena->next) < size) {
+		size_t block_size;
+
+		block_size = MAX(size, ARENA_BLOCK_SIZE);
+		p = g_malloc(block_size);
+		g_ptr_array_add(arena->blocks, p);
+		arena->next = p;
+		arena->end = p + block_size;
+	}
+	p = arena->next;
+	arena->next += size;
+	g_mutex_unlock(&arena->lock);
+	memset(p, 0, size);
+	return p;
+}
+
+/* Let ARENA, if not NULL, own ARRAY, used by one of its entities, and return
+   ARRAY.  The array is not freed before the arena. */
+static GValueArray *
+arena_adopt_array(struct lu_ent_arena *arena, GValueArray *array)
+{
+	if (arena != NULL) {
+		g_mutex_lock(&arena->lock);
+		g_ptr_array_add(arena->arrays, array);
+		g_mutex_unlock(&arena->lock);
+	}
+	return array;
+}
+
+/* Set DEST, which is not initialized, to a copy of SOURCE, with strings stored
+   in ARENA if it is not NULL. */
+static void
+value_copy_in(struct lu_ent_arena *arena, GValue *dest, const GValue *source)
+{
+	g_value_init(dest, G_VALUE_TYPE(source));
+	if (arena != NULL && G_VALUE_HOLDS_STRING(source)
+	    && g_value_get_string(source) != NULL) {
+		const char *copy;
+
+		g_mutex_lock(&arena->lock);
+		copy = g_string_chunk_insert(arena->strings,
+					     g_value_get_string(source));
+		g_mutex_unlock(&arena->lock);
+		g_value_set_static_string(dest, copy);
+	} else
+		g_value_copy(source, dest);
+}
+
+/* Return a new, unshared and empty, struct lu_attribute_values, allocated in
+   ARENA if it is not NULL. */
+static struct lu_attribute_values *
+attribute_values_new(struct lu_ent_arena *arena)
+{
+	struct lu_attribute_values *v;
+
+	if (arena != NULL)
+		v = arena_alloc(arena, sizeof(*v));
+	else
+		v = g_malloc0(sizeof(*v));
+	v->arena = arena;
+	v->refs = 1;
+	return v;
+}
+
+/* Free the values in V, leaving it empty. */
+static void
+attribute_values_clear(struct lu_attribute_values *v)
+{
+	if (v->values != NULL) {
+		/* An array in an arena is freed with the arena. */
+		if (v->arena == NULL)
+			g_value_array_free(v->values);
+		v->values = NULL;
+	} else
+		g_value_unset(&v->value);
+}
+
+/* Drop a reference to V. */
+static void
+attribute_values_unref(struct lu_attribute_values *v)
+{
+	if (g_atomic_int_dec_and_test(&v->refs)) {
+		attribute_values_clear(v);
+		if (v->arena == NULL)
+			g_free(v);
+	}
+}
+
+/* Make sure the values of ATTR are not shared with any other attribute and are
+   owned by ARENA (which may be NULL), and return them for modification. */
+static struct lu_attribute_values *
+attribute_unshare_in(struct lu_attribute *attr, struct lu_ent_arena *arena)
+{
+	struct lu_attribute_values *copy;
+
+	if (g_atomic_int_get(&attr->v->refs) == 1 && attr->v->arena == arena)
+		return attr->v;
+	/* Copy the strings as well: a separately allocated copy must not
+	   refer to an arena which may be freed before it. */
+	copy = attribute_values_new(arena);
+	if (attr->v->values != NULL) {
+		GValueArray *values;
+		size_t i;
+
+		values = g_value_array_new(attr->v->values->n_values);
+		for (i = 0; i < attr->v->values->n_values; i++) {
+			GValue *value;
+
+			g_value_array_append(values, NULL);
+			value = g_value_array_get_nth(values, i);
+			value_copy_in(arena, value,
+				      g_value_array_get_nth(attr->v->values,
+							    i));
+		}
+		copy->values = arena_adopt_array(arena, values);
+	} else
+		value_copy_in(arena, &copy->value, &attr->v->value);
+	attribute_values_unref(attr->v);
+	attr->v = copy;
+	return copy;
+}
+
+/* Make sure the values of ATTR are not shared with any other attribute, and
+   return them for modification. */
+static struct lu_attribute_values *
+attribute_unshare(struct lu_attribute *attr)
+{
+	return attribute_unshare_in(attr, attr->v->arena);
+}
+
+/* Return all values of ATTR as a GValueArray which may be modified. */
+static GValueArray *
+attribute_values(struct lu_attribute *attr)
+{
+	struct lu_attribute_values *v;
+
+	v = attribute_unshare(attr);
+	if (v->values == NULL) {
+		GValue *slot;
+
+		/* Move the single value into the array. */
+		v->values = arena_adopt_array(v->arena, g_value_array_new(1));
+		g_value_array_append(v->values, NULL);
+		slot = g_value_array_get_nth(v->values, 0);
+		*slot = v->value;
+		memset(&v->value, 0, sizeof(v->value));
+	}
+	g_assert(v->values->n_values > 0);
+	return v->values;
+}
+
+/* Prepare an empty SET, allocated in ARENA if it is not NULL. */
+static void
+attribute_set_init(struct lu_attribute_set *set, struct lu_ent_arena *arena)
+{
+	set->attrs = NULL;
+	set->len = 0;
+	set->size = 0;
+	set->arena = arena;
+	memset(set->slots, 0, sizeof(set->slots));
+}
+
+/* Make sure SET has room for at least SIZE attributes. */
+static void
+attribute_set_reserve(struct lu_attribute_set *set, guint size)
+{
+	struct lu_attribute *attrs;
+
+	if (size <= set->size)
+		return;
+	/* Enough for most users, counting the shadow attributes. */
+	size = MAX(size, MAX(set->size * 2, 16));
+	if (set->arena != NULL) {
+		/* The old array is freed with the arena. */
+		attrs = arena_alloc(set->arena, size * sizeof(*attrs));
+		if (set->len != 0)
+			memcpy(attrs, set->attrs, set->len * sizeof(*attrs));
+	} else
+		attrs = g_renew(struct lu_attribute, set->attrs, size);
+	set->attrs = attrs;
+	set->size = size;
+}
+
+/* Return attribute KEY in SET, or NULL if it is not present. */
+static struct lu_attribute *
+attribute_set_find(const struct lu_attribute_set *set,
+		   const struct attribute_key *key)
+{
+	size_t i;
+
+	if (key->slot >= 0) {
+		i = set->slots[key->slot];
+		if (i == 0)
+			return NULL;
+		return set->attrs + i - 1;
+	}
+	for (i = 0; i < set->len; i++) {
+		if (set->attrs[i].name == key->quark)
+			return set->attrs + i;
+	}
+	return NULL;
+}
+
+/* Add attribute KEY, which must not be present, with values V to SET, taking
+   over the caller's reference to V. */
+static struct lu_attribute *
+attribute_set_insert(struct lu_attribute_set *set,
+		     const struct attribute_key *key,
+		     struct lu_attribute_values *v)
+{
+	struct lu_attribute *attr;
+
+	attribute_set_reserve(set, set->len + 1);
+	attr = set->attrs + set->len;
+	set->len++;
+	attr->name = key->quark;
+	attr->v = v;
+	if (key->slot >= 0)
+		set->slots[key->slot] = set->len;
+	return attr;
+}
+
+/* Add attribute KEY, which must not be present, to SET, and return its empty
+   values.  The caller must store a value into the result. */
+static struct lu_attribute_values *
+attribute_set_add(struct lu_attribute_set *set,
+		  const struct attribute_key *key)
+{
+	return attribute_set_insert(set, key,
+				    attribute_values_new(set->arena))->v;
+}
+
+/* Return empty values of attribute KEY in SET, adding it if necessary.
+   The caller must store a value into the result. */
+static struct lu_attribute_values *
+attribute_set_replace(struct lu_attribute_set *set,
+		      const struct attribute_key *key)
+{
+	struct lu_attribute *attr;
+
+	attr = attribute_set_find(set, key);
+	if (attr == NULL)
+		return attribute_set_add(set, key);
+	if (g_atomic_int_get(&attr->v->refs) == 1)
+		attribute_values_clear(attr->v);
+	else {
+		attribute_values_unref(attr->v);
+		attr->v = attribute_values_new(set->arena);
+	}
+	return attr->v;
+}
+
+/* Remove ATTR from SET. */
+static void
+attribute_set_remove(struct lu_attribute_set *set, struct lu_attribute *attr)
+{
+	size_t i, slot;
+
+	attribute_values_unref(attr->v);
+	i = attr - set->attrs;
+	memmove(set->attrs + i, set->attrs + i + 1,
+		(set->len - i - 1) * sizeof(*set->attrs));
+	set->len--;
+	for (slot = 0; slot < LU_ENT_SLOT_COUNT; slot++) {
+		if (set->slots[slot] == i + 1)
+			set->slots[slot] = 0;
+		else if (set->slots[slot] > i + 1)
+			set->slots[slot]--;
+	}
+}
+
+/* Remove all attributes from SET. */
+static void
+attribute_set_clear(struct lu_attribute_set *set)
+{
+	size_t i;
+
+	for (i = 0; i < set->len; i++)
+		attribute_values_unref(set->attrs[i].v);
+	set->len = 0;
+	memset(set->slots, 0, sizeof(set->slots));
+}
+
+/* Copy all attributes from SOURCE to DEST, wiping out whatever was already in
+   DEST.  The values are shared until either side modifies them. */
+static void
+attribute_set_copy(const struct lu_attribute_set *source,
+		   struct lu_attribute_set *dest)
+{
+	size_t i;
+
+	if (source == dest)
+		return;
+	for (i = 0; i < source->len; i++)
+		g_atomic_int_inc(&source->attrs[i].v->refs);
+	attribute_set_clear(dest);
+	attribute_set_reserve(dest, source->len);
+	if (source->len != 0)
+		memcpy(dest->attrs, source->attrs,
+		       source->len * sizeof(*dest->attrs));
+	dest->len = source->len;
+	memcpy(dest->slots, source->slots, sizeof(dest->slots));
+	if (source->arena != dest->arena) {
+		/* Values in the arena of SOURCE may be freed before DEST. */
+		for (i = 0; i < dest->len; i++)
+			attribute_unshare_in(dest->attrs + i, dest->arena);
+	}
+}
+
+/* Does ATTR contain VALUE?  SEEN, if not NULL, contains all string values of
+   ATTR. */
+static gboolean
+attribute_contains(struct lu_attribute *attr, const GValue *value,
+		   GHashTable *seen)
+{
+	size_t i;
+
+	if (seen != NULL && G_VALUE_HOLDS_STRING(value)
+	    && g_value_get_string(value) != NULL)
+		return g_hash_table_lookup_extended(seen,
+						    g_value_get_string(value),
+						    NULL, NULL);
+	for (i = 0; i < attribute_n_values(attr); i++) {
+		GValue *current;
+
+		current = attribute_nth(attr, i);
+		if (G_VALUE_TYPE(value) == G_VALUE_TYPE(current)
+		    && lu_values_equal(value, current))
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Add all values from SOURCE to DEST, skipping values already present in
+   DEST.  Attributes missing in DEST share their values with SOURCE. */
+static void
+attribute_set_merge(const struct lu_attribute_set *source,
+		    struct lu_attribute_set *dest)
+{
+	size_t i;
+
+	for (i = 0; i < source->len; i++) {
+		struct lu_attribute *src, *dst;
+		struct attribute_key key;
+		GValueArray *values;
+		GHashTable *seen;
+		size_t j;
+
+		src = source->attrs + i;
+		attribute_key_init_q(&key, src->name);
+		dst = attribute_set_find(dest, &key);
+		if (dst == NULL) {
+			g_atomic_int_inc(&src->v->refs);
+			dst = attribute_set_insert(dest, &key, src->v);
+			if (dst->v->arena != dest->arena)
+				attribute_unshare_in(dst, dest->arena);
+			continue;
+		}
+		/* Avoid a quadratic number of comparisons when merging
+		   large lists, e.g. group members. */
+		values = NULL;
+		seen = NULL;
+		if (attribute_n_values(src) * attribute_n_values(dst) > 64) {
+			values = attribute_values(dst);
+			seen = g_hash_table_new(g_str_hash, g_str_equal);
+			for (j = 0; j < values->n_values; j++) {
+				GValue *value;
+
+				value = g_value_array_get_nth(values, j);
+				if (G_VALUE_HOLDS_STRING(value)
+				    && g_value_get_string(value) != NULL)
+					g_hash_table_insert
+						(seen, (gpointer)
+						 g_value_get_string(value),
+						 NULL);
+			}
+		}
+		for (j = 0; j < attribute_n_values(src); j++) {
+			GValue *value;
+
+			value = attribute_nth(src, j);
+			if (attribute_contains(dst, value, seen))
+				continue;
+			if (values == NULL)
+				values = attribute_values(dst);
+			g_value_array_append(values, value);
+			value = g_value_array_get_nth(values,
+						      values->n_values - 1);
+			if (seen != NULL && G_VALUE_HOLDS_STRING(value)
+			    && g_value_get_string(value) != NULL)
+				g_hash_table_insert(seen, (gpointer)
+						    g_value_get_string(value),
+						    NULL);
+		}
+		if (seen != NULL)
+			g_hash_table_destroy(seen);
+	}
+}
+
+/* Do A and B contain the same values? */
+static gboolean
+attribute_values_equal(struct lu_attribute *a, struct lu_attribute *b)
+{
+	size_t i;
+
+	if (a->v == b->v)
+		return TRUE;
+	if (attribute_n_values(a) != attribute_n_values(b))
+		return FALSE;
+	for (i = 0; i < attribute_n_values(a); i++) {
+		GValue *va, *vb;
+
+		va = attribute_nth(a, i);
+		vb = attribute_nth(b, i);
+		if (G_VALUE_TYPE(va) != G_VALUE_TYPE(vb)
+		    || !lu_values_equal(va, vb))
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Apply changes made to CHANGED, which started as a copy of BASE, to DEST. */
+static void
+attribute_set_apply_changes(const struct lu_attribute_set *base,
+			    const struct lu_attribute_set *changed,
+			    struct lu_attribute_set *dest)
+{
+	size_t i;
+
+	for (i = 0; i < changed->len; i++) {
+		struct lu_attribute *attr, *old, *dst;
+		struct attribute_key key;
+
+		attr = changed->attrs + i;
+		attribute_key_init_q(&key, attr->name);
+		old = attribute_set_find(base, &key);
+		if (old != NULL && attribute_values_equal(old, attr))
+			continue;
+		g_atomic_int_inc(&attr->v->refs);
+		dst = attribute_set_find(dest, &key);
+		if (dst != NULL) {
+			attribute_values_unref(dst->v);
+			dst->v = attr->v;
+		} else
+			dst = attribute_set_insert(dest, &key, attr->v);
+		if (dst->v->arena != dest->arena)
+			attribute_unshare_in(dst, dest->arena);
+	}
+	for (i = 0; i < base->len; i++) {
+		struct attribute_key key;
+		struct lu_attribute *dst;
+
+		attribute_key_init_q(&key, base->attrs[i].name);
+		if (attribute_set_find(changed, &key) != NULL)
+			continue;
+		dst = attribute_set_find(dest, &key);
+		if (dst != NULL)
+			attribute_set_remove(dest, dst);
+	}
+}
+
+/* Free SET. */
+static void
+attribute_set_free(struct lu_attribute_set *set)
+{
+	attribute_set_clear(set);
+	if (set->arena == NULL)
+		g_free(set->attrs);
+	set->attrs = NULL;
+	set->size = 0;
+}
+
 /**
  * lu_ent_new:
  *
@@ -47,24 +658,33 @@
 struct lu_ent *
 lu_ent_new()
 {
-	struct lu_ent *ent;
-
-	ent = g_malloc0(sizeof(struct lu_ent));
-	ent->magic = LU_ENT_MAGIC;
-	ent->cache = lu_string_cache_new(TRUE);
-	ent->current = g_array_new(FALSE, TRUE, sizeof(struct lu_attribute));
-	ent->pending = g_array_new(FALSE, TRUE, sizeof(struct lu_attribute));
-	ent->modules = g_value_array_new(1);
-	return ent;
+	return lu_ent_new_typed_in(NULL, lu_invalid);
 }
 
 struct lu_ent *
 lu_ent_new_typed(enum lu_entity_type entity_type)
 {
-	struct lu_ent *ret;
-	ret = lu_ent_new();
-	ret->type = entity_type;
-	return ret;
+	return lu_ent_new_typed_in(NULL, entity_type);
+}
+
+struct lu_ent *
+lu_ent_new_typed_in(struct lu_ent_arena *arena,
+		    enum lu_entity_type entity_type)
+{
+	struct lu_ent *ent;
+
+	slots_init();
+	if (arena != NULL)
+		ent = arena_alloc(arena, sizeof(struct lu_ent));
+	else
+		ent = g_malloc0(sizeof(struct lu_ent));
+	ent->magic = LU_ENT_MAGIC;
+	ent->type = entity_type;
+	ent->arena = arena;
+	attribute_set_init(&ent->current, arena);
+	attribute_set_init(&ent->pending, arena);
+	ent->modules = arena_adopt_array(arena, g_value_array_new(1));
+	return ent;
 }
 
 /**
@@ -72,57 +692,147 @@ lu_ent_new_typed(enum lu_entity_type entity_type)
  * @ent: The entity to free
  *
  * Frees an struct #lu_ent, including all strings it owns.
+ *
+ * If @ent belongs to a #lu_ent_arena, its memory is only returned to the
+ * system by lu_ent_arena_free().
  */
 void
 lu_ent_free(struct lu_ent *ent)
 {
-	size_t i;
-	struct lu_attribute *attr;
+	struct lu_ent_arena *arena;
+
 	g_return_if_fail(ent != NULL);
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
-	/* Free the cache. */
-	ent->cache->free(ent->cache);
-	/* Free each current attribute. */
-	for (i = 0; i < ent->current->len; i++) {
-		attr = &g_array_index(ent->current, struct lu_attribute, i);
-		/* Free the values array in this attribute; the array free
-		 * will get the rest. */
-		g_value_array_free(attr->values);
-		attr->name = 0;
-		attr->values = NULL;
-	}
-	g_array_free(ent->current, TRUE);
-	/* Free each pending attribute. */
-	for (i = 0; i < ent->pending->len; i++) {
-		attr = &g_array_index(ent->pending, struct lu_attribute, i);
-		/* Free the values array in this attribute; the array free
-		 * will get the rest. */
-		g_value_array_free(attr->values);
-		attr->name = 0;
-		attr->values = NULL;
+	arena = ent->arena;
+	attribute_set_free(&ent->current);
+	attribute_set_free(&ent->pending);
+	/* The cache and the module list of an entity in an arena are freed
+	   with the arena. */
+	if (arena == NULL) {
+		if (ent->cache != NULL)
+			ent->cache->free(ent->cache);
+		g_value_array_free(ent->modules);
 	}
-	g_array_free(ent->pending, TRUE);
-	/* Free the module list. */
-	g_value_array_free(ent->modules);
 	memset(ent, 0, sizeof(struct lu_ent));
-	g_free(ent);
+	if (arena == NULL)
+		g_free(ent);
+}
+
+/* Free CACHE, owned by an arena. */
+static void
+arena_string_cache_free(gpointer cache)
+{
+	struct lu_string_cache *c;
+
+	c = cache;
+	c->free(c);
+}
+
+/**
+ * lu_ent_arena_new:
+ *
+ * Creates an arena which owns entities returned by functions like
+ * lu_users_enumerate_full_arena(), including their attribute values, so that
+ * all of them can be freed at once.
+ *
+ * Returns: The created arena, which should be deallocated by
+ * lu_ent_arena_free()
+ */
+struct lu_ent_arena *
+lu_ent_arena_new(void)
+{
+	struct lu_ent_arena *arena;
+
+	arena = g_malloc0(sizeof(*arena));
+	arena->blocks = g_ptr_array_new_with_free_func(g_free);
+	arena->strings = g_string_chunk_new(ARENA_BLOCK_SIZE);
+	arena->arrays = g_ptr_array_new_with_free_func((GDestroyNotify)
+						       g_value_array_free);
+	arena->caches = g_ptr_array_new_with_free_func
+		(arena_string_cache_free);
+	g_mutex_init(&arena->lock);
+	return arena;
+}
+
+/**
+ * lu_ent_arena_free:
+ * @arena: The arena to free
+ *
+ * Frees @arena and all entities it owns.  Calling lu_ent_free() on the
+ * entities first is allowed, but not necessary.  Data obtained from the
+ * entities, e.g. strings returned by lu_ent_get_first_string(), must not be
+ * used afterwards.
+ */
+void
+lu_ent_arena_free(struct lu_ent_arena *arena)
+{
+	g_return_if_fail(arena != NULL);
+	/* All memory used by the entities is owned by the arena, so they
+	   don't need to be visited. */
+	g_ptr_array_free(arena->caches, TRUE);
+	g_ptr_array_free(arena->arrays, TRUE);
+	g_string_chunk_free(arena->strings);
+	g_ptr_array_free(arena->blocks, TRUE);
+	g_mutex_clear(&arena->lock);
+	g_free(arena);
+}
+
+void
+lu_ent_value_init_string_len(struct lu_ent *ent, GValue *value,
+			     const char *string, size_t len)
+{
+	g_value_init(value, G_TYPE_STRING);
+	if (ent->arena != NULL) {
+		const char *copy;
+
+		g_mutex_lock(&ent->arena->lock);
+		copy = g_string_chunk_insert_len(ent->arena->strings, string,
+						 len);
+		g_mutex_unlock(&ent->arena->lock);
+		g_value_set_static_string(value, copy);
+	} else
+		g_value_take_string(value, g_strndup(string, len));
+}
+
+struct lu_string_cache *
+lu_ent_string_cache(struct lu_ent *ent)
+{
+	/* Most entities never need the cache. */
+	if (ent->cache == NULL) {
+		ent->cache = lu_string_cache_new(TRUE);
+		if (ent->arena != NULL) {
+			g_mutex_lock(&ent->arena->lock);
+			g_ptr_array_add(ent->arena->caches, ent->cache);
+			g_mutex_unlock(&ent->arena->lock);
+		}
+	}
+	return ent->cache;
+}
+
+char *
+lu_ent_cache_string(struct lu_ent *ent, const char *string)
+{
+	struct lu_string_cache *cache;
+
+	cache = lu_ent_string_cache(ent);
+	return cache->cache(cache, string);
 }
 
 /* Dump a set of attributes */
 static void
-lu_ent_dump_attributes(GArray *attrs, FILE *fp)
+lu_ent_dump_attributes(struct lu_attribute_set *set, FILE *fp)
 {
 	size_t i;
 
-	for (i = 0; i < attrs->len; i++) {
+	for (i = 0; i < set->len; i++) {
 		struct lu_attribute *attribute;
 		size_t j;
 
-		attribute = &g_array_index(attrs, struct lu_attribute, i);
-		for (j = 0; j < attribute->values->n_values; j++) {
+		attribute = set->attrs + i;
+		for (j = 0; j < attribute_n_values(attribute); j++) {
 			GValue *value;
 
-			value = g_value_array_get_nth(attribute->values, j);
+			value = attribute_nth(attribute, j);
 			fprintf(fp, " %s = ",
 				g_quark_to_string(attribute->name));
 			if (G_VALUE_HOLDS_STRING(value))
@@ -185,9 +895,9 @@ lu_ent_dump(struct lu_ent *ent, FILE *fp)
 	}
 	fprintf(fp, ")\n");
 	/* Print the current data values. */
-	lu_ent_dump_attributes(ent->current, fp);
+	lu_ent_dump_attributes(&ent->current, fp);
 	fprintf(fp, "\n");
-	lu_ent_dump_attributes(ent->pending, fp);
+	lu_ent_dump_attributes(&ent->pending, fp);
 }
 
 /* Add a module to the list of modules kept for this entity. */
@@ -230,49 +940,9 @@ lu_ent_clear_modules(struct lu_ent *ent)
 {
 	g_return_if_fail(ent != NULL);
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
-	g_value_array_free(ent->modules);
-	ent->modules = g_value_array_new(1);
-}
-
-/* Remove all attributes from an object.  This function takes the address
- * of whichever list we want cleared. */
-static void
-clear_attribute_list(GArray *dest)
-{
-	int i;
-
-	for (i = dest->len - 1; i >= 0; i--) {
-		struct lu_attribute *attr;
-
-		attr = &g_array_index(dest, struct lu_attribute, i);
-		g_value_array_free(attr->values);
-		attr->values = NULL;
-		g_array_remove_index_fast(dest, i);
-	}
-}
-
-/* Copy all attributes from source to dest, wiping out whatever was already
- * in the destination array. */
-static void
-copy_attributes(GArray *source, GArray *dest)
-{
-	size_t i;
-
-	/* First, clear the destination list of all attributes. */
-	clear_attribute_list(dest);
-	/* Now copy all of the attributes and their values. */
-	for (i = 0; i < source->len; i++) {
-		struct lu_attribute *attr, newattr;
-
-		attr = &g_array_index(source, struct lu_attribute, i);
-		/* Copy the attribute name, then its values, into the holding
-		 * area. */
-		memset(&newattr, 0, sizeof(newattr));
-		newattr.name = attr->name;
-		newattr.values = g_value_array_copy(attr->values);
-		/* Now append the attribute to the array. */
-		g_array_append_val(dest, newattr);
-	}
+	if (ent->arena == NULL)
+		g_value_array_free(ent->modules);
+	ent->modules = arena_adopt_array(ent->arena, g_value_array_new(1));
 }
 
 /**
@@ -285,7 +955,7 @@ copy_attributes(GArray *source, GArray *dest)
 void
 lu_ent_revert(struct lu_ent *entity)
 {
-	copy_attributes(entity->current, entity->pending);
+	attribute_set_copy(&entity->current, &entity->pending);
 }
 
 /**
@@ -297,7 +967,7 @@ lu_ent_revert(struct lu_ent *entity)
 void
 lu_ent_commit(struct lu_ent *entity)
 {
-	copy_attributes(entity->pending, entity->current);
+	attribute_set_copy(&entity->pending, &entity->current);
 }
 
 /**
@@ -315,62 +985,102 @@ lu_ent_copy(struct lu_ent *source, struct lu_ent *dest)
 	g_return_if_fail(source->magic == LU_ENT_MAGIC);
 	g_return_if_fail(dest->magic == LU_ENT_MAGIC);
 	dest->type = source->type;
-	copy_attributes(source->current, dest->current);
-	copy_attributes(source->pending, dest->pending);
-	g_value_array_free(dest->modules);
-	dest->modules = g_value_array_copy(source->modules);
+	attribute_set_copy(&source->current, &dest->current);
+	attribute_set_copy(&source->pending, &dest->pending);
+	if (dest->arena == NULL)
+		g_value_array_free(dest->modules);
+	dest->modules = arena_adopt_array(dest->arena,
+					  g_value_array_copy(source->modules));
 }
 
-/* Return a GQark for lower-cased attribute */
-static GQuark
-quark_from_attribute(const char *attribute)
+void
+lu_ent_merge(struct lu_ent *dest, struct lu_ent *source)
 {
-	GQuark quark;
-	char *lower;
+	size_t i;
 
-	lower = g_ascii_strdown(attribute, -1);
-	quark = g_quark_from_string(lower);
-	g_free(lower);
-	return quark;
+	g_return_if_fail(source != NULL);
+	g_return_if_fail(dest != NULL);
+	g_return_if_fail(source->magic == LU_ENT_MAGIC);
+	g_return_if_fail(dest->magic == LU_ENT_MAGIC);
+	attribute_set_merge(&source->current, &dest->current);
+	attribute_set_merge(&source->pending, &dest->pending);
+	for (i = 0; i < source->modules->n_values; i++)
+		lu_ent_add_module(dest, g_value_get_string
+				  (g_value_array_get_nth(source->modules, i)));
 }
 
-static GValueArray *
-lu_ent_get_int(GArray *list, const char *attribute)
+void
+lu_ent_apply_changes(struct lu_ent *dest, struct lu_ent *base,
+		     struct lu_ent *changed)
 {
-	GQuark aquark;
 	size_t i;
 
+	g_return_if_fail(dest != NULL);
+	g_return_if_fail(base != NULL);
+	g_return_if_fail(changed != NULL);
+	g_return_if_fail(dest->magic == LU_ENT_MAGIC);
+	g_return_if_fail(base->magic == LU_ENT_MAGIC);
+	g_return_if_fail(changed->magic == LU_ENT_MAGIC);
+	if (changed->type != base->type)
+		dest->type = changed->type;
+	attribute_set_apply_changes(&base->current, &changed->current,
+				    &dest->current);
+	attribute_set_apply_changes(&base->pending, &changed->pending,
+				    &dest->pending);
+	for (i = 0; i < changed->modules->n_values; i++)
+		lu_ent_add_module(dest, g_value_get_string
+				  (g_value_array_get_nth(changed->modules,
+							 i)));
+}
+
+GQuark
+lu_ent_attribute_quark(const char *attribute)
+{
+	struct attribute_key key;
+
+	slots_init();
+	attribute_key_init(&key, attribute, TRUE);
+	return key.quark;
+}
+
+/* Return attribute ATTRIBUTE in LIST, or NULL if it is not present. */
+static struct lu_attribute *
+lu_ent_find_int(struct lu_attribute_set *list, const char *attribute)
+{
+	struct attribute_key key;
+
+	if (!attribute_key_init(&key, attribute, FALSE))
+		return NULL;
+	return attribute_set_find(list, &key);
+}
+
+static GValueArray *
+lu_ent_get_int(struct lu_attribute_set *list, const char *attribute)
+{
+	struct lu_attribute *attr;
+
 	g_return_val_if_fail(list != NULL, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	aquark = quark_from_attribute(attribute);
-	for (i = 0; i < list->len; i++) {
-		struct lu_attribute *attr;
-
-		attr = &g_array_index(list, struct lu_attribute, i);
-		if (attr != NULL) {
-			if (attr->name == aquark) {
-				g_assert(attr->values != NULL);
-				g_assert(attr->values->n_values > 0);
-				return attr->values;
-			}
-		}
-	}
-	return NULL;
+	attr = lu_ent_find_int(list, attribute);
+	if (attr == NULL)
+		return NULL;
+	return attribute_values(attr);
 }
 
 /* Return a read-only pointer to the first string value of ATTRIBUTE in LIST
    if any, or NULL if ATTRIBUTE doesn't exist or on error. */
 static const char *
-lu_ent_get_first_string_int(GArray *list, const char *attribute)
+lu_ent_get_first_string_int(struct lu_attribute_set *list,
+			    const char *attribute)
 {
-	GValueArray *vals;
+	struct lu_attribute *attr;
 	GValue *v;
 
-	vals = lu_ent_get_int(list, attribute);
-	if (vals == NULL)
+	attr = lu_ent_find_int(list, attribute);
+	if (attr == NULL)
 		return NULL;
-	v = g_value_array_get_nth(vals, 0);
+	v = attribute_nth(attr, 0);
 	if (!G_VALUE_HOLDS_STRING(v))
 		return NULL;
 	return g_value_get_string(v);
@@ -381,87 +1091,70 @@ lu_ent_get_first_string_int(GArray *list, const char *attribute)
 
    The caller should call g_free() on the result. */
 static char *
-lu_ent_get_first_value_strdup_int(GArray *list, const char *attribute)
+lu_ent_get_first_value_strdup_int(struct lu_attribute_set *list,
+				  const char *attribute)
 {
-	GValueArray *vals;
+	struct lu_attribute *attr;
 
-	vals = lu_ent_get_int(list, attribute);
-	if (vals == NULL)
+	attr = lu_ent_find_int(list, attribute);
+	if (attr == NULL)
 		return NULL;
-	return lu_value_strdup(g_value_array_get_nth(vals, 0));
+	return lu_value_strdup(attribute_nth(attr, 0));
 }
 
 /* Return an id_t contents of the first value of ATTRIBUTE in LIST if any,
    or LU_VALUE_INVALID_ID if ATTRIBUTE doesn't exist or on error. */
 static id_t
-lu_ent_get_first_id_int(GArray *list, const char *attribute)
+lu_ent_get_first_id_int(struct lu_attribute_set *list, const char *attribute)
 {
-	GValueArray *vals;
+	struct lu_attribute *attr;
 
-	vals = lu_ent_get_int(list, attribute);
-	if (vals == NULL)
+	attr = lu_ent_find_int(list, attribute);
+	if (attr == NULL)
 		return LU_VALUE_INVALID_ID;
-	return lu_value_get_id(g_value_array_get_nth(vals, 0));
+	return lu_value_get_id(attribute_nth(attr, 0));
 }
 
 static gboolean
-lu_ent_has_int(GArray *list, const char *attribute)
+lu_ent_has_int(struct lu_attribute_set *list, const char *attribute)
 {
 	g_return_val_if_fail(list != NULL, FALSE);
 	g_return_val_if_fail(attribute != NULL, FALSE);
 	g_return_val_if_fail(strlen(attribute) > 0, FALSE);
-	return (lu_ent_get_int(list, attribute) != NULL) ? TRUE : FALSE;
+	return (lu_ent_find_int(list, attribute) != NULL) ? TRUE : FALSE;
 }
 
 static void
-lu_ent_clear_int(GArray *list, const char *attribute)
+lu_ent_clear_int(struct lu_attribute_set *list, const char *attribute)
 {
-	int i;
-	struct lu_attribute *attr = NULL;
-	GQuark aquark;
+	struct lu_attribute *attr;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	aquark = quark_from_attribute(attribute);
-	for (i = list->len - 1; i >= 0; i--) {
-		attr = &g_array_index(list, struct lu_attribute, i);
-		if (attr->name == aquark)
-			break;
-	}
-	if (i >= 0) {
-		g_value_array_free(attr->values);
-		attr->values = NULL;
-		g_array_remove_index(list, i);
-	}
+	attr = lu_ent_find_int(list, attribute);
+	if (attr != NULL)
+		attribute_set_remove(list, attr);
 }
 
-/* Delete all existing values of ATTR in LIST and return a GValueArray to which
-   new values should be appended. */
-static GValueArray *
-lu_ent_set_prepare(GArray *list, const char *attr)
+/* Delete all existing values of ATTR in LIST and return its empty values,
+   ready for storing a new value. */
+static struct lu_attribute_values *
+lu_ent_set_prepare(struct lu_attribute_set *list, const char *attr)
 {
-	GValueArray *dest;
+	struct attribute_key key;
 
-	dest = lu_ent_get_int(list, attr);
-	if (dest == NULL) {
-		struct lu_attribute newattr;
-
-		memset(&newattr, 0, sizeof(newattr));
-		newattr.name = quark_from_attribute(attr);
-		newattr.values = g_value_array_new(0);
-		dest = newattr.values;
-		g_array_append_val(list, newattr);
-	}
-	while (dest->n_values > 0)
-		g_value_array_remove(dest, dest->n_values - 1);
-	return dest;
+	attribute_key_init(&key, attr, TRUE);
+	return attribute_set_replace(list, &key);
 }
 
 static void
-lu_ent_set_int(GArray *list, const char *attr, const GValueArray *values)
+lu_ent_set_int(struct lu_attribute_set *list, const char *attr,
+	       const GValueArray *values)
 {
-	GValueArray *dest, *copy;
+	struct lu_attribute_values *dest;
+	GValueArray *copy;
+	GValue v;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(attr != NULL);
@@ -470,147 +1163,149 @@ lu_ent_set_int(GArray *list, const char *attr, const GValueArray *values)
 		lu_ent_clear_int(list, attr);
 		return;
 	}
+	/* Copy the values first, VALUES may belong to ATTR. */
+	copy = NULL;
+	memset(&v, 0, sizeof(v));
+	if (values->n_values == 1)
+		value_copy_in(list->arena, &v, &values->values[0]);
+	else
+		copy = arena_adopt_array(list->arena,
+					 g_value_array_copy(values));
 	dest = lu_ent_set_prepare(list, attr);
-	copy = g_value_array_copy(values);
-	lu_util_append_values(dest, copy);
-	g_value_array_free(copy);
+	dest->values = copy;
+	dest->value = v;
 }
 
 /* Replace current value of ATTR in LIST with a single string VALUE */
 static void
-lu_ent_set_string_int(GArray *list, const char *attr, const char *value)
+lu_ent_set_string_int(struct lu_attribute_set *list, const char *attr,
+		      const char *value)
 {
-	GValueArray *dest;
-	GValue v;
+	struct lu_attribute_values *dest;
+	GValue v, copy;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(attr != NULL);
 	g_return_if_fail(strlen(attr) > 0);
 	g_return_if_fail(value != NULL);
-	dest = lu_ent_set_prepare(list, attr);
-
+	/* VALUE may belong to ATTR. */
 	memset(&v, 0, sizeof(v));
 	g_value_init(&v, G_TYPE_STRING);
-	g_value_set_string(&v, value);
-	g_value_array_append(dest, &v);
+	g_value_set_static_string(&v, value);
+	memset(&copy, 0, sizeof(copy));
+	value_copy_in(list->arena, &copy, &v);
 	g_value_unset(&v);
+	dest = lu_ent_set_prepare(list, attr);
+	dest->value = copy;
 }
 
 /* Replace current value of ATTR in LIST with a single id_t VALUE */
 static void
-lu_ent_set_id_int(GArray *list, const char *attr, id_t value)
+lu_ent_set_id_int(struct lu_attribute_set *list, const char *attr,
+		  id_t value)
 {
-	GValueArray *dest;
-	GValue v;
+	struct lu_attribute_values *dest;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(attr != NULL);
 	g_return_if_fail(strlen(attr) > 0);
 	g_return_if_fail(value != LU_VALUE_INVALID_ID);
 	dest = lu_ent_set_prepare(list, attr);
-
-	memset(&v, 0, sizeof(v));
-	lu_value_init_set_id(&v, value);
-	g_value_array_append(dest, &v);
-	g_value_unset(&v);
+	lu_value_init_set_id(&dest->value, value);
 }
 
 /* Replace current value of ATTR in LIST with a single long VALUE */
 static void
-lu_ent_set_long_int(GArray *list, const char *attr, long value)
+lu_ent_set_long_int(struct lu_attribute_set *list, const char *attr,
+		    long value)
 {
-	GValueArray *dest;
-	GValue v;
+	struct lu_attribute_values *dest;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(attr != NULL);
 	g_return_if_fail(strlen(attr) > 0);
 	dest = lu_ent_set_prepare(list, attr);
-
-	memset(&v, 0, sizeof(v));
-	g_value_init(&v, G_TYPE_LONG);
-	g_value_set_long(&v, value);
-	g_value_array_append(dest, &v);
-	g_value_unset(&v);
+	g_value_init(&dest->value, G_TYPE_LONG);
+	g_value_set_long(&dest->value, value);
 }
 
 static void
-lu_ent_add_int(GArray *list, const char *attr, const GValue *value)
+lu_ent_add_int(struct lu_attribute_set *list, const char *attr,
+	       const GValue *value)
 {
-	GValueArray *dest;
+	struct attribute_key key;
+	struct lu_attribute *dest;
 	size_t i;
 
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(value != NULL);
 	g_return_if_fail(attr != NULL);
 	g_return_if_fail(strlen(attr) > 0);
-	dest = lu_ent_get_int(list, attr);
+	attribute_key_init(&key, attr, TRUE);
+	dest = attribute_set_find(list, &key);
 	if (dest == NULL) {
-		struct lu_attribute newattr;
+		struct lu_attribute_values *v;
 
-		memset(&newattr, 0, sizeof(newattr));
-		newattr.name = quark_from_attribute(attr);
-		newattr.values = g_value_array_new(1);
-		dest = newattr.values;
-		g_array_append_val(list, newattr);
+		v = attribute_set_add(list, &key);
+		value_copy_in(list->arena, &v->value, value);
+		return;
 	}
-	for (i = 0; i < dest->n_values; i++) {
+	for (i = 0; i < attribute_n_values(dest); i++) {
 		GValue *current;
 
-		current = g_value_array_get_nth(dest, i);
+		current = attribute_nth(dest, i);
 		if (G_VALUE_TYPE(value) == G_VALUE_TYPE(current)
 		    && lu_values_equal(value, current))
-			break;
+			return;
 	}
-	if (i >= dest->n_values)
-		g_value_array_append(dest, value);
+	g_value_array_append(attribute_values(dest), value);
 }
 
 static void
-lu_ent_clear_all_int(GArray *list)
+lu_ent_clear_all_int(struct lu_attribute_set *list)
 {
-	clear_attribute_list(list);
+	attribute_set_clear(list);
 }
 
 static void
-lu_ent_del_int(GArray *list, const char *attr, const GValue *value)
+lu_ent_del_int(struct lu_attribute_set *list, const char *attr,
+	       const GValue *value)
 {
-	GValueArray *dest;
+	struct lu_attribute *dest;
 	size_t i;
 	g_return_if_fail(list != NULL);
 	g_return_if_fail(value != NULL);
 	g_return_if_fail(attr != NULL);
 	g_return_if_fail(strlen(attr) > 0);
-	dest = lu_ent_get_int(list, attr);
+	dest = lu_ent_find_int(list, attr);
 	if (dest != NULL) {
-		for (i = 0; i < dest->n_values; i++) {
+		for (i = 0; i < attribute_n_values(dest); i++) {
 			GValue *tvalue;
 
-			tvalue = g_value_array_get_nth(dest, i);
+			tvalue = attribute_nth(dest, i);
 			if (G_VALUE_TYPE(value) == G_VALUE_TYPE(tvalue)
 			    && lu_values_equal(value, tvalue))
 				break;
 		}
-		if (i < dest->n_values) {
-			g_value_array_remove(dest, i);
-			if (dest->n_values == 0)
-				lu_ent_clear_int(list, attr);
+		if (i < attribute_n_values(dest)) {
+			if (attribute_n_values(dest) == 1)
+				attribute_set_remove(list, dest);
+			else
+				g_value_array_remove(attribute_values(dest),
+						     i);
 		}
 	}
 }
 
 static GList *
-lu_ent_get_attributes_int(GArray *list)
+lu_ent_get_attributes_int(struct lu_attribute_set *list)
 {
 	size_t i;
 	GList *ret = NULL;
 	g_return_val_if_fail(list != NULL, NULL);
-	for (i = 0; i < list->len; i++) {
-		struct lu_attribute *attr;
-
-		attr = &g_array_index(list, struct lu_attribute, i);
-		ret = g_list_prepend(ret, (char*)g_quark_to_string(attr->name));
-	}
+	for (i = 0; i < list->len; i++)
+		ret = g_list_prepend(ret, (char*)g_quark_to_string
+				     (list->attrs[i].name));
 	return g_list_reverse(ret);
 }
 
@@ -632,7 +1327,7 @@ lu_ent_get(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_int(ent->pending, attribute);
+	return lu_ent_get_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_get_current:
@@ -652,7 +1347,7 @@ lu_ent_get_current(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_int(ent->current, attribute);
+	return lu_ent_get_int(&ent->current, attribute);
 }
 
 /**
@@ -674,7 +1369,7 @@ lu_ent_get_first_string(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_first_string_int(ent->pending, attribute);
+	return lu_ent_get_first_string_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_get_first_string_current:
@@ -695,7 +1390,7 @@ lu_ent_get_first_string_current(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_first_string_int(ent->current, attribute);
+	return lu_ent_get_first_string_int(&ent->current, attribute);
 }
 
 /**
@@ -716,7 +1411,7 @@ lu_ent_get_first_value_strdup(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_first_value_strdup_int(ent->pending, attribute);
+	return lu_ent_get_first_value_strdup_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_get_first_value_strdup_current:
@@ -736,7 +1431,7 @@ lu_ent_get_first_value_strdup_current(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
 	g_return_val_if_fail(attribute != NULL, NULL);
 	g_return_val_if_fail(strlen(attribute) > 0, NULL);
-	return lu_ent_get_first_value_strdup_int(ent->current, attribute);
+	return lu_ent_get_first_value_strdup_int(&ent->current, attribute);
 }
 
 /**
@@ -758,7 +1453,7 @@ lu_ent_get_first_id(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, LU_VALUE_INVALID_ID);
 	g_return_val_if_fail(attribute != NULL, LU_VALUE_INVALID_ID);
 	g_return_val_if_fail(strlen(attribute) > 0, LU_VALUE_INVALID_ID);
-	return lu_ent_get_first_id_int(ent->pending, attribute);
+	return lu_ent_get_first_id_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_get_first_id_current:
@@ -779,7 +1474,7 @@ lu_ent_get_first_id_current(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, LU_VALUE_INVALID_ID);
 	g_return_val_if_fail(attribute != NULL, LU_VALUE_INVALID_ID);
 	g_return_val_if_fail(strlen(attribute) > 0, LU_VALUE_INVALID_ID);
-	return lu_ent_get_first_id_int(ent->current, attribute);
+	return lu_ent_get_first_id_int(&ent->current, attribute);
 }
 
 /**
@@ -798,7 +1493,7 @@ lu_ent_has(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, FALSE);
 	g_return_val_if_fail(attribute != NULL, FALSE);
 	g_return_val_if_fail(strlen(attribute) > 0, FALSE);
-	return lu_ent_has_int(ent->pending, attribute);
+	return lu_ent_has_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_has_current:
@@ -816,7 +1511,7 @@ lu_ent_has_current(struct lu_ent *ent, const char *attribute)
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, FALSE);
 	g_return_val_if_fail(attribute != NULL, FALSE);
 	g_return_val_if_fail(strlen(attribute) > 0, FALSE);
-	return lu_ent_has_int(ent->current, attribute);
+	return lu_ent_has_int(&ent->current, attribute);
 }
 
 /**
@@ -835,7 +1530,7 @@ lu_ent_set(struct lu_ent *ent, const char *attribute, const GValueArray *values)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_set_int(ent->pending, attribute, values);
+	lu_ent_set_int(&ent->pending, attribute, values);
 }
 /**
  * lu_ent_set_current:
@@ -854,7 +1549,7 @@ lu_ent_set_current(struct lu_ent *ent, const char *attribute,
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_set_int(ent->current, attribute, values);
+	lu_ent_set_int(&ent->current, attribute, values);
 }
 
 /**
@@ -874,7 +1569,7 @@ lu_ent_set_string(struct lu_ent *ent, const char *attribute, const char *value)
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != NULL);
-	lu_ent_set_string_int(ent->pending, attribute, value);
+	lu_ent_set_string_int(&ent->pending, attribute, value);
 }
 /**
  * lu_ent_set_string_current:
@@ -894,7 +1589,7 @@ lu_ent_set_string_current(struct lu_ent *ent, const char *attribute,
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != NULL);
-	lu_ent_set_string_int(ent->current, attribute, value);
+	lu_ent_set_string_int(&ent->current, attribute, value);
 }
 
 /**
@@ -913,7 +1608,7 @@ lu_ent_set_id(struct lu_ent *ent, const char *attribute, id_t value)
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != LU_VALUE_INVALID_ID);
-	lu_ent_set_id_int(ent->pending, attribute, value);
+	lu_ent_set_id_int(&ent->pending, attribute, value);
 }
 /**
  * lu_ent_set_id_current:
@@ -931,7 +1626,7 @@ lu_ent_set_id_current(struct lu_ent *ent, const char *attribute, id_t value)
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != LU_VALUE_INVALID_ID);
-	lu_ent_set_id_int(ent->current, attribute, value);
+	lu_ent_set_id_int(&ent->current, attribute, value);
 }
 
 /**
@@ -949,7 +1644,7 @@ lu_ent_set_long(struct lu_ent *ent, const char *attribute, long value)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_set_long_int(ent->pending, attribute, value);
+	lu_ent_set_long_int(&ent->pending, attribute, value);
 }
 /**
  * lu_ent_set_long_current:
@@ -966,7 +1661,7 @@ lu_ent_set_long_current(struct lu_ent *ent, const char *attribute, long value)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_set_long_int(ent->current, attribute, value);
+	lu_ent_set_long_int(&ent->current, attribute, value);
 }
 
 /**
@@ -985,7 +1680,7 @@ lu_ent_add(struct lu_ent *ent, const char *attribute, const GValue *value)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_add_int(ent->pending, attribute, value);
+	lu_ent_add_int(&ent->pending, attribute, value);
 }
 /**
  * lu_ent_add_current:
@@ -1004,7 +1699,32 @@ lu_ent_add_current(struct lu_ent *ent, const char *attribute,
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_add_int(ent->current, attribute, value);
+	lu_ent_add_int(&ent->current, attribute, value);
+}
+
+void
+lu_ent_append_current_q(struct lu_ent *ent, GQuark attribute, GValue *value)
+{
+	struct attribute_key key;
+	struct lu_attribute *dest;
+	GValueArray *values;
+	GValue *slot;
+
+	g_return_if_fail(ent != NULL);
+	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
+	g_return_if_fail(value != NULL);
+	attribute_key_init_q(&key, attribute);
+	dest = attribute_set_find(&ent->current, &key);
+	/* Move the value instead of copying it. */
+	if (dest == NULL)
+		slot = &attribute_set_add(&ent->current, &key)->value;
+	else {
+		values = attribute_values(dest);
+		g_value_array_append(values, NULL);
+		slot = g_value_array_get_nth(values, values->n_values - 1);
+	}
+	*slot = *value;
+	memset(value, 0, sizeof(*value));
 }
 
 /**
@@ -1021,7 +1741,7 @@ lu_ent_clear(struct lu_ent *ent, const char *attribute)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_clear_int(ent->pending, attribute);
+	lu_ent_clear_int(&ent->pending, attribute);
 }
 /**
  * lu_ent_clear_current:
@@ -1037,7 +1757,7 @@ lu_ent_clear_current(struct lu_ent *ent, const char *attribute)
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
-	lu_ent_clear_int(ent->current, attribute);
+	lu_ent_clear_int(&ent->current, attribute);
 }
 
 /**
@@ -1051,7 +1771,7 @@ lu_ent_clear_all(struct lu_ent *ent)
 {
 	g_return_if_fail(ent != NULL);
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
-	lu_ent_clear_all_int(ent->pending);
+	lu_ent_clear_all_int(&ent->pending);
 }
 /**
  * lu_ent_clear_all_current:
@@ -1064,7 +1784,7 @@ lu_ent_clear_all_current(struct lu_ent *ent)
 {
 	g_return_if_fail(ent != NULL);
 	g_return_if_fail(ent->magic == LU_ENT_MAGIC);
-	lu_ent_clear_all_int(ent->current);
+	lu_ent_clear_all_int(&ent->current);
 }
 
 /**
@@ -1084,7 +1804,7 @@ lu_ent_del(struct lu_ent *ent, const char *attribute, const GValue *value)
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != NULL);
-	lu_ent_del_int(ent->pending, attribute, value);
+	lu_ent_del_int(&ent->pending, attribute, value);
 }
 /**
  * lu_ent_del_current:
@@ -1104,7 +1824,7 @@ lu_ent_del_current(struct lu_ent *ent, const char *attribute,
 	g_return_if_fail(attribute != NULL);
 	g_return_if_fail(strlen(attribute) > 0);
 	g_return_if_fail(value != NULL);
-	lu_ent_del_int(ent->current, attribute, value);
+	lu_ent_del_int(&ent->current, attribute, value);
 }
 
 /**
@@ -1121,7 +1841,7 @@ lu_ent_get_attributes(struct lu_ent *ent)
 {
 	g_return_val_if_fail(ent != NULL, NULL);
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
-	return lu_ent_get_attributes_int(ent->pending);
+	return lu_ent_get_attributes_int(&ent->pending);
 }
 /**
  * lu_ent_get_attributes_current:
@@ -1137,5 +1857,5 @@ lu_ent_get_attributes_current(struct lu_ent *ent)
 {
 	g_return_val_if_fail(ent != NULL, NULL);
 	g_return_val_if_fail(ent->magic == LU_ENT_MAGIC, NULL);
-	return lu_ent_get_attributes_int(ent->current);
+	return lu_ent_get_attributes_int(&ent->current);
 }
@@ -50,6 +50,15 @@ struct lu_ent;
 typedef struct lu_ent lu_ent_t;
 #endif
 
+/**
+ * lu_ent_arena:
+ *
+ * An opaque structure which owns memory of many struct #lu_ent entities, so
+ * that they can be allocated quickly and freed all at once.  See
+ * lu_users_enumerate_full_arena().
+ */
+struct lu_ent_arena;
+
 /* Attributes carried by all user structures. */
 /**
  * LU_USERNAME:
@@ -261,6 +270,9 @@ typedef struct lu_ent lu_ent_t;
 struct lu_ent *lu_ent_new(void);
 void lu_ent_free(struct lu_ent *ent);
 
+struct lu_ent_arena *lu_ent_arena_new(void);
+void lu_ent_arena_free(struct lu_ent_arena *arena);
+
 void lu_ent_copy(struct lu_ent *source, struct lu_ent *dest);
 
 void lu_ent_revert(struct lu_ent *ent);
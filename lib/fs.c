@@ -175,47 +175,62 @@ copy_symlink(int src_dir_fd, const char *src_path, int dest_dir_fd,
 	return TRUE;
 }
 
-/* Copy SRC_FD, which corresponds to SRC_PATH, to DEST_NAME in DEST_DIR_FD,
-   which corresponds to DEST_PATH.  Use ACCESS_OPTIONS.  Use SRC_STAT for data
-   about SRC_PATH.
+/* At most this many threads copy file contents for lu_homedir_copy(). */
+#define COPY_THREADS_MAX 8
+/* Files smaller than this are copied by the thread walking the tree; handing
+   them over would cost more than copying them. */
+#define COPY_PARALLEL_MIN (64 * 1024)
+/* At most this many files wait for a copy thread, each holding two file
+   descriptors. */
+#define COPY_QUEUE_MAX 64
+
+/* Threads copying contents of regular files while the thread walking the tree
+   creates the rest of the copy. */
+struct copy_pool {
+	GThreadPool *pool;
+	GMutex lock;
+	GCond changed;
+	guint pending;		/* Files not copied yet, protected by lock */
+	struct lu_error *error;	/* The first failure, protected by lock */
+};
 
-   On return from this function, SELinux fscreate context is unspecified.
+/* A regular file copied by a struct copy_pool thread. */
+struct copy_job {
+	struct copy_pool *pool;
+	int src_fd, dest_fd;
+	char *src_path, *dest_path;
+	struct stat src_stat;
+	const struct copy_access_options *access_options;
+};
 
-   Note that SRC_PATH should only be used for error messages, not to access the
-   files; if the user is still logged in, a directory in the path may be
-   replaced by a symbolic link, redirecting the access outside of SRC_FD.
-   Likewise for DEST_*. */
+/* Copy data of SRC_FD, which corresponds to SRC_PATH, to the new DEST_FD,
+   which corresponds to DEST_PATH, and then apply the ownership, permissions
+   and times of the original.  Use ACCESS_OPTIONS.  Use SRC_STAT for data about
+   SRC_PATH.
+
+   This does not use the SELinux fscreate context, so it can run in any
+   thread. */
 static gboolean
-copy_regular_file(int src_fd, const char *src_path, int dest_dir_fd,
-		  const char *dest_name, const char *dest_path,
-		  const struct stat *src_stat,
-		  const struct copy_access_options *access_options,
-		  struct lu_error **error)
+copy_file_contents(int src_fd, const char *src_path, int dest_fd,
+		   const char *dest_path, const struct stat *src_stat,
+		   const struct copy_access_options *access_options,
+		   struct lu_error **error)
 {
-	int dest_fd;
 	struct timespec timebuf[2];
-	gboolean ret = FALSE;
 
 	LU_ERROR_CHECK(error);
 
-	if (access_options->preserve_source) {
-		if (!lu_util_fscreate_from_fd(src_fd, src_path, error))
-			return FALSE;
-	} else if (!lu_util_fscreate_for_path(dest_path,
-					      src_stat->st_mode & S_IFMT,
-					      error))
-		return FALSE;
-	/* Start with absolutely restrictive permissions; the original file may
-	   be e.g. a hardlink to /etc/shadow. */
-	dest_fd = openat(dest_dir_fd, dest_name,
-			 O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW, 0);
-	if (dest_fd == -1) {
-		lu_error_new(error, lu_error_open, _("Error writing `%s': %s"),
+	/* Let the kernel copy the data if it can, or just copy it. */
+	switch (lu_util_copy_file_data(src_fd, dest_fd, src_stat->st_size)) {
+	case 1:
+		goto copied;
+	case 0:
+		break;
+	default:
+		lu_error_new(error, lu_error_write, _("Error writing `%s': %s"),
 			     dest_path, strerror(errno));
 		return FALSE;
 	}
-
-	/* Now just copy the data. */
 	for (;;) {
 		unsigned char buf[BUFSIZ];
 		ssize_t left;
@@ -228,7 +243,7 @@ copy_regular_file(int src_fd, const char *src_path, int dest_dir_fd,
 			lu_error_new(error, lu_error_read,
 				     _("Error reading `%s': %s"), src_path,
 				     strerror(errno));
-			goto err_dest_fd;
+			return FALSE;
 		}
 		if (left == 0)
 			break;
@@ -243,12 +258,13 @@ copy_regular_file(int src_fd, const char *src_path, int dest_dir_fd,
 				lu_error_new(error, lu_error_write,
 					     _("Error writing `%s': %s"),
 					     dest_path, strerror(errno));
-				goto err_dest_fd;
+				return FALSE;
 			}
 			p += out;
 			left -= out;
 		}
 	}
+copied:
 
 	/* Set the ownership; permissions are still restrictive. */
 	if (fchown(dest_fd, uid_for_copy(access_options, src_stat),
@@ -257,7 +273,7 @@ copy_regular_file(int src_fd, const char *src_path, int dest_dir_fd,
 		lu_error_new(error, lu_error_generic,
 			     _("Error changing owner of `%s': %s"), dest_path,
 			     strerror(errno));
-		goto err_dest_fd;
+		return FALSE;
 	}
 
 	/* Set the desired mode.  Do this explicitly to preserve S_ISGID and
@@ -267,18 +283,188 @@ copy_regular_file(int src_fd, const char *src_path, int dest_dir_fd,
 		lu_error_new(error, lu_error_generic,
 			     _("Error setting mode of `%s': %s"), dest_path,
 			     strerror(errno));
-		goto err_dest_fd;
+		return FALSE;
 	}
 
 	timebuf[0] = src_stat->st_atim;
 	timebuf[1] = src_stat->st_mtim;
 	futimens(dest_fd, timebuf);
+	return TRUE;
+}
 
-	ret = TRUE;
-	/* Fall through */
+/* Copy a struct copy_job, and free it.  A GFunc for a GThreadPool. */
+static void
+copy_job_run(gpointer data, gpointer user_data)
+{
+	struct copy_job *job;
+	struct copy_pool *pool;
+	struct lu_error *error;
+
+	(void)user_data;
+	job = data;
+	pool = job->pool;
+	error = NULL;
+	copy_file_contents(job->src_fd, job->src_path, job->dest_fd,
+			   job->dest_path, &job->src_stat, job->access_options,
+			   &error);
+	close(job->dest_fd);
+	close(job->src_fd);
+	g_free(job->dest_path);
+	g_free(job->src_path);
+	g_free(job);
+
+	g_mutex_lock(&pool->lock);
+	if (error != NULL && pool->error == NULL) {
+		pool->error = error;
+		error = NULL;
+	}
+	pool->pending--;
+	g_cond_signal(&pool->changed);
+	g_mutex_unlock(&pool->lock);
+	if (error != NULL)
+		lu_error_free(&error);
+}
+
+/* Return a new struct copy_pool, or NULL if files should be copied by the
+   calling thread. */
+static struct copy_pool *
+copy_pool_new(void)
+{
+	struct copy_pool *pool;
+	long threads;
+
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads <= 1)
+		return NULL;
+	pool = g_malloc0(sizeof(*pool));
+	pool->pool = g_thread_pool_new(copy_job_run, NULL,
+				       MIN(threads, COPY_THREADS_MAX), TRUE,
+				       NULL);
+	if (pool->pool == NULL) {
+		g_free(pool);
+		return NULL;
+	}
+	g_mutex_init(&pool->lock);
+	g_cond_init(&pool->changed);
+	return pool;
+}
+
+/* Queue JOB in POOL, waiting if too many files are queued already.  In every
+   case, even on error, take ownership of JOB.  Return FALSE and set ERROR if
+   an earlier file could not be copied, so that the walk can stop early. */
+static gboolean
+copy_pool_push(struct copy_pool *pool, struct copy_job *job,
+	       struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+
+	g_mutex_lock(&pool->lock);
+	while (pool->pending >= COPY_QUEUE_MAX && pool->error == NULL)
+		g_cond_wait(&pool->changed, &pool->lock);
+	if (pool->error != NULL) {
+		lu_error_new(error, pool->error->code, "%s",
+			     pool->error->string);
+		g_mutex_unlock(&pool->lock);
+		close(job->dest_fd);
+		close(job->src_fd);
+		g_free(job->dest_path);
+		g_free(job->src_path);
+		g_free(job);
+		return FALSE;
+	}
+	pool->pending++;
+	g_mutex_unlock(&pool->lock);
+	if (!g_thread_pool_push(pool->pool, job, NULL))
+		copy_job_run(job, NULL);
+	return TRUE;
+}
+
+/* Wait for all files queued in POOL, and free it.  Return FALSE and set ERROR
+   if any of them could not be copied. */
+static gboolean
+copy_pool_finish(struct copy_pool *pool, struct lu_error **error)
+{
+	gboolean ret;
 
-err_dest_fd:
+	LU_ERROR_CHECK(error);
+
+	/* Wait for all jobs to finish. */
+	g_thread_pool_free(pool->pool, FALSE, TRUE);
+	ret = pool->error == NULL;
+	if (!ret)
+		*error = pool->error;
+	g_cond_clear(&pool->changed);
+	g_mutex_clear(&pool->lock);
+	g_free(pool);
+	return ret;
+}
+
+/* Copy SRC_FD, which corresponds to SRC_PATH, to DEST_NAME in DEST_DIR_FD,
+   which corresponds to DEST_PATH.  Use ACCESS_OPTIONS.  Use SRC_STAT for data
+   about SRC_PATH.  If POOL is not NULL, larger files may be finished by its
+   threads after this function returns.
+
+   In every case, even on error, close SRC_FD.  On return from this function,
+   SELinux fscreate context is unspecified.
+
+   Note that SRC_PATH should only be used for error messages, not to access the
+   files; if the user is still logged in, a directory in the path may be
+   replaced by a symbolic link, redirecting the access outside of SRC_FD.
+   Likewise for DEST_*. */
+static gboolean
+copy_regular_file_and_close(int src_fd, const char *src_path, int dest_dir_fd,
+			    const char *dest_name, const char *dest_path,
+			    const struct stat *src_stat,
+			    const struct copy_access_options *access_options,
+			    struct copy_pool *pool, struct lu_error **error)
+{
+	int dest_fd;
+	gboolean ret;
+
+	LU_ERROR_CHECK(error);
+
+	ret = FALSE;
+	/* The fscreate context belongs to this thread, so the file is always
+	   created here. */
+	if (access_options->preserve_source) {
+		if (!lu_util_fscreate_from_fd(src_fd, src_path, error))
+			goto err_src_fd;
+	} else if (!lu_util_fscreate_for_path(dest_path,
+					      src_stat->st_mode & S_IFMT,
+					      error))
+		goto err_src_fd;
+	/* Start with absolutely restrictive permissions; the original file may
+	   be e.g. a hardlink to /etc/shadow. */
+	dest_fd = openat(dest_dir_fd, dest_name,
+			 O_EXCL | O_CREAT | O_WRONLY | O_NOFOLLOW | O_CLOEXEC,
+			 0);
+	if (dest_fd == -1) {
+		lu_error_new(error, lu_error_open, _("Error writing `%s': %s"),
+			     dest_path, strerror(errno));
+		goto err_src_fd;
+	}
+
+	if (pool != NULL && src_stat->st_size >= COPY_PARALLEL_MIN) {
+		struct copy_job *job;
+
+		job = g_malloc(sizeof(*job));
+		job->pool = pool;
+		job->src_fd = src_fd;
+		job->dest_fd = dest_fd;
+		job->src_path = g_strdup(src_path);
+		job->dest_path = g_strdup(dest_path);
+		job->src_stat = *src_stat;
+		job->access_options = access_options;
+		return copy_pool_push(pool, job, error);
+	}
+
+	ret = copy_file_contents(src_fd, src_path, dest_fd, dest_path,
+				 src_stat, access_options, error);
 	close(dest_fd);
+	/* Fall through */
+
+err_src_fd:
+	close(src_fd);
 	return ret;
 }
 
@@ -289,10 +475,13 @@ static gboolean lu_copy_dir_and_close(int src_dir_fd, GString *src_path_buf,
 				      GString *dest_path_buf,
 				      const struct stat *src_dir_stat,
 				      const struct copy_access_options
-				      *access_options, struct lu_error **error);
+				      *access_options,
+				      struct copy_pool *pool,
+				      struct lu_error **error);
 
 /* Copy ENT_NAME in SRC_DIR_FD, which corresponds to SRC_PATH_BUF,
-   to DEST_DIR_FD, which corresponds to DEST_PATH_BUF.  Use ACCESS_OPTIONS.
+   to DEST_DIR_FD, which corresponds to DEST_PATH_BUF.  Use ACCESS_OPTIONS, and
+   POOL if not NULL.
 
    On return from this function, SELinux fscreate context is unspecified.  This
    function may temporarily modify SRC_PATH_BUF and DEST_PATH_BUF, but they
@@ -306,7 +495,7 @@ static gboolean
 copy_dir_entry(int src_dir_fd, GString *src_path_buf, int dest_dir_fd,
 	       GString *dest_path_buf, const char *ent_name,
 	       const struct copy_access_options *access_options,
-	       struct lu_error **error)
+	       struct copy_pool *pool, struct lu_error **error)
 {
 	struct stat st;
 	int ifd;
@@ -349,13 +538,15 @@ copy_dir_entry(int src_dir_fd, GString *src_path_buf, int dest_dir_fd,
 	if (S_ISDIR(st.st_mode)) {
 		ret = lu_copy_dir_and_close(ifd, src_path_buf, dest_dir_fd,
 					    ent_name, dest_path_buf, &st,
-					    access_options, error);
+					    access_options, pool, error);
 		ifd = -1;
-	} else if (S_ISREG(st.st_mode))
-		ret = copy_regular_file(ifd, src_path_buf->str, dest_dir_fd,
-					ent_name, dest_path_buf->str, &st,
-					access_options, error);
-	else
+	} else if (S_ISREG(st.st_mode)) {
+		ret = copy_regular_file_and_close(ifd, src_path_buf->str,
+						  dest_dir_fd, ent_name,
+						  dest_path_buf->str, &st,
+						  access_options, pool, error);
+		ifd = -1;
+	} else
 		/* Note that we don't copy device specials. */
 		ret = TRUE;
 	/* Fall through */
@@ -367,8 +558,8 @@ err_ifd:
 }
 
 /* Copy SRC_DIR_FD, which corresponds to SRC_PATH_BUF, to DEST_DIR_NAME under
-   DEST_PARENT_FD, which corresponds to DEST_PATH_BUF.  Use ACCESS_OPTIONS.  Use
-   SRC_DIR_STAT for data about SRC_PATH_BUF.
+   DEST_PARENT_FD, which corresponds to DEST_PATH_BUF.  Use ACCESS_OPTIONS, and
+   POOL if not NULL.  Use SRC_DIR_STAT for data about SRC_PATH_BUF.
 
    In every case, even on error, close SRC_DIR_FD.
 
@@ -385,7 +576,7 @@ lu_copy_dir_and_close(int src_dir_fd, GString *src_path_buf, int dest_parent_fd,
 		      const char *dest_dir_name, GString *dest_path_buf,
 		      const struct stat *src_dir_stat,
 		      const struct copy_access_options *access_options,
-		      struct lu_error **error)
+		      struct copy_pool *pool, struct lu_error **error)
 {
 	size_t orig_src_path_buf_len, orig_dest_path_buf_len;
 	struct dirent *ent;
@@ -468,7 +659,7 @@ lu_copy_dir_and_close(int src_dir_fd, GString *src_path_buf, int dest_parent_fd,
 
 		if (!copy_dir_entry(src_dir_fd, src_path_buf, dest_dir_fd,
 				    dest_path_buf, ent->d_name, access_options,
-				    error))
+				    pool, error))
 			goto err_dest_dir_fd;
 
 		g_string_truncate(src_path_buf, orig_src_path_buf_len);
@@ -517,7 +708,8 @@ lu_copy_dir_and_close(int src_dir_fd, GString *src_path_buf, int dest_parent_fd,
 	return ret;
 }
 
-/* Copy SRC_DIR to DEST_DIR.  Use ACCESS_OPTIONS.
+/* Copy SRC_DIR to DEST_DIR.  Use ACCESS_OPTIONS.  Contents of larger files
+   are copied by a pool of threads while the tree is walked.
 
    Return TRUE on error.
 
@@ -535,6 +727,7 @@ lu_homedir_copy(const char *src_dir, const char *dest_dir,
 	int fd;
 	struct stat st;
 	GString *src_path_buf, *dest_path_buf;
+	struct copy_pool *pool;
 	gboolean ret;
 
 	LU_ERROR_CHECK(error);
@@ -557,8 +750,22 @@ lu_homedir_copy(const char *src_dir, const char *dest_dir,
 
 	src_path_buf = g_string_new(src_dir);
 	dest_path_buf = g_string_new(dest_dir);
+	pool = copy_pool_new();
 	ret = lu_copy_dir_and_close(fd, src_path_buf, AT_FDCWD, dest_dir,
-				    dest_path_buf, &st, access_options, error);
+				    dest_path_buf, &st, access_options, pool,
+				    error);
+	if (pool != NULL) {
+		struct lu_error *pool_error;
+
+		/* Report a failure of the walk in preference to one of the
+		   files it queued. */
+		pool_error = NULL;
+		if (!copy_pool_finish(pool, &pool_error) && ret) {
+			*error = pool_error;
+			ret = FALSE;
+		} else if (pool_error != NULL)
+			lu_error_free(&pool_error);
+	}
 	g_string_free(dest_path_buf, TRUE);
 	g_string_free(src_path_buf, TRUE);
 	goto err_fscreate;
@@ -879,6 +1086,48 @@ lu_homedir_remove_for_user_if_owned(struct lu_ent *ent, struct lu_error **error)
 	return homedir_remove_for_user(ent, uid, error);
 }
 
+/* Rename OLDHOME to NEWHOME, never replacing an existing NEWHOME.
+   Return 1 on success, 0 if OLDHOME must be copied instead (nothing was
+   changed in that case), -1 on error. */
+static int
+homedir_rename(const char *oldhome, const char *newhome,
+	       struct lu_error **error)
+{
+#ifdef HAVE_RENAMEAT2
+	struct stat st;
+
+	LU_ERROR_CHECK(error);
+
+	/* lu_homedir_copy() copies the directory a symlink points to; renaming
+	   would move just the symlink. */
+	if (lstat(oldhome, &st) != 0 || !S_ISDIR(st.st_mode))
+		return 0;
+	if (renameat2(AT_FDCWD, oldhome, AT_FDCWD, newhome,
+		      RENAME_NOREPLACE) == 0)
+		return 1;
+	switch (errno) {
+	case EEXIST:
+	case ENOTEMPTY:
+		lu_error_new(error, lu_error_generic,
+			     _("Error creating `%s': %s"), newhome,
+			     strerror(errno));
+		return -1;
+	default:
+		/* Besides EXDEV, e.g. EBUSY if OLDHOME is a mount point,
+		   EPERM or EACCES from security policies that don't apply
+		   to copying, or EINVAL and ENOSYS if RENAME_NOREPLACE is not
+		   supported (plain rename() could replace an empty NEWHOME).
+		   Copying may still work. */
+		return 0;
+	}
+#else
+	(void)oldhome;
+	(void)newhome;
+	(void)error;
+	return 0;
+#endif
+}
+
 /**
  * lu_homedir_move:
  * @oldhome: Path to the old home directory
@@ -887,8 +1136,10 @@ lu_homedir_remove_for_user_if_owned(struct lu_ent *ent, struct lu_error **error)
  *
  * Moves user's home directory to @newhome.
  *
- * Currently implemented by first creating a copy, then deleting the original,
- * expect this to take a long time.
+ * Within a single file system the directory is simply renamed, which keeps
+ * ownership, permissions and SELinux contexts of all files.  Otherwise a copy
+ * with the same ownership, permissions and contexts is created first, then
+ * the original is deleted; expect this to take a long time.
  *
  * If you want to use this in a hostile environment, ensure that no untrusted
  * user has write permission to any parent of @oldhome or @newhome.  Usually
@@ -907,6 +1158,15 @@ lu_homedir_move(const char *oldhome, const char *newhome,
 	g_return_val_if_fail(oldhome != NULL, FALSE);
 	g_return_val_if_fail(newhome != NULL, FALSE);
 
+	switch (homedir_rename(oldhome, newhome, error)) {
+	case 1:
+		return TRUE;
+	case 0:
+		break;
+	default:
+		return FALSE;
+	}
+
 	access_options.preserve_source = TRUE;
 	if (!lu_homedir_copy(oldhome, newhome, &access_options, error))
 		return FALSE;
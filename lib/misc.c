@@ -316,7 +316,12 @@ gboolean
 lu_set_modules(struct lu_context * context, const char *list,
 	       struct lu_error ** error)
 {
-	return lu_modules_load(context, list, &context->module_names, error);
+	gboolean ret;
+
+	lu_forget_used_ids(context);
+	ret = lu_modules_load(context, list, &context->module_names, error);
+	lu_ent_cache_reset(context);
+	return ret;
 }
 
 /**
@@ -135,10 +135,11 @@ load_one_module(struct lu_context *ctx, const char *module_dir,
 
 	g_free(module_file);
 
-	/* Initialize the last two fields in the module structure and add it to
-	   the module tree. */
+	/* Initialize the fields owned by the library in the module structure
+	   and add it to the module tree. */
 	module->lu_context = ctx;
 	module->module_handle = handle;
+	g_mutex_init(&module->call_lock);
 	module_name = ctx->scache->cache(ctx->scache, module_name);
 	g_tree_insert(ctx->modules, module_name, module);
 
@@ -244,6 +245,7 @@ lu_module_unload(gpointer key, gpointer value, gpointer data)
 
 		module = (struct lu_module *) value;
 		handle = module->module_handle;
+		g_mutex_clear(&module->call_lock);
 		module->close(module);
 		/* Unload the module. */
 		if (handle != NULL)
@@ -143,12 +143,18 @@ lu_start(const char *auth_name, enum lu_entity_type auth_type,
 						    "files shadow");
 	}
 
+	ctx->parallel_reads
+		= g_ascii_strcasecmp(lu_cfg_read_single(ctx,
+							"defaults/parallel_reads",
+							"no"), "yes") == 0;
+
 	/* Load the modules. */
 	if (!lu_modules_load(ctx, modules, &ctx->module_names, error))
 		goto err_modules; /* lu_module_load sets errors */
 	if (!lu_modules_load(ctx, create_modules, &ctx->create_module_names,
 			     error))
 		goto err_module_names; /* lu_module_load sets errors */
+	lu_ent_cache_reset(ctx);
 
 	return ctx;
 
@@ -174,6 +180,13 @@ lu_end(struct lu_context *context)
 {
 	g_assert(context != NULL);
 
+	if (context->in_transaction)
+		lu_transaction_abort(context);
+	lu_forget_used_ids(context);
+	lu_ent_cache_free(context);
+	if (context->read_pool != NULL)
+		g_thread_pool_free(context->read_pool, FALSE, TRUE);
+
 	g_tree_foreach(context->modules, lu_module_unload, NULL);
 	g_tree_destroy(context->modules);
 
@@ -201,7 +214,7 @@ extract_name(struct lu_ent *ent)
 				       : LU_GROUPNAME);
 	if (name == NULL)
 		return NULL;
-	return ent->cache->cache(ent->cache, name);
+	return lu_ent_cache_string(ent, name);
 }
 
 static gboolean
@@ -386,14 +399,50 @@ lu_refresh_group(struct lu_context *context, struct lu_ent *entity,
 	return lu_refresh_int(context, entity, error);
 }
 
+/* The module whose call_lock is held by the current thread, if any. */
+static GPrivate held_module = G_PRIVATE_INIT(NULL);
+
+/* Prepare for calling a function of MODULE in the current thread.  Return a
+   value for module_call_end().
+
+   With parallel_reads, modules are called from several threads at once, and
+   a module may call back into the library (e.g. to look up groups of a user)
+   while other threads are using the other modules, so each call holds the
+   call_lock of its module.  A thread holds at most one such lock: the lock
+   of a module calling back into the library is released until the nested
+   call returns, so threads never wait for each other in a cycle. */
+static struct lu_module *
+module_call_begin(struct lu_module *module)
+{
+	struct lu_module *outer;
+
+	outer = g_private_get(&held_module);
+	if (outer != NULL)
+		g_mutex_unlock(&outer->call_lock);
+	g_mutex_lock(&module->call_lock);
+	g_private_set(&held_module, module);
+	return outer;
+}
+
+/* Finish a call of MODULE started by module_call_begin(), which returned
+   OUTER. */
+static void
+module_call_end(struct lu_module *module, struct lu_module *outer)
+{
+	g_private_set(&held_module, outer);
+	g_mutex_unlock(&module->call_lock);
+	if (outer != NULL)
+		g_mutex_lock(&outer->call_lock);
+}
+
 static gboolean
-run_single(struct lu_context *context,
-	   struct lu_module *module,
-	   enum lu_dispatch_id id,
-	   const char *sdata, id_t ldata,
-	   struct lu_ent *entity,
-	   gpointer *ret,
-	   struct lu_error **error)
+call_module(struct lu_context *context,
+	    struct lu_module *module,
+	    enum lu_dispatch_id id,
+	    const char *sdata, id_t ldata,
+	    struct lu_ent *entity,
+	    gpointer *ret,
+	    struct lu_error **error)
 {
 	GPtrArray *ptrs;
 	size_t i;
@@ -592,6 +641,25 @@ run_single(struct lu_context *context,
 	g_assert_not_reached();
 }
 
+static gboolean
+run_single(struct lu_context *context,
+	   struct lu_module *module,
+	   enum lu_dispatch_id id,
+	   const char *sdata, id_t ldata,
+	   struct lu_ent *entity,
+	   gpointer *ret,
+	   struct lu_error **error)
+{
+	struct lu_module *outer;
+	gboolean success;
+
+	outer = module_call_begin(module);
+	success = call_module(context, module, id, sdata, ldata, entity, ret,
+			      error);
+	module_call_end(module, outer);
+	return success;
+}
+
 static gboolean
 logic_and(gboolean a, gboolean b)
 {
@@ -604,133 +672,247 @@ logic_or(gboolean a, gboolean b)
 	return a || b;
 }
 
+/* Remove duplicate values from ARRAY, keeping the first occurrence of each
+   value.  String values, by far the most common, are found using a hash
+   table. */
 static void
 remove_duplicate_values(GValueArray *array)
 {
-	size_t i;
+	GHashTable *seen;
+	size_t i, kept;
 
+	if (array->n_values < 2)
+		return;
+	seen = g_hash_table_new(g_str_hash, g_str_equal);
+	kept = 0;
 	for (i = 0; i < array->n_values; i++) {
-		size_t j;
-		GValue *ivalue;
+		GValue *value;
+		gboolean duplicate;
+
+		value = g_value_array_get_nth(array, i);
+		if (G_VALUE_HOLDS_STRING(value)
+		    && g_value_get_string(value) != NULL) {
+			gpointer key;
+
+			key = (gpointer)g_value_get_string(value);
+			duplicate = g_hash_table_lookup_extended(seen, key,
+								 NULL, NULL);
+			if (!duplicate)
+				g_hash_table_insert(seen, key, NULL);
+		} else {
+			size_t j;
 
-		ivalue = g_value_array_get_nth(array, i);
-		for (j = i + 1; j < array->n_values; j++) {
-			GValue *jvalue;
+			duplicate = FALSE;
+			for (j = 0; j < kept && !duplicate; j++) {
+				GValue *kept_value;
 
-			jvalue = g_value_array_get_nth(array, j);
-			if (G_VALUE_TYPE(ivalue) == G_VALUE_TYPE(jvalue)
-			    && lu_values_equal(ivalue, jvalue)) {
-				g_value_array_remove(array, j);
-				j--;
+				kept_value = g_value_array_get_nth(array, j);
+				duplicate = G_VALUE_TYPE(value)
+					== G_VALUE_TYPE(kept_value)
+					&& lu_values_equal(value, kept_value);
+			}
+		}
+		if (duplicate)
+			g_value_unset(value);
+		else {
+			/* Moving the value keeps the string pointers in SEEN
+			   valid. */
+			if (kept != i) {
+				*g_value_array_get_nth(array, kept) = *value;
+				memset(value, 0, sizeof(*value));
 			}
+			kept++;
 		}
 	}
+	g_hash_table_destroy(seen);
+	/* The values past KEPT are zero-filled, removing them from the end is
+	   cheap. */
+	while (array->n_values > kept)
+		g_value_array_remove(array, array->n_values - 1);
 }
 
-static int
-compare_strings(gconstpointer a, gconstpointer b, gpointer data)
-{
-	(void)data;
-	return strcmp(a, b);
-}
-
+/* Merge entities in ARRAY which describe the same user or group, typically
+   returned by different modules, and return a new array.  ARRAY is freed. */
 static GPtrArray *
 merge_ent_array_duplicates(GPtrArray *array)
 {
 	GPtrArray *ret;
 	size_t i;
-	GTree *users, *groups;
+	GHashTable *users, *groups;
 
 	g_return_val_if_fail(array != NULL, NULL);
-	users = g_tree_new_full(compare_strings, NULL, g_free, NULL);
-	groups = g_tree_new_full(compare_strings, NULL, g_free, NULL);
+	users = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	groups = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
 	/* A structure to hold the new list. */
-	ret = g_ptr_array_new();
+	ret = g_ptr_array_sized_new(array->len);
 	/* Iterate over every entity in the incoming list. */
 	for (i = 0; i < array->len; i++) {
 		struct lu_ent *current, *saved;
 		char *key;
-		GValueArray *values;
-		GValue *value;
-		GTree *tree;
+		GHashTable *table;
 
 		current = g_ptr_array_index(array, i);
 		key = NULL;
-		values = NULL;
-		tree = NULL;
+		table = NULL;
 		/* Get the name of the user or group. */
 		if (current->type == lu_user) {
 			key = lu_ent_get_first_value_strdup(current,
 							    LU_USERNAME);
-			tree = users;
+			table = users;
 		} else if (current->type == lu_group) {
 			key = lu_ent_get_first_value_strdup(current,
 							    LU_GROUPNAME);
-			tree = groups;
+			table = groups;
 		} else {
 			g_warning("Unknown entity(%zu) type: %d.\n",
 				  i, current->type);
 			g_assert_not_reached();
 		}
+		/* An entity without a name can't be merged with anything. */
+		if (key == NULL) {
+			g_ptr_array_add(ret, current);
+			continue;
+		}
 		/* Check if there's already an entity with that name. */
-		saved = g_tree_lookup(tree, key);
+		saved = g_hash_table_lookup(table, key);
 		/* If it's not in there, add this one. */
 		if (saved == NULL) {
-			g_tree_insert(tree, key, current);
+			g_hash_table_insert(table, key, current);
 			g_ptr_array_add(ret, current);
 		} else {
-			GList *attributes, *list;
-			const char *attr;
-			size_t j;
-
-			g_free (key);
-			/* Merge all of its data into the existing one; first,
-			 * the current data. */
-			attributes = lu_ent_get_attributes_current(current);
-			list = attributes;
-			while (attributes != NULL) {
-				attr = (const char *)attributes->data;
-				values = lu_ent_get_current(current, attr);
-				if (values != NULL) {
-					for (j = 0; j < values->n_values; j++) {
-						value = g_value_array_get_nth(
-									values,
-									j);
-						lu_ent_add_current(saved, attr, value);
-					}
-				}
-				attributes = g_list_next(attributes);
-			}
-			g_list_free(list);
-			/* Merge the pending data. */
-			attributes = lu_ent_get_attributes(current);
-			list = attributes;
-			while (attributes != NULL) {
-				attr = (const char *)attributes->data;
-				values = lu_ent_get(current, attr);
-				if (values != NULL) {
-					for (j = 0; j < values->n_values; j++) {
-						value = g_value_array_get_nth(
-									values,
-									j);
-						lu_ent_add(saved, attr, value);
-					}
-				}
-				attributes = g_list_next(attributes);
-			}
-			g_list_free(list);
-			/* Now merge the entity's list of modules. */
-			lu_util_append_values(saved->modules, current->modules);
-			remove_duplicate_values(saved->modules);
+			g_free(key);
+			/* Merge all of its data, including the list of
+			   modules, into the existing one. */
+			lu_ent_merge(saved, current);
 			lu_ent_free(current);
 		}
 	}
-	g_tree_destroy(users);
-	g_tree_destroy(groups);
+	g_hash_table_destroy(users);
+	g_hash_table_destroy(groups);
 	g_ptr_array_free(array, TRUE);
 	return ret;
 }
 
+/* Maximum number of threads used for parallel module calls */
+#define READ_THREADS 4
+
+/* Module calls made by a single run_list() invocation in parallel. */
+struct run_batch {
+	struct lu_context *context;
+	enum lu_dispatch_id id;
+	const char *sdata;
+	id_t ldata;
+	GMutex lock;
+	GCond done;
+	guint pending;		/* Protected by lock */
+};
+
+/* Results of a single module call in a struct run_batch */
+struct run_job {
+	struct run_batch *batch;
+	struct lu_module *module;
+	struct lu_ent *entity;	/* A private copy of the caller's entity */
+	gpointer scratch;
+	gboolean success;
+	struct lu_error *error;
+};
+
+/* Can ID be sent to all modules at once?  This is true for calls which
+   don't modify any module data, so that the results don't depend on the
+   order of the calls. */
+static gboolean
+dispatch_id_is_read_only(enum lu_dispatch_id id)
+{
+	switch (id) {
+	case user_lookup_name:
+	case user_lookup_id:
+	case user_is_locked:
+	case users_enumerate:
+	case users_enumerate_by_group:
+	case users_enumerate_full:
+	case group_lookup_name:
+	case group_lookup_id:
+	case group_is_locked:
+	case groups_enumerate:
+	case groups_enumerate_by_user:
+	case groups_enumerate_full:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+/* Run JOB, possibly in a thread of the read pool. */
+static void
+run_job(gpointer data, gpointer user_data)
+{
+	struct run_job *job;
+	struct run_batch *batch;
+
+	(void)user_data;
+	job = data;
+	batch = job->batch;
+	job->success = run_single(batch->context, job->module, batch->id,
+				  batch->sdata, batch->ldata, job->entity,
+				  &job->scratch, &job->error);
+	g_mutex_lock(&batch->lock);
+	batch->pending--;
+	if (batch->pending == 0)
+		g_cond_signal(&batch->done);
+	g_mutex_unlock(&batch->lock);
+}
+
+/* Run ID in MODULE_COUNT modules described by JOBS in parallel, each using a
+   private copy of ENTITY.  Return FALSE if threads are not available, leaving
+   JOBS unmodified. */
+static gboolean
+run_jobs_parallel(struct lu_context *context, enum lu_dispatch_id id,
+		  const char *sdata, id_t ldata, struct lu_ent *entity,
+		  struct run_job *jobs, size_t module_count)
+{
+	struct run_batch batch;
+	size_t i;
+
+	/* Calls made by a module back into the library run sequentially, in
+	   the calling thread; that thread holds the call_lock of the module,
+	   and a call from a read thread could wait for threads which are all
+	   waiting as well. */
+	if (g_private_get(&held_module) != NULL)
+		return FALSE;
+	if (context->read_pool == NULL) {
+		context->read_pool = g_thread_pool_new(run_job, NULL,
+						       READ_THREADS, FALSE,
+						       NULL);
+		if (context->read_pool == NULL)
+			return FALSE;
+	}
+	batch.context = context;
+	batch.id = id;
+	batch.sdata = sdata;
+	batch.ldata = ldata;
+	g_mutex_init(&batch.lock);
+	g_cond_init(&batch.done);
+	batch.pending = module_count;
+	for (i = 0; i < module_count; i++) {
+		jobs[i].batch = &batch;
+		jobs[i].entity = lu_ent_new();
+		lu_ent_copy(entity, jobs[i].entity);
+	}
+	/* Use this thread for the first module instead of waiting idly. */
+	for (i = 1; i < module_count; i++) {
+		if (!g_thread_pool_push(context->read_pool, jobs + i, NULL))
+			run_job(jobs + i, NULL);
+	}
+	run_job(jobs, NULL);
+	g_mutex_lock(&batch.lock);
+	while (batch.pending != 0)
+		g_cond_wait(&batch.done, &batch.lock);
+	g_mutex_unlock(&batch.lock);
+	g_cond_clear(&batch.done);
+	g_mutex_clear(&batch.lock);
+	return TRUE;
+}
+
 static gboolean
 run_list(struct lu_context *context,
 	 GValueArray *list,
@@ -741,8 +923,10 @@ run_list(struct lu_context *context,
 	 gpointer ret,
 	 struct lu_error **firsterror)
 {
-	gboolean success;
+	gboolean success, parallel;
 	struct lu_error *lasterror = NULL;
+	struct run_job *jobs;
+	struct lu_ent *base;
 	size_t i;
 
 	LU_ERROR_CHECK(firsterror);
@@ -786,21 +970,44 @@ run_list(struct lu_context *context,
 		 (id == groups_enumerate_full) ||
 		 (id == uses_elevated_privileges));
 
+	jobs = g_new0(struct run_job, list->n_values);
+	for (i = 0; i < list->n_values; i++) {
+		jobs[i].module = g_tree_lookup(context->modules,
+					       g_value_get_string
+					       (g_value_array_get_nth(list,
+								      i)));
+		g_assert(jobs[i].module != NULL);
+	}
+	/* Calls which only read data are sent to all modules at once, then
+	   the results are combined in the order of LIST, exactly as if the
+	   modules were called one after another. */
+	base = NULL;
+	parallel = context->parallel_reads && list->n_values > 1
+		&& dispatch_id_is_read_only(id)
+		&& run_jobs_parallel(context, id, sdata, ldata, entity, jobs,
+				     list->n_values);
+	if (parallel) {
+		base = lu_ent_new();
+		lu_ent_copy(entity, base);
+	}
+
 	success = FALSE;
 	for (i = 0; i < list->n_values; i++) {
-		struct lu_module *module;
 		gpointer scratch;
-		GValue *value;
 		gboolean tsuccess;
 
-		value = g_value_array_get_nth(list, i);
-		module = g_tree_lookup(context->modules,
-				       g_value_get_string(value));
-		g_assert(module != NULL);
-		scratch = NULL;
-		tsuccess = run_single(context, module, id,
-				      sdata, ldata, entity, &scratch,
-				      &lasterror);
+		if (parallel) {
+			scratch = jobs[i].scratch;
+			tsuccess = jobs[i].success;
+			lasterror = jobs[i].error;
+			lu_ent_apply_changes(entity, base, jobs[i].entity);
+			lu_ent_free(jobs[i].entity);
+		} else {
+			scratch = NULL;
+			tsuccess = run_single(context, jobs[i].module, id,
+					      sdata, ldata, entity, &scratch,
+					      &lasterror);
+		}
 		if (scratch != NULL) switch (id) {
 			GPtrArray *ptr_array, *tmp_ptr_array;
 			GValueArray *value_array, *tmp_value_array;
@@ -820,12 +1027,14 @@ run_list(struct lu_context *context,
 							      tmp_value_array);
 					g_value_array_free(tmp_value_array);
 				}
-				remove_duplicate_values(value_array);
+				/* Duplicates are removed after all modules
+				   have contributed. */
 				*(GValueArray **)ret = value_array;
 				break;
 			case users_enumerate_full:
 			case groups_enumerate_full:
-				/* FIXME: do some kind of merging here. */
+				/* Entities are merged by lu_dispatch() after
+				   all modules have contributed. */
 				tmp_ptr_array = scratch;
 				ptr_array = *(GPtrArray **)ret;
 				if (ptr_array == NULL) {
@@ -841,7 +1050,6 @@ run_list(struct lu_context *context,
 					}
 					g_ptr_array_free(tmp_ptr_array, TRUE);
 				}
-				/* remove_duplicate_ptrs(ptr_array); */
 				*(GPtrArray **)ret = ptr_array;
 				break;
 			case user_lookup_name:
@@ -877,6 +1085,20 @@ run_list(struct lu_context *context,
 			/* Already have an error, discard. */
 			lu_error_free(&lasterror);
 	}
+	if (base != NULL)
+		lu_ent_free(base);
+	g_free(jobs);
+	switch (id) {
+	case users_enumerate:
+	case users_enumerate_by_group:
+	case groups_enumerate:
+	case groups_enumerate_by_user:
+		if (*(GValueArray **)ret != NULL)
+			remove_duplicate_values(*(GValueArray **)ret);
+		break;
+	default:
+		break;
+	}
 
 	return success;
 }
@@ -910,6 +1132,298 @@ lu_refresh_int(struct lu_context *context, struct lu_ent *entity,
 	return FALSE;
 }
 
+/* A cached result of a successful lookup. */
+struct ent_cache_entry {
+	struct lu_ent *ent;
+	guint64 stamp;			/* ent_cache_stamp() before the
+					   lookup. */
+	gint64 expires;			/* g_get_monotonic_time() limit. */
+};
+
+/* Cached lookups of one entity type. */
+struct ent_cache_table {
+	GHashTable *by_name;		/* Name -> struct ent_cache_entry */
+	GHashTable *by_id;		/* ID -> name, for lookups by ID */
+};
+
+/* Results of lookups in a context, enabled by "defaults/entity_cache". */
+struct lu_ent_cache {
+	struct ent_cache_table users, groups;
+	gint64 ttl;			/* Lifetime of entries in microseconds,
+					   G_MAXINT64 if all modules provide
+					   entity_stamp. */
+	unsigned long hits, misses;
+	GMutex lock;			/* Protects the tables and counters,
+					   modules may look entities up from
+					   read threads. */
+};
+
+/* Parameters of a lookup which may be stored in the cache. */
+struct ent_cache_query {
+	gboolean use;			/* The result may be stored. */
+	guint64 stamp;
+};
+
+static void
+ent_cache_entry_free(gpointer data)
+{
+	struct ent_cache_entry *entry;
+
+	entry = data;
+	lu_ent_free(entry->ent);
+	g_free(entry);
+}
+
+static void
+ent_cache_table_init(struct ent_cache_table *table)
+{
+	table->by_name = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					       ent_cache_entry_free);
+	table->by_id = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+					     NULL, g_free);
+}
+
+static void
+ent_cache_table_clear(struct ent_cache_table *table)
+{
+	g_hash_table_remove_all(table->by_id);
+	g_hash_table_remove_all(table->by_name);
+}
+
+/* Return the lifetime of cached entries with modules of CTX, in
+   microseconds. */
+static gint64
+ent_cache_ttl(struct lu_context *ctx)
+{
+	gint64 ttl;
+	size_t i;
+
+	ttl = G_MAXINT64;
+	for (i = 0; i < ctx->module_names->n_values; i++) {
+		struct lu_module *module;
+		const char *value;
+		unsigned long seconds;
+		char *key, *end;
+
+		module = g_tree_lookup(ctx->modules,
+				       g_value_get_string
+				       (g_value_array_get_nth(ctx->module_names,
+							      i)));
+		g_assert(module != NULL);
+		if (module->entity_stamp != NULL)
+			continue;
+		key = g_strconcat(module->name, "/cache_ttl", NULL);
+		value = lu_cfg_read_single(ctx, key, "60");
+		errno = 0;
+		seconds = strtoul(value, &end, 10);
+		if (errno != 0 || *end != 0 || end == value) {
+			g_warning("Invalid %s value '%s'", key, value);
+			seconds = 0;
+		}
+		g_free(key);
+		ttl = MIN(ttl, (gint64)MIN(seconds, G_MAXINT32)
+			  * G_USEC_PER_SEC);
+	}
+	return ttl;
+}
+
+void
+lu_ent_cache_free(struct lu_context *ctx)
+{
+	struct lu_ent_cache *cache;
+
+	cache = ctx->ent_cache;
+	if (cache == NULL)
+		return;
+	g_hash_table_destroy(cache->users.by_id);
+	g_hash_table_destroy(cache->users.by_name);
+	g_hash_table_destroy(cache->groups.by_id);
+	g_hash_table_destroy(cache->groups.by_name);
+	g_mutex_clear(&cache->lock);
+	g_free(cache);
+	ctx->ent_cache = NULL;
+}
+
+void
+lu_ent_cache_reset(struct lu_context *ctx)
+{
+	const char *enabled;
+
+	enabled = lu_cfg_read_single(ctx, "defaults/entity_cache", "no");
+	if (g_ascii_strcasecmp(enabled, "yes") != 0) {
+		lu_ent_cache_free(ctx);
+		return;
+	}
+	if (ctx->ent_cache == NULL) {
+		ctx->ent_cache = g_malloc0(sizeof(*ctx->ent_cache));
+		ent_cache_table_init(&ctx->ent_cache->users);
+		ent_cache_table_init(&ctx->ent_cache->groups);
+		g_mutex_init(&ctx->ent_cache->lock);
+	} else {
+		ent_cache_table_clear(&ctx->ent_cache->users);
+		ent_cache_table_clear(&ctx->ent_cache->groups);
+	}
+	ctx->ent_cache->ttl = ent_cache_ttl(ctx);
+}
+
+/* Drop cached entities of TYPE in CTX. */
+static void
+ent_cache_forget(struct lu_context *ctx, enum lu_entity_type type)
+{
+	if (ctx->ent_cache == NULL)
+		return;
+	g_mutex_lock(&ctx->ent_cache->lock);
+	ent_cache_table_clear(type == lu_user ? &ctx->ent_cache->users
+			      : &ctx->ent_cache->groups);
+	g_mutex_unlock(&ctx->ent_cache->lock);
+}
+
+/* Drop cached entities in CTX which may be affected by operation ID. */
+static void
+ent_cache_forget_after(struct lu_context *ctx, enum lu_dispatch_id id)
+{
+	switch (id) {
+	case user_add:
+	case user_mod:
+	case user_del:
+	case user_lock:
+	case user_unlock:
+	case user_unlock_nonempty:
+	case user_setpass:
+	case user_removepass:
+		ent_cache_forget(ctx, lu_user);
+		break;
+	case group_add:
+	case group_mod:
+	case group_del:
+	case group_lock:
+	case group_unlock:
+	case group_unlock_nonempty:
+	case group_setpass:
+	case group_removepass:
+		ent_cache_forget(ctx, lu_group);
+		break;
+	default:
+		break;
+	}
+}
+
+/* Compute a value which changes whenever data about entities of TYPE in
+   modules of CTX that provide entity_stamp change.
+   Return TRUE if *STAMP is valid. */
+static gboolean
+ent_cache_stamp(struct lu_context *ctx, enum lu_entity_type type,
+		guint64 *stamp)
+{
+	size_t i;
+
+	*stamp = 0;
+	for (i = 0; i < ctx->module_names->n_values; i++) {
+		struct lu_module *module, *outer;
+		gboolean valid;
+
+		module = g_tree_lookup(ctx->modules,
+				       g_value_get_string
+				       (g_value_array_get_nth(ctx->module_names,
+							      i)));
+		g_assert(module != NULL);
+		if (module->entity_stamp == NULL)
+			continue;
+		outer = module_call_begin(module);
+		valid = module->entity_stamp(module, type, stamp);
+		module_call_end(module, outer);
+		if (!valid)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+/* Look up an entity of TYPE with NAME, or with ID if NAME is NULL, in the
+   cache of CTX, and copy it to ENT if found.  Otherwise, fill QUERY for
+   ent_cache_store().
+   Return TRUE if found. */
+static gboolean
+ent_cache_lookup(struct lu_context *ctx, enum lu_entity_type type,
+		 const char *name, id_t id, struct lu_ent *ent,
+		 struct ent_cache_query *query)
+{
+	struct lu_ent_cache *cache;
+	struct ent_cache_table *table;
+	struct ent_cache_entry *entry;
+	gboolean found;
+
+	query->use = FALSE;
+	cache = ctx->ent_cache;
+	/* Only an empty ENT can be filled from the cache, lookups add to the
+	   existing contents. */
+	if (cache == NULL || cache->ttl == 0 || ent == NULL
+	    || ent->current.len != 0 || ent->pending.len != 0
+	    || ent->modules->n_values != 0)
+		return FALSE;
+	/* Not under CACHE->lock, modules may look entities up while holding
+	   their call_lock. */
+	if (!ent_cache_stamp(ctx, type, &query->stamp))
+		return FALSE;
+	query->use = TRUE;
+
+	g_mutex_lock(&cache->lock);
+	table = type == lu_user ? &cache->users : &cache->groups;
+	if (name == NULL)
+		name = g_hash_table_lookup(table->by_id, GUINT_TO_POINTER(id));
+	entry = name != NULL ? g_hash_table_lookup(table->by_name, name)
+		: NULL;
+	if (entry != NULL && entry->stamp == query->stamp
+	    && g_get_monotonic_time() < entry->expires
+	    && (id == LU_VALUE_INVALID_ID
+		|| lu_ent_get_first_id(entry->ent,
+				       type == lu_user ? LU_UIDNUMBER
+				       : LU_GIDNUMBER) == id)) {
+		lu_ent_copy(entry->ent, ent);
+		cache->hits++;
+		found = TRUE;
+	} else {
+		cache->misses++;
+		found = FALSE;
+	}
+	g_mutex_unlock(&cache->lock);
+	return found;
+}
+
+/* Store ENT, the result of a lookup of an entity of TYPE with ID, or by name
+   if ID is LU_VALUE_INVALID_ID, to the cache of CTX, if QUERY allows it. */
+static void
+ent_cache_store(struct lu_context *ctx, enum lu_entity_type type, id_t id,
+		struct lu_ent *ent, const struct ent_cache_query *query)
+{
+	struct lu_ent_cache *cache;
+	struct ent_cache_table *table;
+	struct ent_cache_entry *entry;
+	const char *name;
+
+	cache = ctx->ent_cache;
+	if (!query->use || cache == NULL)
+		return;
+	name = extract_name(ent);
+	if (name == NULL)
+		return;
+
+	entry = g_malloc(sizeof(*entry));
+	entry->ent = lu_ent_new();
+	lu_ent_copy(ent, entry->ent);
+	entry->stamp = query->stamp;
+	if (cache->ttl == G_MAXINT64)
+		entry->expires = G_MAXINT64;
+	else
+		entry->expires = g_get_monotonic_time() + cache->ttl;
+	table = type == lu_user ? &cache->users : &cache->groups;
+	g_mutex_lock(&cache->lock);
+	g_hash_table_replace(table->by_name, g_strdup(name), entry);
+	if (id != LU_VALUE_INVALID_ID)
+		g_hash_table_replace(table->by_id, GUINT_TO_POINTER(id),
+				     g_strdup(name));
+	g_mutex_unlock(&cache->lock);
+}
+
 static gboolean
 lu_dispatch(struct lu_context *context,
 	    enum lu_dispatch_id id,
@@ -923,6 +1437,7 @@ lu_dispatch(struct lu_context *context,
 	GValueArray *values = NULL;
 	GPtrArray *ptrs = NULL;
 	gpointer scratch = NULL;
+	gboolean chained = FALSE, saved_chained;
 
 	LU_ERROR_CHECK(error);
 
@@ -958,7 +1473,7 @@ lu_dispatch(struct lu_context *context,
 			}
 			sdata = lu_ent_get_first_string_current(tmp, attr);
 			if (sdata != NULL)
-				sdata = tmp->cache->cache(tmp->cache, sdata);
+				sdata = lu_ent_cache_string(tmp, sdata);
 			else {
 				/* No values for the right attribute. */
 				break;
@@ -967,12 +1482,16 @@ lu_dispatch(struct lu_context *context,
 			/* No match on that ID. */
 			break;
 		}
+		chained = TRUE;
 		/* no break: fall through on successful ID->name conversion */
 	case user_lookup_name:
 	case group_lookup_name:
 		/* Make sure data items are right for this call. */
 		g_assert(sdata != NULL);
-		/* Run the list. */
+		/* Run the list.  This may be a nested lookup made by a
+		   module, so restore the caller's state afterwards. */
+		saved_chained = context->lookup_chained;
+		context->lookup_chained = chained;
 		if (run_list(context, context->module_names, logic_or, id,
 			     sdata, LU_VALUE_INVALID_ID, tmp, &scratch,
 			     error)) {
@@ -982,6 +1501,7 @@ lu_dispatch(struct lu_context *context,
 			}
 			success = TRUE;
 		}
+		context->lookup_chained = saved_chained;
 		break;
 	case user_default:
 	case group_default:
@@ -1160,6 +1680,8 @@ lu_dispatch(struct lu_context *context,
 		break;
 	}
 	lu_ent_free(tmp);
+	/* Even a failed operation may have modified some modules. */
+	ent_cache_forget_after(context, id);
 
 	if (success) {
 		switch (id) {
@@ -1190,6 +1712,67 @@ lu_dispatch(struct lu_context *context,
 	return success;
 }
 
+/* Look up an entity of TYPE with NAME, or with ID if NAME is NULL, using
+   the cache of CTX if possible. */
+static gboolean
+lookup_cached(struct lu_context *ctx, enum lu_entity_type type,
+	      const char *name, id_t id, struct lu_ent *ent,
+	      struct lu_error **error)
+{
+	struct ent_cache_query query;
+	enum lu_dispatch_id dispatch_id;
+
+	if (ent_cache_lookup(ctx, type, name, id, ent, &query))
+		return TRUE;
+	if (name != NULL) {
+		dispatch_id = type == lu_user ? user_lookup_name
+			: group_lookup_name;
+		id = LU_VALUE_INVALID_ID;
+	} else
+		dispatch_id = type == lu_user ? user_lookup_id
+			: group_lookup_id;
+	if (!lu_dispatch(ctx, dispatch_id, name, id, ent, NULL, error))
+		return FALSE;
+	ent_cache_store(ctx, type, id, ent, &query);
+	return TRUE;
+}
+
+/**
+ * lu_get_cache_statistics:
+ * @context: A context
+ * @hits: Filled with the number of lookups answered from the entity cache,
+ * or %NULL
+ * @misses: Filled with the number of lookups which had to use modules, or
+ * %NULL
+ *
+ * Returns statistics of the cache of looked up users and groups in @context,
+ * which is enabled by the <literal>entity_cache</literal> configuration
+ * option.  Only lookups which could use the cache are counted.
+ *
+ * Returns: %TRUE if the cache is enabled.
+ */
+gboolean
+lu_get_cache_statistics(struct lu_context *context, unsigned long *hits,
+			unsigned long *misses)
+{
+	g_return_val_if_fail(context != NULL, FALSE);
+
+	if (context->ent_cache == NULL) {
+		if (hits != NULL)
+			*hits = 0;
+		if (misses != NULL)
+			*misses = 0;
+		return FALSE;
+	}
+	g_mutex_lock(&context->ent_cache->lock);
+	if (hits != NULL)
+		*hits = context->ent_cache->hits;
+	if (misses != NULL)
+		*misses = context->ent_cache->misses;
+	g_mutex_unlock(&context->ent_cache->lock);
+	return TRUE;
+}
+
 /**
  * lu_uses_elevated_privileges:
  * @context: A context
@@ -1212,8 +1795,200 @@ lu_uses_elevated_privileges (struct lu_context *context)
 	return ret;
 }
 
-/**
- * lu_user_lookup_name:
+/* Return the modules used by CTX in the order they are configured, each only
+   once, for g_ptr_array_free(..., TRUE). */
+static GPtrArray *
+transaction_modules(struct lu_context *ctx)
+{
+	GValueArray *lists[2];
+	GPtrArray *modules;
+	size_t i, j;
+
+	modules = g_ptr_array_new();
+	lists[0] = ctx->module_names;
+	lists[1] = ctx->create_module_names;
+	for (i = 0; i < G_N_ELEMENTS(lists); i++) {
+		for (j = 0; j < lists[i]->n_values; j++) {
+			struct lu_module *module;
+			size_t k;
+
+			module = g_tree_lookup(ctx->modules,
+					       g_value_get_string
+					       (g_value_array_get_nth(lists[i],
+								      j)));
+			g_assert(module != NULL);
+			for (k = 0; k < modules->len; k++) {
+				if (g_ptr_array_index(modules, k) == module)
+					break;
+			}
+			if (k == modules->len)
+				g_ptr_array_add(modules, module);
+		}
+	}
+	return modules;
+}
+
+/* Abort a transaction in all modules used by CTX. */
+static void
+transaction_abort_all(struct lu_context *ctx)
+{
+	GPtrArray *modules;
+	size_t i;
+
+	modules = transaction_modules(ctx);
+	for (i = 0; i < modules->len; i++) {
+		struct lu_module *module, *outer;
+
+		module = g_ptr_array_index(modules, i);
+		if (module->transaction_abort != NULL) {
+			outer = module_call_begin(module);
+			module->transaction_abort(module);
+			module_call_end(module, outer);
+		}
+	}
+	g_ptr_array_free(modules, TRUE);
+}
+
+/**
+ * lu_transaction_begin:
+ * @context: A context
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Starts a transaction.  Until lu_transaction_commit() or
+ * lu_transaction_abort() is called, modules that support transactions keep
+ * their changes private (lookups using @context already see them) and write
+ * them out together, which makes adding or modifying many entities at once
+ * much cheaper.  Modules that don't support transactions apply changes
+ * immediately, as usual.  The ldap module sends changes immediately, but does
+ * not wait for their results until they are needed; these changes can not be
+ * discarded by lu_transaction_abort().
+ *
+ * If an operation fails after a module has started modifying its data, the
+ * transaction can only be aborted; lu_transaction_commit() will fail.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+lu_transaction_begin(struct lu_context *context, struct lu_error **error)
+{
+	GPtrArray *modules;
+	gboolean ret;
+	size_t i;
+
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(context != NULL, FALSE);
+
+	if (context->in_transaction) {
+		lu_error_new(error, lu_error_generic,
+			     _("a transaction is already in progress"));
+		return FALSE;
+	}
+	modules = transaction_modules(context);
+	ret = TRUE;
+	for (i = 0; i < modules->len && ret; i++) {
+		struct lu_module *module, *outer;
+
+		module = g_ptr_array_index(modules, i);
+		if (module->transaction_begin == NULL)
+			continue;
+		outer = module_call_begin(module);
+		ret = module->transaction_begin(module, error);
+		module_call_end(module, outer);
+	}
+	g_ptr_array_free(modules, TRUE);
+	if (!ret) {
+		transaction_abort_all(context);
+		return FALSE;
+	}
+	context->in_transaction = TRUE;
+	ent_cache_forget(context, lu_user);
+	ent_cache_forget(context, lu_group);
+	return TRUE;
+}
+
+/**
+ * lu_transaction_commit:
+ * @context: A context
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Writes out all changes made since lu_transaction_begin() and ends the
+ * transaction.  Modules commit in the order they are configured.  The commit
+ * is not atomic: the files and shadow modules replace each modified file
+ * atomically, but if replacing one of them fails, files replaced before it
+ * keep their changes and changes to the remaining files are lost; the ldap
+ * module has sent its changes already.  If a module fails to commit, the
+ * other modules still commit theirs.  @error describes the first failure.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+lu_transaction_commit(struct lu_context *context, struct lu_error **error)
+{
+	GPtrArray *modules;
+	gboolean ret;
+	size_t i;
+
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(context != NULL, FALSE);
+
+	if (!context->in_transaction) {
+		lu_error_new(error, lu_error_generic,
+			     _("no transaction is in progress"));
+		return FALSE;
+	}
+	modules = transaction_modules(context);
+	ret = TRUE;
+	for (i = 0; i < modules->len; i++) {
+		struct lu_module *module, *outer;
+		struct lu_error *module_error;
+
+		module = g_ptr_array_index(modules, i);
+		if (module->transaction_commit == NULL)
+			continue;
+		module_error = NULL;
+		outer = module_call_begin(module);
+		if (module->transaction_commit(module, &module_error) == FALSE
+		    && ret) {
+			ret = FALSE;
+			if (error != NULL) {
+				*error = module_error;
+				module_error = NULL;
+			}
+		}
+		module_call_end(module, outer);
+		if (module_error != NULL)
+			lu_error_free(&module_error);
+	}
+	g_ptr_array_free(modules, TRUE);
+	context->in_transaction = FALSE;
+	ent_cache_forget(context, lu_user);
+	ent_cache_forget(context, lu_group);
+	return ret;
+}
+
+/**
+ * lu_transaction_abort:
+ * @context: A context
+ *
+ * Discards all changes made since lu_transaction_begin() by modules that
+ * support transactions, and ends the transaction.  Does nothing if no
+ * transaction is in progress.
+ */
+void
+lu_transaction_abort(struct lu_context *context)
+{
+	g_return_if_fail(context != NULL);
+
+	if (!context->in_transaction)
+		return;
+	transaction_abort_all(context);
+	context->in_transaction = FALSE;
+	ent_cache_forget(context, lu_user);
+	ent_cache_forget(context, lu_group);
+}
+
+/**
+ * lu_user_lookup_name:
  * @context: A context
  * @name: User name
  * @ent: An entity filled with received information
@@ -1230,8 +2005,8 @@ lu_user_lookup_name(struct lu_context * context, const char *name,
 {
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(name != NULL, FALSE);
-	return lu_dispatch(context, user_lookup_name, name, 0,
-			   ent, NULL, error);
+	return lookup_cached(context, lu_user, name, LU_VALUE_INVALID_ID, ent,
+			     error);
 }
 
 /**
@@ -1252,8 +2027,8 @@ lu_group_lookup_name(struct lu_context * context, const char *name,
 {
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(name != NULL, FALSE);
-	return lu_dispatch(context, group_lookup_name, name, 0,
-			   ent, NULL, error);
+	return lookup_cached(context, lu_group, name, LU_VALUE_INVALID_ID, ent,
+			     error);
 }
 
 /**
@@ -1273,8 +2048,7 @@ lu_user_lookup_id(struct lu_context * context, uid_t uid,
 		  struct lu_ent * ent, struct lu_error ** error)
 {
 	LU_ERROR_CHECK(error);
-	return lu_dispatch(context, user_lookup_id, NULL, uid,
-			   ent, NULL, error);
+	return lookup_cached(context, lu_user, NULL, uid, ent, error);
 }
 
 /**
@@ -1294,8 +2068,664 @@ lu_group_lookup_id(struct lu_context * context, gid_t gid,
 		   struct lu_ent * ent, struct lu_error ** error)
 {
 	LU_ERROR_CHECK(error);
-	return lu_dispatch(context, group_lookup_id, NULL, gid,
-			   ent, NULL, error);
+	return lookup_cached(context, lu_group, NULL, gid, ent, error);
+}
+
+/* Find the position of the entity named NAME in INDEX, trying FOLDED, which
+   is keyed by names in lower case, if there is no exact match, because some
+   modules match names case-insensitively.  Return TRUE if found. */
+static gboolean
+batch_index_find(GHashTable *index, GHashTable *folded, const char *name,
+		 size_t *pos)
+{
+	gpointer value;
+	char *key;
+	gboolean ret;
+
+	if (g_hash_table_lookup_extended(index, name, NULL, &value)) {
+		*pos = GPOINTER_TO_SIZE(value);
+		return TRUE;
+	}
+	key = g_ascii_strdown(name, -1);
+	ret = g_hash_table_lookup_extended(folded, key, NULL, &value);
+	g_free(key);
+	if (ret)
+		*pos = GPOINTER_TO_SIZE(value);
+	return ret;
+}
+
+/* Look up entities of TYPE with names in NAMES in all modules, using their
+   batch lookup functions if available, and with the same results as
+   separate lookups. */
+static GPtrArray *
+lookup_names_many(struct lu_context *ctx, enum lu_entity_type type,
+		  GValueArray *names, struct lu_error **error)
+{
+	struct ent_cache_query *queries;
+	struct lu_ent **results, *empty;
+	struct lu_error *first_error;
+	GHashTable *index, *folded;
+	GValueArray *missing;
+	GPtrArray *ret;
+	const char *name_attr;
+	gboolean *cached;
+	size_t i, m;
+
+	name_attr = type == lu_user ? LU_USERNAME : LU_GROUPNAME;
+	results = g_new0(struct lu_ent *, names->n_values);
+	queries = g_new0(struct ent_cache_query, names->n_values);
+	cached = g_new0(gboolean, names->n_values);
+	index = g_hash_table_new(g_str_hash, g_str_equal);
+	folded = g_hash_table_new_full(g_str_hash, g_str_equal, g_free, NULL);
+	missing = g_value_array_new(names->n_values);
+	for (i = 0; i < names->n_values; i++) {
+		GValue *value;
+		const char *name;
+
+		value = g_value_array_get_nth(names, i);
+		name = g_value_get_string(value);
+		/* Each name is returned only once. */
+		if (name == NULL || *name == '\0'
+		    || g_hash_table_lookup_extended(index, name, NULL, NULL))
+			continue;
+		g_hash_table_insert(index, (char *)name, GSIZE_TO_POINTER(i));
+		g_hash_table_insert(folded, g_ascii_strdown(name, -1),
+				    GSIZE_TO_POINTER(i));
+		results[i] = lu_ent_new_typed_in(ctx->ent_arena, lu_invalid);
+		if (ent_cache_lookup(ctx, type, name, LU_VALUE_INVALID_ID,
+				     results[i], queries + i))
+			cached[i] = TRUE;
+		else
+			g_value_array_append(missing, value);
+	}
+
+	first_error = NULL;
+	empty = lu_ent_new();
+	for (m = 0; m < ctx->module_names->n_values && missing->n_values != 0;
+	     m++) {
+		struct lu_module *module, *outer;
+		GPtrArray *(*lookup_many) (struct lu_module *, GValueArray *,
+					   struct lu_error **);
+		gboolean (*lookup_one) (struct lu_module *, const char *,
+					struct lu_ent *, struct lu_error **);
+		struct lu_error *err;
+		GPtrArray *ents;
+		size_t j;
+
+		module = g_tree_lookup(ctx->modules,
+				       g_value_get_string
+				       (g_value_array_get_nth(ctx->module_names,
+							      m)));
+		g_assert(module != NULL);
+		lookup_many = type == lu_user ? module->users_lookup_names
+			: module->groups_lookup_names;
+		err = NULL;
+		if (lookup_many == NULL) {
+			lookup_one = type == lu_user ? module->user_lookup_name
+				: module->group_lookup_name;
+			for (j = 0; j < missing->n_values; j++) {
+				const char *name;
+				gboolean ok;
+
+				name = g_value_get_string
+					(g_value_array_get_nth(missing, j));
+				batch_index_find(index, folded, name, &i);
+				outer = module_call_begin(module);
+				ok = lookup_one(module, name, results[i], &err);
+				module_call_end(module, outer);
+				if (ok)
+					lu_ent_add_module(results[i],
+							  module->name);
+				if (err != NULL && first_error == NULL)
+					first_error = err;
+				else if (err != NULL)
+					lu_error_free(&err);
+				err = NULL;
+			}
+			continue;
+		}
+		outer = module_call_begin(module);
+		ents = lookup_many(module, missing, &err);
+		module_call_end(module, outer);
+		if (ents == NULL) {
+			if (err != NULL && first_error == NULL)
+				first_error = err;
+			else if (err != NULL)
+				lu_error_free(&err);
+			continue;
+		}
+		for (j = 0; j < ents->len; j++) {
+			struct lu_ent *ent;
+			GValueArray *values;
+			size_t k;
+
+			ent = g_ptr_array_index(ents, j);
+			values = lu_ent_get_current(ent, name_attr);
+			for (k = 0; values != NULL && k < values->n_values;
+			     k++) {
+				const char *name;
+
+				name = g_value_get_string
+					(g_value_array_get_nth(values, k));
+				if (name != NULL
+				    && batch_index_find(index, folded, name,
+							&i)
+				    && !cached[i]) {
+					/* As if the module stored its result
+					   into RESULTS[I]. */
+					lu_ent_apply_changes(results[i], empty,
+							     ent);
+					lu_ent_add_module(results[i],
+							  module->name);
+					break;
+				}
+			}
+			lu_ent_free(ent);
+		}
+		g_ptr_array_free(ents, TRUE);
+	}
+	lu_ent_free(empty);
+
+	ret = g_ptr_array_new();
+	for (i = 0; i < names->n_values; i++) {
+		if (results[i] == NULL)
+			continue;
+		if (cached[i])
+			g_ptr_array_add(ret, results[i]);
+		else if (results[i]->modules->n_values != 0) {
+			lu_ent_revert(results[i]);
+			results[i]->type = type;
+			ent_cache_store(ctx, type, LU_VALUE_INVALID_ID,
+					results[i], queries + i);
+			g_ptr_array_add(ret, results[i]);
+		} else
+			lu_ent_free(results[i]);
+	}
+	/* Like a single lookup, fail only if nothing was found. */
+	if (first_error != NULL) {
+		if (ret->len == 0 && missing->n_values != 0) {
+			*error = first_error;
+			g_ptr_array_free(ret, TRUE);
+			ret = NULL;
+		} else
+			lu_error_free(&first_error);
+	}
+	g_value_array_free(missing);
+	g_hash_table_destroy(folded);
+	g_hash_table_destroy(index);
+	g_free(cached);
+	g_free(queries);
+	g_free(results);
+	return ret;
+}
+
+/* Look up entities of TYPE with IDs in IDS in all modules, using their batch
+   lookup functions if available, and with the same results as separate
+   lookups. */
+static GPtrArray *
+lookup_ids_many(struct lu_context *ctx, enum lu_entity_type type,
+		GValueArray *ids, struct lu_error **error)
+{
+	struct ent_cache_query *queries;
+	struct lu_ent **results;
+	struct lu_error *first_error;
+	GHashTable *index, *found_names;
+	GValueArray *missing, *names;
+	GPtrArray *ret, *by_name;
+	const char *name_attr, *id_attr;
+	size_t i, m;
+
+	name_attr = type == lu_user ? LU_USERNAME : LU_GROUPNAME;
+	id_attr = type == lu_user ? LU_UIDNUMBER : LU_GIDNUMBER;
+	results = g_new0(struct lu_ent *, ids->n_values);
+	queries = g_new0(struct ent_cache_query, ids->n_values);
+	/* Position of each ID in IDS */
+	index = g_hash_table_new(NULL, NULL);
+	missing = g_value_array_new(ids->n_values);
+	for (i = 0; i < ids->n_values; i++) {
+		GValue *value;
+		id_t id;
+
+		value = g_value_array_get_nth(ids, i);
+		id = lu_value_get_id(value);
+		if (id == LU_VALUE_INVALID_ID
+		    || g_hash_table_lookup_extended(index,
+						    GSIZE_TO_POINTER(id),
+						    NULL, NULL))
+			continue;
+		g_hash_table_insert(index, GSIZE_TO_POINTER(id),
+				    GSIZE_TO_POINTER(i));
+		results[i] = lu_ent_new_typed_in(ctx->ent_arena, lu_invalid);
+		if (!ent_cache_lookup(ctx, type, NULL, id, results[i],
+				      queries + i)) {
+			lu_ent_free(results[i]);
+			results[i] = NULL;
+			g_value_array_append(missing, value);
+		}
+	}
+
+	/* Find the names for the IDs, as a lookup by ID does. */
+	first_error = NULL;
+	found_names = g_hash_table_new_full(NULL, NULL, NULL, g_free);
+	for (m = 0; m < ctx->module_names->n_values && missing->n_values != 0;
+	     m++) {
+		struct lu_module *module, *outer;
+		GPtrArray *(*lookup_many) (struct lu_module *, GValueArray *,
+					   struct lu_error **);
+		struct lu_error *err;
+		GPtrArray *ents;
+		size_t j;
+
+		module = g_tree_lookup(ctx->modules,
+				       g_value_get_string
+				       (g_value_array_get_nth(ctx->module_names,
+							      m)));
+		g_assert(module != NULL);
+		lookup_many = type == lu_user ? module->users_lookup_ids
+			: module->groups_lookup_ids;
+		err = NULL;
+		if (lookup_many == NULL) {
+			for (j = 0; j < missing->n_values; j++) {
+				struct lu_ent *ent;
+				gboolean ok;
+				id_t id;
+				char *name;
+
+				id = lu_value_get_id(g_value_array_get_nth
+						     (missing, j));
+				ent = lu_ent_new();
+				outer = module_call_begin(module);
+				if (type == lu_user)
+					ok = module->user_lookup_id(module, id,
+								    ent, &err);
+				else
+					ok = module->group_lookup_id(module, id,
+								     ent, &err);
+				module_call_end(module, outer);
+				name = ok ? lu_ent_get_first_value_strdup_current
+					(ent, name_attr) : NULL;
+				if (name != NULL)
+					g_hash_table_replace
+						(found_names,
+						 GSIZE_TO_POINTER(id), name);
+				lu_ent_free(ent);
+				if (err != NULL && first_error == NULL)
+					first_error = err;
+				else if (err != NULL)
+					lu_error_free(&err);
+				err = NULL;
+			}
+			continue;
+		}
+		outer = module_call_begin(module);
+		ents = lookup_many(module, missing, &err);
+		module_call_end(module, outer);
+		if (ents == NULL) {
+			if (err != NULL && first_error == NULL)
+				first_error = err;
+			else if (err != NULL)
+				lu_error_free(&err);
+			continue;
+		}
+		for (j = 0; j < ents->len; j++) {
+			struct lu_ent *ent;
+			id_t id;
+			char *name;
+
+			ent = g_ptr_array_index(ents, j);
+			id = lu_ent_get_first_id_current(ent, id_attr);
+			name = lu_ent_get_first_value_strdup_current(ent,
+								     name_attr);
+			if (id != LU_VALUE_INVALID_ID && name != NULL
+			    && g_hash_table_lookup_extended
+			    (index, GSIZE_TO_POINTER(id), NULL, NULL))
+				g_hash_table_replace(found_names,
+						     GSIZE_TO_POINTER(id),
+						     name);
+			else
+				g_free(name);
+			lu_ent_free(ent);
+		}
+		g_ptr_array_free(ents, TRUE);
+	}
+
+	/* Look the names up, and match the results to the IDs. */
+	names = g_value_array_new(missing->n_values);
+	for (i = 0; i < missing->n_values; i++) {
+		const char *name;
+		GValue value;
+
+		name = g_hash_table_lookup
+			(found_names,
+			 GSIZE_TO_POINTER(lu_value_get_id
+					  (g_value_array_get_nth(missing,
+								 i))));
+		if (name == NULL)
+			continue;
+		memset(&value, 0, sizeof(value));
+		g_value_init(&value, G_TYPE_STRING);
+		g_value_set_static_string(&value, name);
+		g_value_array_append(names, &value);
+		g_value_unset(&value);
+	}
+	by_name = NULL;
+	if (names->n_values != 0) {
+		struct lu_error *err;
+
+		err = NULL;
+		by_name = lookup_names_many(ctx, type, names, &err);
+		if (by_name == NULL) {
+			if (first_error == NULL)
+				first_error = err;
+			else if (err != NULL)
+				lu_error_free(&err);
+		}
+	}
+	if (by_name != NULL) {
+		GHashTable *ents_by_name;
+
+		ents_by_name = g_hash_table_new(g_str_hash, g_str_equal);
+		for (i = 0; i < by_name->len; i++) {
+			struct lu_ent *ent;
+			const char *name;
+
+			ent = g_ptr_array_index(by_name, i);
+			name = lu_ent_get_first_string(ent, name_attr);
+			if (name != NULL)
+				g_hash_table_insert(ents_by_name, (char *)name,
+						    ent);
+		}
+		for (i = 0; i < missing->n_values; i++) {
+			struct lu_ent *ent;
+			const char *name;
+			size_t pos;
+			id_t id;
+
+			id = lu_value_get_id(g_value_array_get_nth(missing, i));
+			name = g_hash_table_lookup(found_names,
+						   GSIZE_TO_POINTER(id));
+			ent = name != NULL
+				? g_hash_table_lookup(ents_by_name, name)
+				: NULL;
+			if (ent == NULL)
+				continue;
+			pos = GPOINTER_TO_SIZE
+				(g_hash_table_lookup(index,
+						     GSIZE_TO_POINTER(id)));
+			/* Several IDs may belong to the same name, each
+			   result must be a separate entity. */
+			results[pos] = lu_ent_new_typed_in(ctx->ent_arena,
+							   lu_invalid);
+			lu_ent_copy(ent, results[pos]);
+			ent_cache_store(ctx, type, id, results[pos],
+					queries + pos);
+		}
+		g_hash_table_destroy(ents_by_name);
+		for (i = 0; i < by_name->len; i++)
+			lu_ent_free(g_ptr_array_index(by_name, i));
+		g_ptr_array_free(by_name, TRUE);
+	}
+	g_value_array_free(names);
+	g_hash_table_destroy(found_names);
+
+	ret = g_ptr_array_new();
+	for (i = 0; i < ids->n_values; i++) {
+		if (results[i] != NULL)
+			g_ptr_array_add(ret, results[i]);
+	}
+	/* Like a single lookup, fail only if nothing was found. */
+	if (first_error != NULL) {
+		if (ret->len == 0) {
+			*error = first_error;
+			g_ptr_array_free(ret, TRUE);
+			ret = NULL;
+		} else
+			lu_error_free(&first_error);
+	}
+	g_value_array_free(missing);
+	g_hash_table_destroy(index);
+	g_free(queries);
+	g_free(results);
+	return ret;
+}
+
+/**
+ * lu_users_lookup_names:
+ * @context: A context
+ * @names: User names
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Looks up users with names in @names, like lu_user_lookup_name() for each
+ * name, but modules can look up all of them at once, e.g. using a single scan
+ * of a file.
+ *
+ * Returns: A list of pointers to user entities, in the order of @names,
+ * without users which don't exist.  The entities and the list should be freed
+ * by the caller.  Returns %NULL only if an error occurred and no user was
+ * found.
+ */
+GPtrArray *
+lu_users_lookup_names(struct lu_context *context, GValueArray *names,
+		      struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(names != NULL, NULL);
+	return lookup_names_many(context, lu_user, names, error);
+}
+
+/**
+ * lu_users_lookup_ids:
+ * @context: A context
+ * @ids: User IDs, values set using lu_value_init_set_id()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Looks up users with UIDs in @ids, like lu_user_lookup_id() for each UID, but
+ * modules can look up all of them at once.
+ *
+ * Returns: A list of pointers to user entities, in the order of @ids,
+ * without users which don't exist.  The entities and the list should be freed
+ * by the caller.  Returns %NULL only if an error occurred and no user was
+ * found.
+ */
+GPtrArray *
+lu_users_lookup_ids(struct lu_context *context, GValueArray *ids,
+		    struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(ids != NULL, NULL);
+	return lookup_ids_many(context, lu_user, ids, error);
+}
+
+/**
+ * lu_groups_lookup_names:
+ * @context: A context
+ * @names: Group names
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Looks up groups with names in @names, like lu_group_lookup_name() for each
+ * name, but modules can look up all of them at once, e.g. using a single scan
+ * of a file.
+ *
+ * Returns: A list of pointers to group entities, in the order of @names,
+ * without groups which don't exist.  The entities and the list should be
+ * freed by the caller.  Returns %NULL only if an error occurred and no group
+ * was found.
+ */
+GPtrArray *
+lu_groups_lookup_names(struct lu_context *context, GValueArray *names,
+		       struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(names != NULL, NULL);
+	return lookup_names_many(context, lu_group, names, error);
+}
+
+/**
+ * lu_groups_lookup_ids:
+ * @context: A context
+ * @ids: Group IDs, values set using lu_value_init_set_id()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Looks up groups with GIDs in @ids, like lu_group_lookup_id() for each GID,
+ * but modules can look up all of them at once.
+ *
+ * Returns: A list of pointers to group entities, in the order of @ids,
+ * without groups which don't exist.  The entities and the list should be
+ * freed by the caller.  Returns %NULL only if an error occurred and no group
+ * was found.
+ */
+GPtrArray *
+lu_groups_lookup_ids(struct lu_context *context, GValueArray *ids,
+		     struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(ids != NULL, NULL);
+	return lookup_ids_many(context, lu_group, ids, error);
+}
+
+/* Return the index of the first range in RANGES that ends at or after ID,
+   or RANGES->len if there is no such range. */
+static guint
+id_ranges_search(GArray *ranges, id_t id)
+{
+	guint lo, hi;
+
+	lo = 0;
+	hi = ranges->len;
+	while (lo < hi) {
+		guint mid;
+
+		mid = lo + (hi - lo) / 2;
+		if (g_array_index(ranges, struct lu_id_range, mid).last < id)
+			lo = mid + 1;
+		else
+			hi = mid;
+	}
+	return lo;
+}
+
+/* Add ID to RANGES. */
+static void
+id_ranges_add(GArray *ranges, id_t id)
+{
+	struct lu_id_range *r, new_range;
+	guint i;
+
+	i = id_ranges_search(ranges, id);
+	if (i < ranges->len) {
+		r = &g_array_index(ranges, struct lu_id_range, i);
+		if (r->first <= id)
+			return;
+		if (r->first == id + 1) {
+			r->first = id;
+			if (i > 0) {
+				struct lu_id_range *prev;
+
+				prev = &g_array_index(ranges,
+						      struct lu_id_range,
+						      i - 1);
+				if (prev->last + 1 == id) {
+					prev->last = r->last;
+					g_array_remove_index(ranges, i);
+				}
+			}
+			return;
+		}
+	}
+	if (i > 0) {
+		r = &g_array_index(ranges, struct lu_id_range, i - 1);
+		if (r->last + 1 == id) {
+			r->last = id;
+			return;
+		}
+	}
+	new_range.first = id;
+	new_range.last = id;
+	g_array_insert_val(ranges, i, new_range);
+}
+
+/* Remove ID from RANGES. */
+static void
+id_ranges_remove(GArray *ranges, id_t id)
+{
+	struct lu_id_range *r, new_range;
+	guint i;
+
+	i = id_ranges_search(ranges, id);
+	if (i == ranges->len)
+		return;
+	r = &g_array_index(ranges, struct lu_id_range, i);
+	if (r->first > id)
+		return;
+	if (r->first == id && r->last == id)
+		g_array_remove_index(ranges, i);
+	else if (r->first == id)
+		r->first++;
+	else if (r->last == id)
+		r->last--;
+	else {
+		new_range.first = id + 1;
+		new_range.last = r->last;
+		r->last = id - 1;
+		g_array_insert_val(ranges, i + 1, new_range);
+	}
+}
+
+/* Return the first ID >= ID which is not in RANGES, or LU_VALUE_INVALID_ID
+   if there is none. */
+static id_t
+id_ranges_first_unused(GArray *ranges, id_t id)
+{
+	const struct lu_id_range *r;
+	guint i;
+
+	i = id_ranges_search(ranges, id);
+	if (i < ranges->len) {
+		r = &g_array_index(ranges, struct lu_id_range, i);
+		/* Ranges are never adjacent, so r->last + 1 is not in
+		   RANGES. */
+		if (r->first <= id)
+			id = r->last == LU_VALUE_INVALID_ID
+				? LU_VALUE_INVALID_ID : r->last + 1;
+	}
+	return id;
+}
+
+/* Return a pointer to the ranges of used IDs of TYPE in CTX. */
+static GArray **
+used_ids_ptr(struct lu_context *ctx, enum lu_entity_type type)
+{
+	return type == lu_user ? &ctx->used_uids : &ctx->used_gids;
+}
+
+/* Update the set of used IDs of TYPE in CTX after an entity's ID changed
+   from OLD_ID to NEW_ID; either can be LU_VALUE_INVALID_ID. */
+static void
+used_ids_update(struct lu_context *ctx, enum lu_entity_type type, id_t old_id,
+		id_t new_id)
+{
+	GArray *ranges;
+
+	ranges = *used_ids_ptr(ctx, type);
+	if (ranges == NULL || old_id == new_id)
+		return;
+	if (old_id != LU_VALUE_INVALID_ID)
+		id_ranges_remove(ranges, old_id);
+	if (new_id != LU_VALUE_INVALID_ID)
+		id_ranges_add(ranges, new_id);
+}
+
+void
+lu_forget_used_ids(struct lu_context *ctx)
+{
+	if (ctx->used_uids != NULL) {
+		g_array_free(ctx->used_uids, TRUE);
+		ctx->used_uids = NULL;
+	}
+	if (ctx->used_gids != NULL) {
+		g_array_free(ctx->used_gids, TRUE);
+		ctx->used_gids = NULL;
+	}
 }
 
 /**
@@ -1339,6 +2769,9 @@ lu_user_add(struct lu_context * context, struct lu_ent * ent,
 				  ent, NULL, error) &&
 		      lu_refresh_user(context, ent, error);
 	}
+	if (ret)
+		used_ids_update(context, lu_user, LU_VALUE_INVALID_ID,
+				lu_ent_get_first_id(ent, LU_UIDNUMBER));
 	return ret;
 }
 
@@ -1369,6 +2802,9 @@ lu_group_add(struct lu_context * context, struct lu_ent * ent,
 				  LU_VALUE_INVALID_ID, ent, NULL, error) &&
 		      lu_refresh_group(context, ent, error);
 	}
+	if (ret)
+		used_ids_update(context, lu_group, LU_VALUE_INVALID_ID,
+				lu_ent_get_first_id(ent, LU_GIDNUMBER));
 	return ret;
 }
 
@@ -1387,12 +2823,18 @@ gboolean
 lu_user_modify(struct lu_context * context, struct lu_ent * ent,
 	       struct lu_error ** error)
 {
+	id_t old_id, new_id;
+
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(ent != NULL, FALSE);
 	g_return_val_if_fail(ent->type == lu_user, FALSE);
-	return lu_dispatch(context, user_mod, NULL, LU_VALUE_INVALID_ID, ent,
-			   NULL, error) &&
-	       lu_refresh_user(context, ent, error);
+	old_id = lu_ent_get_first_id_current(ent, LU_UIDNUMBER);
+	new_id = lu_ent_get_first_id(ent, LU_UIDNUMBER);
+	if (!lu_dispatch(context, user_mod, NULL, LU_VALUE_INVALID_ID, ent, NULL,
+			 error))
+		return FALSE;
+	used_ids_update(context, lu_user, old_id, new_id);
+	return lu_refresh_user(context, ent, error);
 }
 
 /**
@@ -1410,12 +2852,18 @@ gboolean
 lu_group_modify(struct lu_context * context, struct lu_ent * ent,
 		struct lu_error ** error)
 {
+	id_t old_id, new_id;
+
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(ent != NULL, FALSE);
 	g_return_val_if_fail(ent->type == lu_group, FALSE);
-	return lu_dispatch(context, group_mod, NULL, LU_VALUE_INVALID_ID, ent,
-			   NULL, error) &&
-	       lu_refresh_group(context, ent, error);
+	old_id = lu_ent_get_first_id_current(ent, LU_GIDNUMBER);
+	new_id = lu_ent_get_first_id(ent, LU_GIDNUMBER);
+	if (!lu_dispatch(context, group_mod, NULL, LU_VALUE_INVALID_ID, ent, NULL,
+			 error))
+		return FALSE;
+	used_ids_update(context, lu_group, old_id, new_id);
+	return lu_refresh_group(context, ent, error);
 }
 
 /**
@@ -1435,8 +2883,13 @@ lu_user_delete(struct lu_context * context, struct lu_ent * ent,
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(ent != NULL, FALSE);
 	g_return_val_if_fail(ent->type == lu_user, FALSE);
-	return lu_dispatch(context, user_del, NULL, LU_VALUE_INVALID_ID, ent,
-			   NULL, error);
+	if (!lu_dispatch(context, user_del, NULL, LU_VALUE_INVALID_ID, ent, NULL,
+			 error))
+		return FALSE;
+	used_ids_update(context, lu_user,
+			lu_ent_get_first_id_current(ent, LU_UIDNUMBER),
+			LU_VALUE_INVALID_ID);
+	return TRUE;
 }
 
 /**
@@ -1456,8 +2909,13 @@ lu_group_delete(struct lu_context * context, struct lu_ent * ent,
 	LU_ERROR_CHECK(error);
 	g_return_val_if_fail(ent != NULL, FALSE);
 	g_return_val_if_fail(ent->type == lu_group, FALSE);
-	return lu_dispatch(context, group_del, NULL, LU_VALUE_INVALID_ID, ent,
-			   NULL, error);
+	if (!lu_dispatch(context, group_del, NULL, LU_VALUE_INVALID_ID, ent, NULL,
+			 error))
+		return FALSE;
+	used_ids_update(context, lu_group,
+			lu_ent_get_first_id_current(ent, LU_GIDNUMBER),
+			LU_VALUE_INVALID_ID);
+	return TRUE;
 }
 
 /**
@@ -1794,6 +3252,47 @@ lu_group_removepass(struct lu_context * context, struct lu_ent * ent,
 	return ret;
 }
 
+/**
+ * lu_crypt_passwords:
+ * @context: A context
+ * @passwords: Plaintext passwords
+ * @count: Number of entries in @passwords
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Encrypts @count passwords at once, using the same hash method and number of
+ * rounds as lu_user_setpass() would, and using all available processors.
+ * The results can be passed to lu_user_setpass() or lu_group_setpass() with
+ * @crypted set to %TRUE.
+ *
+ * Returns: A %NULL-terminated array of @count encrypted passwords, which
+ * should be freed by g_strfreev(), or %NULL on error.
+ */
+char **
+lu_crypt_passwords(struct lu_context *context, const char *const *passwords,
+		   size_t count, struct lu_error **error)
+{
+	char **salts, **ret;
+	size_t i;
+
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(context != NULL, NULL);
+	g_return_val_if_fail(passwords != NULL || count == 0, NULL);
+
+	/* Select the salt type here, so that the hash rounds are chosen for
+	   each password separately, as in lu_user_setpass(). */
+	salts = g_new(char *, count + 1);
+	for (i = 0; i < count; i++)
+		salts[i] = lu_util_default_salt_specifier(context);
+	salts[count] = NULL;
+	ret = lu_util_make_crypted_batch(passwords, (const char *const *)salts,
+					 count);
+	g_strfreev(salts);
+	if (ret == NULL)
+		lu_error_new(error, lu_error_generic,
+			     _("error encrypting password"));
+	return ret;
+}
+
 /**
  * lu_users_enumerate:
  * @context: A context
@@ -1944,35 +3443,25 @@ lu_users_enumerate_by_group_full(struct lu_context * context,
 {
 	GPtrArray *ret = NULL;
 	GValueArray *names;
-	size_t i;
+	struct lu_error *err2;
 
 	LU_ERROR_CHECK(error);
 	/* We may have the membership information stored in one module,
 	   but the user information in a different module, so don't just let
 	   each module load its own information; only get the list of users,
-	   and then look for the users in all modules. */
+	   and then look for all of the users in all modules at once. */
 	names = lu_users_enumerate_by_group(context, group, error);
 	if (*error != NULL)
 		return NULL;
 
-	ret = g_ptr_array_new();
-	for (i = 0; i < names->n_values; i++) {
-		const char *name;
-		struct lu_error *err2;
-		struct lu_ent *ent;
-
-		name = g_value_get_string(g_value_array_get_nth(names, i));
-		ent = lu_ent_new();
-		err2 = NULL;
-		if (lu_user_lookup_name(context, name, ent, &err2))
-			g_ptr_array_add(ret, ent);
-		else {
-			lu_ent_free(ent);
-			/* Silently ignore the error and return at
-			   least some results. */
-			if (err2 != NULL)
-				lu_error_free(&err2);
-		}
+	err2 = NULL;
+	ret = lu_users_lookup_names(context, names, &err2);
+	if (ret == NULL) {
+		/* Silently ignore the error and return at least an empty
+		   list. */
+		if (err2 != NULL)
+			lu_error_free(&err2);
+		ret = g_ptr_array_new();
 	}
 
 	g_value_array_free(names);
@@ -1998,112 +3487,523 @@ lu_groups_enumerate_by_user_full(struct lu_context * context,
 {
 	GPtrArray *ret = NULL;
 	GValueArray *names;
-	size_t i;
+	struct lu_error *err2;
 
 	LU_ERROR_CHECK(error);
 	/* We may have the membership information stored in one module,
 	   but the group information in a different module, so don't just let
 	   each module load its own information; only get the list of groups,
-	   and then look for the users in all modules. */
+	   and then look for all of the groups in all modules at once. */
 	names = lu_groups_enumerate_by_user(context, user, error);
 	if (*error != NULL)
 		return NULL;
 
-	ret = g_ptr_array_new();
-	for (i = 0; i < names->n_values; i++) {
-		const char *name;
-		struct lu_error *err2;
+	err2 = NULL;
+	ret = lu_groups_lookup_names(context, names, &err2);
+	if (ret == NULL) {
+		/* Silently ignore the error and return at least an empty
+		   list. */
+		if (err2 != NULL)
+			lu_error_free(&err2);
+		ret = g_ptr_array_new();
+	}
+
+	g_value_array_free(names);
+
+	return ret;
+}
+
+/**
+ * lu_users_enumerate_full_arena:
+ * @context: A context
+ * @pattern: A glob-like pattern for user name
+ * @arena: An arena created by lu_ent_arena_new()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Returns a list of entities, one for each user matching a pattern, like
+ * lu_users_enumerate_full().  The entities are allocated in @arena, which
+ * is much cheaper for large lists.
+ *
+ * Returns: A list of pointers to user entities.  The list should be freed by
+ * the caller; the entities are freed by lu_ent_arena_free().
+ */
+GPtrArray *
+lu_users_enumerate_full_arena(struct lu_context * context,
+			      const char *pattern, struct lu_ent_arena *arena,
+			      struct lu_error ** error)
+{
+	struct lu_ent_arena *saved;
+	GPtrArray *ret;
+
+	saved = context->ent_arena;
+	context->ent_arena = arena;
+	ret = lu_users_enumerate_full(context, pattern, error);
+	context->ent_arena = saved;
+	return ret;
+}
+
+/**
+ * lu_groups_enumerate_full_arena:
+ * @context: A context
+ * @pattern: A glob-like pattern for group name
+ * @arena: An arena created by lu_ent_arena_new()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Returns a list of entities, one for each group matching a pattern, like
+ * lu_groups_enumerate_full().  The entities are allocated in @arena.
+ *
+ * Returns: A list of pointers to group entities.  The list should be freed by
+ * the caller; the entities are freed by lu_ent_arena_free().
+ */
+GPtrArray *
+lu_groups_enumerate_full_arena(struct lu_context * context,
+			       const char *pattern, struct lu_ent_arena *arena,
+			       struct lu_error ** error)
+{
+	struct lu_ent_arena *saved;
+	GPtrArray *ret;
+
+	saved = context->ent_arena;
+	context->ent_arena = arena;
+	ret = lu_groups_enumerate_full(context, pattern, error);
+	context->ent_arena = saved;
+	return ret;
+}
+
+/**
+ * lu_users_enumerate_by_group_full_arena:
+ * @context: A context
+ * @group: Group name
+ * @arena: An arena created by lu_ent_arena_new()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Returns a list of entities, one for each member of a group @group, like
+ * lu_users_enumerate_by_group_full().  The entities are allocated in @arena.
+ *
+ * Returns: A list of pointers to user entities.  The list should be freed by
+ * the caller; the entities are freed by lu_ent_arena_free().
+ */
+GPtrArray *
+lu_users_enumerate_by_group_full_arena(struct lu_context * context,
+				       const char *group,
+				       struct lu_ent_arena *arena,
+				       struct lu_error ** error)
+{
+	struct lu_ent_arena *saved;
+	GPtrArray *ret;
+
+	saved = context->ent_arena;
+	context->ent_arena = arena;
+	ret = lu_users_enumerate_by_group_full(context, group, error);
+	context->ent_arena = saved;
+	return ret;
+}
+
+/**
+ * lu_groups_enumerate_by_user_full_arena:
+ * @context: A context
+ * @user: User name
+ * @arena: An arena created by lu_ent_arena_new()
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Returns a list of entities, one for each group containing an user @user,
+ * like lu_groups_enumerate_by_user_full().  The entities are allocated in
+ * @arena.
+ *
+ * Returns: A list of pointers to group entities.  The list should be freed by
+ * the caller; the entities are freed by lu_ent_arena_free().
+ */
+GPtrArray *
+lu_groups_enumerate_by_user_full_arena(struct lu_context * context,
+				       const char *user,
+				       struct lu_ent_arena *arena,
+				       struct lu_error ** error)
+{
+	struct lu_ent_arena *saved;
+	GPtrArray *ret;
+
+	saved = context->ent_arena;
+	context->ent_arena = arena;
+	ret = lu_groups_enumerate_by_user_full(context, user, error);
+	context->ent_arena = saved;
+	return ret;
+}
+
+/* Parameters of enumerate_full_stream() for stream_one(). */
+struct enumerate_stream {
+	struct lu_module *module;
+	enum lu_entity_type type;
+	lu_ent_fn *callback;
+	gpointer data;
+};
+
+/* Pass ENT, found by a module, to the caller's callback in DATA, a struct
+ * enumerate_stream, in the same form lu_dispatch() returns entities. */
+static gboolean
+stream_one(struct lu_ent *ent, gpointer data)
+{
+	struct enumerate_stream *stream;
+	gboolean ret;
+
+	stream = data;
+	lu_ent_add_module(ent, stream->module->name);
+	lu_ent_revert(ent);
+	ent->type = stream->type;
+	ret = stream->callback(ent, stream->data);
+	lu_ent_free(ent);
+	return ret;
+}
+
+/* Pass all entities of TYPE matching PATTERN to CALLBACK with DATA. */
+static gboolean
+enumerate_full_stream(struct lu_context *context, enum lu_entity_type type,
+		      const char *pattern, lu_ent_fn *callback, gpointer data,
+		      struct lu_error **error)
+{
+	GPtrArray *ents;
+	gboolean go_on;
+	size_t i;
+
+	/* Entities can only be passed on as they arrive if they come from a
+	   single module; otherwise entities with the same name must be merged
+	   first. */
+	if (context->module_names->n_values == 1) {
+		struct enumerate_stream stream;
+		gboolean (*fn) (struct lu_module *, const char *, lu_ent_fn *,
+				gpointer, struct lu_error **);
+
+		stream.module = g_tree_lookup
+			(context->modules,
+			 g_value_get_string
+			 (g_value_array_get_nth(context->module_names, 0)));
+		g_assert(stream.module != NULL);
+		fn = type == lu_user
+			? stream.module->users_enumerate_full_stream
+			: stream.module->groups_enumerate_full_stream;
+		if (fn != NULL) {
+			stream.type = type;
+			stream.callback = callback;
+			stream.data = data;
+			return fn(stream.module, pattern, stream_one, &stream,
+				  error);
+		}
+	}
+
+	ents = NULL;
+	if (!lu_dispatch(context, type == lu_user ? users_enumerate_full
+			 : groups_enumerate_full, pattern,
+			 LU_VALUE_INVALID_ID, NULL, &ents, error))
+		return FALSE;
+	go_on = TRUE;
+	for (i = 0; ents != NULL && i < ents->len; i++) {
 		struct lu_ent *ent;
 
-		name = g_value_get_string(g_value_array_get_nth(names, i));
-		ent = lu_ent_new();
-		err2 = NULL;
-		if (lu_group_lookup_name(context, name, ent, &err2))
-			g_ptr_array_add(ret, ent);
-		else {
+		ent = g_ptr_array_index(ents, i);
+		if (go_on)
+			go_on = callback(ent, data);
+		lu_ent_free(ent);
+	}
+	if (ents != NULL)
+		g_ptr_array_free(ents, TRUE);
+	return TRUE;
+}
+
+/**
+ * lu_users_enumerate_full_stream:
+ * @context: A context
+ * @pattern: A glob-like pattern for user name
+ * @callback: A function called for each user
+ * @data: Data passed to @callback
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Calls @callback for each user matching a pattern, like
+ * lu_users_enumerate_full().  If only one module is used and it supports it,
+ * each user is passed to @callback as soon as it is read, without waiting for
+ * the rest of the list; users with the same name are not merged in that case.
+ *
+ * The entity passed to @callback is freed after @callback returns.  If
+ * @callback returns %FALSE, no more users are passed to it.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+lu_users_enumerate_full_stream(struct lu_context *context, const char *pattern,
+			       lu_ent_fn *callback, gpointer data,
+			       struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(callback != NULL, FALSE);
+	return enumerate_full_stream(context, lu_user, pattern, callback, data,
+				     error);
+}
+
+/**
+ * lu_groups_enumerate_full_stream:
+ * @context: A context
+ * @pattern: A glob-like pattern for group name
+ * @callback: A function called for each group
+ * @data: Data passed to @callback
+ * @error: Filled with a #lu_error if an error occurs
+ *
+ * Calls @callback for each group matching a pattern, like
+ * lu_groups_enumerate_full().  If only one module is used and it supports it,
+ * each group is passed to @callback as soon as it is read, without waiting
+ * for the rest of the list; groups with the same name are not merged in that
+ * case.
+ *
+ * The entity passed to @callback is freed after @callback returns.  If
+ * @callback returns %FALSE, no more groups are passed to it.
+ *
+ * Returns: %TRUE on success.
+ */
+gboolean
+lu_groups_enumerate_full_stream(struct lu_context *context,
+				const char *pattern, lu_ent_fn *callback,
+				gpointer data, struct lu_error **error)
+{
+	LU_ERROR_CHECK(error);
+	g_return_val_if_fail(callback != NULL, FALSE);
+	return enumerate_full_stream(context, lu_group, pattern, callback,
+				     data, error);
+}
+
+/* Compare two id_t values, for qsort(). */
+static int
+compare_ids(const void *xa, const void *xb)
+{
+	id_t a, b;
+
+	a = *(const id_t *)xa;
+	b = *(const id_t *)xb;
+	return a < b ? -1 : a > b;
+}
+
+/* Append all IDs of TYPE visible through NSS to IDS. */
+static void
+nss_collect_ids(GArray *ids, enum lu_entity_type type)
+{
+	size_t buf_size;
+	char *buf;
+
+	buf_size = LINE_MAX * 4;
+	buf = g_malloc(buf_size);
+	if (type == lu_user)
+		setpwent();
+	else
+		setgrent();
+	for (;;) {
+		struct passwd pwd, *pwd_res;
+		struct group grp, *grp_res;
+		id_t id;
+		int rv;
+
+		id = LU_VALUE_INVALID_ID;
+		if (type == lu_user) {
+			rv = getpwent_r(&pwd, buf, buf_size, &pwd_res);
+			if (rv == 0 && pwd_res != NULL)
+				id = pwd.pw_uid;
+		} else {
+			rv = getgrent_r(&grp, buf, buf_size, &grp_res);
+			if (rv == 0 && grp_res != NULL)
+				id = grp.gr_gid;
+		}
+		if (rv == ERANGE && buf_size < 1024 * 1024) {
+			/* The same entry is returned again next time. */
+			buf_size *= 2;
+			buf = g_realloc(buf, buf_size);
+			continue;
+		}
+		if (rv != 0 || (type == lu_user ? pwd_res == NULL
+				: grp_res == NULL))
+			break;
+		if (id != LU_VALUE_INVALID_ID)
+			g_array_append_val(ids, id);
+	}
+	if (type == lu_user)
+		endpwent();
+	else
+		endgrent();
+	g_free(buf);
+}
+
+/* Return the ranges of IDs of TYPE used in CTX, loading them if
+   necessary. */
+static GArray *
+used_ids_get(struct lu_context *ctx, enum lu_entity_type type)
+{
+	struct lu_error *error = NULL;
+	GArray **ptr, *ids, *ranges;
+	GPtrArray *ents;
+	const char *attr;
+	size_t i;
+
+	ptr = used_ids_ptr(ctx, type);
+	if (*ptr != NULL)
+		return *ptr;
+
+	ids = g_array_new(FALSE, FALSE, sizeof(id_t));
+	if (type == lu_user) {
+		ents = lu_users_enumerate_full(ctx, "*", &error);
+		attr = LU_UIDNUMBER;
+	} else {
+		ents = lu_groups_enumerate_full(ctx, "*", &error);
+		attr = LU_GIDNUMBER;
+	}
+	/* Incomplete data is fine, each candidate ID is checked before it is
+	   returned anyway. */
+	if (error != NULL)
+		lu_error_free(&error);
+	if (ents != NULL) {
+		for (i = 0; i < ents->len; i++) {
+			struct lu_ent *ent;
+			id_t id;
+
+			ent = g_ptr_array_index(ents, i);
+			id = lu_ent_get_first_id(ent, attr);
+			if (id != LU_VALUE_INVALID_ID)
+				g_array_append_val(ids, id);
 			lu_ent_free(ent);
-			/* Silently ignore the error and return at
-			   least some results. */
-			if (err2 != NULL)
-				lu_error_free(&err2);
 		}
+		g_ptr_array_free(ents, TRUE);
 	}
+	/* There may be read-only sources of user information on the system,
+	 * and we want to avoid allocating an ID that's already in use by a
+	 * service we can't write to, so check with NSS as well. */
+	nss_collect_ids(ids, type);
+
+	qsort(ids->data, ids->len, sizeof(id_t), compare_ids);
+	ranges = g_array_new(FALSE, FALSE, sizeof(struct lu_id_range));
+	for (i = 0; i < ids->len; i++) {
+		struct lu_id_range *last;
+		id_t id;
+
+		id = g_array_index(ids, id_t, i);
+		if (ranges->len != 0) {
+			last = &g_array_index(ranges, struct lu_id_range,
+					      ranges->len - 1);
+			if (id <= last->last)
+				continue;
+			if (id == last->last + 1) {
+				last->last = id;
+				continue;
+			}
+		}
+		g_array_set_size(ranges, ranges->len + 1);
+		last = &g_array_index(ranges, struct lu_id_range,
+				      ranges->len - 1);
+		last->first = id;
+		last->last = id;
+	}
+	g_array_free(ids, TRUE);
+	*ptr = ranges;
+	return ranges;
+}
 
-	g_value_array_free(names);
+/* Check whether ID of TYPE is currently in use, asking NSS and all modules
+   in CTX. */
+static gboolean
+id_is_used(struct lu_context *ctx, enum lu_entity_type type, id_t id)
+{
+	struct lu_error *error = NULL;
+	struct lu_ent *ent;
+	char buf[LINE_MAX * 4];
+	gboolean ret;
+
+	/* FIXME: use growing buffers here. */
+	if (type == lu_user) {
+		struct passwd pwd, *err;
+
+		if (getpwuid_r(id, &pwd, buf, sizeof(buf), &err) == 0
+		    && err == &pwd)
+			return TRUE;
+	} else {
+		struct group grp, *err;
 
+		if (getgrgid_r(id, &grp, buf, sizeof(buf), &err) == 0
+		    && err == &grp)
+			return TRUE;
+	}
+	ent = lu_ent_new();
+	if (type == lu_user)
+		ret = lu_user_lookup_id(ctx, id, ent, &error);
+	else
+		ret = lu_group_lookup_id(ctx, id, ent, &error);
+	if (error) {
+		lu_error_free(&error);
+	}
+	lu_ent_free(ent);
 	return ret;
 }
 
+/* Return the first ID of TYPE >= ID which is not used, updating RANGES, or
+   LU_VALUE_INVALID_ID if there is none. */
+static id_t
+find_unused_id(struct lu_context *ctx, enum lu_entity_type type,
+	       GArray *ranges, id_t id)
+{
+	for (;;) {
+		id = id_ranges_first_unused(ranges, id);
+		if (id == LU_VALUE_INVALID_ID || !id_is_used(ctx, type, id))
+			return id;
+		/* Created outside of this context after RANGES was
+		   loaded. */
+		id_ranges_add(ranges, id);
+	}
+}
+
 id_t
 lu_get_first_unused_id(struct lu_context *ctx,
 		       enum lu_entity_type type,
 		       id_t id)
 {
-	struct lu_ent *ent;
-	char buf[LINE_MAX * 4];
-
 	g_return_val_if_fail(ctx != NULL, (id_t)-1);
 
-	ent = lu_ent_new();
-	if (type == lu_user) {
-		struct lu_error *error = NULL;
-		do {
-			struct passwd pwd, *err;
-
-			/* There may be read-only sources of user information
-			 * on the system, and we want to avoid allocating an ID
-			 * that's already in use by a service we can't write
-			 * to, so check with NSS first.  FIXME: use growing
-			 * buffers here. */
-			if ((getpwuid_r(id, &pwd, buf, sizeof(buf), &err) == 0) &&
-			    (err == &pwd)) {
-				id++;
-				continue;
-			}
-			if (lu_user_lookup_id(ctx, id, ent, &error)) {
-				lu_ent_free(ent);
-				ent = lu_ent_new();
-				id++;
-				continue;
-			}
-			if (error) {
-				lu_error_free(&error);
-			}
-			break;
-		} while (id != (id_t)-1);
-	} else if (type == lu_group) {
-		struct lu_error *error = NULL;
-		do {
-			struct group grp, *err;
-			int rv;
-
-			/* There may be read-only sources of user information
-			 * on the system, and we want to avoid allocating an ID
-			 * that's already in use by a service we can't write
-			 * to, so check with NSS first. */
-			rv = getgrgid_r(id, &grp, buf, sizeof(buf), &err);
-			if (rv == 0 && err == &grp) {
-				id++;
-				continue;
-			}
-			if (lu_group_lookup_id(ctx, id, ent, &error)) {
-				lu_ent_free(ent);
-				ent = lu_ent_new();
-				id++;
-				continue;
-			}
-			if (error) {
-				lu_error_free(&error);
-			}
-			break;
-		} while (id != (id_t)-1);
-	}
+	/* All used IDs are loaded once, and only the candidate ID is checked
+	   individually, so that the cost does not grow with the number of
+	   used IDs below the result. */
+	if (type == lu_user || type == lu_group)
+		id = find_unused_id(ctx, type, used_ids_get(ctx, type), id);
 	if (id == (id_t)-1)
 		id = 0;
-	lu_ent_free(ent);
 	return id;
 }
 
+id_t
+lu_reserve_unused_ids(struct lu_context *ctx, enum lu_entity_type type,
+		      id_t id, id_t count)
+{
+	GArray *ranges;
+
+	g_return_val_if_fail(ctx != NULL, 0);
+	g_return_val_if_fail(type == lu_user || type == lu_group, 0);
+	g_return_val_if_fail(count > 0, 0);
+
+	ranges = used_ids_get(ctx, type);
+	for (;;) {
+		id_t first, i;
+
+		first = find_unused_id(ctx, type, ranges, id);
+		if (first == LU_VALUE_INVALID_ID)
+			return 0;
+		for (i = 1; i < count; i++) {
+			id = first + i;
+			if (id == LU_VALUE_INVALID_ID)
+				return 0;
+			if (id_ranges_first_unused(ranges, id) != id)
+				break;
+			if (id_is_used(ctx, type, id)) {
+				id_ranges_add(ranges, id);
+				break;
+			}
+		}
+		if (i == count) {
+			for (i = 0; i < count; i++)
+				id_ranges_add(ranges, first + i);
+			return first;
+		}
+	}
+}
+
 /* Replace all instances of OLD in g_malloc()'ed STRING by NEW.
    Change LU_HOMEDIRECTORY *KEY to LU_DUBIOUS_HOMEDIRECTORY if the substitution
    results in a new "." or ".." directory component. */
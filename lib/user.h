@@ -99,6 +99,14 @@ gboolean lu_set_modules(struct lu_context *context,
 			const char *list, struct lu_error **error);
 const char *lu_get_modules(struct lu_context *context);
 gboolean lu_uses_elevated_privileges (struct lu_context *context);
+gboolean lu_get_cache_statistics(struct lu_context *context,
+				 unsigned long *hits, unsigned long *misses);
+
+gboolean lu_transaction_begin(struct lu_context *context,
+			      struct lu_error **error);
+gboolean lu_transaction_commit(struct lu_context *context,
+			       struct lu_error **error);
+void lu_transaction_abort(struct lu_context *context);
 
 gboolean lu_user_default(struct lu_context *ctx, const char *name,
 			 gboolean system_account, struct lu_ent *ent);
@@ -160,6 +168,9 @@ gboolean lu_user_removepass(struct lu_context *context,
 gboolean lu_group_removepass(struct lu_context *context,
 			     struct lu_ent *ent,
 			     struct lu_error **error);
+char **lu_crypt_passwords(struct lu_context *context,
+			  const char *const *passwords, size_t count,
+			  struct lu_error **error);
 
 GValueArray *lu_users_enumerate(struct lu_context *context,
 				const char *pattern,
@@ -187,5 +198,47 @@ GPtrArray *lu_groups_enumerate_by_user_full(struct lu_context *context,
 					    const char *user,
 					    struct lu_error **error);
 
+GPtrArray *lu_users_lookup_names(struct lu_context *context,
+				 GValueArray *names,
+				 struct lu_error **error);
+GPtrArray *lu_users_lookup_ids(struct lu_context *context,
+			       GValueArray *ids,
+			       struct lu_error **error);
+GPtrArray *lu_groups_lookup_names(struct lu_context *context,
+				  GValueArray *names,
+				  struct lu_error **error);
+GPtrArray *lu_groups_lookup_ids(struct lu_context *context,
+				GValueArray *ids,
+				struct lu_error **error);
+
+/* A function called for each entity found by a streaming enumeration. */
+typedef gboolean (lu_ent_fn)(struct lu_ent *ent, gpointer data);
+
+gboolean lu_users_enumerate_full_stream(struct lu_context *context,
+					const char *pattern,
+					lu_ent_fn *callback, gpointer data,
+					struct lu_error **error);
+gboolean lu_groups_enumerate_full_stream(struct lu_context *context,
+					 const char *pattern,
+					 lu_ent_fn *callback, gpointer data,
+					 struct lu_error **error);
+
+GPtrArray *lu_users_enumerate_full_arena(struct lu_context *context,
+					 const char *pattern,
+					 struct lu_ent_arena *arena,
+					 struct lu_error **error);
+GPtrArray *lu_groups_enumerate_full_arena(struct lu_context *context,
+					  const char *pattern,
+					  struct lu_ent_arena *arena,
+					  struct lu_error **error);
+GPtrArray *lu_users_enumerate_by_group_full_arena(struct lu_context *context,
+						  const char *group,
+						  struct lu_ent_arena *arena,
+						  struct lu_error **error);
+GPtrArray *lu_groups_enumerate_by_user_full_arena(struct lu_context *context,
+						  const char *user,
+						  struct lu_ent_arena *arena,
+						  struct lu_error **error);
+
 G_END_DECLS
 #endif
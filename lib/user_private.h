@@ -42,7 +42,7 @@
 G_BEGIN_DECLS
 
 #define LU_ENT_MAGIC		0x00000006
-#define LU_MODULE_VERSION	0x000e0000
+#define LU_MODULE_VERSION	0x00120000
 #define _(String)		dgettext(PACKAGE_NAME, String)
 #define N_(String)		String
 /* A crypt hash is at least 64 bits of data, encoded 6 bits per printable
@@ -75,20 +75,93 @@ struct lu_string_cache {
 /* A function to create a new cache. */
 struct lu_string_cache *lu_string_cache_new(gboolean case_sensitive);
 
+/* Attributes which have a fixed slot in every entity. */
+enum lu_ent_slot {
+	LU_ENT_SLOT_USERNAME,
+	LU_ENT_SLOT_USERPASSWORD,
+	LU_ENT_SLOT_UIDNUMBER,
+	LU_ENT_SLOT_GIDNUMBER,
+	LU_ENT_SLOT_GECOS,
+	LU_ENT_SLOT_HOMEDIRECTORY,
+	LU_ENT_SLOT_LOGINSHELL,
+	LU_ENT_SLOT_GROUPNAME,
+	LU_ENT_SLOT_GROUPPASSWORD,
+	LU_ENT_SLOT_MEMBERNAME,
+	LU_ENT_SLOT_ADMINISTRATORNAME,
+	LU_ENT_SLOT_SHADOWPASSWORD,
+	LU_ENT_SLOT_SHADOWLASTCHANGE,
+	LU_ENT_SLOT_SHADOWMIN,
+	LU_ENT_SLOT_SHADOWMAX,
+	LU_ENT_SLOT_SHADOWWARNING,
+	LU_ENT_SLOT_SHADOWINACTIVE,
+	LU_ENT_SLOT_SHADOWEXPIRE,
+	LU_ENT_SLOT_SHADOWFLAG,
+	LU_ENT_SLOT_COMMONNAME,
+	LU_ENT_SLOT_GIVENNAME,
+	LU_ENT_SLOT_SN,
+	LU_ENT_SLOT_ROOMNUMBER,
+	LU_ENT_SLOT_TELEPHONENUMBER,
+	LU_ENT_SLOT_HOMEPHONE,
+	LU_ENT_SLOT_EMAIL,
+	LU_ENT_SLOT_COUNT
+};
+
+/* Values of an attribute of an entity, shared by copies of the attribute
+ * (e.g. in current and pending values, or in copies of the entity) until one
+ * of them is modified.  A single value is usually stored directly in VALUE;
+ * VALUES is used for more values, or when a GValueArray of the values was
+ * requested. */
+struct lu_attribute_values {
+	gint refs;
+	struct lu_ent_arena *arena; /* Owner of this structure, of VALUES and
+				       of strings in VALUE, or NULL */
+	GValueArray *values;	/* All values, or NULL if there is one */
+	GValue value;		/* The value if VALUES is NULL */
+};
+
+/* An attribute of an entity. */
 struct lu_attribute {
 	GQuark name;
-	GValueArray *values;
+	struct lu_attribute_values *v;
+};
+
+/* A set of attributes, in the order in which they were added. */
+struct lu_attribute_set {
+	struct lu_attribute *attrs;
+	guint len, size;	/* Used and allocated elements of ATTRS */
+	struct lu_ent_arena *arena; /* Owner of ATTRS and of all values in
+				       the set, or NULL if they are
+				       allocated separately */
+	guint slots[LU_ENT_SLOT_COUNT]; /* Index + 1 of attributes with a
+					   fixed slot in ATTRS, or 0 */
+};
+
+/* Memory owning entities, their attributes and strings, all of which are
+ * released at once.  Entities in an arena never refer to memory outside it,
+ * and values are copied when they move between an arena and other
+ * entities. */
+struct lu_ent_arena {
+	GPtrArray *blocks;	/* Allocated memory blocks */
+	char *next, *end;	/* Free space in the last block */
+	GStringChunk *strings;
+	GPtrArray *arrays;	/* GValueArrays used by the entities */
+	GPtrArray *caches;	/* String caches of the entities */
+	GMutex lock;		/* Protects all of the above, modules may
+				   enumerate in parallel */
 };
 
 /* An entity structure. */
 struct lu_ent {
 	u_int32_t magic;
 	enum lu_entity_type type;	/* User or group? */
+	struct lu_ent_arena *arena;	/* Owner of the entity, or NULL */
 	struct lu_string_cache *cache;	/* String cache for attribute values,
-					   typically case-sensitive. */
-	GArray *current, *pending;	/* Current and pending attribute names
-					   and values, stored as a GArray of
-					   lu_attribute structures. */
+					   typically case-sensitive.  Created
+					   by lu_ent_string_cache() when
+					   needed. */
+	struct lu_attribute_set current, pending; /* Current and pending
+						     attribute names and
+						     values. */
 	GValueArray *modules;		/* Names of modules this user's info
 					   was looked up in or initialized
 					   using. */
@@ -113,6 +186,30 @@ struct lu_context {
 						   a subset of all modules. */
 	GTree *modules;			/* A tree, keyed by module name,
 					   of module structures. */
+	gboolean in_transaction;	/* Between lu_transaction_begin() and
+					   lu_transaction_commit() or
+					   lu_transaction_abort(). */
+	GArray *used_uids, *used_gids;	/* Sorted, disjoint, non-adjacent
+					   struct lu_id_range of IDs known to
+					   be used or reserved, NULL if not
+					   loaded yet. */
+	struct lu_ent_cache *ent_cache;	/* Results of lookups, NULL if
+					   disabled. */
+	struct lu_ent_arena *ent_arena;	/* Arena for entities returned by the
+					   current enumeration, or NULL */
+	gboolean parallel_reads;	/* Run read-only module calls in
+					   parallel. */
+	GThreadPool *read_pool;		/* Threads for parallel reads, NULL if
+					   not created yet. */
+	gboolean lookup_chained;	/* The name lookup being run continues
+					   an ID lookup in the same call, so
+					   modules may reuse what they found
+					   by ID. */
+};
+
+/* A range of IDs. */
+struct lu_id_range {
+	id_t first, last;		/* Both inclusive. */
 };
 
 /* A module structure. */
@@ -124,6 +221,9 @@ struct lu_module {
 	const char *name;		/* Name of the module. */
 	struct lu_context *lu_context;	/* Context the module was opened in. */
 	void *module_context;		/* Module-private data. */
+	GMutex call_lock;		/* Held by the library while calling
+					   the module; initialized by the
+					   library. */
 
 	/* Check if the current list of module combinations (array of module
 	   names) is valid.  Note that this can be called several times during
@@ -272,6 +372,61 @@ struct lu_module {
 					     const char *pattern,
 					     struct lu_error ** error);
 
+	/* Group the following modifications until transaction_commit or
+	 * transaction_abort is called.  These are optional (may be NULL) for
+	 * modules which always apply modifications immediately.
+	 * transaction_abort must be harmless if transaction_begin was not
+	 * called. */
+	gboolean(*transaction_begin) (struct lu_module * module,
+				      struct lu_error ** error);
+	gboolean(*transaction_commit) (struct lu_module * module,
+				       struct lu_error ** error);
+	void(*transaction_abort) (struct lu_module * module);
+
+	/* Mix a value which changes whenever the module's data about entities
+	 * of TYPE change into *STAMP, e.g. by hashing file status.  Return
+	 * FALSE if the data is not available.  This is optional (may be NULL);
+	 * entities looked up using modules which don't provide it are cached
+	 * only for a limited time. */
+	gboolean(*entity_stamp) (struct lu_module * module,
+				 enum lu_entity_type type,
+				 guint64 * stamp);
+
+	/* Look up all users or groups with names (strings) or IDs (values
+	 * set by lu_value_init_set_id()) in KEYS at once, and return an
+	 * array of entities in any order, at most one for each key, or NULL
+	 * on error.  Entities found by ID must contain the ID and the name,
+	 * which is then looked up by name, as in single-entity lookups.
+	 * These are optional (may be NULL); the single-entity lookup
+	 * functions are used for modules which don't provide them. */
+	GPtrArray *(*users_lookup_names) (struct lu_module * module,
+					  GValueArray * names,
+					  struct lu_error ** error);
+	GPtrArray *(*users_lookup_ids) (struct lu_module * module,
+					GValueArray * ids,
+					struct lu_error ** error);
+	GPtrArray *(*groups_lookup_names) (struct lu_module * module,
+					   GValueArray * names,
+					   struct lu_error ** error);
+	GPtrArray *(*groups_lookup_ids) (struct lu_module * module,
+					 GValueArray * ids,
+					 struct lu_error ** error);
+
+	/* Pass each user or group matching PATTERN to CALLBACK with DATA as
+	 * soon as it is read, instead of collecting them all first.  CALLBACK
+	 * takes ownership of the entity and returns FALSE to stop the
+	 * enumeration.  These are optional (may be NULL). */
+	gboolean (*users_enumerate_full_stream) (struct lu_module * module,
+						 const char *pattern,
+						 lu_ent_fn * callback,
+						 gpointer data,
+						 struct lu_error ** error);
+	gboolean (*groups_enumerate_full_stream) (struct lu_module * module,
+						  const char *pattern,
+						  lu_ent_fn * callback,
+						  gpointer data,
+						  struct lu_error ** error);
+
 	/* Clean up any data this module has, and unload it. */
 	gboolean(*close) (struct lu_module * module);
 };
@@ -286,6 +441,35 @@ typedef struct lu_module *(*lu_module_init_t) (struct lu_context * context,
 					       struct lu_error ** error);
 
 struct lu_ent *lu_ent_new_typed(enum lu_entity_type entity_type);
+/* Create an entity owned by ARENA, or a separately allocated one if ARENA is
+   NULL. */
+struct lu_ent *lu_ent_new_typed_in(struct lu_ent_arena *arena,
+				   enum lu_entity_type entity_type);
+
+/* Faster access to entity attributes, for modules parsing many entities. */
+/* Return the identifier of ATTRIBUTE used by lu_ent_append_current_q(). */
+GQuark lu_ent_attribute_quark(const char *attribute);
+/* Append VALUE to current values of ATTRIBUTE, a result of
+   lu_ent_attribute_quark(), without checking for duplicates.  Takes over the
+   contents of VALUE and leaves it zero-filled.  A string VALUE must have been
+   created for ENT by lu_ent_value_init_string_len(). */
+void lu_ent_append_current_q(struct lu_ent *ent, GQuark attribute,
+			     GValue *value);
+/* Set VALUE, which is not initialized, to a copy of LEN bytes at STRING,
+   stored in the arena of ENT if any. */
+void lu_ent_value_init_string_len(struct lu_ent *ent, GValue *value,
+				  const char *string, size_t len);
+/* Add all attribute values and modules of SOURCE to DEST, skipping values
+   already present in DEST. */
+void lu_ent_merge(struct lu_ent *dest, struct lu_ent *source);
+/* Apply changes made to CHANGED, which was created as a copy of BASE, to
+   DEST. */
+void lu_ent_apply_changes(struct lu_ent *dest, struct lu_ent *base,
+			  struct lu_ent *changed);
+/* Return the string cache of ENT. */
+struct lu_string_cache *lu_ent_string_cache(struct lu_ent *ent);
+/* Return a copy of STRING which lives as long as ENT. */
+char *lu_ent_cache_string(struct lu_ent *ent, const char *string);
 
 /* Common code expected to be used by some modules. */
 gboolean lu_common_user_default(struct lu_module *module, const char *name,
@@ -304,6 +488,11 @@ gboolean lu_common_sgroup_default(struct lu_module *module, const char *name,
 /* Generate a crypted password. */
 const char *lu_make_crypted(const char *plain, const char *previous);
 char *lu_util_default_salt_specifier(struct lu_context *context);
+/* Crypt COUNT passwords in PLAIN, each using a new salt based on the
+   corresponding entry in PREVIOUS, in parallel.  Return a NULL-terminated
+   array for g_strfreev(), or NULL on error. */
+char **lu_util_make_crypted_batch(const char *const *plain,
+				  const char *const *previous, size_t count);
 
 /* Handle SELinux fscreate context.  Note that modules built WITH_SELINUX are
    intentionally not compatible with libuser built !WITH_SELINUX. */
@@ -333,6 +522,13 @@ typedef char lu_security_context_t; /* "Something" */
   ((void)(PATH), (void)(MODE), (void)(ERROR), TRUE)
 #endif
 
+/* Take or release the lckpwdf() lock for CONTEXT; unlike lckpwdf(), these
+   calls can be nested, and other contexts in this process are excluded as
+   well. */
+gboolean lu_util_lckpwdf(const struct lu_context *context,
+			 struct lu_error **error);
+void lu_util_ulckpwdf(const struct lu_context *context);
+
 #ifndef LU_DISABLE_DEPRECATED
 /* Lock a file. Deprecated. */
 gpointer lu_util_lock_obtain(int fd, struct lu_error **error);
@@ -353,9 +549,28 @@ gboolean lu_util_field_write(int fd, const char *first, unsigned int field,
 
 void lu_util_update_shadow_last_change(struct lu_ent *ent);
 
+/* Copy contents of IFD, SIZE bytes long, to the empty OFD within the kernel if
+   possible.  Return 1 on success, 0 if the data must be copied by reading it
+   (nothing was written to OFD), -1 on error, with errno set. */
+int lu_util_copy_file_data(int ifd, int ofd, off_t size);
+
 /* Find the first unused ID of the given type, searching starting at "id". */
 id_t lu_get_first_unused_id(struct lu_context *ctx, enum lu_entity_type type,
 			    id_t id);
+/* Find the first COUNT consecutive unused IDs of the given type, searching
+   starting at "id", and reserve them so that they are not returned by
+   lu_get_first_unused_id() or this function again in CTX.  Return the first
+   ID, or 0 if no such range exists. */
+id_t lu_reserve_unused_ids(struct lu_context *ctx, enum lu_entity_type type,
+			   id_t id, id_t count);
+/* Forget all information about used IDs in CTX. */
+void lu_forget_used_ids(struct lu_context *ctx);
+
+/* Drop all cached entities in CTX, and enable or disable the cache according
+   to the configuration and the current modules. */
+void lu_ent_cache_reset(struct lu_context *ctx);
+/* Drop the entity cache of CTX, if any. */
+void lu_ent_cache_free(struct lu_context *ctx);
 
 /* Append a copy of VALUES to DEST */
 void lu_util_append_values(GValueArray *dest, GValueArray *values);
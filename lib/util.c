@@ -17,6 +17,7 @@
  */
 
 #include <config.h>
+#include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
 #include <sys/time.h>
@@ -25,11 +26,18 @@
 #include <errno.h>
 #include <fcntl.h>
 #include <limits.h>
+#include <shadow.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <time.h>
 #include <unistd.h>
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+#include <sys/sendfile.h>
+#endif
 #ifdef WITH_SELINUX
 #include <selinux/selinux.h>
 #include <selinux/label.h>
@@ -38,12 +46,18 @@
 #define LU_DEFAULT_SALT_LEN  8
 #define LU_MAX_LOCK_ATTEMPTS 6
 #define LU_LOCK_TIMEOUT      2
+#define LCKPWDF_TIMEOUT      15 /* Seconds, as used by lckpwdf() */
+/* Bytes copied at once past the expected end of a file */
+#define COPY_CHUNK_SIZE      (1024 * 1024)
 #include "user_private.h"
 #include "internal.h"
 
 #define HASH_ROUNDS_MIN 1000
 #define HASH_ROUNDS_MAX 999999999
 
+/* Size of a buffer for a crypt() salt */
+#define SALT_SIZE 2048
+
 #if (defined CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY && \
      CRYPT_GENSALT_IMPLEMENTS_AUTO_ENTROPY)
 #define USE_XCRYPT_GENSALT 1
@@ -151,10 +165,11 @@ static const struct {
 	{ "", "", 2 },
 };
 
-const char *
-lu_make_crypted(const char *plain, const char *previous)
+/* Store a new salt for crypt() based on PREVIOUS into SALT, which has
+   SALT_SIZE bytes.  Return FALSE on error. */
+static gboolean
+make_salt(char *salt, const char *previous)
 {
-	char salt[2048];
 	size_t i, len = 0;
 #if USE_XCRYPT_GENSALT
 	unsigned long rounds = 0;
@@ -188,9 +203,11 @@ lu_make_crypted(const char *plain, const char *previous)
 			rounds = HASH_ROUNDS_MAX;
 	}
 
-	g_assert(CRYPT_GENSALT_OUTPUT_SIZE <= sizeof(salt));
+	g_assert(CRYPT_GENSALT_OUTPUT_SIZE <= SALT_SIZE);
 
-	crypt_gensalt_rn(previous, rounds, NULL, 0, salt, sizeof(salt));
+	if (crypt_gensalt_rn(previous, rounds, NULL, 0, salt, SALT_SIZE)
+	    == NULL)
+		return FALSE;
 #else
 		const char *start, *end;
 
@@ -202,18 +219,120 @@ lu_make_crypted(const char *plain, const char *previous)
 	}
 
 	g_assert(len + salt_type_info[i].salt_length
-		 + strlen(salt_type_info[i].separator) < sizeof(salt));
+		 + strlen(salt_type_info[i].separator) < SALT_SIZE);
 	memcpy(salt, previous, len);
 
 	if (fill_urandom(salt + len, salt_type_info[i].salt_length) == FALSE)
-		return NULL;
+		return FALSE;
 	strcpy(salt + len + salt_type_info[i].salt_length,
 	       salt_type_info[i].separator);
 #endif
 
+	return TRUE;
+}
+
+const char *
+lu_make_crypted(const char *plain, const char *previous)
+{
+	char salt[SALT_SIZE];
+
+	if (make_salt(salt, previous) == FALSE)
+		return NULL;
 	return crypt(plain, salt);
 }
 
+/* A single password hashed by lu_util_make_crypted_batch(). */
+struct crypt_job {
+	const char *plain;
+	char *salt;
+	char *result;
+};
+
+/* Hash a struct crypt_job.  A GFunc for a GThreadPool. */
+static void
+crypt_job_run(gpointer data, gpointer user_data)
+{
+	struct crypt_job *job;
+	struct crypt_data *cd;
+	const char *res;
+
+	(void)user_data;
+	job = data;
+	/* struct crypt_data is too large for thread stacks on some
+	   systems. */
+	cd = g_malloc0(sizeof(*cd));
+	res = crypt_r(job->plain, job->salt, cd);
+	/* Some implementations return a string starting with '*' on
+	   failure instead of NULL. */
+	if (res != NULL && res[0] != '*')
+		job->result = g_strdup(res);
+	memset(cd, 0, sizeof(*cd));
+	g_free(cd);
+}
+
+char **
+lu_util_make_crypted_batch(const char *const *plain,
+			   const char *const *previous, size_t count)
+{
+	struct crypt_job *jobs;
+	GThreadPool *pool;
+	char **ret;
+	size_t i;
+	long threads;
+
+	jobs = g_new0(struct crypt_job, count);
+	for (i = 0; i < count; i++) {
+		char salt[SALT_SIZE];
+
+		jobs[i].plain = plain[i];
+		/* Salts are generated here rather than in the workers, which
+		   keeps their randomness source single-threaded. */
+		if (make_salt(salt, previous[i]) == FALSE)
+			goto err_jobs;
+		jobs[i].salt = g_strdup(salt);
+	}
+
+	pool = NULL;
+	threads = sysconf(_SC_NPROCESSORS_ONLN);
+	if (threads > 1 && count > 1) {
+		if ((unsigned long)threads > count)
+			threads = count;
+		pool = g_thread_pool_new(crypt_job_run, NULL, threads, TRUE,
+					 NULL);
+	}
+	if (pool != NULL) {
+		for (i = 0; i < count; i++)
+			g_thread_pool_push(pool, jobs + i, NULL);
+		/* Wait for all jobs to finish. */
+		g_thread_pool_free(pool, FALSE, TRUE);
+	} else {
+		for (i = 0; i < count; i++)
+			crypt_job_run(jobs + i, NULL);
+	}
+
+	ret = g_new(char *, count + 1);
+	for (i = 0; i < count; i++) {
+		if (jobs[i].result == NULL) {
+			g_free(ret);
+			goto err_jobs;
+		}
+		ret[i] = jobs[i].result;
+	}
+	ret[count] = NULL;
+	for (i = 0; i < count; i++)
+		g_free(jobs[i].salt);
+	g_free(jobs);
+	return ret;
+
+err_jobs:
+	for (i = 0; i < count; i++) {
+		g_free(jobs[i].salt);
+		g_free(jobs[i].result);
+	}
+	g_free(jobs);
+	return NULL;
+}
+
 
 static const char *
 parse_hash_rounds(struct lu_context *context, const char *key,
@@ -312,6 +431,73 @@ found:
 	return g_strdup(salt_types[i].initializer);
 }
 
+/* lckpwdf() locks are held by the process, so track which context holds the
+   lock to keep excluding other contexts, possibly in other threads. */
+static GMutex lckpwdf_mutex;
+static GCond lckpwdf_released;
+/* The following are protected by lckpwdf_mutex: */
+static const struct lu_context *lckpwdf_owner;
+/* Number of lu_util_lckpwdf() calls not yet matched by lu_util_ulckpwdf(). */
+static unsigned lckpwdf_depth;
+
+gboolean
+lu_util_lckpwdf(const struct lu_context *context, struct lu_error **error)
+{
+	gint64 deadline;
+
+	LU_ERROR_CHECK(error);
+
+	g_mutex_lock(&lckpwdf_mutex);
+	/* Wait for other contexts as long as lckpwdf() waits for other
+	   processes. */
+	deadline = g_get_monotonic_time()
+		+ LCKPWDF_TIMEOUT * G_TIME_SPAN_SECOND;
+	while (lckpwdf_depth != 0 && lckpwdf_owner != context) {
+		if (!g_cond_wait_until(&lckpwdf_released, &lckpwdf_mutex,
+				       deadline)
+		    && lckpwdf_depth != 0 && lckpwdf_owner != context) {
+			g_mutex_unlock(&lckpwdf_mutex);
+			lu_error_new(error, lu_error_lock,
+				     _("error locking file: %s"),
+				     strerror(EAGAIN));
+			return FALSE;
+		}
+	}
+	if (lckpwdf_depth == 0) {
+		if (lckpwdf() != 0) {
+			int saved_errno;
+
+			saved_errno = errno;
+			g_mutex_unlock(&lckpwdf_mutex);
+			lu_error_new(error, lu_error_lock,
+				     _("error locking file: %s"),
+				     strerror(saved_errno));
+			return FALSE;
+		}
+		lckpwdf_owner = context;
+	}
+	lckpwdf_depth++;
+	g_mutex_unlock(&lckpwdf_mutex);
+	return TRUE;
+}
+
+void
+lu_util_ulckpwdf(const struct lu_context *context)
+{
+	g_mutex_lock(&lckpwdf_mutex);
+	if (lckpwdf_depth == 0 || lckpwdf_owner != context) {
+		g_mutex_unlock(&lckpwdf_mutex);
+		g_return_if_reached();
+	}
+	lckpwdf_depth--;
+	if (lckpwdf_depth == 0) {
+		(void)ulckpwdf();
+		lckpwdf_owner = NULL;
+		g_cond_broadcast(&lckpwdf_released);
+	}
+	g_mutex_unlock(&lckpwdf_mutex);
+}
+
 gpointer
 lu_util_lock_obtain(int fd, struct lu_error ** error)
 {
@@ -892,6 +1078,81 @@ lu_util_fscreate_for_path(const char *path, mode_t mode,
 }
 #endif
 
+/* Try to copy contents of IFD, which has SIZE bytes, to the empty OFD without
+ * reading the data into memory: share the data blocks if the file system
+ * supports it, or let the kernel copy them.
+ * Return 1 on success, 0 if the data must be copied by reading it (nothing was
+ * written to OFD in that case), -1 on error, with errno set. */
+int
+lu_util_copy_file_data(int ifd, int ofd, off_t size)
+{
+	off_t copied;
+
+#ifdef FICLONE
+	if (ioctl(ofd, FICLONE, ifd) == 0)
+		return 1;
+#endif
+	/* Like a read() loop, continue until end of file even if the file has
+	   grown meanwhile. */
+	copied = 0;
+#ifdef HAVE_COPY_FILE_RANGE
+	for (;;) {
+		ssize_t res;
+
+		res = copy_file_range(ifd, NULL, ofd, NULL,
+				      copied < size ? size - copied
+				      : COPY_CHUNK_SIZE, 0);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			/* Not supported for these files. */
+			if (copied == 0
+			    && (errno == ENOSYS || errno == EXDEV
+				|| errno == EINVAL || errno == EBADF
+				|| errno == EOPNOTSUPP || errno == EPERM))
+				break;
+			return -1;
+		}
+		if (res == 0) {
+			/* Some file systems, e.g. procfs, report an empty
+			   copy instead of failing. */
+			if (copied == 0 && size > 0)
+				break;
+			return 1;
+		}
+		copied += res;
+	}
+#endif
+#ifdef HAVE_SYS_SENDFILE_H
+	/* Older kernels can't copy between file systems, but can still avoid
+	   copying the data through user space. */
+	for (;;) {
+		ssize_t res;
+
+		res = sendfile(ofd, ifd, NULL,
+			       copied < size ? size - copied
+			       : COPY_CHUNK_SIZE);
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			if (copied == 0
+			    && (errno == ENOSYS || errno == EINVAL))
+				return 0;
+			return -1;
+		}
+		if (res == 0)
+			return copied == 0 && size > 0 ? 0 : 1;
+		copied += res;
+	}
+#else
+	(void)ifd;
+	(void)ofd;
+	(void)size;
+	(void)copied;
+	return 0;
+#endif
+}
+
 /* Append a copy of VALUES to DEST */
 void
 lu_util_append_values(GValueArray *dest, GValueArray *values)
@@ -17,9 +17,11 @@
  */
 
 #include <config.h>
+#include <sys/mman.h>
 #include <sys/param.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <errno.h>
 #include <inttypes.h>
 #include <fcntl.h>
@@ -34,6 +36,10 @@
 
 #define CHUNK_SIZE	(LINE_MAX * 4)
 
+#ifndef IOV_MAX
+#define IOV_MAX 16 /* The minimum allowed by POSIX */
+#endif
+
 LU_MODULE_INIT(libuser_files_init)
 LU_MODULE_INIT(libuser_shadow_init)
 
@@ -44,9 +50,12 @@ struct format_specifier {
 	const char *attribute;
 	const char *def;
 	gboolean multiple, suppress_if_def, def_if_empty;
+	/* Filled by format_tables_init(): */
+	GQuark quark;		/* lu_ent_attribute_quark(attribute) */
+	gboolean is_string;	/* Values are stored as G_TYPE_STRING */
 };
 
-static const struct format_specifier format_passwd[] = {
+static struct format_specifier format_passwd[] = {
 	{ LU_USERNAME, NULL, FALSE, FALSE, FALSE },
 	{ LU_USERPASSWORD, LU_COMMON_DEFAULT_PASSWORD, FALSE, FALSE, FALSE },
 	{ LU_UIDNUMBER, NULL, FALSE, FALSE, FALSE },
@@ -56,14 +65,14 @@ static const struct format_specifier format_passwd[] = {
 	{ LU_LOGINSHELL, LU_COMMON_DEFAULT_SHELL, FALSE, FALSE, TRUE },
 };
 
-static const struct format_specifier format_group[] = {
+static struct format_specifier format_group[] = {
 	{ LU_GROUPNAME, NULL, FALSE, FALSE, FALSE },
 	{ LU_GROUPPASSWORD, LU_COMMON_DEFAULT_PASSWORD, FALSE, FALSE, FALSE },
 	{ LU_GIDNUMBER, NULL, FALSE, FALSE, FALSE },
 	{ LU_MEMBERNAME, NULL, TRUE, FALSE, FALSE },
 };
 
-static const struct format_specifier format_shadow[] = {
+static struct format_specifier format_shadow[] = {
 	{ LU_SHADOWNAME, NULL, FALSE, FALSE, FALSE },
 	{ LU_SHADOWPASSWORD, LU_COMMON_DEFAULT_PASSWORD, FALSE, FALSE, FALSE },
 	{ LU_SHADOWLASTCHANGE, "-1", FALSE, TRUE, TRUE },
@@ -75,7 +84,7 @@ static const struct format_specifier format_shadow[] = {
 	{ LU_SHADOWFLAG, "-1", FALSE, TRUE, TRUE },
 };
 
-static const struct format_specifier format_gshadow[] = {
+static struct format_specifier format_gshadow[] = {
 	{ LU_GROUPNAME, NULL, FALSE, FALSE, FALSE },
 	{ LU_SHADOWPASSWORD, LU_COMMON_DEFAULT_PASSWORD, FALSE, FALSE, FALSE },
 	{ LU_ADMINISTRATORNAME, NULL, TRUE, FALSE, FALSE },
@@ -102,8 +111,382 @@ module_filename(struct lu_module *module, const char *file_suffix)
 	return g_strconcat(dir, file_suffix, NULL);
 }
 
+/* Identity, size and modification times of a file, used to detect changes. */
+struct file_stamp {
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime, ctime;
+};
+
+/* An index of the entries of a file by name (field 1) and by ID (field 3),
+ * mapping the field value to the offset of the first line containing it.
+ *
+ * The index is valid only as long as the file has the same identity, size and
+ * modification times as when the index was built.  It is built only when a
+ * file is looked up again without changing in between, so that a series of
+ * modifications doesn't keep building indices which are immediately thrown
+ * away.  The index of a file is dropped whenever the module starts editing
+ * it. */
+struct file_index {
+	struct file_stamp stamp;
+	GHashTable *names, *ids; /* NULL if the index was not built. */
+};
+
+/* An index of group memberships in the passwd and group files, answering
+ * the *_enumerate_by_* queries.  All strings are stored in STRINGS, the lists
+ * are GPtrArrays of strings in file order.
+ *
+ * The index is valid as long as both files are unchanged, and it is dropped
+ * whenever the module starts editing a file. */
+struct membership_index {
+	struct file_stamp passwd, group;
+	GStringChunk *strings;	/* NULL if the index was not built. */
+	GHashTable *users_by_gid; /* GID -> users with that primary GID */
+	GHashTable *members_by_group; /* Group name -> listed members */
+	GHashTable *groups_by_user; /* User name -> groups, primary or not */
+};
+
+/* Module-private data, shared by the files and shadow modules. */
+struct files_module_context {
+	GHashTable *indices;	/* File suffix -> struct file_index */
+	gboolean in_transaction;
+	GPtrArray *edits;	/* struct editing of files modified in the
+				   current transaction */
+	struct membership_index membership;
+};
+
+/* Remember the status ST in STAMP. */
+static void
+file_stamp_set(struct file_stamp *stamp, const struct stat *st)
+{
+	stamp->dev = st->st_dev;
+	stamp->ino = st->st_ino;
+	stamp->size = st->st_size;
+	stamp->mtime = st->st_mtim;
+	stamp->ctime = st->st_ctim;
+}
+
+/* Does STAMP describe a file with status ST? */
+static gboolean
+file_stamp_matches(const struct file_stamp *stamp, const struct stat *st)
+{
+	return stamp->dev == st->st_dev && stamp->ino == st->st_ino
+		&& stamp->size == st->st_size
+		&& stamp->mtime.tv_sec == st->st_mtim.tv_sec
+		&& stamp->mtime.tv_nsec == st->st_mtim.tv_nsec
+		&& stamp->ctime.tv_sec == st->st_ctim.tv_sec
+		&& stamp->ctime.tv_nsec == st->st_ctim.tv_nsec;
+}
+
+/* Drop the contents of INDEX, if any. */
+static void
+file_index_clear(struct file_index *index)
+{
+	if (index->names != NULL) {
+		g_hash_table_destroy(index->names);
+		index->names = NULL;
+	}
+	if (index->ids != NULL) {
+		g_hash_table_destroy(index->ids);
+		index->ids = NULL;
+	}
+}
+
+/* Drop the contents of INDEX and remember the file status ST. */
+static void
+file_index_reset(struct file_index *index, const struct stat *st)
+{
+	file_index_clear(index);
+	file_stamp_set(&index->stamp, st);
+}
+
+static void
+file_index_free(gpointer data)
+{
+	struct file_index *index;
+
+	index = data;
+	file_index_clear(index);
+	g_free(index);
+}
+
+/* Drop the contents of INDEX, if any. */
+static void
+membership_index_clear(struct membership_index *index)
+{
+	if (index->strings == NULL)
+		return;
+	g_hash_table_destroy(index->users_by_gid);
+	g_hash_table_destroy(index->members_by_group);
+	g_hash_table_destroy(index->groups_by_user);
+	g_string_chunk_free(index->strings);
+	index->strings = NULL;
+}
+
+/* Create module-private data for a files or shadow module. */
+static struct files_module_context *
+files_module_context_new(void)
+{
+	struct files_module_context *ctx;
+
+	ctx = g_malloc0(sizeof(*ctx));
+	ctx->indices = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					     file_index_free);
+	ctx->edits = g_ptr_array_new();
+	return ctx;
+}
+
+/* Free module-private data of a files or shadow module. */
+static void
+files_module_context_free(struct files_module_context *ctx)
+{
+	g_assert(ctx->edits->len == 0);
+	g_ptr_array_free(ctx->edits, TRUE);
+	g_hash_table_destroy(ctx->indices);
+	membership_index_clear(&ctx->membership);
+	g_free(ctx);
+}
+
+/* Does INDEX describe a file with status ST? */
+static gboolean
+file_index_is_current(const struct file_index *index, const struct stat *st)
+{
+	return file_stamp_matches(&index->stamp, st);
+}
+
+/* Contents of a file, mapped into memory if possible, read line by line
+ * without copying. */
+struct file_lines {
+	char *contents;
+	size_t size;
+	gboolean mapped;
+	const char *next;	/* Start of the next line to return */
+};
+
+/* Make SIZE bytes of contents of FD available in LINES.
+ * Return TRUE on success, FALSE with errno set on error.  FD may be closed
+ * afterwards. */
+static gboolean
+file_lines_map(struct file_lines *lines, int fd, off_t size)
+{
+	lines->size = size;
+	lines->mapped = FALSE;
+	if (size == 0)
+		lines->contents = NULL;
+	else {
+		lines->contents = mmap(NULL, size, PROT_READ, MAP_SHARED, fd,
+				       0);
+		if (lines->contents == MAP_FAILED) {
+			ssize_t len;
+
+			lines->contents = g_malloc(size);
+			len = pread(fd, lines->contents, size, 0);
+			if (len != size) {
+				if (len != -1)
+					errno = EIO;
+				g_free(lines->contents);
+				return FALSE;
+			}
+		} else
+			lines->mapped = TRUE;
+	}
+	lines->next = lines->contents;
+	return TRUE;
+}
+
+/* Get the next line from LINES, without the terminator, into *LINE and *LEN.
+ * Return FALSE at end of file. */
+static gboolean
+file_lines_next(struct file_lines *lines, const char **line, size_t *len)
+{
+	const char *end, *nl;
+
+	end = lines->contents + lines->size;
+	if (lines->next == NULL || lines->next >= end)
+		return FALSE;
+	nl = memchr(lines->next, '\n', end - lines->next);
+	if (nl == NULL)
+		nl = end;
+	*line = lines->next;
+	*len = nl - lines->next;
+	lines->next = nl < end ? nl + 1 : end;
+	return TRUE;
+}
+
+/* Release the contents in LINES. */
+static void
+file_lines_close(struct file_lines *lines)
+{
+	if (lines->mapped)
+		munmap(lines->contents, lines->size);
+	else
+		g_free(lines->contents);
+}
+
+/* Add the field between FIELD_START and FIELD_END of a line at LINE_OFFSET to
+ * TABLE, unless an earlier line has the same value. */
+static void
+file_index_add(GHashTable *table, const char *field_start,
+	       const char *field_end, size_t line_offset)
+{
+	char *key;
+
+	key = g_strndup(field_start, field_end - field_start);
+	if (g_hash_table_lookup_extended(table, key, NULL, NULL))
+		g_free(key);
+	else
+		g_hash_table_insert(table, key, GSIZE_TO_POINTER(line_offset));
+}
+
+/* Build INDEX from the contents of FD, which has status ST.
+ * Return TRUE on success. */
+static gboolean
+file_index_build(struct file_index *index, int fd, const struct stat *st)
+{
+	struct file_lines lines;
+	const char *line;
+	size_t len;
+
+	if (!file_lines_map(&lines, fd, st->st_size))
+		return FALSE;
+
+	index->names = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     NULL);
+	index->ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					   NULL);
+	/* This must match what lu_util_line_get_matchingx() would find. */
+	while (file_lines_next(&lines, &line, &len)) {
+		const char *line_end, *field_start, *p;
+		int field;
+
+		line_end = line + len;
+		field = 1;
+		field_start = line;
+		for (p = line; p < line_end && field < 3; p++) {
+			if (*p == ':') {
+				if (field == 1)
+					file_index_add(index->names,
+						       field_start, p,
+						       line - lines.contents);
+				field++;
+				field_start = p + 1;
+			}
+		}
+		if (field == 1)
+			file_index_add(index->names, field_start, line_end,
+				       line - lines.contents);
+		else if (field == 3) {
+			p = memchr(field_start, ':', line_end - field_start);
+			file_index_add(index->ids, field_start,
+				       p != NULL ? p : line_end,
+				       line - lines.contents);
+		}
+	}
+
+	file_lines_close(&lines);
+	return TRUE;
+}
+
+/* Read a line starting at OFFSET in FD, without the terminator.
+ * Return the line for g_free(), or NULL on error. */
+static char *
+line_read_at(int fd, off_t offset)
+{
+	GString *line;
+
+	line = g_string_new(NULL);
+	for (;;) {
+		char buf[CHUNK_SIZE], *nl;
+		ssize_t len;
+
+		len = pread(fd, buf, sizeof(buf), offset);
+		if (len == -1) {
+			if (errno == EINTR)
+				continue;
+			g_string_free(line, TRUE);
+			return NULL;
+		}
+		if (len == 0)
+			break;
+		nl = memchr(buf, '\n', len);
+		if (nl != NULL) {
+			g_string_append_len(line, buf, nl - buf);
+			break;
+		}
+		g_string_append_len(line, buf, len);
+		offset += len;
+	}
+	return g_string_free(line, FALSE);
+}
+
+/* Does the FIELD'th field of LINE contain exactly VALUE? */
+static gboolean
+line_field_equals(const char *line, int field, const char *value)
+{
+	size_t len;
+
+	for (; field > 1; field--) {
+		line = strchr(line, ':');
+		if (line == NULL)
+			return FALSE;
+		line++;
+	}
+	len = strlen(value);
+	return strncmp(line, value, len) == 0
+		&& (line[len] == ':' || line[len] == '\0');
+}
+
+/* Find a line in FD, which is FILE_SUFFIX in MODULE, with VALUE in the
+ * FIELD'th field, using the module's index of the file if possible.
+ * Return the line for g_free(), or NULL if not found or on error. */
+static char *
+indexed_line_get_matching(struct lu_module *module, const char *file_suffix,
+			  int fd, const char *value, int field,
+			  struct lu_error **error)
+{
+	struct files_module_context *ctx;
+	struct file_index *index;
+	struct stat st;
+	GHashTable *table;
+	gpointer offset;
+	char *line;
+
+	if ((field != 1 && field != 3) || fstat(fd, &st) == -1)
+		goto scan;
+
+	ctx = module->module_context;
+	index = g_hash_table_lookup(ctx->indices, file_suffix);
+	if (index == NULL) {
+		index = g_malloc0(sizeof(*index));
+		file_index_reset(index, &st);
+		g_hash_table_insert(ctx->indices, (char *)file_suffix, index);
+		goto scan;
+	}
+	if (!file_index_is_current(index, &st)) {
+		file_index_reset(index, &st);
+		goto scan;
+	}
+	if (index->names == NULL && !file_index_build(index, fd, &st))
+		goto scan;
+
+	table = field == 1 ? index->names : index->ids;
+	if (!g_hash_table_lookup_extended(table, value, NULL, &offset))
+		return NULL;
+	line = line_read_at(fd, GPOINTER_TO_SIZE(offset));
+	if (line != NULL && line_field_equals(line, field, value))
+		return line;
+	/* The file was modified without changing its status; don't trust the
+	   index any more. */
+	g_free(line);
+	file_index_reset(index, &st);
+
+scan:
+	return lu_util_line_get_matchingx(fd, value, field, error);
+}
+
 /* Copy contents of INPUT_FILENAME to OUTPUT_FILENAME, exclusively creating it
- * if EXCLUSIVE.
+ * if EXCLUSIVE.  Access and modification times are copied as well.
  * Return the file descriptor for OUTPUT_FILENAME, open for reading and writing,
  * or -1 on error.
  * Note that this does no locking and assumes the directories hosting the files
@@ -177,7 +560,18 @@ open_and_copy_file(const char *input_filename, const char *output_filename,
 		goto err_ofd;
 	}
 
-	/* Copy the data, block by block. */
+	/* Copy the data, block by block, unless the kernel can do it. */
+	switch (lu_util_copy_file_data(ifd, ofd, st.st_size)) {
+	case 1:
+		goto copied;
+	case 0:
+		break;
+	default:
+		lu_error_new(error, lu_error_write,
+			     _("Error writing `%s': %s"), output_filename,
+			     strerror(errno));
+		goto err_ofd;
+	}
 	for (;;) {
 		char buf[CHUNK_SIZE];
 		ssize_t left;
@@ -211,6 +605,22 @@ open_and_copy_file(const char *input_filename, const char *output_filename,
 			left -= out;
 		}
 	}
+copied:
+
+	/* Keep the times of the original, so that editing_open() can tell
+	 * whether an existing backup is up to date. */
+	{
+		struct timespec times[2];
+
+		times[0] = st.st_atim;
+		times[1] = st.st_mtim;
+		if (futimens(ofd, times) != 0) {
+			lu_error_new(error, lu_error_generic,
+				     _("Error changing times of `%s': %s"),
+				     output_filename, strerror(errno));
+			goto err_ofd;
+		}
+	}
 
 	/* Flush data to disk. */
 	if (fsync(ofd) != 0 || lseek(ofd, 0, SEEK_SET) == -1) {
@@ -229,6 +639,36 @@ open_and_copy_file(const char *input_filename, const char *output_filename,
 	return res;
 }
 
+/* Is BACKUP_FILENAME, created by open_and_copy_file(), an up to date copy of
+ * FILENAME? */
+static gboolean
+backup_is_current(const char *filename, const char *backup_filename)
+{
+	struct stat st, backup_st;
+
+	if (stat(filename, &st) != 0 || lstat(backup_filename, &backup_st) != 0)
+		return FALSE;
+	/* The modification time can be set to an arbitrary value, but any
+	 * change of FILENAME, in place or by renaming another file over it,
+	 * sets its status change time, which can not.  open_and_copy_file()
+	 * changes the status of the backup after copying the data, so the
+	 * backup is current only if FILENAME has not changed since; if both
+	 * happened within the same clock tick, copy the file again. */
+	if (st.st_ctim.tv_sec > backup_st.st_ctim.tv_sec
+	    || (st.st_ctim.tv_sec == backup_st.st_ctim.tv_sec
+		&& st.st_ctim.tv_nsec >= backup_st.st_ctim.tv_nsec))
+		return FALSE;
+	return S_ISREG(backup_st.st_mode)
+		&& (st.st_dev != backup_st.st_dev
+		    || st.st_ino != backup_st.st_ino)
+		&& st.st_size == backup_st.st_size
+		&& st.st_mtim.tv_sec == backup_st.st_mtim.tv_sec
+		&& st.st_mtim.tv_nsec == backup_st.st_mtim.tv_nsec
+		&& st.st_uid == backup_st.st_uid
+		&& st.st_gid == backup_st.st_gid
+		&& st.st_mode == backup_st.st_mode;
+}
+
 /* Deal with an existing LOCK_FILENAME.
  * Return TRUE if the caller should try again. */
 static gboolean
@@ -348,50 +788,102 @@ lock_file_remove(const char *filename)
 /* State related to a file currently open for editing. */
 struct editing {
 	char *filename;
-	lu_security_context_t fscreate;
 	char *new_filename;
 	int new_fd;
+	struct lu_context *lock_owner;	/* Holds lckpwdf() for, or NULL */
+	/* Used only within a transaction: */
+	const char *file_suffix;
+	gboolean modifying;	/* The current operation has started modifying
+				   new_fd. */
+	gboolean failed;	/* An operation failed after modifying new_fd,
+				   so its contents are not trustworthy. */
 };
 
+/* Return editing state of FILE_SUFFIX in the current transaction of CTX, or
+ * NULL if the file was not modified in the transaction. */
+static struct editing *
+transaction_find_editing(struct files_module_context *ctx,
+			 const char *file_suffix)
+{
+	size_t i;
+
+	for (i = 0; i < ctx->edits->len; i++) {
+		struct editing *e;
+
+		e = g_ptr_array_index(ctx->edits, i);
+		if (strcmp(e->file_suffix, file_suffix) == 0)
+			return e;
+	}
+	return NULL;
+}
+
 /* Open and lock FILE_SUFFIX in MODULE for editing.
+ * Within a transaction, only the first call for a file does this, later calls
+ * return the same state.
  * Return editing state, or NULL on error. */
 static struct editing *
 editing_open(struct lu_module *module, const char *file_suffix,
 	     struct lu_error **error)
 {
+	struct files_module_context *ctx;
 	struct editing *e;
+	lu_security_context_t fscreate;
 	struct stat st;
 	char *tmp;
 	char *backup_name;
 	int fd;
 
+	ctx = module->module_context;
+	/* Modifications may not change the file status visibly, e.g. when
+	   a line is replaced by one of the same length within a transaction,
+	   so drop the indices of the file. */
+	g_hash_table_remove(ctx->indices, file_suffix);
+	membership_index_clear(&ctx->membership);
+	if (ctx->in_transaction) {
+		e = transaction_find_editing(ctx, file_suffix);
+		if (e != NULL) {
+			if (lseek(e->new_fd, 0, SEEK_SET) == -1) {
+				lu_error_new(error, lu_error_read,
+					     _("couldn't read from `%s': %s"),
+					     e->new_filename, strerror(errno));
+				return NULL;
+			}
+			e->modifying = FALSE;
+			return e;
+		}
+	}
+
 	e = g_malloc0(sizeof (*e));
 	e->filename = module_filename(module, file_suffix);
 	/* Make sure this all works if e->filename is a symbolic link, at least
 	 * as long as it points to the same file system. */
 
 	if (geteuid() == 0) {
-		if (lckpwdf() != 0) {
-			lu_error_new(error, lu_error_lock,
-				     _("error locking file: %s"),
-				     strerror(errno));
+		if (lu_util_lckpwdf(module->lu_context, error) == FALSE)
 			goto err_filename;
-		}
+		e->lock_owner = module->lu_context;
 	}
 	if (lock_file_create(e->filename, error) == FALSE)
 		goto err_lckpwdf;
 
-	if (!lu_util_fscreate_save(&e->fscreate, error))
+	if (!lu_util_fscreate_save(&fscreate, error))
 		goto err_locked;
 	if (!lu_util_fscreate_from_file(e->filename, error))
 		goto err_fscreate;
 
+	/* Don't copy the file again if it has not changed since the last
+	 * backup, e.g. after an unsuccessful modification. */
 	backup_name = g_strconcat(e->filename, "-", NULL);
-	fd = open_and_copy_file(e->filename, backup_name, FALSE, error);
-	g_free (backup_name);
-	if (fd == -1)
-		goto err_fscreate;
-	close(fd);
+	if (!backup_is_current(e->filename, backup_name)) {
+		fd = open_and_copy_file(e->filename, backup_name, FALSE,
+					error);
+		if (fd == -1) {
+			g_free(backup_name);
+			goto err_fscreate;
+		}
+		close(fd);
+	}
+	g_free(backup_name);
 
 	/* If file is a symlink, create new file at target location,
 	 * otherwise later rename() could fail, because symlink and target
@@ -414,19 +906,26 @@ editing_open(struct lu_module *module, const char *file_suffix,
 			       	       error);
 	if (e->new_fd == -1)
 		goto err_new_filename;
+	/* No other files are created until editing_close(); in particular,
+	 * rename() keeps the context of the new file. */
+	lu_util_fscreate_restore(fscreate);
 
+	if (ctx->in_transaction) {
+		e->file_suffix = file_suffix;
+		g_ptr_array_add(ctx->edits, e);
+	}
 	return e;
 
 err_new_filename:
  	g_free(e->new_filename);
 err_fscreate:
-	lu_util_fscreate_restore(e->fscreate);
+	lu_util_fscreate_restore(fscreate);
 
 err_locked:
 	(void)lock_file_remove(e->filename);
 err_lckpwdf:
-	if (geteuid() == 0)
-		(void)ulckpwdf();
+	if (e->lock_owner != NULL)
+		lu_util_ulckpwdf(e->lock_owner);
 
 err_filename:
  	g_free(e->filename);
@@ -469,24 +968,31 @@ err:
 	return ret;
 }
 
-/* Finish editing E, commit edits if COMMIT.
- * Return true only if RET_INPUT and everything went OK; suggested usage is
- *  ret = editing_close(e, commit, ret, error); */
+/* Flush the new contents of E to disk.
+ * Return TRUE on success. */
 static gboolean
-editing_close(struct editing *e, gboolean commit, gboolean ret_input,
-	      struct lu_error **error)
+editing_sync(struct editing *e, struct lu_error **error)
+{
+	if (fsync(e->new_fd) != 0) {
+		lu_error_new(error, lu_error_write, _("Error writing `%s': %s"),
+			     e->new_filename, strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
+
+/* Stop editing E, replacing the original file by the (already synced) new
+ * contents if COMMIT, and free E.
+ * Return true only if RET_INPUT and everything went OK. */
+static gboolean
+editing_finish(struct editing *e, gboolean commit, gboolean ret_input,
+	       struct lu_error **error)
 {
 	gboolean ret = FALSE;
 	gboolean unlink_new_filename = TRUE;
 
 	g_assert(e != NULL);
 
-	if (commit && fsync(e->new_fd) != 0) {
-		lu_error_new(error, lu_error_write, _("Error writing `%s': %s"),
-			     e->new_filename, strerror(errno));
-		close(e->new_fd);
-		goto err;
-	}
 	close(e->new_fd);
 
 	if (commit) {
@@ -501,187 +1007,516 @@ err:
 	if (unlink_new_filename)
 		(void)unlink(e->new_filename);
 	g_free(e->new_filename);
-	lu_util_fscreate_restore(e->fscreate);
 
 	(void)lock_file_remove(e->filename);
-	if (geteuid() == 0)
-		(void)ulckpwdf();
+	if (e->lock_owner != NULL)
+		lu_util_ulckpwdf(e->lock_owner);
 
 	g_free(e->filename);
 	g_free(e);
 	return ret;
 }
 
+/* Finish editing E, commit edits if COMMIT.
+ * Within a transaction, the edits are only committed when the transaction is.
+ * Return true only if RET_INPUT and everything went OK; suggested usage is
+ *  ret = editing_close(e, commit, ret, error); */
+static gboolean
+editing_close(struct editing *e, gboolean commit, gboolean ret_input,
+	      struct lu_error **error)
+{
+	g_assert(e != NULL);
+
+	if (e->file_suffix != NULL) {
+		if (!commit && e->modifying)
+			e->failed = TRUE;
+		e->modifying = FALSE;
+		return ret_input;
+	}
+
+	if (commit && !editing_sync(e, error))
+		return editing_finish(e, FALSE, FALSE, error);
+	return editing_finish(e, commit, ret_input, error);
+}
+
+/* Start a transaction in MODULE. */
+static gboolean
+lu_files_transaction_begin(struct lu_module *module, struct lu_error **error)
+{
+	struct files_module_context *ctx;
+
+	(void)error;
+	ctx = module->module_context;
+	g_assert(!ctx->in_transaction);
+	ctx->in_transaction = TRUE;
+	return TRUE;
+}
+
+/* Replace all files modified in the current transaction in MODULE.  Each file
+ * is replaced atomically, but not all of them together: if replacing a file
+ * fails, files replaced before it stay replaced and the rest are discarded. */
+static gboolean
+lu_files_transaction_commit(struct lu_module *module, struct lu_error **error)
+{
+	struct files_module_context *ctx;
+	gboolean ret = TRUE;
+	size_t i;
+
+	ctx = module->module_context;
+	g_assert(ctx->in_transaction);
+	/* Make sure all files can be committed before replacing any of
+	   them. */
+	for (i = 0; ret && i < ctx->edits->len; i++) {
+		struct editing *e;
+
+		e = g_ptr_array_index(ctx->edits, i);
+		if (e->failed) {
+			lu_error_new(error, lu_error_write,
+				     _("an earlier modification of `%s' "
+				       "failed"), e->filename);
+			ret = FALSE;
+		} else
+			ret = editing_sync(e, error);
+	}
+	for (i = 0; i < ctx->edits->len; i++)
+		ret = editing_finish(g_ptr_array_index(ctx->edits, i), ret,
+				     ret, error);
+	g_ptr_array_set_size(ctx->edits, 0);
+	ctx->in_transaction = FALSE;
+	return ret;
+}
+
+/* Discard all modifications in the current transaction in MODULE, if any. */
+static void
+lu_files_transaction_abort(struct lu_module *module)
+{
+	struct files_module_context *ctx;
+	size_t i;
+
+	ctx = module->module_context;
+	for (i = 0; i < ctx->edits->len; i++)
+		(void)editing_finish(g_ptr_array_index(ctx->edits, i), FALSE,
+				     FALSE, NULL);
+	g_ptr_array_set_size(ctx->edits, 0);
+	ctx->in_transaction = FALSE;
+}
 
-/* Read a line from the file, no matter how long it is, and return it as a
- * newly-allocated string, with the terminator intact. */
+/* Return the name of the file to read for FILE_SUFFIX in MODULE, which
+ * includes any modifications made in the current transaction, for g_free(). */
 static char *
-line_read(FILE * fp)
+reading_filename(struct lu_module *module, const char *file_suffix)
 {
-	char *buf;
-	size_t len, buf_size = CHUNK_SIZE;
+	struct files_module_context *ctx;
+	struct editing *e;
 
-	buf = g_malloc(buf_size);
-	len = 0;
-	while (fgets(buf + len, buf_size - len, fp) != NULL) {
-		len += strlen(buf + len);
-		if (len > 0 && buf[len - 1] == '\n')
-			break;
+	ctx = module->module_context;
+	e = NULL;
+	if (ctx->in_transaction)
+		e = transaction_find_editing(ctx, file_suffix);
+	if (e != NULL)
+		return g_strdup(e->new_filename);
+	return module_filename(module, file_suffix);
+}
+
+/* Open FILE_SUFFIX in MODULE for reading, including any modifications made
+ * in the current transaction.
+ * Return a file descriptor, or -1 on error. */
+static int
+open_for_reading(struct lu_module *module, const char *file_suffix,
+		 struct lu_error **error)
+{
+	char *filename;
+	int fd;
+
+	filename = reading_filename(module, file_suffix);
+	fd = open(filename, O_RDONLY);
+	if (fd == -1)
+		lu_error_new(error, lu_error_open,
+			     _("couldn't open `%s': %s"), filename,
+			     strerror(errno));
+	g_free(filename);
+	return fd;
+}
+
+/* Open FILE_SUFFIX in MODULE for reading, like open_for_reading(), and make
+ * its contents available in LINES.
+ * Return TRUE on success. */
+static gboolean
+file_lines_open(struct file_lines *lines, struct lu_module *module,
+		const char *file_suffix, struct lu_error **error)
+{
+	struct stat st;
+	int fd;
 
-		buf_size += CHUNK_SIZE;
-		buf = g_realloc(buf, buf_size);
+	fd = open_for_reading(module, file_suffix, error);
+	if (fd == -1)
+		return FALSE;
+	if (fstat(fd, &st) == -1) {
+		lu_error_new(error, lu_error_stat, NULL);
+		close(fd);
+		return FALSE;
 	}
-	if (len == 0) {
-		g_free(buf);
-		return NULL;
-	} else {
-		return buf;
+	if (!file_lines_map(lines, fd, st.st_size)) {
+		lu_error_new(error, lu_error_read, NULL);
+		close(fd);
+		return FALSE;
+	}
+	close(fd);
+	return TRUE;
+}
+
+/* Find the FIELD'th field (counting from 1) in LEN bytes at LINE.
+ * Return the start of the field and store its length into *FIELD_LEN, or
+ * return NULL if LINE does not have that many fields. */
+static const char *
+line_span_field(const char *line, size_t len, int field, size_t *field_len)
+{
+	const char *end, *p;
+
+	end = line + len;
+	for (; field > 1; field--) {
+		p = memchr(line, ':', end - line);
+		if (p == NULL)
+			return NULL;
+		line = p + 1;
+	}
+	p = memchr(line, ':', end - line);
+	*field_len = (p != NULL ? p : end) - line;
+	return line;
+}
+
+/* Are LEN bytes at SPAN equal to VALUE? */
+static gboolean
+span_equals(const char *span, size_t len, const char *value)
+{
+	return strlen(value) == len && memcmp(span, value, len) == 0;
+}
+
+/* Append a copy of LEN bytes at STRING to VALUES. */
+static void
+value_array_append_span(GValueArray *values, const char *string, size_t len)
+{
+	GValue *value;
+
+	g_value_array_append(values, NULL);
+	value = g_value_array_get_nth(values, values->n_values - 1);
+	g_value_init(value, G_TYPE_STRING);
+	g_value_take_string(value, g_strndup(string, len));
+}
+
+/* Does the entry name in LEN bytes at NAME match PATTERN?  BUF is used as
+ * temporary storage. */
+static gboolean
+span_matches_pattern(const char *name, size_t len, const char *pattern,
+		     GString *buf)
+{
+	if (strcmp(pattern, "*") == 0)
+		return TRUE;
+	g_string_truncate(buf, 0);
+	g_string_append_len(buf, name, len);
+	return fnmatch(pattern, buf->str, 0) == 0;
+}
+
+/* Fill the parsing information in FORMATS. */
+static void
+format_specifiers_init(struct format_specifier *formats, size_t format_count)
+{
+	size_t i;
+
+	for (i = 0; i < format_count; i++) {
+		struct lu_error *err;
+		GValue value;
+
+		formats[i].quark = lu_ent_attribute_quark(formats[i].attribute);
+		/* Ask lu_value_init_set_attr_from_string() instead of
+		   duplicating its knowledge of attribute types; only string
+		   attributes accept an empty value. */
+		memset(&value, 0, sizeof(value));
+		err = NULL;
+		if (lu_value_init_set_attr_from_string(&value,
+						       formats[i].attribute,
+						       "", &err)) {
+			formats[i].is_string = G_VALUE_HOLDS_STRING(&value);
+			g_value_unset(&value);
+		} else {
+			formats[i].is_string = FALSE;
+			if (err != NULL)
+				lu_error_free(&err);
+		}
+	}
+}
+
+/* Fill the parsing information in all format tables, once per process; the
+   tables are shared by all contexts, which may be used by other threads. */
+static void
+format_tables_init(void)
+{
+	static gsize initialized;
+
+	if (g_once_init_enter(&initialized)) {
+		format_specifiers_init(format_passwd,
+				       G_N_ELEMENTS(format_passwd));
+		format_specifiers_init(format_group,
+				       G_N_ELEMENTS(format_group));
+		format_specifiers_init(format_shadow,
+				       G_N_ELEMENTS(format_shadow));
+		format_specifiers_init(format_gshadow,
+				       G_N_ELEMENTS(format_gshadow));
+		g_once_init_leave(&initialized, 1);
 	}
 }
 
-/* Parse a single field value. */
+/* Parse a single field value for ENT from LEN bytes at STRING, which need not
+   be NUL-terminated. */
 static gboolean
-parse_field(const struct format_specifier *format, GValue *value,
-	    const char *string)
+parse_field(const struct format_specifier *format, struct lu_ent *ent,
+	    GValue *value, const char *string, size_t len)
 {
 	struct lu_error *err;
+	char buf[64], *copy;
 	gboolean ret;
 
+	if (format->is_string) {
+		lu_ent_value_init_string_len(ent, value, string, len);
+		return TRUE;
+	}
+
+	/* Numbers are short, avoid allocating memory for them. */
+	if (len < sizeof(buf)) {
+		memcpy(buf, string, len);
+		buf[len] = '\0';
+		copy = buf;
+	} else
+		copy = g_strndup(string, len);
 	err = NULL;
 	ret = lu_value_init_set_attr_from_string(value, format->attribute,
-						 string, &err);
+						 copy, &err);
 	if (ret == FALSE) {
 		g_assert(err != NULL);
 		g_warning("%s", lu_strerror(err));
 		lu_error_free(&err);
 	}
+	if (copy != buf)
+		g_free(copy);
 	return ret;
 }
 
-/* Parse a string into an ent structure using the elements in the format
- * specifier array. */
+/* Check whether the LEN bytes at VALUE are equal to one of the strings in
+   VALUES. */
 static gboolean
-parse_generic(const gchar *line, const struct format_specifier *formats,
-	      size_t format_count, struct lu_ent *ent)
+string_values_contain(GValueArray *values, const char *value, size_t len)
+{
+	size_t i;
+
+	for (i = 0; i < values->n_values; i++) {
+		const char *s;
+
+		s = g_value_get_string(g_value_array_get_nth(values, i));
+		if (strncmp(s, value, len) == 0 && s[len] == '\0')
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Add all non-empty comma-separated values in LEN bytes at FIELD to ENT,
+   skipping duplicates. */
+static void
+parse_multiple_field(const struct format_specifier *format, const char *field,
+		     size_t len, struct lu_ent *ent)
 {
+	/* Values already added, if there are too many to search linearly. */
+	GHashTable *seen;
+	GValueArray *added;
+	const char *end;
 	size_t i;
-	gchar **v = NULL;
+
+	seen = NULL;
+	added = g_value_array_new(0);
+	end = field + len;
+	while (field < end) {
+		const char *comma;
+		size_t item_len;
+		GValue value;
+		gboolean ret;
+
+		comma = memchr(field, ',', end - field);
+		if (comma == NULL)
+			comma = end;
+		item_len = comma - field;
+		/* Skip over empty strings. */
+		if (item_len == 0)
+			goto next;
+
+		memset(&value, 0, sizeof(value));
+		/* Always succeeds assuming the attribute values use
+		   G_TYPE_STRING, which is currently true. */
+		ret = parse_field(format, ent, &value, field, item_len);
+		g_assert(ret != FALSE);
+		g_assert(G_VALUE_HOLDS_STRING(&value));
+		if (seen != NULL) {
+			if (g_hash_table_lookup_extended
+			    (seen, g_value_get_string(&value), NULL, NULL)) {
+				g_value_unset(&value);
+				goto next;
+			}
+		} else if (string_values_contain(added, field, item_len)) {
+			g_value_unset(&value);
+			goto next;
+		}
+		/* Move the value, a copy would not be owned by ENT's
+		   arena. */
+		g_value_array_append(added, NULL);
+		*g_value_array_get_nth(added, added->n_values - 1) = value;
+		if (seen == NULL && added->n_values > 16) {
+			seen = g_hash_table_new(g_str_hash, g_str_equal);
+			for (i = 0; i < added->n_values; i++)
+				g_hash_table_insert
+					(seen, (gpointer)g_value_get_string
+					 (g_value_array_get_nth(added, i)),
+					 NULL);
+		} else if (seen != NULL)
+			g_hash_table_insert(seen, (gpointer)g_value_get_string
+					    (g_value_array_get_nth
+					     (added, added->n_values - 1)),
+					    NULL);
+	next:
+		field = comma + 1;
+	}
+	if (seen != NULL)
+		g_hash_table_destroy(seen);
+	/* Move the values to ENT in their original order; the moved-from
+	   values are left zeroed, so g_value_array_free() skips them. */
+	for (i = 0; i < added->n_values; i++)
+		lu_ent_append_current_q(ent, format->quark,
+					g_value_array_get_nth(added, i));
+	g_value_array_free(added);
+}
+
+/* Parse LEN bytes at LINE into an ent structure using the elements in the
+ * format specifier array.  The line is scanned once, and values are copied
+ * directly from it. */
+static gboolean
+parse_generic(const gchar *line, size_t len,
+	      const struct format_specifier *formats, size_t format_count,
+	      struct lu_ent *ent)
+{
+	const char *fields[format_count], *p, *end;
+	size_t lengths[format_count], i, n;
 	GValue value;
 
+	g_assert(format_count > 0);
+	/* Find the fields, the last one extends to the end of the line (as
+	   in g_strsplit(line, ":", format_count)). */
+	p = line;
+	end = line + len;
+	for (n = 0; n < format_count; n++) {
+		const char *colon;
+
+		fields[n] = p;
+		colon = n + 1 < format_count ? memchr(p, ':', end - p) : NULL;
+		if (colon == NULL) {
+			lengths[n] = end - p;
+			n++;
+			break;
+		}
+		lengths[n] = colon - p;
+		p = colon + 1;
+	}
 	/* Make sure the line is properly formatted, meaning that it has enough
 	   fields in it for us to parse out all the fields we want, allowing
 	   for the last one to be empty. */
-	v = g_strsplit(line, ":", format_count);
-	g_assert(format_count > 0);
-	if (g_strv_length(v) < format_count - 1) {
+	if (n < format_count - 1) {
 		g_warning("entry is incorrectly formatted");
 		return FALSE;
 	}
+	for (; n < format_count; n++) {
+		fields[n] = "";
+		lengths[n] = 0;
+	}
 
 	/* Now parse out the fields. */
 	memset(&value, 0, sizeof(value));
 	for (i = 0; i < format_count; i++) {
-		const gchar *val;
-
-		val = v[i];
-		if (val == NULL)
-			val = "";
 		/* Clear out old values in the destination structure. */
 		lu_ent_clear_current(ent, formats[i].attribute);
 		if (formats[i].multiple) {
 			/* Field contains multiple comma-separated values. */
-			gchar **w;
-			size_t j;
-
-			/* Split up the field. */
-			w = g_strsplit(val, ",", 0);
-			for (j = 0; (w != NULL) && (w[j] != NULL); j++) {
-				gboolean ret;
-
-				/* Skip over empty strings. */
-				if (strlen(w[j]) == 0)
-					continue;
-				/* Always succeeds assuming the attribute
-				   values use G_TYPE_STRING, which is currently
-				   true. */
-				ret = parse_field(formats + i, &value, w[j]);
-				g_assert (ret != FALSE);
-				/* Add it to the current values list. */
-				lu_ent_add_current(ent, formats[i].attribute,
-						   &value);
-				g_value_unset(&value);
-			}
-			g_strfreev(w);
+			parse_multiple_field(formats + i, fields[i], lengths[i],
+					     ent);
+			continue;
+		}
+		/* Check if we need to supply the default value. */
+		if (formats[i].def_if_empty && formats[i].def != NULL
+		    && lengths[i] == 0) {
+			gboolean ret;
+
+			/* Convert the default to the right type. */
+			ret = parse_field(formats + i, ent, &value,
+					  formats[i].def,
+					  strlen(formats[i].def));
+			g_assert (ret != FALSE);
 		} else {
-			/* Check if we need to supply the default value. */
-			if (formats[i].def_if_empty && formats[i].def != NULL
-			    && strlen(val) == 0) {
-				gboolean ret;
-
-				/* Convert the default to the right type. */
-				ret = parse_field(formats + i, &value,
-						  formats[i].def);
-				g_assert (ret != FALSE);
-			} else {
-				if (parse_field (formats + i, &value, val)
-				    == FALSE)
-					continue;
-			}
-			/* If we recovered a value, add it to the current
-			 * values list for the entity. */
-			lu_ent_add_current(ent, formats[i].attribute, &value);
-			g_value_unset(&value);
+			if (parse_field(formats + i, ent, &value, fields[i],
+					lengths[i]) == FALSE)
+				continue;
 		}
+		/* If we recovered a value, add it to the current values list
+		 * for the entity. */
+		lu_ent_append_current_q(ent, formats[i].quark, &value);
 	}
-	g_strfreev(v);
 	return TRUE;
 }
 
 /* Parse an entry from /etc/passwd into an ent structure, using the attribute
  * names we know. */
 static gboolean
-lu_files_parse_user_entry(const gchar * line, struct lu_ent *ent)
+lu_files_parse_user_entry(const gchar *line, size_t len,
+			  struct lu_ent *ent)
 {
 	ent->type = lu_user;
 	lu_ent_clear_all(ent);
-	return parse_generic(line, format_passwd, G_N_ELEMENTS(format_passwd),
-			     ent);
+	return parse_generic(line, len, format_passwd,
+			     G_N_ELEMENTS(format_passwd), ent);
 }
 
 /* Parse an entry from /etc/group into an ent structure, using the attribute
  * names we know. */
 static gboolean
-lu_files_parse_group_entry(const gchar * line, struct lu_ent *ent)
+lu_files_parse_group_entry(const gchar *line, size_t len,
+			   struct lu_ent *ent)
 {
 	ent->type = lu_group;
 	lu_ent_clear_all(ent);
-	return parse_generic(line, format_group, G_N_ELEMENTS(format_group),
-			     ent);
+	return parse_generic(line, len, format_group,
+			     G_N_ELEMENTS(format_group), ent);
 }
 
 /* Parse an entry from /etc/shadow into an ent structure, using the attribute
  * names we know. */
 static gboolean
-lu_shadow_parse_user_entry(const gchar * line, struct lu_ent *ent)
+lu_shadow_parse_user_entry(const gchar *line, size_t len,
+			   struct lu_ent *ent)
 {
 	ent->type = lu_user;
 	lu_ent_clear_all(ent);
-	return parse_generic(line, format_shadow, G_N_ELEMENTS(format_shadow),
-			     ent);
+	return parse_generic(line, len, format_shadow,
+			     G_N_ELEMENTS(format_shadow), ent);
 }
 
 /* Parse an entry from /etc/shadow into an ent structure, using the attribute
  * names we know. */
 static gboolean
-lu_shadow_parse_group_entry(const gchar * line, struct lu_ent *ent)
+lu_shadow_parse_group_entry(const gchar *line, size_t len,
+			    struct lu_ent *ent)
 {
 	ent->type = lu_group;
 	lu_ent_clear_all(ent);
-	return parse_generic(line, format_gshadow,
+	return parse_generic(line, len, format_gshadow,
 			     G_N_ELEMENTS(format_gshadow), ent);
 }
 
-typedef gboolean(*parse_fn) (const gchar * line, struct lu_ent * ent);
+typedef gboolean(*parse_fn) (const gchar *line, size_t len,
+			     struct lu_ent *ent);
 
 /* Look up an entry in the named file, using the string stored in "name" as
  * a key, looking for it in the field'th field, using the given parsing
@@ -693,7 +1528,7 @@ generic_lookup(struct lu_module *module, const char *file_suffix,
 {
 	gboolean ret;
 	int fd = -1;
-	char *line, *filename;
+	char *line;
 
 	g_assert(module != NULL);
 	g_assert(name != NULL);
@@ -701,34 +1536,117 @@ generic_lookup(struct lu_module *module, const char *file_suffix,
 	g_assert(field > 0);
 	g_assert(ent != NULL);
 
-	filename = module_filename(module, file_suffix);
-
 	/* Open the file. */
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		g_free(filename);
+	fd = open_for_reading(module, file_suffix, error);
+	if (fd == -1)
 		return FALSE;
-	}
-	g_free(filename);
 
 	/* Search for the entry in this file. */
-	line = lu_util_line_get_matchingx(fd, name, field, error);
+	line = indexed_line_get_matching(module, file_suffix, fd, name, field,
+					 error);
 	if (line == NULL) {
 		close(fd);
 		return FALSE;
 	}
 
 	/* If we found data, parse it and then free the data. */
-	ret = parser(line, ent);
+	ret = parser(line, strlen(line), ent);
 	g_free(line);
 	close(fd);
 
 	return ret;
 }
 
+/* Look up entries with keys in KEYS, strings, in the FIELD'th field in the
+ * named file, using a single scan of the file, using the given parsing
+ * function to load the results into entities.  Like generic_lookup(), only
+ * the first matching entry of each key is used.
+ * Return the entities, or NULL on error. */
+static GPtrArray *
+generic_lookup_many(struct lu_module *module, const char *file_suffix,
+		    GValueArray *keys, int field, parse_fn parser,
+		    struct lu_error **error)
+{
+	struct file_lines lines;
+	GHashTable *wanted;
+	GPtrArray *ret;
+	GString *buf;
+	const char *line;
+	size_t i, len;
+
+	g_assert(module != NULL);
+	g_assert(keys != NULL);
+	g_assert(parser != NULL);
+	g_assert(field > 0);
+
+	if (!file_lines_open(&lines, module, file_suffix, error))
+		return NULL;
+
+	wanted = g_hash_table_new(g_str_hash, g_str_equal);
+	for (i = 0; i < keys->n_values; i++) {
+		const char *key;
+
+		key = g_value_get_string(g_value_array_get_nth(keys, i));
+		if (key != NULL)
+			g_hash_table_insert(wanted, (char *)key, NULL);
+	}
+	ret = g_ptr_array_new();
+	buf = g_string_new(NULL);
+	while (g_hash_table_size(wanted) != 0
+	       && file_lines_next(&lines, &line, &len)) {
+		struct lu_ent *ent;
+		const char *p;
+		size_t field_len;
+
+		if (len == 0)
+			continue;
+		p = line_span_field(line, len, field, &field_len);
+		if (p == NULL)
+			continue;
+		g_string_truncate(buf, 0);
+		g_string_append_len(buf, p, field_len);
+		if (!g_hash_table_remove(wanted, buf->str))
+			continue;
+		ent = lu_ent_new_typed_in(module->lu_context->ent_arena,
+					  lu_invalid);
+		if (parser(line, len, ent) != FALSE)
+			g_ptr_array_add(ret, ent);
+		else
+			lu_ent_free(ent);
+	}
+	g_string_free(buf, TRUE);
+	g_hash_table_destroy(wanted);
+	file_lines_close(&lines);
+
+	return ret;
+}
+
+/* Convert IDS, set by lu_value_init_set_id(), to strings as they are stored
+ * in files. */
+static GValueArray *
+ids_to_keys(GValueArray *ids)
+{
+	GValueArray *keys;
+	GValue value;
+	size_t i;
+
+	keys = g_value_array_new(ids->n_values);
+	memset(&value, 0, sizeof(value));
+	g_value_init(&value, G_TYPE_STRING);
+	for (i = 0; i < ids->n_values; i++) {
+		id_t id;
+
+		id = lu_value_get_id(g_value_array_get_nth(ids, i));
+		if (id == LU_VALUE_INVALID_ID)
+			continue;
+		g_value_take_string(&value,
+				    g_strdup_printf("%jd", (intmax_t)id));
+		g_value_array_append(keys, &value);
+	}
+	g_value_unset(&value);
+	return keys;
+}
+
 /* Look up a user by name in /etc/passwd. */
 static gboolean
 lu_files_user_lookup_name(struct lu_module *module,
@@ -850,6 +1768,161 @@ lu_shadow_group_lookup_id(struct lu_module *module, gid_t gid,
 	return ret;
 }
 
+/* Look up users by name in /etc/passwd. */
+static GPtrArray *
+lu_files_users_lookup_names(struct lu_module *module, GValueArray *names,
+			    struct lu_error **error)
+{
+	return generic_lookup_many(module, suffix_passwd, names, 1,
+				   lu_files_parse_user_entry, error);
+}
+
+/* Look up users by ID in /etc/passwd. */
+static GPtrArray *
+lu_files_users_lookup_ids(struct lu_module *module, GValueArray *ids,
+			  struct lu_error **error)
+{
+	GValueArray *keys;
+	GPtrArray *ret;
+
+	keys = ids_to_keys(ids);
+	ret = generic_lookup_many(module, suffix_passwd, keys, 3,
+				  lu_files_parse_user_entry, error);
+	g_value_array_free(keys);
+	return ret;
+}
+
+/* Look up groups by name in /etc/group. */
+static GPtrArray *
+lu_files_groups_lookup_names(struct lu_module *module, GValueArray *names,
+			     struct lu_error **error)
+{
+	return generic_lookup_many(module, suffix_group, names, 1,
+				   lu_files_parse_group_entry, error);
+}
+
+/* Look up groups by ID in /etc/group. */
+static GPtrArray *
+lu_files_groups_lookup_ids(struct lu_module *module, GValueArray *ids,
+			   struct lu_error **error)
+{
+	GValueArray *keys;
+	GPtrArray *ret;
+
+	keys = ids_to_keys(ids);
+	ret = generic_lookup_many(module, suffix_group, keys, 3,
+				  lu_files_parse_group_entry, error);
+	g_value_array_free(keys);
+	return ret;
+}
+
+/* Look up users by name in /etc/shadow. */
+static GPtrArray *
+lu_shadow_users_lookup_names(struct lu_module *module, GValueArray *names,
+			     struct lu_error **error)
+{
+	return generic_lookup_many(module, suffix_shadow, names, 1,
+				   lu_shadow_parse_user_entry, error);
+}
+
+/* Look up entries of IDS in the shadow file FILE_SUFFIX, using PARSER.  The
+ * shadow files don't contain IDs, so convert them to names using
+ * FILES_PARSER on FILES_SUFFIX first, like lu_shadow_user_lookup_id(), and
+ * add them back to the results, using ID_ATTR. */
+static GPtrArray *
+shadow_lookup_ids(struct lu_module *module, GValueArray *ids,
+		  const char *files_suffix, parse_fn files_parser,
+		  const char *file_suffix, parse_fn parser,
+		  const char *name_attr, const char *id_attr,
+		  struct lu_error **error)
+{
+	GValueArray *keys, *names;
+	GPtrArray *ents, *ret;
+	GHashTable *name_ids;
+	GValue value;
+	size_t i;
+
+	keys = ids_to_keys(ids);
+	ents = generic_lookup_many(module, files_suffix, keys, 3, files_parser,
+				   error);
+	g_value_array_free(keys);
+	if (ents == NULL)
+		return NULL;
+
+	name_ids = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					 NULL);
+	names = g_value_array_new(ents->len);
+	memset(&value, 0, sizeof(value));
+	g_value_init(&value, G_TYPE_STRING);
+	for (i = 0; i < ents->len; i++) {
+		struct lu_ent *ent;
+		char *name;
+
+		ent = g_ptr_array_index(ents, i);
+		name = lu_ent_get_first_value_strdup(ent, name_attr);
+		if (name != NULL) {
+			g_value_set_string(&value, name);
+			g_value_array_append(names, &value);
+			g_hash_table_insert(name_ids, name,
+					    GSIZE_TO_POINTER
+					    (lu_ent_get_first_id(ent,
+								 id_attr)));
+		}
+		lu_ent_free(ent);
+	}
+	g_value_unset(&value);
+	g_ptr_array_free(ents, TRUE);
+
+	ret = generic_lookup_many(module, file_suffix, names, 1, parser,
+				  error);
+	g_value_array_free(names);
+	for (i = 0; ret != NULL && i < ret->len; i++) {
+		struct lu_ent *ent;
+		const char *name;
+		gpointer id;
+
+		ent = g_ptr_array_index(ret, i);
+		name = lu_ent_get_first_string(ent, name_attr);
+		if (name != NULL
+		    && g_hash_table_lookup_extended(name_ids, name, NULL, &id))
+			lu_ent_set_id_current(ent, id_attr,
+					      GPOINTER_TO_SIZE(id));
+	}
+	g_hash_table_destroy(name_ids);
+	return ret;
+}
+
+/* Look up users by ID in /etc/shadow. */
+static GPtrArray *
+lu_shadow_users_lookup_ids(struct lu_module *module, GValueArray *ids,
+			   struct lu_error **error)
+{
+	return shadow_lookup_ids(module, ids, suffix_passwd,
+				 lu_files_parse_user_entry, suffix_shadow,
+				 lu_shadow_parse_user_entry, LU_USERNAME,
+				 LU_UIDNUMBER, error);
+}
+
+/* Look up groups by name in /etc/gshadow. */
+static GPtrArray *
+lu_shadow_groups_lookup_names(struct lu_module *module, GValueArray *names,
+			      struct lu_error **error)
+{
+	return generic_lookup_many(module, suffix_gshadow, names, 1,
+				   lu_shadow_parse_group_entry, error);
+}
+
+/* Look up groups by ID in /etc/gshadow. */
+static GPtrArray *
+lu_shadow_groups_lookup_ids(struct lu_module *module, GValueArray *ids,
+			    struct lu_error **error)
+{
+	return shadow_lookup_ids(module, ids, suffix_group,
+				 lu_files_parse_group_entry, suffix_gshadow,
+				 lu_shadow_parse_group_entry, LU_GROUPNAME,
+				 LU_GIDNUMBER, error);
+}
+
 static gboolean
 lu_files_permits_duplicate_ids(struct lu_module *module)
 {
@@ -1074,31 +2147,141 @@ err:
 	return NULL;
 }
 
-/* Does NUL-terminated CONTENTS contains an entry with the same entry name used
-   in LINE? */
+/* Does the LEN bytes long LINE contain an entry named by the NAME_LEN bytes at
+   NAME? */
 static gboolean
-entry_name_conflicts(const char *contents, const char *line)
+line_has_name(const char *line, size_t len, const char *name, size_t name_len)
 {
-	size_t prefix_len;
-	char *prefix, *fragment;
-	gboolean res;
+	return len > name_len && line[name_len] == ':'
+		&& memcmp(line, name, name_len) == 0;
+}
 
-	if (strchr(line, ':') != NULL)
-		prefix_len = strchr(line, ':') - line + 1;
-	else if (strchr(line, '\n') != NULL)
-		prefix_len = strchr(line, '\n') - line + 1;
-	else
-		prefix_len = strlen(line);
-	if (strncmp(contents, line, prefix_len) == 0)
-		return TRUE;
+/* Make the current contents of E available in LINES.
+ * Return TRUE on success. */
+static gboolean
+editing_map(struct editing *e, struct file_lines *lines,
+	    struct lu_error **error)
+{
+	struct stat st;
 
-	prefix = g_strndup(line, prefix_len);
-	fragment = g_strconcat("\n", prefix, NULL);
-	g_free(prefix);
+	if (fstat(e->new_fd, &st) == -1) {
+		lu_error_new(error, lu_error_stat, _("couldn't stat `%s': %s"),
+			     e->new_filename, strerror(errno));
+		return FALSE;
+	}
+	if (!file_lines_map(lines, e->new_fd, st.st_size)) {
+		lu_error_new(error, lu_error_read,
+			     _("couldn't read from `%s': %s"), e->new_filename,
+			     strerror(errno));
+		return FALSE;
+	}
+	return TRUE;
+}
 
-	res = strstr(contents, fragment) != NULL;
-	g_free(fragment);
-	return res;
+/* Write all data in the COUNT buffers in IOV to FD, starting at OFFSET.
+ * Return TRUE on success, FALSE with errno set on error.  IOV is modified. */
+static gboolean
+write_vectors(int fd, off_t offset, struct iovec *iov, size_t count)
+{
+	if (lseek(fd, offset, SEEK_SET) == -1)
+		return FALSE;
+	while (count > 0) {
+		ssize_t res;
+
+		res = writev(fd, iov, MIN(count, IOV_MAX));
+		if (res == -1) {
+			if (errno == EINTR)
+				continue;
+			return FALSE;
+		}
+		if (res == 0) {
+			errno = ENOSPC;
+			return FALSE;
+		}
+		while (count > 0 && (size_t)res >= iov->iov_len) {
+			res -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (char *)iov->iov_base + res;
+			iov->iov_len -= res;
+		}
+	}
+	return TRUE;
+}
+
+/* A change of a file: the bytes from START to END are replaced by LEN bytes
+   at DATA. */
+struct file_edit {
+	size_t start, end;
+	const char *data;
+	size_t len;
+};
+
+/* Apply COUNT EDITS, sorted by START and not overlapping, to E, the current
+ * contents of which are in LINES.
+ * Only the part of the file starting at the first edit is written, with a
+ * single gather write of the replacement data and the unchanged spans in
+ * between; the part after the last edit is left alone if it does not move.
+ * Return TRUE on success. */
+static gboolean
+editing_apply(struct editing *e, const struct file_lines *lines,
+	      const struct file_edit *edits, size_t count,
+	      struct lu_error **error)
+{
+	struct iovec *iov;
+	char *kept;
+	size_t i, iov_count, first, kept_end, new_size;
+	gboolean ret = FALSE;
+
+	g_assert(count > 0);
+	first = edits[0].start;
+	new_size = lines->size;
+	for (i = 0; i < count; i++)
+		new_size = new_size - (edits[i].end - edits[i].start)
+			+ edits[i].len;
+	kept_end = new_size == lines->size ? edits[count - 1].end : lines->size;
+
+	/* The unchanged spans live in the file which is being overwritten,
+	   so they must be copied out first. */
+	kept = g_malloc(kept_end - first);
+	memcpy(kept, lines->contents + first, kept_end - first);
+
+	iov = g_new(struct iovec, 2 * count);
+	iov_count = 0;
+	for (i = 0; i < count; i++) {
+		size_t next;
+
+		if (edits[i].len != 0) {
+			iov[iov_count].iov_base = (char *)edits[i].data;
+			iov[iov_count].iov_len = edits[i].len;
+			iov_count++;
+		}
+		next = i + 1 < count ? edits[i + 1].start : kept_end;
+		if (next > edits[i].end) {
+			iov[iov_count].iov_base = kept + (edits[i].end - first);
+			iov[iov_count].iov_len = next - edits[i].end;
+			iov_count++;
+		}
+	}
+
+	e->modifying = TRUE;
+	if (!write_vectors(e->new_fd, first, iov, iov_count)
+	    || (new_size < lines->size
+		&& ftruncate(e->new_fd, new_size) != 0)) {
+		lu_error_new(error, lu_error_write,
+			     _("couldn't write to `%s': %s"), e->new_filename,
+			     strerror(errno));
+		goto err;
+	}
+	ret = TRUE;
+	/* Fall through */
+
+err:
+	g_free(iov);
+	g_free(kept);
+	return ret;
 }
 
 /* Add an entity to a given flat file, using a given formatting functin to
@@ -1109,10 +2292,11 @@ generic_add(struct lu_module *module, const char *file_suffix,
 	    struct lu_ent *ent, struct lu_error **error)
 {
 	struct editing *e;
-	char *line, *contents;
-	ssize_t r;
-	struct stat st;
-	off_t offset;
+	struct file_lines lines;
+	struct iovec iov[2];
+	const char *line;
+	char *new_line;
+	size_t len, name_len, iov_count;
 	gboolean ret = FALSE;
 
 	g_assert(module != NULL);
@@ -1120,77 +2304,58 @@ generic_add(struct lu_module *module, const char *file_suffix,
 	g_assert(format_count > 0);
 	g_assert(ent != NULL);
 
-	line = format_generic(ent, formats, format_count, error);
-	if (line == NULL)
+	new_line = format_generic(ent, formats, format_count, error);
+	if (new_line == NULL)
 		goto err;
 
 	e = editing_open(module, file_suffix, error);
 	if (e == NULL)
-		goto err_line;
+		goto err_new_line;
 
-	/* Read the file's size. */
-	if (fstat(e->new_fd, &st) == -1) {
-		lu_error_new(error, lu_error_stat,
-			     _("couldn't stat `%s': %s"), e->new_filename,
-			     strerror(errno));
+	/* We still have the lock, so the file is not going to get funky on
+	 * us. */
+	if (!editing_map(e, &lines, error))
 		goto err_editing;
-	}
-
-	/* Read the entire file in.  There's some room for improvement here,
-	 * but at least we still have the lock, so it's not going to get
-	 * funky on us. */
-	contents = g_malloc0(st.st_size + 1);
-	if (read(e->new_fd, contents, st.st_size) != st.st_size) {
-		lu_error_new(error, lu_error_read,
-			     _("couldn't read from `%s': %s"),
-			     e->new_filename, strerror(errno));
-		goto err_contents;
-	}
 
 	/* Sanity-check to make sure that the entity isn't already listed in
 	   the file. */
-	if (entry_name_conflicts(contents, line)) {
-		lu_error_new(error, lu_error_generic,
-			     _("entry already present in file"));
-		goto err_contents;
-	}
-	/* Hooray, we can add this entry at the end of the file. */
-	offset = lseek(e->new_fd, 0, SEEK_END);
-	if (offset == -1) {
-		lu_error_new(error, lu_error_write,
-			     _("couldn't write to `%s': %s"),
-			     e->new_filename, strerror(errno));
-		goto err_contents;
-	}
-	/* If the last byte in the file isn't a newline, add one, and silently
-	 * curse people who use text editors (which shall remain unnamed) which
-	 * allow saving of the file without a final line terminator. */
-	if ((st.st_size > 0) && (contents[st.st_size - 1] != '\n')) {
-		if (write(e->new_fd, "\n", 1) != 1) {
-			lu_error_new(error, lu_error_write,
-				     _("couldn't write to `%s': %s"),
-				     e->new_filename, strerror(errno));
-			goto err_contents;
+	name_len = strcspn(new_line, ":\n");
+	while (file_lines_next(&lines, &line, &len)) {
+		if (line_has_name(line, len, new_line, name_len)) {
+			lu_error_new(error, lu_error_generic,
+				     _("entry already present in file"));
+			goto err_lines;
 		}
 	}
-	/* Attempt to write the entire line to the end. */
-	r = write(e->new_fd, line, strlen(line));
-	if ((size_t)r != strlen(line)) {
-		/* Oh, come on! */
+	/* Hooray, we can add this entry at the end of the file.  If the last
+	 * byte in the file isn't a newline, add one, and silently curse people
+	 * who use text editors (which shall remain unnamed) which allow saving
+	 * of the file without a final line terminator. */
+	iov_count = 0;
+	if (lines.size > 0 && lines.contents[lines.size - 1] != '\n') {
+		iov[iov_count].iov_base = (char *)"\n";
+		iov[iov_count].iov_len = 1;
+		iov_count++;
+	}
+	iov[iov_count].iov_base = new_line;
+	iov[iov_count].iov_len = strlen(new_line);
+	iov_count++;
+	e->modifying = TRUE;
+	if (!write_vectors(e->new_fd, lines.size, iov, iov_count)) {
 		lu_error_new(error, lu_error_write,
 			     _("couldn't write to `%s': %s"), e->new_filename,
 			     strerror(errno));
-		goto err_contents;
+		goto err_lines;
 	}
 	ret = TRUE;
 	/* Fall through */
 
-err_contents:
-	g_free(contents);
+err_lines:
+	file_lines_close(&lines);
 err_editing:
 	ret = editing_close(e, ret, ret, error); /* Commit/rollback happens here. */
-err_line:
-	g_free(line);
+err_new_line:
+	g_free(new_line);
 err:
 	return ret;
 }
@@ -1299,12 +2464,13 @@ generic_mod(struct lu_module *module, const char *file_suffix,
 	    struct lu_ent *ent, struct lu_error **error)
 {
 	struct editing *e;
-	char *new_line, *contents, *line, *rest;
-	char *current_name, *fragment;
+	struct file_lines lines;
+	struct file_edit edit;
+	const char *line;
+	char *new_line, *current_name;
 	const char *name_attribute;
-	gboolean ret = FALSE;
-	struct stat st;
-	size_t len;
+	gboolean ret = FALSE, found, renaming;
+	size_t len, name_len, new_name_len;
 
 	g_assert(module != NULL);
 	g_assert(formats != NULL);
@@ -1337,71 +2503,45 @@ generic_mod(struct lu_module *module, const char *file_suffix,
 	if (e == NULL)
 		goto err_new_line;
 
-	if (fstat(e->new_fd, &st) == -1) {
-		lu_error_new(error, lu_error_stat, _("couldn't stat `%s': %s"),
-			     e->new_filename, strerror(errno));
+	if (!editing_map(e, &lines, error))
 		goto err_editing;
-	}
 
-	contents = g_malloc(st.st_size + 1 + strlen(new_line));
-	if (read(e->new_fd, contents, st.st_size) != st.st_size) {
-		lu_error_new(error, lu_error_read,
-			     _("couldn't read from `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_contents;
-	}
-	contents[st.st_size] = '\0';
-
-	fragment = g_strconcat("\n", current_name, ":", (const gchar *)NULL);
-	len = strlen(current_name);
-	if (strncmp(contents, current_name, len) == 0 && contents[len] == ':')
-		line = contents;
-	else {
-		line = strstr(contents, fragment);
-		if (line != NULL)
-			line++;
-	}
-	g_free(fragment);
-
-	if ((strncmp(new_line, current_name, len) != 0 || new_line[len] != ':')
-	    && entry_name_conflicts(contents, new_line)) {
-		lu_error_new(error, lu_error_generic,
-			     _("entry with conflicting name already present "
-			       "in file"));
-		goto err_contents;
+	/* Find the entry, and any other entry using the new name, in a single
+	 * pass. */
+	name_len = strlen(current_name);
+	new_name_len = strcspn(new_line, ":\n");
+	renaming = new_name_len != name_len
+		|| memcmp(new_line, current_name, name_len) != 0;
+	found = FALSE;
+	while (file_lines_next(&lines, &line, &len)) {
+		if (renaming && line_has_name(line, len, new_line,
+					      new_name_len)) {
+			lu_error_new(error, lu_error_generic,
+				     _("entry with conflicting name already "
+				       "present in file"));
+			goto err_lines;
+		}
+		if (!found && line_has_name(line, len, current_name,
+					    name_len)) {
+			edit.start = line - lines.contents;
+			edit.end = lines.next - lines.contents;
+			found = TRUE;
+			if (!renaming)
+				break;
+		}
 	}
-
-	if (line == NULL) {
+	if (!found) {
 		lu_error_new(error, lu_error_search, NULL);
-		goto err_contents;
+		goto err_lines;
 	}
 
-	rest = strchr(line, '\n');
-	if (rest != NULL)
-		rest++;
-	else
-		rest = strchr(line, '\0');
-	memmove(line + strlen(new_line), rest,
-		contents + st.st_size + 1 - rest);
-	memcpy(line, new_line, strlen(new_line));
-	if (lseek(e->new_fd, line - contents, SEEK_SET) == -1) {
-		lu_error_new(error, lu_error_write, NULL);
-		goto err_contents;
-	}
-	len = strlen(line);
-	if ((size_t)write(e->new_fd, line, len) != len) {
-		lu_error_new(error, lu_error_write, NULL);
-		goto err_contents;
-	}
-	if (ftruncate(e->new_fd, (line - contents) + len) != 0) {
-		lu_error_new(error, lu_error_write, NULL);
-		goto err_contents;
-	}
-	ret = TRUE;
+	edit.data = new_line;
+	edit.len = strlen(new_line);
+	ret = editing_apply(e, &lines, &edit, 1, error);
 	/* Fall through */
 
-err_contents:
-	g_free(contents);
+err_lines:
+	file_lines_close(&lines);
 err_editing:
 	ret = editing_close(e, ret, ret, error); /* Commit/rollback happens here. */
 err_new_line:
@@ -1467,123 +2607,65 @@ generic_del(struct lu_module *module, const char *file_suffix,
 	    struct lu_ent *ent, struct lu_error **error)
 {
 	struct editing *e;
+	struct file_lines lines;
+	GArray *edits;
+	const char *line;
 	char *name;
-	char *contents;
-	char *fragment2;
-	struct stat st;
-	size_t len;
+	size_t len, name_len;
         gboolean commit = FALSE, ret = FALSE;
-	gboolean found;
 
 	/* Get the entity's current name. */
 	if (ent->type == lu_user)
 		name = lu_ent_get_first_value_strdup_current(ent, LU_USERNAME);
-	else if (ent->type == lu_group)
-		name = lu_ent_get_first_value_strdup_current(ent, LU_GROUPNAME);
-	else
-		g_assert_not_reached();
-	g_assert(name != NULL);
-
-	g_assert(module != NULL);
-	g_assert(ent != NULL);
-
-	e = editing_open(module, file_suffix, error);
-	if (e == NULL)
-		goto err_name;
-
-	/* Determine the file's size. */
-	if (fstat(e->new_fd, &st) == -1) {
-		lu_error_new(error, lu_error_stat,
-			     _("couldn't stat `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_editing;
-	}
-
-	/* Allocate space to hold the file and read it all in. */
-	contents = g_malloc(st.st_size + 1);
-	if (read(e->new_fd, contents, st.st_size) != st.st_size) {
-		lu_error_new(error, lu_error_read,
-			     _("couldn't read from `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_contents;
-	}
-	contents[st.st_size] = '\0';
-
-	/* Generate a pattern for a beginning of a non-first line */
-	fragment2 = g_strconcat("\n", name, ":", (const gchar *)NULL);
-
-	/* Remove all occurrences of this entry from the file. */
-	len = strlen(name);
-	do {
-		char *tmp;
-
-		found = FALSE;
-		/* If the data is on the first line of the file, we remove the
-		 * first line. */
-		if (strncmp(contents, name, len) == 0
-			&& contents[len] == ':') {
-			char *p;
+	else if (ent->type == lu_group)
+		name = lu_ent_get_first_value_strdup_current(ent, LU_GROUPNAME);
+	else
+		g_assert_not_reached();
+	g_assert(name != NULL);
 
-			p = strchr(contents, '\n');
-			if (p != NULL)
-				memmove(contents, p + 1, strlen(p + 1) + 1);
-			else
-				strcpy(contents, "");
-			found = TRUE;
-		} else
-		/* If the data occurs elsewhere, cover it up. */
-		if ((tmp = strstr(contents, fragment2)) != NULL) {
-			char *p;
+	g_assert(module != NULL);
+	g_assert(ent != NULL);
 
-			p = strchr(tmp + 1, '\n');
-			if (p != NULL)
-				memmove(tmp + 1, p + 1, strlen (p + 1) + 1);
-			else
-				strcpy(tmp + 1, "");
-			found = TRUE;
-		}
-	} while(found);
+	e = editing_open(module, file_suffix, error);
+	if (e == NULL)
+		goto err_name;
 
-	g_free(fragment2);
+	if (!editing_map(e, &lines, error))
+		goto err_editing;
 
-	/* If the resulting memory chunk is the same size as the file, then
-	 * nothing's changed. */
-	len = strlen(contents);
-	if ((off_t)len == st.st_size) {
-		ret = TRUE;
-		goto err_contents;
-	}
+	/* Find all occurrences of this entry in the file. */
+	edits = g_array_new(FALSE, FALSE, sizeof(struct file_edit));
+	name_len = strlen(name);
+	while (file_lines_next(&lines, &line, &len)) {
+		struct file_edit edit;
 
-	/* Otherwise we need to write the new data to the file.  Jump back to
-	 * the beginning of the file. */
-	if (lseek(e->new_fd, 0, SEEK_SET) == -1) {
-		lu_error_new(error, lu_error_write,
-			     _("couldn't write to `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_contents;
+		if (!line_has_name(line, len, name, name_len))
+			continue;
+		edit.start = line - lines.contents;
+		edit.end = lines.next - lines.contents;
+		edit.data = NULL;
+		edit.len = 0;
+		g_array_append_val(edits, edit);
 	}
 
-	/* Write the new contents out. */
-	if ((size_t)write(e->new_fd, contents, len) != len) {
-		lu_error_new(error, lu_error_write,
-			     _("couldn't write to `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_contents;
+	/* If there are no occurrences, then nothing's changed. */
+	if (edits->len == 0) {
+		ret = TRUE;
+		goto err_edits;
 	}
 
-	/* Truncate the file to the new (certainly shorter) length. */
-	if (ftruncate(e->new_fd, len) == -1) {
-		lu_error_new(error, lu_error_generic,
-			     _("couldn't write to `%s': %s"), e->new_filename,
-			     strerror(errno));
-		goto err_contents;
-	}
+	/* Otherwise cover them up. */
+	if (!editing_apply(e, &lines, &g_array_index(edits, struct file_edit,
+						     0),
+			   edits->len, error))
+		goto err_edits;
 	commit = TRUE;
 	ret = TRUE;
 	/* Fall through */
 
- err_contents:
-	g_free(contents);
+err_edits:
+	g_array_free(edits, TRUE);
+	file_lines_close(&lines);
 err_editing:
 	/* Commit/rollback happens here. */
 	ret = editing_close(e, commit, ret, error);
@@ -1634,17 +2716,17 @@ lock_process(char *cryptedPassword, enum lock_op op, struct lu_ent *ent,
 
 	switch (op) {
 	case LO_LOCK:
-		ret = ent->cache->cache(ent->cache, cryptedPassword);
+		ret = lu_ent_cache_string(ent, cryptedPassword);
 		if (ret[0] != '!') {
 			cryptedPassword = g_strconcat("!!", ret, NULL);
-			ret = ent->cache->cache(ent->cache, cryptedPassword);
+			ret = lu_ent_cache_string(ent, cryptedPassword);
 			g_free(cryptedPassword);
 		}
 		break;
 	case LO_UNLOCK:
 		for (ret = cryptedPassword; ret[0] == '!'; ret++)
 			;
-		ret = ent->cache->cache(ent->cache, ret);
+		ret = lu_ent_cache_string(ent, ret);
 		break;
 	case LO_UNLOCK_NONEMPTY:
 		for (ret = cryptedPassword; ret[0] == '!'; ret++)
@@ -1653,7 +2735,7 @@ lock_process(char *cryptedPassword, enum lock_op op, struct lu_ent *ent,
 			lu_error_new(error, lu_error_unlock_empty, NULL);
 			return NULL;
 		}
-		ret = ent->cache->cache(ent->cache, ret);
+		ret = lu_ent_cache_string(ent, ret);
 		break;
 
 	default:
@@ -1708,6 +2790,7 @@ generic_lock(struct lu_module *module, const char *file_suffix, int field,
 		goto err_editing;
 
 	/* Make the change. */
+	e->modifying = TRUE;
 	if (lu_util_field_write(e->new_fd, name, field, new_value, error)
 	    == FALSE)
 		goto err_editing;
@@ -1728,7 +2811,6 @@ static gboolean
 generic_is_locked(struct lu_module *module, const char *file_suffix,
 		  int field, struct lu_ent *ent, struct lu_error **error)
 {
-	char *filename;
 	char *value, *name = NULL;
 	int fd;
 	gboolean ret = FALSE;
@@ -1744,16 +2826,10 @@ generic_is_locked(struct lu_module *module, const char *file_suffix,
 	g_assert(module != NULL);
 	g_assert(ent != NULL);
 
-	filename = module_filename(module, file_suffix);
-
 	/* Open the file. */
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		goto err_filename;
-	}
+	fd = open_for_reading(module, file_suffix, error);
+	if (fd == -1)
+		goto err_name;
 
 	/* Read the value. */
 	value = lu_util_field_read(fd, name, field, error);
@@ -1767,8 +2843,7 @@ generic_is_locked(struct lu_module *module, const char *file_suffix,
 
 err_fd:
 	close(fd);
-err_filename:
-	g_free(filename);
+err_name:
 	g_free(name);
 	return ret;
 }
@@ -1986,6 +3061,7 @@ generic_setpass(struct lu_module *module, const char *file_suffix, int field,
 	}
 
 	/* Now write our changes to the file. */
+	e->modifying = TRUE;
 	ret = lu_util_field_write(e->new_fd, name, field, password, error);
 	/* Fall through */
 
@@ -2069,71 +3145,39 @@ static GValueArray *
 lu_files_enumerate(struct lu_module *module, const char *file_suffix,
 		   const char *pattern, struct lu_error **error)
 {
-	int fd;
+	struct file_lines lines;
 	GValueArray *ret;
-	GValue value;
-	char *buf;
-	char *filename;
-	FILE *fp;
+	GString *buf;
+	const char *line;
+	size_t len;
 
 	g_assert(module != NULL);
 	pattern = pattern ?: "*";
 
-	filename = module_filename(module, file_suffix);
-
 	/* Open the file. */
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		g_free(filename);
-		return NULL;
-	}
-
-	/* Wrap the file for stdio operations. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		close(fd);
-		g_free(filename);
+	if (!file_lines_open(&lines, module, file_suffix, error))
 		return NULL;
-	}
 
 	/* Create a new array to hold values. */
 	ret = g_value_array_new(0);
-	memset(&value, 0, sizeof(value));
-	g_value_init(&value, G_TYPE_STRING);
+	buf = g_string_new(NULL);
 	/* Read each line, */
-	while ((buf = line_read(fp)) != NULL) {
-		char *p;
+	while (file_lines_next(&lines, &line, &len)) {
+		const char *p;
 
-		if (strlen(buf) == 1) {
-			g_free(buf);
+		if (len == 0)
 			continue;
-		}
 		/* require that each non-empty line has meaningful data in it */
-		p = strchr(buf, ':');
-		if (p != NULL) {
-			/* snip off the parts we don't care about, */
-			*p = '\0';
-			if (buf[0] != '+' && buf[0] != '-' &&
-			    fnmatch(pattern, buf, 0) == 0) {
-				/* add add it to the list we're returning. */
-				g_value_set_string(&value, buf);
-				g_value_array_append(ret, &value);
-				g_value_reset(&value);
-			}
-		}
-		g_free(buf);
+		p = memchr(line, ':', len);
+		if (p != NULL && line[0] != '+' && line[0] != '-'
+		    && span_matches_pattern(line, p - line, pattern, buf))
+			/* and add it to the list we're returning. */
+			value_array_append_span(ret, line, p - line);
 	}
 
 	/* Clean up. */
-	g_value_unset(&value);
-	fclose(fp);
-	g_free(filename);
+	g_string_free(buf, TRUE);
+	file_lines_close(&lines);
 
 	return ret;
 }
@@ -2153,180 +3197,251 @@ lu_files_groups_enumerate(struct lu_module *module, const char *pattern,
 	return lu_files_enumerate(module, suffix_group, pattern, error);
 }
 
-/* Get a list of all of the users who are in a given group. */
-static GValueArray *
-lu_files_users_enumerate_by_group(struct lu_module *module,
-				  const char *group, gid_t gid,
-				  struct lu_error **error)
+/* Return a copy of LEN bytes at STRING stored in INDEX.  BUF is used as
+ * temporary storage. */
+static const char *
+membership_intern(struct membership_index *index, const char *string,
+		  size_t len, GString *buf)
 {
-	int fd;
-	GValueArray *ret;
-	GValue value;
-	char *buf, grp[CHUNK_SIZE];
-	char *pwdfilename, *grpfilename, *p, *q;
-	FILE *fp;
-
-	g_assert(module != NULL);
-	g_assert(group != NULL);
-
-	/* Generate the names of the two files we'll be looking at. */
-	pwdfilename = module_filename(module, suffix_passwd);
-	grpfilename = module_filename(module, suffix_group);
+	g_string_truncate(buf, 0);
+	g_string_append_len(buf, string, len);
+	return g_string_chunk_insert_const(index->strings, buf->str);
+}
 
-	/* Open the passwd file. */
-	fd = open(pwdfilename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), pwdfilename,
-			     strerror(errno));
-		g_free(pwdfilename);
-		g_free(grpfilename);
-		return NULL;
-	}
+/* Append VALUE to the list for KEY in TABLE, creating the list if necessary.
+ * VALUE may be NULL to only create the list. */
+static void
+membership_table_append(GHashTable *table, const char *key, const char *value)
+{
+	GPtrArray *list;
 
-	/* Wrap the descriptor in a stdio FILE. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), pwdfilename,
-			     strerror(errno));
-		close(fd);
-		g_free(pwdfilename);
-		g_free(grpfilename);
-		return NULL;
+	list = g_hash_table_lookup(table, key);
+	if (list == NULL) {
+		list = g_ptr_array_new();
+		g_hash_table_insert(table, (char *)key, list);
 	}
+	if (value != NULL)
+		g_ptr_array_add(list, (char *)value);
+}
 
-	/* Create an array to store values we're going to return. */
-	ret = g_value_array_new(0);
-	memset(&value, 0, sizeof(value));
-	g_value_init(&value, G_TYPE_STRING);
-	snprintf(grp, sizeof(grp), "%jd", (intmax_t)gid);
+/* Fill INDEX from PASSWD and GROUP.  The results must match what the
+ * original line-by-line scans in lu_files_users_enumerate_by_group() and
+ * lu_files_groups_enumerate_by_user() would find. */
+static void
+membership_index_build(struct membership_index *index,
+		       struct file_lines *passwd, struct file_lines *group)
+{
+	GHashTable *user_gids, *primary_users;
+	GHashTableIter iter;
+	gpointer key, value;
+	GString *buf;
+	const char *line;
+	size_t len;
 
-	/* Iterate over each line. */
-	while ((buf = line_read(fp)) != NULL) {
-		if (strlen(buf) == 1 || buf[0] == '-' || buf[0] == '+') {
-			g_free(buf);
+	index->strings = g_string_chunk_new(CHUNK_SIZE);
+	index->users_by_gid = g_hash_table_new_full
+		(g_str_hash, g_str_equal, NULL,
+		 (GDestroyNotify)g_ptr_array_unref);
+	index->members_by_group = g_hash_table_new_full
+		(g_str_hash, g_str_equal, NULL,
+		 (GDestroyNotify)g_ptr_array_unref);
+	index->groups_by_user = g_hash_table_new_full
+		(g_str_hash, g_str_equal, NULL,
+		 (GDestroyNotify)g_ptr_array_unref);
+	buf = g_string_new(NULL);
+
+	/* User name -> GID of the first entry with that name. */
+	user_gids = g_hash_table_new(g_str_hash, g_str_equal);
+	while (file_lines_next(passwd, &line, &len)) {
+		const char *name, *gid;
+		size_t name_len, gid_len;
+
+		if (len == 0 || line[0] == '-' || line[0] == '+')
 			continue;
+		gid = line_span_field(line, len, 4, &gid_len);
+		if (gid == NULL)
+			continue;
+		name = line_span_field(line, len, 1, &name_len);
+		name = membership_intern(index, name, name_len, buf);
+		gid = membership_intern(index, gid, gid_len, buf);
+		membership_table_append(index->users_by_gid, gid, name);
+		if (!g_hash_table_lookup_extended(user_gids, name, NULL, NULL))
+			g_hash_table_insert(user_gids, (char *)name,
+					    (char *)gid);
+	}
+	/* GID -> users using it as their primary GID. */
+	primary_users = g_hash_table_new_full(g_str_hash, g_str_equal, NULL,
+					      (GDestroyNotify)g_ptr_array_unref);
+	g_hash_table_iter_init(&iter, user_gids);
+	while (g_hash_table_iter_next(&iter, &key, &value))
+		membership_table_append(primary_users, value, key);
+	g_hash_table_destroy(user_gids);
+
+	while (file_lines_next(group, &line, &len)) {
+		const char *name, *gid, *p, *end, *members_end;
+		size_t name_len, gid_len, members_len;
+		GPtrArray *users;
+		gboolean first;
+
+		if (len == 0 || line[0] == '+' || line[0] == '-')
+			continue;
+		name = line_span_field(line, len, 1, &name_len);
+		name = membership_intern(index, name, name_len, buf);
+		/* Only the first entry of a group lists its members. */
+		first = g_hash_table_lookup(index->members_by_group, name)
+			== NULL;
+		if (first)
+			membership_table_append(index->members_by_group, name,
+						NULL);
+		gid = line_span_field(line, len, 3, &gid_len);
+		p = line_span_field(line, len, 4, &members_len);
+		if (gid == NULL || p == NULL)
+			continue;
+		/* The group is a primary group of these users, */
+		gid = membership_intern(index, gid, gid_len, buf);
+		users = g_hash_table_lookup(primary_users, gid);
+		if (users != NULL) {
+			size_t i;
+
+			for (i = 0; i < users->len; i++)
+				membership_table_append
+					(index->groups_by_user,
+					 g_ptr_array_index(users, i), name);
 		}
-		/* Find the end of the first field. */
-		p = strchr(buf, ':');
-		q = NULL;
-		/* If the field has an end, find the end of the second field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* If the second field has an end, find the end of the third. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* If the third has an end, find the fourth. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			q = p;
-			p = strchr(p, ':');
-		}
-		/* If we haven't run out of fields by now, we can match. */
-		if (q != NULL) {
-			/* Terminate the fourth field. */
-			if (p != NULL) {
-				*p = '\0';
-			}
-			/* If it matches the gid, add this user's name to the
-			 * list. */
-			if (strcmp(q, grp) == 0) {
-				g_value_set_string(&value, buf);
-				g_value_array_append(ret, &value);
-				g_value_reset(&value);
+		/* and a supplementary group of its members.  Note that the
+		 * lookup by user considers the rest of the line, not only the
+		 * fourth field. */
+		members_end = p + members_len;
+		end = line + len;
+		while (p < end) {
+			const char *comma, *member;
+
+			comma = memchr(p, ',', end - p);
+			if (comma == NULL)
+				comma = end;
+			if (comma > p) {
+				member = membership_intern(index, p, comma - p,
+							   buf);
+				if (first && comma <= members_end)
+					membership_table_append
+						(index->members_by_group, name,
+						 member);
+				else if (first && p < members_end)
+					/* The last member ends the field. */
+					membership_table_append
+						(index->members_by_group, name,
+						 membership_intern
+						 (index, p, members_end - p,
+						  buf));
+				membership_table_append(index->groups_by_user,
+							member, name);
 			}
+			p = comma + 1;
 		}
-		g_free(buf);
 	}
-	/* Close the file. */
-	g_value_unset(&value);
-	fclose(fp);
+	g_hash_table_destroy(primary_users);
+	g_string_free(buf, TRUE);
+}
 
-	/* Open the group file. */
-	fd = open(grpfilename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), grpfilename,
-			     strerror(errno));
-		g_free(pwdfilename);
-		g_free(grpfilename);
-		g_value_array_free(ret);
-		return NULL;
-	}
+/* Get the membership index of MODULE, building it if it is missing or out of
+ * date.
+ * Return the index, or NULL on error. */
+static struct membership_index *
+membership_index_get(struct lu_module *module, struct lu_error **error)
+{
+	struct files_module_context *ctx;
+	struct membership_index *index;
+	struct file_lines passwd, group;
+	struct stat passwd_st, group_st;
+	int passwd_fd, group_fd;
 
-	/* Wrap the group file in an stdio file. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), grpfilename,
-			     strerror(errno));
-		close(fd);
-		g_free(pwdfilename);
-		g_free(grpfilename);
-		g_value_array_free(ret);
+	ctx = module->module_context;
+	index = NULL;
+
+	passwd_fd = open_for_reading(module, suffix_passwd, error);
+	if (passwd_fd == -1)
 		return NULL;
-	}
+	group_fd = open_for_reading(module, suffix_group, error);
+	if (group_fd == -1)
+		goto out_passwd_fd;
+	if (fstat(passwd_fd, &passwd_st) == -1
+	    || fstat(group_fd, &group_st) == -1) {
+		lu_error_new(error, lu_error_stat, NULL);
+		goto out_group_fd;
+	}
+
+	if (ctx->membership.strings != NULL
+	    && file_stamp_matches(&ctx->membership.passwd, &passwd_st)
+	    && file_stamp_matches(&ctx->membership.group, &group_st)) {
+		index = &ctx->membership;
+		goto out_group_fd;
+	}
+
+	membership_index_clear(&ctx->membership);
+	if (!file_lines_map(&passwd, passwd_fd, passwd_st.st_size)) {
+		lu_error_new(error, lu_error_read, NULL);
+		goto out_group_fd;
+	}
+	if (!file_lines_map(&group, group_fd, group_st.st_size)) {
+		lu_error_new(error, lu_error_read, NULL);
+		file_lines_close(&passwd);
+		goto out_group_fd;
+	}
+	membership_index_build(&ctx->membership, &passwd, &group);
+	file_stamp_set(&ctx->membership.passwd, &passwd_st);
+	file_stamp_set(&ctx->membership.group, &group_st);
+	file_lines_close(&group);
+	file_lines_close(&passwd);
+	index = &ctx->membership;
+
+out_group_fd:
+	close(group_fd);
+out_passwd_fd:
+	close(passwd_fd);
+	return index;
+}
+
+/* Append the strings in the list for KEY in TABLE, if any, to VALUES. */
+static void
+membership_table_copy(GValueArray *values, GHashTable *table, const char *key)
+{
+	GPtrArray *list;
+	size_t i;
 
-	/* Iterate over all of these lines as well. */
-	while ((buf = line_read(fp)) != NULL) {
-		if (strlen(buf) == 1 || buf[0] == '+' || buf[0] == '-') {
-			g_free(buf);
-			continue;
-		}
-		/* Terminate at the end of the first field, and find the end of
-		 * the second field. */
-		p = strchr(buf, ':');
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* If the first field matches, continue. */
-		if (strcmp(buf, group) == 0) {
-			/* Find the end of the third field. */
-			if (p != NULL) {
-				*p = '\0';
-				p++;
-				p = strchr(p, ':');
-			}
-			/* Find the beginning of the fourth field. */
-			if (p != NULL) {
-				*p = '\0';
-				p++;
-				/* Iterate through all of the pieces of
-				 * the field. */
-				while ((q = strsep(&p, ",\n")) != NULL) {
-					/* Add this name. */
-					if (strlen(q) > 0) {
-						g_value_init(&value,
-							     G_TYPE_STRING);
-						g_value_set_string(&value, q);
-						g_value_array_append(ret,
-								     &value);
-						g_value_unset(&value);
-					}
-				}
-			}
-			g_free(buf);
-			break;
-		}
-		g_free(buf);
+	list = g_hash_table_lookup(table, key);
+	if (list == NULL)
+		return;
+	for (i = 0; i < list->len; i++) {
+		const char *s;
+
+		s = g_ptr_array_index(list, i);
+		value_array_append_span(values, s, strlen(s));
 	}
+}
 
-	/* Clean up. */
-	fclose(fp);
+/* Get a list of all of the users who are in a given group. */
+static GValueArray *
+lu_files_users_enumerate_by_group(struct lu_module *module,
+				  const char *group, gid_t gid,
+				  struct lu_error **error)
+{
+	struct membership_index *index;
+	GValueArray *ret;
+	char grp[CHUNK_SIZE];
 
-	g_free(pwdfilename);
-	g_free(grpfilename);
+	g_assert(module != NULL);
+	g_assert(group != NULL);
+
+	index = membership_index_get(module, error);
+	if (index == NULL)
+		return NULL;
 
+	/* Users with the group as their primary group come first, followed by
+	 * members listed in the group file. */
+	ret = g_value_array_new(0);
+	snprintf(grp, sizeof(grp), "%jd", (intmax_t)gid);
+	membership_table_copy(ret, index->users_by_gid, grp);
+	membership_table_copy(ret, index->members_by_group, group);
 	return ret;
 }
 
@@ -2337,169 +3452,20 @@ lu_files_groups_enumerate_by_user(struct lu_module *module,
 				  uid_t uid,
 				  struct lu_error **error)
 {
-	int fd;
+	struct membership_index *index;
 	GValueArray *ret;
-	GValue value;
-	char *buf;
-	char *key, *pwdfilename, *grpfilename, *p, *q;
-	FILE *fp;
 
 	(void)uid;
 	g_assert(module != NULL);
 	g_assert(user != NULL);
 
-	/* Generate the names of files we'll be looking at. */
-	pwdfilename = module_filename(module, suffix_passwd);
-	grpfilename = module_filename(module, suffix_group);
-
-	/* Open the first file. */
-	fd = open(pwdfilename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), pwdfilename,
-			     strerror(errno));
-		goto err_pwdfilename;
-	}
-
-	/* Open it so that we can use stdio. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), pwdfilename,
-			     strerror(errno));
-		close(fd);
-		goto err_pwdfilename;
-	}
+	index = membership_index_get(module, error);
+	if (index == NULL)
+		return NULL;
 
-	/* Initialize the list of values we'll return. */
 	ret = g_value_array_new(0);
-	memset(&value, 0, sizeof(value));
-	g_value_init(&value, G_TYPE_STRING);
-
-	/* Iterate through all of the lines in the file. */
-	key = NULL;
-	while ((buf = line_read(fp)) != NULL) {
-		if (strlen(buf) == 1 || buf[0] == '+' || buf[0] == '-') {
-			g_free(buf);
-			continue;
-		}
-		/* Find the end of the first field. */
-		p = strchr(buf, ':');
-		/* Find the end of the second field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* Find the end of the third field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* Find the the fourth field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			q = strchr(p, ':');
-			/* If it matches, save the gid. */
-			if (strcmp(buf, user) == 0) {
-				if (q) {
-					*q = '\0';
-				}
-				key = g_strdup(p);
-				g_free(buf);
-				break;
-			}
-		}
-		g_free(buf);
-	}
-	fclose(fp);
-
-	/* Open the groups file. */
-	fd = open(grpfilename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), grpfilename,
-			     strerror(errno));
-		goto err_key;
-	}
-
-	/* Open it so that we can use stdio. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), grpfilename,
-			     strerror(errno));
-		close(fd);
-		goto err_key;
-	}
-
-	/* Iterate through all of the lines in the file. */
-	while ((buf = line_read(fp)) != NULL) {
-		if (strlen(buf) == 1 || buf[0] == '+' || buf[0] == '-') {
-			g_free(buf);
-			continue;
-		}
-		/* Find the end of the first field. */
-		p = strchr(buf, ':');
-		/* Find the end of the second field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			p = strchr(p, ':');
-		}
-		/* Find the end of the third field. */
-		if (p != NULL) {
-			*p = '\0';
-			p++;
-			q = strchr(p, ':');
-			if (q && key) {
-				/* Terminate the third field. */
-				*q = '\0';
-				if (strcmp(p, key) == 0) {
-					/* Add the name of the group because its
-					 * gid is the user's primary. */
-					g_value_set_string(&value, buf);
-					g_value_array_append(ret, &value);
-					g_value_reset(&value);
-				}
-			}
-			p = q;
-		}
-		/* Find the beginning of the third field. */
-		if (p != NULL) {
-			p++;
-			/* Break out each piece of the fourth field. */
-			while ((q = strsep(&p, ",\n")) != NULL) {
-				if (strlen(q) > 0) {
-					if (strcmp(q, user) == 0) {
-						g_value_set_string(&value, buf);
-						g_value_array_append(ret,
-								     &value);
-						g_value_reset(&value);
-					}
-				}
-			}
-		}
-		g_free(buf);
-	}
-	g_free(key);
-	g_value_unset(&value);
-
-	fclose(fp);
-	g_free(pwdfilename);
-	g_free(grpfilename);
-
+	membership_table_copy(ret, index->groups_by_user, user);
 	return ret;
-
- err_key:
-	g_free(key);
-	g_value_array_free(ret);
- err_pwdfilename:
-	g_free(pwdfilename);
-	g_free(grpfilename);
-	return NULL;
 }
 
 /* Enumerate all of the accounts listed in the given file, using the
@@ -2509,70 +3475,46 @@ lu_files_enumerate_full(struct lu_module *module, const char *file_suffix,
 			parse_fn parser, const char *pattern,
 			struct lu_error **error)
 {
-	int fd;
-	GPtrArray *ret = NULL;
-	char *buf;
-	char *key, *filename;
-	FILE *fp;
+	struct file_lines lines;
+	GPtrArray *ret;
+	GString *buf;
+	const char *line;
+	size_t len;
 
 	g_assert(module != NULL);
 	pattern = pattern ?: "*";
 
-	filename = module_filename(module, file_suffix);
-
 	/* Open the file. */
-	fd = open(filename, O_RDONLY);
-	if (fd == -1) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		goto err_filename;
-	}
-
-	/* Wrap the file up in stdio. */
-	fp = fdopen(fd, "r");
-	if (fp == NULL) {
-		lu_error_new(error, lu_error_open,
-			     _("couldn't open `%s': %s"), filename,
-			     strerror(errno));
-		close(fd);
-		goto err_filename;
-	}
+	if (!file_lines_open(&lines, module, file_suffix, error))
+		return NULL;
 
 	/* Allocate an array to hold results. */
 	ret = g_ptr_array_new();
-	while ((buf = line_read(fp)) != NULL) {
+	buf = g_string_new(NULL);
+	while (file_lines_next(&lines, &line, &len)) {
 		struct lu_ent *ent;
+		const char *p;
 
-		if (strlen(buf) == 1 || buf[0] == '+' || buf[0] == '-') {
-			g_free(buf);
+		if (len == 0 || line[0] == '+' || line[0] == '-')
 			continue;
-		}
-		ent = lu_ent_new();
-		/* Snip the line off at the right place. */
-		key = strchr(buf, '\n');
-		if (key != NULL) {
-			*key = '\0';
-		}
-		if (strchr(buf, ':')) {
-			key = g_strndup(buf, strchr(buf, ':') - buf);
-		} else {
-			key = g_strdup(buf);
-		}
+		p = memchr(line, ':', len);
+		if (p == NULL)
+			p = line + len;
 		/* If the account name matches the pattern, parse it and add
 		 * it to the list. */
-		if (fnmatch(pattern, key, 0) == 0 && parser(buf, ent) != FALSE)
+		if (!span_matches_pattern(line, p - line, pattern, buf))
+			continue;
+		ent = lu_ent_new_typed_in(module->lu_context->ent_arena,
+					  lu_invalid);
+		if (parser(line, len, ent) != FALSE)
 			g_ptr_array_add(ret, ent);
 		else
 			lu_ent_free(ent);
-		g_free(buf);
-		g_free(key);
 	}
 
-	fclose(fp);
+	g_string_free(buf, TRUE);
+	file_lines_close(&lines);
 
- err_filename:
-	g_free(filename);
 	return ret;
 }
 
@@ -2663,6 +3605,60 @@ lu_shadow_groups_enumerate_full(struct lu_module *module,
 				       error);
 }
 
+/* Mix the status of FILE_SUFFIX in MODULE into *STAMP. */
+static gboolean
+file_entity_stamp(struct lu_module *module, const char *file_suffix,
+		  guint64 *stamp)
+{
+	struct stat st;
+	char *filename;
+	guint64 values[7], h;
+	size_t i;
+
+	filename = reading_filename(module, file_suffix);
+	if (stat(filename, &st) != 0) {
+		g_free(filename);
+		return FALSE;
+	}
+	g_free(filename);
+	values[0] = st.st_dev;
+	values[1] = st.st_ino;
+	values[2] = st.st_size;
+	values[3] = st.st_mtim.tv_sec;
+	values[4] = st.st_mtim.tv_nsec;
+	values[5] = st.st_ctim.tv_sec;
+	values[6] = st.st_ctim.tv_nsec;
+	/* FNV-1a over the 64-bit values. */
+	h = *stamp ^ G_GUINT64_CONSTANT(14695981039346656037);
+	for (i = 0; i < G_N_ELEMENTS(values); i++) {
+		h ^= values[i];
+		h *= G_GUINT64_CONSTANT(1099511628211);
+	}
+	*stamp = h;
+	return TRUE;
+}
+
+static gboolean
+lu_files_entity_stamp(struct lu_module *module, enum lu_entity_type type,
+		      guint64 *stamp)
+{
+	return file_entity_stamp(module, type == lu_user ? suffix_passwd
+				 : suffix_group, stamp);
+}
+
+/* Lookups by ID in the shadow module use the passwd and group files as
+ * well. */
+static gboolean
+lu_shadow_entity_stamp(struct lu_module *module, enum lu_entity_type type,
+		       guint64 *stamp)
+{
+	if (type == lu_user)
+		return file_entity_stamp(module, suffix_passwd, stamp)
+			&& file_entity_stamp(module, suffix_shadow, stamp);
+	return file_entity_stamp(module, suffix_group, stamp)
+		&& file_entity_stamp(module, suffix_gshadow, stamp);
+}
+
 static gboolean
 lu_files_shadow_valid_module_combination(struct lu_module *module,
 					 GValueArray *names,
@@ -2744,6 +3740,8 @@ close_module(struct lu_module *module)
 {
 	g_return_val_if_fail(module != NULL, FALSE);
 
+	lu_files_transaction_abort(module);
+	files_module_context_free(module->module_context);
 	module->scache->free(module->scache);
 	memset(module, 0, sizeof(struct lu_module));
 	g_free(module);
@@ -2777,6 +3775,8 @@ libuser_files_init(struct lu_context *context,
 	ret->version = LU_MODULE_VERSION;
 	ret->scache = lu_string_cache_new(TRUE);
 	ret->name = ret->scache->cache(ret->scache, LU_MODULE_NAME_FILES);
+	ret->module_context = files_module_context_new();
+	format_tables_init();
 
 	/* Set the method pointers. */
 	ret->valid_module_combination
@@ -2819,6 +3819,15 @@ libuser_files_init(struct lu_context *context,
 	ret->groups_enumerate_by_user = lu_files_groups_enumerate_by_user;
 	ret->groups_enumerate_full = lu_files_groups_enumerate_full;
 
+	ret->transaction_begin = lu_files_transaction_begin;
+	ret->transaction_commit = lu_files_transaction_commit;
+	ret->transaction_abort = lu_files_transaction_abort;
+	ret->entity_stamp = lu_files_entity_stamp;
+	ret->users_lookup_names = lu_files_users_lookup_names;
+	ret->users_lookup_ids = lu_files_users_lookup_ids;
+	ret->groups_lookup_names = lu_files_groups_lookup_names;
+	ret->groups_lookup_ids = lu_files_groups_lookup_ids;
+
 	ret->close = close_module;
 
 	/* Done. */
@@ -2868,6 +3877,8 @@ libuser_shadow_init(struct lu_context *context,
 	ret->version = LU_MODULE_VERSION;
 	ret->scache = lu_string_cache_new(TRUE);
 	ret->name = ret->scache->cache(ret->scache, LU_MODULE_NAME_SHADOW);
+	ret->module_context = files_module_context_new();
+	format_tables_init();
 
 	/* Set the method pointers. */
 	ret->valid_module_combination
@@ -2910,6 +3921,15 @@ libuser_shadow_init(struct lu_context *context,
 	ret->groups_enumerate_by_user = lu_shadow_groups_enumerate_by_user;
 	ret->groups_enumerate_full = lu_shadow_groups_enumerate_full;
 
+	ret->transaction_begin = lu_files_transaction_begin;
+	ret->transaction_commit = lu_files_transaction_commit;
+	ret->transaction_abort = lu_files_transaction_abort;
+	ret->entity_stamp = lu_shadow_entity_stamp;
+	ret->users_lookup_names = lu_shadow_users_lookup_names;
+	ret->users_lookup_ids = lu_shadow_users_lookup_ids;
+	ret->groups_lookup_names = lu_shadow_groups_lookup_names;
+	ret->groups_lookup_ids = lu_shadow_groups_lookup_ids;
+
 	ret->close = close_module;
 
 	/* Done. */
@@ -45,6 +45,13 @@
 #define SHADOWACCOUNT "shadowAccount"
 #define INETORGPERSON "inetOrgPerson"
 #define DISTINGUISHED_NAME "dn"
+#define LOOKUP_CHUNK 100	/* Keys looked up in a single search */
+#define POOL_MAX_IDLE 300	/* Seconds after which pooled connections are
+				   not reused */
+#define POOL_CHECK_TIMEOUT 5	/* Seconds to wait when checking a pooled
+				   connection */
+#define DN_CACHE_MAX 1024	/* Distinguished names remembered by a
+				   context */
 
 LU_MODULE_INIT(libuser_ldap_init)
 
@@ -135,6 +142,12 @@ static const char *const lu_ldap_group_attributes[] = {
 	NULL
 };
 
+/* Groups of a user remembered by lu_ldap_groups_enumerate_by_user(). */
+struct membership {
+	GValueArray *groups;	/* Group names */
+	gint64 expires;		/* Monotonic time */
+};
+
 struct lu_ldap_context {
 	struct lu_context *global_context;	/* The library context. */
 	struct lu_module *module;		/* The module's structure. */
@@ -143,7 +156,24 @@ struct lu_ldap_context {
 	char *sasl_mechanism;	/* What sasl mechanism to use. */
 	const char *user_branch, *group_branch;	/* Cached config values */
 	char **mapped_user_attributes, **mapped_group_attributes;
-	LDAP *ldap;				/* The connection. */
+	char *pool_key;		/* Identifies compatible pooled connections */
+	unsigned pool_size;	/* Maximum idle connections to keep */
+	unsigned page_size;	/* Entries requested at once, 0 = all */
+	LDAP *ldap;		/* The connection, NULL until first used. */
+	GHashTable *dn_cache;	/* "attr=value,base" -> dn of the entry */
+	/* The entry found by the last ID lookup, for a name lookup which
+	   continues it. */
+	LDAPMessage *chain_messages, *chain_entry;
+	const char *const *chain_attributes;
+	char *chain_name;
+	GHashTable *memberships;	/* User name -> struct membership */
+	gint64 membership_ttl;	/* Microseconds, 0 to not remember */
+	gboolean member_dn;	/* Look for the user's DN in "member" */
+	gboolean in_transaction;
+	GQueue *writes;		/* struct write_op sent, oldest first */
+	unsigned write_window;	/* Maximum length of writes */
+	GString *write_errors;	/* Failed writes not reported yet, or NULL */
+	struct replica *replica;	/* Local copy of entries, or NULL */
 };
 
 static void
@@ -152,6 +182,16 @@ close_server(LDAP *ldap)
 	ldap_unbind_ext(ldap, NULL, NULL);
 }
 
+static void
+membership_free(gpointer data)
+{
+	struct membership *membership;
+
+	membership = data;
+	g_value_array_free(membership->groups);
+	g_free(membership);
+}
+
 /* Get the name of the user running the calling application. */
 static char *
 getuser(void)
@@ -433,6 +473,213 @@ bind_server(struct lu_ldap_context *context, struct lu_error **error)
 	return ldap;
 }
 
+/* Bound connections not used by any module, shared by all contexts in the
+ * process, so that contexts created for short tasks don't have to connect
+ * and bind again.  The keys are hashes of the connection parameters, see
+ * connection_key_new(); the values are GQueues of struct pool_connection. */
+struct pool_connection {
+	LDAP *ldap;
+	gint64 released;	/* Monotonic time when added to the pool */
+};
+
+G_LOCK_DEFINE_STATIC(pool);
+static GHashTable *pool; /* = NULL */
+static pid_t pool_pid;
+
+static void
+pool_queue_free(gpointer data)
+{
+	GQueue *queue;
+	struct pool_connection *conn;
+
+	queue = data;
+	while ((conn = g_queue_pop_head(queue)) != NULL) {
+		close_server(conn->ldap);
+		g_free(conn);
+	}
+	g_queue_free(queue);
+}
+
+/* Free KEY and the queue in VALUE without unbinding its connections, for
+ * g_hash_table_foreach_steal(). */
+static gboolean
+pool_queue_forget(gpointer key, gpointer value, gpointer user_data)
+{
+	GQueue *queue;
+
+	(void)user_data;
+	queue = value;
+	while (!g_queue_is_empty(queue))
+		g_free(g_queue_pop_head(queue));
+	g_queue_free(queue);
+	g_free(key);
+	return TRUE;
+}
+
+/* Drop connections inherited from a parent process.  Unbinding them would
+ * close the parent's sessions, so only our bookkeeping is freed and the LDAP
+ * handles themselves are left alone.  The caller must hold the pool lock. */
+static void
+pool_forget_inherited(void)
+{
+	if (pool != NULL && pool_pid != getpid()) {
+		g_hash_table_foreach_steal(pool, pool_queue_forget, NULL);
+		g_hash_table_destroy(pool);
+		pool = NULL;
+	}
+}
+
+/* Append FIELD to KEY so that it can't be confused with other fields. */
+static void
+pool_key_append(GString *key, const char *field)
+{
+	field = field ?: "";
+	g_string_append_printf(key, "%zu:%s", strlen(field), field);
+}
+
+/* Return a key identifying connections bound using the parameters in
+ * CONTEXT, for g_free().  It is hashed so that the pool does not keep
+ * passwords after the contexts using them are gone.  Unless WITH_PASSWORD,
+ * the password is left out, so that the key can be stored in files. */
+static char *
+connection_key_new(struct lu_ldap_context *context, gboolean with_password)
+{
+	GString *key;
+	char *ret;
+	size_t i;
+
+	key = g_string_new(NULL);
+	for (i = 0; i < G_N_ELEMENTS(context->prompts); i++) {
+		if (i == LU_LDAP_PASSWORD && !with_password)
+			continue;
+		pool_key_append(key, context->prompts[i].value);
+	}
+	pool_key_append(key, context->user_branch);
+	pool_key_append(key, context->sasl_mechanism);
+	g_string_append_printf(key, "%d%d", context->bind_simple,
+			       context->bind_sasl);
+	ret = g_compute_checksum_for_string(G_CHECKSUM_SHA256, key->str,
+					    key->len);
+	memset(key->str, 0, key->len);
+	g_string_free(key, TRUE);
+	return ret;
+}
+
+/* Check that LDAP is still usable, by reading the root DSE. */
+static gboolean
+connection_alive(LDAP *ldap)
+{
+	static char *noattrs[] = { (char *)LDAP_NO_ATTRS, NULL };
+
+	struct timeval timeout;
+	LDAPMessage *messages = NULL;
+	int err;
+
+	timeout.tv_sec = POOL_CHECK_TIMEOUT;
+	timeout.tv_usec = 0;
+	err = ldap_search_ext_s(ldap, "", LDAP_SCOPE_BASE, "(objectClass=*)",
+				noattrs, FALSE, NULL, NULL, &timeout, 1,
+				&messages);
+	if (messages != NULL)
+		ldap_msgfree(messages);
+	/* Result codes sent by the server (e.g. insufficient access) are
+	   fine; errors detected by the client library are negative. */
+	return err >= 0;
+}
+
+/* Take a live connection for CONTEXT from the pool, or return NULL.  The
+ * candidates are checked without holding the pool lock, so that a slow server
+ * does not hold up other threads. */
+static LDAP *
+pool_take(struct lu_ldap_context *context)
+{
+	for (;;) {
+		struct pool_connection *conn;
+		GQueue *queue;
+		LDAP *ldap;
+		gint64 released;
+
+		G_LOCK(pool);
+		pool_forget_inherited();
+		queue = pool != NULL
+			? g_hash_table_lookup(pool, context->pool_key) : NULL;
+		/* The most recently used connections are the most likely to
+		   be still open. */
+		conn = queue != NULL ? g_queue_pop_tail(queue) : NULL;
+		G_UNLOCK(pool);
+		if (conn == NULL)
+			return NULL;
+		ldap = conn->ldap;
+		released = conn->released;
+		g_free(conn);
+		if (g_get_monotonic_time() - released
+		    <= POOL_MAX_IDLE * G_USEC_PER_SEC && connection_alive(ldap))
+			return ldap;
+		close_server(ldap);
+	}
+}
+
+/* Return LDAP, used by CONTEXT, to the pool, or close it if the pool is
+ * full. */
+static void
+pool_release(struct lu_ldap_context *context, LDAP *ldap)
+{
+	struct pool_connection *conn;
+	GQueue *queue;
+
+	G_LOCK(pool);
+	pool_forget_inherited();
+	if (pool == NULL) {
+		pool = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					     pool_queue_free);
+		pool_pid = getpid();
+	}
+	queue = g_hash_table_lookup(pool, context->pool_key);
+	if (queue == NULL) {
+		queue = g_queue_new();
+		g_hash_table_insert(pool, g_strdup(context->pool_key), queue);
+	}
+	if (queue->length < context->pool_size) {
+		conn = g_malloc(sizeof(*conn));
+		conn->ldap = ldap;
+		conn->released = g_get_monotonic_time();
+		g_queue_push_tail(queue, conn);
+		ldap = NULL;
+	}
+	G_UNLOCK(pool);
+	if (ldap != NULL)
+		close_server(ldap);
+}
+
+/* Make sure CONTEXT has a bound connection, reusing one from the pool if
+ * possible.  The connection is only created when first needed, so that
+ * contexts which don't use this module never connect to the server.
+ * Return TRUE on success. */
+static gboolean
+lu_ldap_connect(struct lu_ldap_context *context, struct lu_error **error)
+{
+	if (context->ldap != NULL)
+		return TRUE;
+	if (context->pool_size != 0)
+		context->ldap = pool_take(context);
+	if (context->ldap == NULL)
+		context->ldap = bind_server(context, error);
+	return context->ldap != NULL;
+}
+
+static void write_drain(struct lu_ldap_context *ctx);
+
+/* Like lu_ldap_connect(), but also wait for writes sent earlier, so that
+ * the next request sees their results.  Return TRUE on success. */
+static gboolean
+lu_ldap_connection(struct lu_ldap_context *context, struct lu_error **error)
+{
+	if (!lu_ldap_connect(context, error))
+		return FALSE;
+	write_drain(context);
+	return TRUE;
+}
+
 /* Map an attribute name from an internal name to an LDAP atribute name. */
 static const char *
 map_to_ldap(struct lu_string_cache *cache, const char *libuser_attribute)
@@ -494,7 +741,9 @@ lu_ldap_ent_to_dn(struct lu_module *module, const char *namingAttr,
 	g_assert(name != NULL);
 	g_assert(strlen(name) > 0);
 
-	/* Search for the right object using the entity's current name. */
+	/* Search for the right object using the entity's current name.
+	 * Writes still waiting for results are not waited for here;
+	 * write_submit() orders operations on the same entry. */
 	base = lu_ldap_base(module, branch);
 	ctx = module->module_context;
 
@@ -512,63 +761,1218 @@ lu_ldap_ent_to_dn(struct lu_module *module, const char *namingAttr,
 			if (tmp)
 				ldap_memfree(tmp);
 		}
-		ldap_msgfree(messages);
+		ldap_msgfree(messages);
+	}
+	g_free(filter);
+
+	if (ret == NULL) {
+		/* Guess at the DN using the branch and the base. */
+		tmp = g_strdup_printf("%s=%s,%s", mapped_naming_attr, name,
+				      base);
+		ret = module->scache->cache(module->scache, tmp);
+		g_free(tmp);
+	}
+
+	return ret;
+}
+
+/* Add VAL, a value of ATTR read from the directory, to the current values of
+ * ATTR in ENT. */
+static void
+add_current_string(struct lu_ent *ent, const char *attr, const char *val)
+{
+	GValue value;
+	struct lu_error *error;
+
+#ifdef DEBUG
+	g_print("Got `%s' = `%s'.\n", attr, val);
+#endif
+	memset(&value, 0, sizeof(value));
+	error = NULL;
+	if (lu_value_init_set_attr_from_string(&value, attr, val, &error)
+	    == FALSE) {
+		g_assert(error != NULL);
+		g_warning("%s", lu_strerror(error));
+		lu_error_free(&error);
+	} else {
+		lu_ent_add_current(ent, attr, &value);
+		g_value_unset(&value);
+	}
+}
+
+/* Read ATTRIBUTES, which are MAPPED_ATTRIBUTES in the directory, and the
+ * distinguished name of ENTRY into ENT. */
+static void
+lu_ldap_read_entry(struct lu_module *module, LDAPMessage *entry,
+		   const char *const *attributes, char **mapped_attributes,
+		   struct lu_ent *ent)
+{
+	struct lu_ldap_context *ctx;
+	size_t i;
+	char *p;
+
+	ctx = module->module_context;
+	/* Set the distinguished name. */
+	p = ldap_get_dn(ctx->ldap, entry);
+	lu_ent_set_string_current(ent, DISTINGUISHED_NAME, p);
+	ldap_memfree(p);
+
+	/* Read each of the attributes we asked for. */
+	for (i = 0; attributes[i]; i++) {
+		BerValue **values;
+		const char *attr;
+
+		/* Get the values which correspond to this attribute. */
+		attr = attributes[i];
+		values = ldap_get_values_len(ctx->ldap, entry,
+					     mapped_attributes[i]);
+		/* If we got answers, add them. */
+		if (values) {
+			size_t j;
+
+			lu_ent_clear_current(ent, attr);
+			for (j = 0; values[j]; j++) {
+				char *val;
+
+				val = g_strndup(values[j]->bv_val,
+						values[j]->bv_len);
+				add_current_string(ent, attr, val);
+				g_free(val);
+			}
+			ldap_value_free_len(values);
+		}
+	}
+}
+
+/* Called by lu_ldap_search() for each ENTRY found, with DATA.  Return FALSE
+ * to stop the search. */
+typedef gboolean (entry_fn)(struct lu_module *module, LDAPMessage *entry,
+			    gpointer data);
+
+/* Search the subtree of BASE for entries matching FILTER, reading
+ * ATTRIBUTES, and call FN with DATA for each entry as soon as it arrives.
+ * The results are requested in pages using the simple paged results control,
+ * so that large directories are not cut off by the server's size limit, and
+ * the client never holds more than one page.
+ * Return an LDAP result code. */
+static int
+lu_ldap_search(struct lu_module *module, const char *base, const char *filter,
+	       char **attributes, entry_fn *fn, gpointer data)
+{
+	struct lu_ldap_context *ctx;
+	struct berval cookie;
+	gboolean more, stopped;
+	int err;
+
+	ctx = module->module_context;
+	cookie.bv_val = NULL;
+	cookie.bv_len = 0;
+	stopped = FALSE;
+	do {
+		LDAPControl *page, *controls[2];
+		gboolean done;
+		int msgid;
+
+		more = FALSE;
+		page = NULL;
+		if (ctx->page_size != 0) {
+			/* Not critical, servers without paging return all
+			   entries at once. */
+			err = ldap_create_page_control(ctx->ldap,
+						       ctx->page_size,
+						       &cookie, FALSE, &page);
+			if (err != LDAP_SUCCESS)
+				break;
+		}
+		controls[0] = page;
+		controls[1] = NULL;
+		err = ldap_search_ext(ctx->ldap, base, LDAP_SCOPE_SUBTREE,
+				      filter, attributes, FALSE,
+				      page != NULL ? controls : NULL, NULL,
+				      NULL, LDAP_NO_LIMIT, &msgid);
+		if (page != NULL)
+			ldap_control_free(page);
+		if (err != LDAP_SUCCESS)
+			break;
+
+		done = FALSE;
+		while (!done) {
+			LDAPMessage *message;
+			LDAPControl **result_controls, *response;
+			int rc;
+
+			message = NULL;
+			switch (ldap_result(ctx->ldap, msgid, LDAP_MSG_ONE, NULL,
+					    &message)) {
+			case LDAP_RES_SEARCH_ENTRY:
+				if (!fn(module, message, data)) {
+					ldap_abandon_ext(ctx->ldap, msgid, NULL,
+							 NULL);
+					stopped = TRUE;
+					done = TRUE;
+				}
+				break;
+
+			case LDAP_RES_SEARCH_RESULT:
+				done = TRUE;
+				result_controls = NULL;
+				err = ldap_parse_result(ctx->ldap, message, &rc,
+							NULL, NULL, NULL,
+							&result_controls,
+							FALSE);
+				if (err == LDAP_SUCCESS)
+					err = rc;
+				ber_memfree(cookie.bv_val);
+				cookie.bv_val = NULL;
+				cookie.bv_len = 0;
+				response = err == LDAP_SUCCESS
+					&& result_controls != NULL
+					? ldap_control_find
+					(LDAP_CONTROL_PAGEDRESULTS,
+					 result_controls, NULL)
+					: NULL;
+				if (response != NULL) {
+					ber_int_t estimate;
+
+					/* An empty cookie marks the last
+					   page. */
+					if (ldap_parse_pageresponse_control
+					    (ctx->ldap, response, &estimate,
+					     &cookie) == LDAP_SUCCESS
+					    && cookie.bv_len != 0)
+						more = TRUE;
+				}
+				if (result_controls != NULL)
+					ldap_controls_free(result_controls);
+				break;
+
+			case -1:
+			case 0:
+				done = TRUE;
+				ldap_get_option(ctx->ldap, LDAP_OPT_RESULT_CODE,
+						&err);
+				if (err == LDAP_SUCCESS)
+					err = LDAP_OTHER;
+				break;
+
+			default:
+				/* Ignore search references. */
+				break;
+			}
+			if (message != NULL)
+				ldap_msgfree(message);
+		}
+	} while (more && !stopped);
+	ber_memfree(cookie.bv_val);
+	return err;
+}
+
+/* Return the directory names of ATTRIBUTES, lu_ldap_user_attributes or
+ * lu_ldap_group_attributes. */
+static char **
+mapped_attributes_of(struct lu_ldap_context *ctx,
+		     const char *const *attributes)
+{
+	if (attributes == lu_ldap_user_attributes)
+		return ctx->mapped_user_attributes;
+	g_assert(attributes == lu_ldap_group_attributes);
+	return ctx->mapped_group_attributes;
+}
+
+/* Return the key identifying entries with NAME in NAMING_ATTR under BASE in
+ * the DN cache. */
+static char *
+dn_cache_key(const char *namingAttr, const char *name, const char *base)
+{
+	return g_strconcat(namingAttr, "=", name, ",", base, NULL);
+}
+
+/* Remember that the entry with NAME in NAMING_ATTR under BASE is DN. */
+static void
+dn_cache_store(struct lu_ldap_context *ctx, const char *namingAttr,
+	       const char *name, const char *base, const char *dn)
+{
+	if (g_hash_table_size(ctx->dn_cache) >= DN_CACHE_MAX)
+		g_hash_table_remove_all(ctx->dn_cache);
+	g_hash_table_replace(ctx->dn_cache,
+			     dn_cache_key(namingAttr, name, base),
+			     g_strdup(dn));
+}
+
+/* Forget the entry kept by an ID lookup for a chained name lookup. */
+static void
+chain_forget(struct lu_ldap_context *ctx)
+{
+	if (ctx->chain_messages != NULL) {
+		ldap_msgfree(ctx->chain_messages);
+		ctx->chain_messages = NULL;
+	}
+	ctx->chain_entry = NULL;
+	g_free(ctx->chain_name);
+	ctx->chain_name = NULL;
+}
+
+/* Entries copied to the local replica. */
+#define REPLICA_FILTER \
+	"(|("OBJECTCLASS"="POSIXACCOUNT")("OBJECTCLASS"="POSIXGROUP"))"
+#define REPLICA_HEADER "libuser-ldap-replica 1"
+
+/* An entry in the local replica. */
+struct replica_entry {
+	char *dn;
+	gboolean user, group;	/* posixAccount, posixGroup */
+	gboolean present;	/* Seen in the current refresh */
+	GHashTable *attrs;	/* Attribute -> GPtrArray of string values */
+};
+
+/* A local copy of the users and groups in the directory, kept up to date
+ * using the content synchronization operation (RFC 4533). */
+struct replica {
+	char *path;		/* The file storing the replica */
+	char *key;		/* Identifies the server and bind identity */
+	char **attributes;	/* Attributes requested from the server */
+	GHashTable *entries;	/* entryUUID in hex -> struct replica_entry */
+	GHashTable *index;	/* "u:attr=value" or "g:attr=value" ->
+				   struct replica_entry, NULL if stale */
+	GByteArray *cookie;	/* Synchronization state, NULL if none */
+	gboolean loaded;	/* The file was read */
+	gboolean fresh;		/* Refreshed after the last write */
+	gboolean failed;	/* The server can't synchronize, don't use */
+	gboolean changed;	/* Differs from the file */
+	unsigned readers;	/* Iterations over entries in progress */
+};
+
+/* Hash and compare strings ignoring ASCII case, as LDAP does for the
+ * attribute names and most values the replica is searched by. */
+static guint
+ascii_case_hash(gconstpointer key)
+{
+	const char *p;
+	guint hash;
+
+	hash = 5381;
+	for (p = key; *p != 0; p++)
+		hash = hash * 33 + (guchar)g_ascii_tolower(*p);
+	return hash;
+}
+
+static gboolean
+ascii_case_equal(gconstpointer a, gconstpointer b)
+{
+	return g_ascii_strcasecmp(a, b) == 0;
+}
+
+static void
+free_string_array(gpointer data)
+{
+	g_ptr_array_free(data, TRUE);
+}
+
+static struct replica_entry *
+replica_entry_new(const char *dn)
+{
+	struct replica_entry *entry;
+
+	entry = g_malloc0(sizeof(*entry));
+	entry->dn = g_strdup(dn);
+	entry->attrs = g_hash_table_new_full(ascii_case_hash, ascii_case_equal,
+					     g_free, free_string_array);
+	return entry;
+}
+
+static void
+replica_entry_free(gpointer data)
+{
+	struct replica_entry *entry;
+
+	entry = data;
+	g_free(entry->dn);
+	g_hash_table_destroy(entry->attrs);
+	g_free(entry);
+}
+
+/* Add VALUE, which is taken over, to ATTR of ENTRY. */
+static void
+replica_entry_take_value(struct replica_entry *entry, const char *attr,
+			 char *value)
+{
+	GPtrArray *values;
+
+	values = g_hash_table_lookup(entry->attrs, attr);
+	if (values == NULL) {
+		values = g_ptr_array_new_with_free_func(g_free);
+		g_hash_table_insert(entry->attrs, g_strdup(attr), values);
+	}
+	g_ptr_array_add(values, value);
+	if (g_ascii_strcasecmp(attr, OBJECTCLASS) == 0) {
+		if (g_ascii_strcasecmp(value, POSIXACCOUNT) == 0)
+			entry->user = TRUE;
+		else if (g_ascii_strcasecmp(value, POSIXGROUP) == 0)
+			entry->group = TRUE;
+	}
+}
+
+/* Return TRUE if ENTRY is BASE or below it. */
+static gboolean
+replica_entry_in(const struct replica_entry *entry, const char *base)
+{
+	size_t dn_len, base_len;
+
+	dn_len = strlen(entry->dn);
+	base_len = strlen(base);
+	if (dn_len == base_len)
+		return g_ascii_strcasecmp(entry->dn, base) == 0;
+	return dn_len > base_len && entry->dn[dn_len - base_len - 1] == ','
+		&& g_ascii_strcasecmp(entry->dn + dn_len - base_len, base)
+		   == 0;
+}
+
+/* Return TRUE if some value of ATTR in ENTRY matches PATTERN, which may
+ * contain "*" wildcards. */
+static gboolean
+replica_entry_matches(const struct replica_entry *entry, const char *attr,
+		      const char *pattern)
+{
+	GPtrArray *values;
+	char *folded;
+	gboolean ret;
+	size_t i;
+
+	values = g_hash_table_lookup(entry->attrs, attr);
+	if (values == NULL)
+		return FALSE;
+	if (strchr(pattern, '*') == NULL) {
+		for (i = 0; i < values->len; i++) {
+			if (g_ascii_strcasecmp(g_ptr_array_index(values, i),
+					       pattern) == 0)
+				return TRUE;
+		}
+		return FALSE;
+	}
+	folded = g_ascii_strdown(pattern, -1);
+	ret = FALSE;
+	for (i = 0; !ret && i < values->len; i++) {
+		char *value;
+
+		value = g_ascii_strdown(g_ptr_array_index(values, i), -1);
+		ret = g_pattern_match_simple(folded, value);
+		g_free(value);
+	}
+	g_free(folded);
+	return ret;
+}
+
+/* Read ATTRIBUTES, which are MAPPED_ATTRIBUTES in the directory, and the
+ * distinguished name of replica ENTRY into ENT. */
+static void
+replica_read_entry(const struct replica_entry *entry,
+		   const char *const *attributes, char **mapped_attributes,
+		   struct lu_ent *ent)
+{
+	size_t i;
+
+	lu_ent_set_string_current(ent, DISTINGUISHED_NAME, entry->dn);
+	for (i = 0; attributes[i]; i++) {
+		GPtrArray *values;
+		size_t j;
+
+		values = g_hash_table_lookup(entry->attrs,
+					     mapped_attributes[i]);
+		if (values == NULL)
+			continue;
+		lu_ent_clear_current(ent, attributes[i]);
+		for (j = 0; j < values->len; j++)
+			add_current_string(ent, attributes[i],
+					   g_ptr_array_index(values, j));
+	}
+}
+
+/* Forget all entries and the synchronization state of REPLICA. */
+static void
+replica_clear(struct replica *replica)
+{
+	g_hash_table_remove_all(replica->entries);
+	if (replica->index != NULL) {
+		g_hash_table_destroy(replica->index);
+		replica->index = NULL;
+	}
+	if (replica->cookie != NULL) {
+		g_byte_array_free(replica->cookie, TRUE);
+		replica->cookie = NULL;
+	}
+	replica->changed = TRUE;
+}
+
+/* Return a replica for CTX stored in PATH, not loaded yet. */
+static struct replica *
+replica_new(struct lu_ldap_context *ctx, const char *path)
+{
+	struct replica *replica;
+	GPtrArray *attributes;
+	char **lists[2];
+	size_t i, j;
+
+	replica = g_malloc0(sizeof(*replica));
+	replica->path = g_strdup(path);
+	replica->key = connection_key_new(ctx, FALSE);
+	replica->entries = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, replica_entry_free);
+
+	/* Everything lookups may ask for, each attribute once. */
+	attributes = g_ptr_array_new();
+	g_ptr_array_add(attributes, g_strdup(OBJECTCLASS));
+	if (ctx->member_dn)
+		g_ptr_array_add(attributes, g_strdup("member"));
+	lists[0] = ctx->mapped_user_attributes;
+	lists[1] = ctx->mapped_group_attributes;
+	for (i = 0; i < G_N_ELEMENTS(lists); i++) {
+		for (j = 0; lists[i][j] != NULL; j++) {
+			size_t k;
+
+			for (k = 0; k < attributes->len; k++) {
+				if (g_ascii_strcasecmp
+				    (g_ptr_array_index(attributes, k),
+				     lists[i][j]) == 0)
+					break;
+			}
+			if (k == attributes->len)
+				g_ptr_array_add(attributes,
+						g_strdup(lists[i][j]));
+		}
+	}
+	g_ptr_array_add(attributes, NULL);
+	replica->attributes = (char **)g_ptr_array_free(attributes, FALSE);
+	return replica;
+}
+
+static void
+replica_free(struct replica *replica)
+{
+	g_free(replica->path);
+	g_free(replica->key);
+	g_strfreev(replica->attributes);
+	g_hash_table_destroy(replica->entries);
+	if (replica->index != NULL)
+		g_hash_table_destroy(replica->index);
+	if (replica->cookie != NULL)
+		g_byte_array_free(replica->cookie, TRUE);
+	g_free(replica);
+}
+
+/* Set the synchronization state of REPLICA to COOKIE. */
+static void
+replica_set_cookie(struct replica *replica, const struct berval *cookie)
+{
+	if (replica->cookie == NULL)
+		replica->cookie = g_byte_array_new();
+	g_byte_array_set_size(replica->cookie, 0);
+	g_byte_array_append(replica->cookie, (const guint8 *)cookie->bv_val,
+			    cookie->bv_len);
+	replica->changed = TRUE;
+}
+
+/* Return VALUE, e.g. an entryUUID, in hexadecimal, for g_free(). */
+static char *
+hex_string(const struct berval *value)
+{
+	char *ret;
+	size_t i;
+
+	ret = g_malloc(value->bv_len * 2 + 1);
+	for (i = 0; i < value->bv_len; i++)
+		sprintf(ret + 2 * i, "%02x", (guchar)value->bv_val[i]);
+	ret[2 * i] = 0;
+	return ret;
+}
+
+/* Read the replica file of CTX, if it was written with the same server and
+ * bind identity.  The file is ignored unless it is a regular file private to
+ * the effective user, because lookups trust its contents. */
+static void
+replica_load(struct lu_ldap_context *ctx)
+{
+	struct replica *replica;
+	struct replica_entry *entry;
+	GMappedFile *file;
+	struct stat st;
+	const char *p, *end;
+	size_t line_no;
+	int fd;
+
+	replica = ctx->replica;
+	replica->loaded = TRUE;
+	fd = open(replica->path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+	if (fd == -1)
+		return;
+	if (fstat(fd, &st) != 0 || !S_ISREG(st.st_mode)
+	    || st.st_uid != geteuid()
+	    || (st.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+		close(fd);
+		return;
+	}
+	file = g_mapped_file_new_from_fd(fd, FALSE, NULL);
+	close(fd);
+	if (file == NULL)
+		return;
+	p = g_mapped_file_get_contents(file);
+	end = p + g_mapped_file_get_length(file);
+	entry = NULL;
+	for (line_no = 0; p < end; line_no++) {
+		const char *nl;
+		char *line, **fields;
+
+		nl = memchr(p, '\n', end - p);
+		if (nl == NULL)
+			break;
+		line = g_strndup(p, nl - p);
+		p = nl + 1;
+		fields = g_strsplit(line, "\t", 3);
+		g_free(line);
+		if (line_no == 0) {
+			if (strcmp(fields[0], REPLICA_HEADER) != 0
+			    || fields[1] == NULL
+			    || strcmp(fields[1], replica->key) != 0) {
+				g_strfreev(fields);
+				break;
+			}
+			if (fields[2] != NULL && *fields[2] != 0) {
+				GByteArray *cookie;
+				const char *h;
+
+				cookie = g_byte_array_new();
+				for (h = fields[2];
+				     g_ascii_isxdigit(h[0])
+				     && g_ascii_isxdigit(h[1]); h += 2) {
+					guint8 byte;
+
+					byte = g_ascii_xdigit_value(h[0]) << 4
+						| g_ascii_xdigit_value(h[1]);
+					g_byte_array_append(cookie, &byte, 1);
+				}
+				replica->cookie = cookie;
+			}
+		} else if (strcmp(fields[0], "E") == 0 && fields[1] != NULL
+			   && fields[2] != NULL) {
+			char *dn;
+
+			dn = g_strcompress(fields[2]);
+			entry = replica_entry_new(dn);
+			g_free(dn);
+			g_hash_table_replace(replica->entries,
+					     g_strdup(fields[1]), entry);
+		} else if (strcmp(fields[0], "A") == 0 && entry != NULL
+			   && fields[1] != NULL && fields[2] != NULL)
+			replica_entry_take_value(entry, fields[1],
+						 g_strcompress(fields[2]));
+		g_strfreev(fields);
+	}
+	g_mapped_file_unref(file);
+	replica->changed = FALSE;
+}
+
+/* Write the replica of CTX to its file, if it changed.  Failures only mean
+ * the next context has more to synchronize, so they are ignored. */
+static void
+replica_save(struct lu_ldap_context *ctx)
+{
+	struct replica *replica;
+	GHashTableIter iter;
+	gpointer key, value;
+	char *tmp, *escaped;
+	FILE *f;
+	int fd;
+
+	replica = ctx->replica;
+	if (!replica->changed)
+		return;
+	tmp = g_strconcat(replica->path, ".XXXXXX", NULL);
+	fd = g_mkstemp(tmp);
+	if (fd == -1)
+		goto err_tmp;
+	if (fchmod(fd, S_IRUSR | S_IWUSR) != 0) {
+		close(fd);
+		goto err_unlink;
+	}
+	f = fdopen(fd, "w");
+	if (f == NULL) {
+		close(fd);
+		goto err_unlink;
+	}
+	fprintf(f, "%s\t%s", REPLICA_HEADER, replica->key);
+	if (replica->cookie != NULL) {
+		struct berval cookie;
+		char *hex;
+
+		cookie.bv_val = (char *)replica->cookie->data;
+		cookie.bv_len = replica->cookie->len;
+		hex = hex_string(&cookie);
+		fprintf(f, "\t%s", hex);
+		g_free(hex);
+	}
+	fputc('\n', f);
+	g_hash_table_iter_init(&iter, replica->entries);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct replica_entry *entry;
+		GHashTableIter attrs;
+		gpointer attr, values;
+
+		entry = value;
+		escaped = g_strescape(entry->dn, NULL);
+		fprintf(f, "E\t%s\t%s\n", (const char *)key, escaped);
+		g_free(escaped);
+		g_hash_table_iter_init(&attrs, entry->attrs);
+		while (g_hash_table_iter_next(&attrs, &attr, &values)) {
+			GPtrArray *array;
+			size_t i;
+
+			array = values;
+			for (i = 0; i < array->len; i++) {
+				escaped = g_strescape(g_ptr_array_index(array,
+									i),
+						      NULL);
+				fprintf(f, "A\t%s\t%s\n", (const char *)attr,
+					escaped);
+				g_free(escaped);
+			}
+		}
+	}
+	if (fflush(f) != 0 || ferror(f) || fsync(fileno(f)) != 0) {
+		fclose(f);
+		goto err_unlink;
+	}
+	if (fclose(f) != 0 || rename(tmp, replica->path) != 0)
+		goto err_unlink;
+	replica->changed = FALSE;
+	g_free(tmp);
+	return;
+
+err_unlink:
+	(void)unlink(tmp);
+err_tmp:
+	g_free(tmp);
+}
+
+/* Apply a search result ENTRY of a synchronization to CTX->replica. */
+static void
+replica_sync_entry(struct lu_ldap_context *ctx, LDAPMessage *entry)
+{
+	struct replica *replica;
+	LDAPControl **controls, *control;
+	BerElement *ber;
+	struct berval uuid, cookie;
+	ber_int_t state;
+	ber_len_t len;
+	char *key;
+
+	replica = ctx->replica;
+	controls = NULL;
+	if (ldap_get_entry_controls(ctx->ldap, entry, &controls)
+	    != LDAP_SUCCESS)
+		return;
+	control = ldap_control_find(LDAP_CONTROL_SYNC_STATE, controls, NULL);
+	if (control == NULL)
+		goto done;
+	ber = ber_init(&control->ldctl_value);
+	if (ber == NULL)
+		goto done;
+	if (ber_scanf(ber, "{em", &state, &uuid) == LBER_ERROR)
+		goto done_ber;
+	key = hex_string(&uuid);
+	switch (state) {
+	case LDAP_SYNC_PRESENT: {
+		struct replica_entry *e;
+
+		e = g_hash_table_lookup(replica->entries, key);
+		if (e != NULL)
+			e->present = TRUE;
+		g_free(key);
+		break;
+	}
+	case LDAP_SYNC_ADD:
+	case LDAP_SYNC_MODIFY: {
+		struct replica_entry *e;
+		char *dn;
+		size_t i;
+
+		dn = ldap_get_dn(ctx->ldap, entry);
+		e = replica_entry_new(dn);
+		ldap_memfree(dn);
+		for (i = 0; replica->attributes[i] != NULL; i++) {
+			BerValue **values;
+			size_t j;
+
+			values = ldap_get_values_len(ctx->ldap, entry,
+						     replica->attributes[i]);
+			for (j = 0; values != NULL && values[j] != NULL; j++)
+				replica_entry_take_value
+					(e, replica->attributes[i],
+					 g_strndup(values[j]->bv_val,
+						   values[j]->bv_len));
+			if (values != NULL)
+				ldap_value_free_len(values);
+		}
+		e->present = TRUE;
+		g_hash_table_replace(replica->entries, key, e);
+		replica->changed = TRUE;
+		break;
+	}
+	case LDAP_SYNC_DELETE:
+		g_hash_table_remove(replica->entries, key);
+		replica->changed = TRUE;
+		g_free(key);
+		break;
+	default:
+		g_free(key);
+		break;
+	}
+	if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE
+	    && ber_scanf(ber, "m", &cookie) != LBER_ERROR)
+		replica_set_cookie(replica, &cookie);
+done_ber:
+	ber_free(ber, 1);
+done:
+	ldap_controls_free(controls);
+}
+
+/* Mark entries with UUIDS as present in REPLICA, or delete them if
+ * DELETES. */
+static void
+replica_sync_ids(struct replica *replica, BerVarray uuids, gboolean deletes)
+{
+	size_t i;
+
+	for (i = 0; uuids != NULL && uuids[i].bv_val != NULL; i++) {
+		char *key;
+
+		key = hex_string(&uuids[i]);
+		if (deletes) {
+			g_hash_table_remove(replica->entries, key);
+			replica->changed = TRUE;
+		} else {
+			struct replica_entry *e;
+
+			e = g_hash_table_lookup(replica->entries, key);
+			if (e != NULL)
+				e->present = TRUE;
+		}
+		g_free(key);
+	}
+}
+
+/* Apply a Sync Info MESSAGE of a synchronization to CTX->replica. */
+static void
+replica_sync_info(struct lu_ldap_context *ctx, LDAPMessage *message)
+{
+	struct replica *replica;
+	struct berval *data, cookie;
+	BerElement *ber;
+	ber_tag_t tag;
+	ber_len_t len;
+	char *oid;
+
+	replica = ctx->replica;
+	oid = NULL;
+	data = NULL;
+	if (ldap_parse_intermediate(ctx->ldap, message, &oid, &data, NULL, 0)
+	    != LDAP_SUCCESS)
+		return;
+	if (oid == NULL || strcmp(oid, LDAP_SYNC_INFO) != 0 || data == NULL)
+		goto done;
+	ber = ber_init(data);
+	if (ber == NULL)
+		goto done;
+	switch (ber_peek_tag(ber, &len)) {
+	case LDAP_TAG_SYNC_NEW_COOKIE:
+		if (ber_scanf(ber, "tm", &tag, &cookie) != LBER_ERROR)
+			replica_set_cookie(replica, &cookie);
+		break;
+	case LDAP_TAG_SYNC_REFRESH_DELETE:
+	case LDAP_TAG_SYNC_REFRESH_PRESENT:
+		if (ber_scanf(ber, "t{", &tag) == LBER_ERROR)
+			break;
+		if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE
+		    && ber_scanf(ber, "m", &cookie) != LBER_ERROR)
+			replica_set_cookie(replica, &cookie);
+		break;
+	case LDAP_TAG_SYNC_ID_SET: {
+		ber_int_t deletes;
+		BerVarray uuids;
+
+		if (ber_scanf(ber, "t{", &tag) == LBER_ERROR)
+			break;
+		if (ber_peek_tag(ber, &len) == LDAP_TAG_SYNC_COOKIE
+		    && ber_scanf(ber, "m", &cookie) != LBER_ERROR)
+			replica_set_cookie(replica, &cookie);
+		deletes = 0;
+		if (ber_peek_tag(ber, &len) == LDAP_TAG_REFRESHDELETES
+		    && ber_scanf(ber, "b", &deletes) == LBER_ERROR)
+			break;
+		uuids = NULL;
+		if (ber_scanf(ber, "[W]", &uuids) == LBER_ERROR)
+			break;
+		replica_sync_ids(replica, uuids, deletes != 0);
+		ber_bvarray_free(uuids);
+		break;
+	}
+	default:
+		break;
+	}
+	ber_free(ber, 1);
+done:
+	ldap_memfree(oid);
+	if (data != NULL)
+		ber_bvfree(data);
+}
+
+/* Remove entries not marked present.  A g_hash_table_foreach_remove()
+ * callback. */
+static gboolean
+replica_entry_absent(gpointer key, gpointer value, gpointer data)
+{
+	struct replica_entry *entry;
+
+	(void)key;
+	(void)data;
+	entry = value;
+	return !entry->present;
+}
+
+/* Clear the present mark of an entry.  A g_hash_table_foreach()
+ * callback. */
+static void
+replica_entry_unmark(gpointer key, gpointer value, gpointer data)
+{
+	struct replica_entry *entry;
+
+	(void)key;
+	(void)data;
+	entry = value;
+	entry->present = FALSE;
+}
+
+/* Bring CTX->replica up to date with a refreshOnly synchronization.  Return
+ * an LDAP error code. */
+static int
+replica_refresh(struct lu_ldap_context *ctx)
+{
+	struct replica *replica;
+	LDAPControl *control, *controls[2];
+	LDAPMessage *message;
+	BerElement *ber;
+	struct berval value;
+	gboolean done;
+	int err, msgid;
+
+	replica = ctx->replica;
+	ber = ber_alloc_t(LBER_USE_DER);
+	if (ber == NULL)
+		return LDAP_NO_MEMORY;
+	if (replica->cookie != NULL) {
+		struct berval cookie;
+
+		cookie.bv_val = (char *)replica->cookie->data;
+		cookie.bv_len = replica->cookie->len;
+		err = ber_printf(ber, "{eO}", (ber_int_t)LDAP_SYNC_REFRESH_ONLY,
+				 &cookie);
+	} else {
+		replica_clear(replica);
+		err = ber_printf(ber, "{e}", (ber_int_t)LDAP_SYNC_REFRESH_ONLY);
+	}
+	if (err == -1 || ber_flatten2(ber, &value, 0) == -1) {
+		ber_free(ber, 1);
+		return LDAP_ENCODING_ERROR;
+	}
+	err = ldap_control_create(LDAP_CONTROL_SYNC, 1, &value, 1, &control);
+	ber_free(ber, 1);
+	if (err != LDAP_SUCCESS)
+		return err;
+	controls[0] = control;
+	controls[1] = NULL;
+
+	g_hash_table_foreach(replica->entries, replica_entry_unmark, NULL);
+	err = ldap_search_ext(ctx->ldap, ctx->prompts[LU_LDAP_BASEDN].value,
+			      LDAP_SCOPE_SUBTREE, REPLICA_FILTER,
+			      replica->attributes, FALSE, controls, NULL,
+			      NULL, LDAP_NO_LIMIT, &msgid);
+	ldap_control_free(control);
+	if (err != LDAP_SUCCESS)
+		return err;
+
+	if (replica->index != NULL) {
+		g_hash_table_destroy(replica->index);
+		replica->index = NULL;
+	}
+	done = FALSE;
+	while (!done) {
+		LDAPControl **result_controls;
+
+		message = NULL;
+		if (ldap_result(ctx->ldap, msgid, LDAP_MSG_ONE, NULL, &message)
+		    <= 0) {
+			ldap_get_option(ctx->ldap, LDAP_OPT_RESULT_CODE, &err);
+			if (err == LDAP_SUCCESS)
+				err = LDAP_OTHER;
+			break;
+		}
+		switch (ldap_msgtype(message)) {
+		case LDAP_RES_SEARCH_ENTRY:
+			replica_sync_entry(ctx, message);
+			break;
+		case LDAP_RES_INTERMEDIATE:
+			replica_sync_info(ctx, message);
+			break;
+		case LDAP_RES_SEARCH_RESULT:
+			done = TRUE;
+			result_controls = NULL;
+			if (ldap_parse_result(ctx->ldap, message, &err, NULL,
+					      NULL, NULL, &result_controls,
+					      FALSE) != LDAP_SUCCESS)
+				err = LDAP_OTHER;
+			if (err == LDAP_SUCCESS) {
+				LDAPControl *sync_done;
+				ber_int_t deletes;
+
+				deletes = 0;
+				sync_done = ldap_control_find
+					(LDAP_CONTROL_SYNC_DONE,
+					 result_controls, NULL);
+				ber = sync_done != NULL
+					? ber_init(&sync_done->ldctl_value)
+					: NULL;
+				if (ber != NULL) {
+					struct berval cookie;
+					ber_len_t len;
+
+					if (ber_scanf(ber, "{") != LBER_ERROR
+					    && ber_peek_tag(ber, &len)
+					    == LDAP_TAG_SYNC_COOKIE
+					    && ber_scanf(ber, "m", &cookie)
+					    != LBER_ERROR)
+						replica_set_cookie(replica,
+								   &cookie);
+					if (ber_peek_tag(ber, &len)
+					    == LDAP_TAG_REFRESHDELETES)
+						(void)ber_scanf(ber, "b",
+								&deletes);
+					ber_free(ber, 1);
+				}
+				/* After a present phase, whatever the server
+				 * didn't mention is gone. */
+				if (deletes == 0
+				    && g_hash_table_foreach_remove
+				    (replica->entries, replica_entry_absent,
+				     NULL) != 0)
+					replica->changed = TRUE;
+			}
+			if (result_controls != NULL)
+				ldap_controls_free(result_controls);
+			break;
+		default:
+			break;
+		}
+		ldap_msgfree(message);
+	}
+	if (!done)
+		ldap_abandon_ext(ctx->ldap, msgid, NULL, NULL);
+	return err;
+}
+
+/* Return TRUE if MODULE can answer reads from its replica, refreshing it
+ * first if necessary. */
+static gboolean
+replica_ready(struct lu_module *module)
+{
+	struct lu_ldap_context *ctx;
+	struct replica *replica;
+	struct lu_error *error;
+	int err;
+
+	ctx = module->module_context;
+	replica = ctx->replica;
+	if (replica == NULL || replica->failed)
+		return FALSE;
+	if (replica->fresh)
+		return TRUE;
+	/* Entries can't change while they are being iterated over. */
+	if (replica->readers != 0)
+		return FALSE;
+	error = NULL;
+	if (!lu_ldap_connection(ctx, &error)) {
+		lu_error_free(&error);
+		return FALSE;
+	}
+	if (!replica->loaded)
+		replica_load(ctx);
+	err = replica_refresh(ctx);
+	if (err == LDAP_SYNC_REFRESH_REQUIRED) {
+		replica_clear(replica);
+		err = replica_refresh(ctx);
+	}
+	if (err != LDAP_SUCCESS) {
+		g_warning(_("Not using the LDAP replica: %s"),
+			  ldap_err2string(err));
+		replica->failed = TRUE;
+		replica_clear(replica);
+		return FALSE;
+	}
+	replica->fresh = TRUE;
+	replica_save(ctx);
+	return TRUE;
+}
+
+/* Attributes indexed for replica_find(). */
+static const char *const replica_indexed[] = {
+	"uid", "uidNumber", "cn", "gidNumber"
+};
+
+/* Add ENTRY to the index of REPLICA.  A g_hash_table_foreach() callback. */
+static void
+replica_index_entry(gpointer key, gpointer value, gpointer data)
+{
+	struct replica *replica;
+	struct replica_entry *entry;
+	size_t i;
+
+	(void)key;
+	replica = data;
+	entry = value;
+	for (i = 0; i < G_N_ELEMENTS(replica_indexed); i++) {
+		GPtrArray *values;
+		size_t j;
+
+		values = g_hash_table_lookup(entry->attrs, replica_indexed[i]);
+		for (j = 0; values != NULL && j < values->len; j++) {
+			const char *value;
+			char *k;
+
+			value = g_ptr_array_index(values, j);
+			if (entry->user) {
+				k = g_strconcat("u:", replica_indexed[i], "=",
+						value, NULL);
+				if (g_hash_table_lookup(replica->index, k)
+				    == NULL)
+					g_hash_table_insert(replica->index, k,
+							    entry);
+				else
+					g_free(k);
+			}
+			if (entry->group) {
+				k = g_strconcat("g:", replica_indexed[i], "=",
+						value, NULL);
+				if (g_hash_table_lookup(replica->index, k)
+				    == NULL)
+					g_hash_table_insert(replica->index, k,
+							    entry);
+				else
+					g_free(k);
+			}
+		}
+	}
+}
+
+/* Return the user (if USER) or group under BASE in the replica of CTX with
+ * VALUE of ATTR, or NULL. */
+static struct replica_entry *
+replica_find(struct lu_ldap_context *ctx, const char *base, gboolean user,
+	     const char *attr, const char *value)
+{
+	struct replica *replica;
+	struct replica_entry *entry;
+	GHashTableIter iter;
+	gpointer v;
+	size_t i;
+
+	replica = ctx->replica;
+	for (i = 0; i < G_N_ELEMENTS(replica_indexed); i++) {
+		if (g_ascii_strcasecmp(attr, replica_indexed[i]) == 0)
+			break;
+	}
+	if (i < G_N_ELEMENTS(replica_indexed)) {
+		char *key;
+
+		if (replica->index == NULL) {
+			replica->index = g_hash_table_new_full
+				(ascii_case_hash, ascii_case_equal, g_free,
+				 NULL);
+			g_hash_table_foreach(replica->entries,
+					     replica_index_entry, replica);
+		}
+		key = g_strconcat(user ? "u:" : "g:", replica_indexed[i], "=",
+				  value, NULL);
+		entry = g_hash_table_lookup(replica->index, key);
+		g_free(key);
+		if (entry != NULL && replica_entry_in(entry, base))
+			return entry;
+		/* Fall back to a scan if the indexed entry is elsewhere. */
+		if (entry == NULL)
+			return NULL;
 	}
-	g_free(filter);
-
-	if (ret == NULL) {
-		/* Guess at the DN using the branch and the base. */
-		tmp = g_strdup_printf("%s=%s,%s", mapped_naming_attr, name,
-				      base);
-		ret = module->scache->cache(module->scache, tmp);
-		g_free(tmp);
+	g_hash_table_iter_init(&iter, replica->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &v)) {
+		entry = v;
+		if ((user ? entry->user : entry->group)
+		    && replica_entry_in(entry, base)
+		    && replica_entry_matches(entry, attr, value))
+			return entry;
 	}
-
-	return ret;
+	return NULL;
 }
 
-/* This is the lookup workhorse. */
+/* Look up an entity with NAME in NAMING_ATTR, matching FILTER, and read
+ * ATTRIBUTES into ENT.  If CHAIN, keep the entry for a name lookup which
+ * continues this lookup.  Return TRUE if found. */
 static gboolean
 lu_ldap_lookup(struct lu_module *module,
 	       const char *namingAttr, const char *name,
-	       struct lu_ent *ent, GPtrArray *ent_array, const char *branch,
+	       struct lu_ent *ent, const char *branch,
 	       const char *filter, const char *const *attributes,
-	       enum lu_entity_type type, struct lu_error **error)
+	       gboolean chain, struct lu_error **error)
 {
 	LDAPMessage *messages = NULL, *entry = NULL;
-	char *filt, **mapped_attributes;
-	const char *dn = NULL;
-	const char *base;
-	gboolean ret = FALSE;
+	char *filt, **mapped_attributes, *key;
+	const char *dn, *base;
 	struct lu_ldap_context *ctx;
 
 	g_assert(module != NULL);
 	g_assert(namingAttr != NULL);
 	g_assert(strlen(namingAttr) > 0);
-	name = name ?: "*";
-	g_assert((ent != NULL) || (ent_array != NULL));
-	if (ent != NULL) {
-		g_assert(ent->magic == LU_ENT_MAGIC);
-	}
+	g_assert(name != NULL);
+	g_assert(ent != NULL);
+	g_assert(ent->magic == LU_ENT_MAGIC);
 	g_assert(attributes != NULL);
 	g_assert(attributes[0] != NULL);
 	LU_ERROR_CHECK(error);
 
 	ctx = module->module_context;
-
-	if (ent != NULL) {
-		/* Try to use the dn the object already knows about. */
-		dn = lu_ent_get_first_string(ent, DISTINGUISHED_NAME);
-		if (dn == NULL)
-			/* Map the user or group name to an LDAP object name. */
-			dn = lu_ldap_ent_to_dn(module, namingAttr, name,
-					       branch);
-	}
+	chain_forget(ctx);
 
 	/* Get the entry in the directory under which we'll search for this
 	 * entity. */
 	base = lu_ldap_base(module, branch);
 
+	if (replica_ready(module)) {
+		struct replica_entry *rentry;
+
+		rentry = replica_find(ctx, base,
+				      attributes == lu_ldap_user_attributes,
+				      namingAttr, name);
+		if (rentry == NULL)
+			return FALSE;
+		replica_read_entry(rentry, attributes,
+				   mapped_attributes_of(ctx, attributes), ent);
+		return TRUE;
+	}
+
+	if (!lu_ldap_connection(ctx, error))
+		return FALSE;
+
+	/* Try to use the dn the object already knows about, or the one
+	 * found by an earlier lookup. */
+	key = dn_cache_key(namingAttr, name, base);
+	dn = lu_ent_get_first_string(ent, DISTINGUISHED_NAME);
+	if (dn == NULL)
+		dn = g_hash_table_lookup(ctx->dn_cache, key);
+
 	/* Generate an LDAP filter, optionally including a filter supplied
 	 * by the caller. */
 	if (filter && (strlen(filter) > 0)) {
@@ -578,41 +1982,34 @@ lu_ldap_lookup(struct lu_module *module,
 		filt = g_strdup_printf("(%s=%s)", namingAttr, name);
 	}
 
+	mapped_attributes = mapped_attributes_of(ctx, attributes);
+
+	/* If we know where the entry is, read it directly.  The filter makes
+	 * sure a stale dn can not return a different entry. */
+	if (dn != NULL) {
 #ifdef DEBUG
-	g_print("Looking up `%s' with filter `%s'.\n", dn, filt);
+		g_print("Looking up `%s' with filter `%s'.\n", dn, filt);
 #endif
-
-	if (attributes == lu_ldap_user_attributes)
-		mapped_attributes = ctx->mapped_user_attributes;
-	else if (attributes == lu_ldap_group_attributes)
-		mapped_attributes = ctx->mapped_group_attributes;
-	else {
-		g_assert_not_reached();
-		mapped_attributes = NULL;
-	}
-
-	if (ent != NULL) {
-		/* Perform the search and read the first (hopefully only)
-		 * entry. */
 		if (ldap_search_ext_s(ctx->ldap, dn, LDAP_SCOPE_BASE, filt,
 				      mapped_attributes, FALSE, NULL, NULL,
 				      NULL, LDAP_NO_LIMIT, &messages)
-		    == LDAP_SUCCESS) {
+		    == LDAP_SUCCESS)
 			entry = ldap_first_entry(ctx->ldap, messages);
+		if (entry == NULL) {
+			g_hash_table_remove(ctx->dn_cache, key);
+			if (messages != NULL) {
+				ldap_msgfree(messages);
+				messages = NULL;
+			}
 		}
 	}
 
-	/* If there isn't an entry with this exact name, search for something
-	 * which matches. */
+	/* Otherwise search for something which matches, once. */
 	if (entry == NULL) {
 #ifdef DEBUG
 		g_print("Looking under `%s' with filter `%s'.\n", base,
 			filt);
 #endif
-		if (messages != NULL) {
-			ldap_msgfree(messages);
-			messages = NULL;
-		}
 		if (ldap_search_ext_s(ctx->ldap, base, LDAP_SCOPE_SUBTREE,
 				      filt, mapped_attributes, FALSE, NULL,
 				      NULL, NULL, LDAP_NO_LIMIT, &messages)
@@ -623,84 +2020,177 @@ lu_ldap_lookup(struct lu_module *module,
 
 	/* We don't need the generated filter any more, so free it. */
 	g_free(filt);
+	g_free(key);
 
-	/* If we got an entry, read its contents into an entity structure. */
-	while (entry != NULL) {
-		GValue value;
-		size_t i;
-		char *p;
+	if (entry == NULL) {
+		if (messages != NULL)
+			ldap_msgfree(messages);
+		return FALSE;
+	}
 
-		/* Mark that the search succeeded. */
-		ret = TRUE;
-		/* If we need to add the data to the array, then create a new
-		 * data item to hold the data. */
-		if (ent_array != NULL)
-			ent = lu_ent_new_typed(type);
-		/* Set the distinguished name. */
-		p = ldap_get_dn(ctx->ldap, entry);
-		lu_ent_set_string_current(ent, DISTINGUISHED_NAME, p);
-		ldap_memfree(p);
-
-		/* Read each of the attributes we asked for. */
-		memset(&value, 0, sizeof(value));
-		for (i = 0; attributes[i]; i++) {
-			BerValue **values;
-			const char *attr;
+	/* Read the entry's contents into the entity structure, and remember
+	 * where it is, both under the key we used and under its name. */
+	lu_ldap_read_entry(module, entry, attributes, mapped_attributes, ent);
+	dn = lu_ent_get_first_string_current(ent, DISTINGUISHED_NAME);
+	if (dn != NULL) {
+		const char *name_attr, *entry_name;
+
+		dn_cache_store(ctx, namingAttr, name, base, dn);
+		name_attr = attributes == lu_ldap_user_attributes
+			? LU_USERNAME : LU_GROUPNAME;
+		entry_name = lu_ent_get_first_string_current(ent, name_attr);
+		if (entry_name != NULL)
+			dn_cache_store(ctx, map_to_ldap(module->scache,
+							name_attr),
+				       entry_name, base, dn);
+		if (chain && entry_name != NULL) {
+			ctx->chain_messages = messages;
+			ctx->chain_entry = entry;
+			ctx->chain_attributes = attributes;
+			ctx->chain_name = g_strdup(entry_name);
+			return TRUE;
+		}
+	}
+	ldap_msgfree(messages);
+	return TRUE;
+}
 
-			/* Get the values which correspond to this attribute. */
-			attr = attributes[i];
-			values = ldap_get_values_len(ctx->ldap, entry,
-						     mapped_attributes[i]);
-			/* If we got answers, add them. */
-			if (values) {
-				size_t j;
+/* If this name lookup continues an ID lookup which found an entity with
+ * NAME and ATTRIBUTES, read the entry that lookup found into ENT instead of
+ * searching again.  Return TRUE if the entry was reused. */
+static gboolean
+lu_ldap_lookup_chained(struct lu_module *module, const char *name,
+		       struct lu_ent *ent, const char *const *attributes)
+{
+	struct lu_ldap_context *ctx;
+	gboolean ret;
 
-				lu_ent_clear_current(ent, attr);
-				for (j = 0; values[j]; j++) {
-					char *val;
-					gboolean ok;
-					struct lu_error *error;
+	ctx = module->module_context;
+	ret = ctx->chain_entry != NULL && ctx->global_context->lookup_chained
+		&& ctx->chain_attributes == attributes
+		&& strcmp(ctx->chain_name, name) == 0;
+	if (ret)
+		lu_ldap_read_entry(module, ctx->chain_entry, attributes,
+				   mapped_attributes_of(ctx, attributes),
+				   ent);
+	chain_forget(ctx);
+	return ret;
+}
 
-					val = g_strndup(values[j]->bv_val,
-							values[j]->bv_len);
-#ifdef DEBUG
-					g_print("Got `%s' = `%s'.\n", attr,
-						val);
-#endif
-					error = NULL;
-					ok = lu_value_init_set_attr_from_string
-						(&value, attr, val, &error);
-					if (ok == FALSE) {
-						g_assert(error != NULL);
-						g_warning("%s", lu_strerror(error));
-						lu_error_free(&error);
-					} else {
-						lu_ent_add_current(ent, attr,
-								   &value);
-						g_value_unset(&value);
-					}
-					g_free(val);
-				}
-				ldap_value_free_len(values);
-			}
-		}
-		/* Stash the data in the array if we need to. */
-		if (ent_array != NULL) {
-			g_ptr_array_add(ent_array, ent);
-			ent = NULL;
-			/* Go to the next entry. */
-			entry = ldap_next_entry(ctx->ldap, entry);
-		} else {
-			/* Stop here. */
-			entry = NULL;
-		}
+/* Parameters of lu_ldap_lookup_all() for lookup_all_entry(). */
+struct lookup_all {
+	const char *const *attributes;
+	char **mapped_attributes;
+	enum lu_entity_type type;
+	lu_ent_fn *callback;
+	gpointer data;
+};
+
+/* Read ENTRY into a new entity and pass it to the callback in DATA, a
+ * struct lookup_all. */
+static gboolean
+lookup_all_entry(struct lu_module *module, LDAPMessage *entry, gpointer data)
+{
+	struct lookup_all *all;
+	struct lu_ldap_context *ctx;
+	struct lu_ent *ent;
+
+	all = data;
+	ctx = module->module_context;
+	ent = lu_ent_new_typed_in(ctx->global_context->ent_arena, all->type);
+	lu_ldap_read_entry(module, entry, all->attributes,
+			   all->mapped_attributes, ent);
+	return all->callback(ent, all->data);
+}
+
+/* Pass the entities in the replica of MODULE under BASE with NAMING_ATTR
+ * matching PATTERN to CALLBACK, as lu_ldap_lookup_all() does. */
+static void
+replica_lookup_all(struct lu_module *module, const char *namingAttr,
+		   const char *pattern, const char *base,
+		   const char *const *attributes, enum lu_entity_type type,
+		   lu_ent_fn *callback, gpointer data)
+{
+	struct lu_ldap_context *ctx;
+	GHashTableIter iter;
+	gpointer value;
+	gboolean user;
+
+	ctx = module->module_context;
+	user = attributes == lu_ldap_user_attributes;
+	/* The callback may look up or change other entities; keep the
+	 * entries we iterate over alive until we are done. */
+	ctx->replica->readers++;
+	g_hash_table_iter_init(&iter, ctx->replica->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct replica_entry *entry;
+		struct lu_ent *ent;
+
+		entry = value;
+		if (!(user ? entry->user : entry->group)
+		    || !replica_entry_in(entry, base)
+		    || !replica_entry_matches(entry, namingAttr, pattern))
+			continue;
+		ent = lu_ent_new_typed_in(ctx->global_context->ent_arena,
+					  type);
+		replica_read_entry(entry, attributes,
+				   mapped_attributes_of(ctx, attributes), ent);
+		if (!callback(ent, data))
+			break;
 	}
-	/* Free all of the responses. */
-	if (messages) {
-		ldap_msgfree(messages);
+	ctx->replica->readers--;
+}
+
+/* Look up all entities with NAMING_ATTR matching PATTERN and FILTER, read
+ * ATTRIBUTES, and pass each entity to CALLBACK with DATA as soon as it
+ * arrives.  CALLBACK takes ownership of the entity and returns FALSE to stop
+ * the search.  Return TRUE on success; as with the other enumeration
+ * functions, a failed search only ends the list. */
+static gboolean
+lu_ldap_lookup_all(struct lu_module *module, const char *namingAttr,
+		   const char *pattern, const char *branch,
+		   const char *filter, const char *const *attributes,
+		   enum lu_entity_type type, lu_ent_fn *callback,
+		   gpointer data, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+	struct lookup_all all;
+	const char *base;
+	char *filt;
+
+	g_assert(module != NULL);
+	g_assert(namingAttr != NULL);
+	g_assert(strlen(namingAttr) > 0);
+	g_assert(callback != NULL);
+	LU_ERROR_CHECK(error);
+
+	ctx = module->module_context;
+	base = lu_ldap_base(module, branch);
+	if (replica_ready(module)) {
+		replica_lookup_all(module, namingAttr, pattern ?: "*", base,
+				   attributes, type, callback, data);
+		return TRUE;
 	}
+	if (!lu_ldap_connection(ctx, error))
+		return FALSE;
 
-	return ret;
+	filt = g_strdup_printf("(&%s(%s=%s))", filter, namingAttr,
+			       pattern ?: "*");
+#ifdef DEBUG
+	g_print("Looking under `%s' with filter `%s'.\n", base, filt);
+#endif
+	all.attributes = attributes;
+	if (attributes == lu_ldap_user_attributes)
+		all.mapped_attributes = ctx->mapped_user_attributes;
+	else
+		all.mapped_attributes = ctx->mapped_group_attributes;
+	all.type = type;
+	all.callback = callback;
+	all.data = data;
+	lu_ldap_search(module, base, filt, all.mapped_attributes,
+		       lookup_all_entry, &all);
+	g_free(filt);
+	return TRUE;
 }
 
 /* Look up a user by name. */
@@ -712,9 +2202,11 @@ lu_ldap_user_lookup_name(struct lu_module *module, const char *name,
 
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
-	return lu_ldap_lookup(module, "uid", name, ent, NULL, ctx->user_branch,
+	if (lu_ldap_lookup_chained(module, name, ent, lu_ldap_user_attributes))
+		return TRUE;
+	return lu_ldap_lookup(module, "uid", name, ent, ctx->user_branch,
 			      "("OBJECTCLASS"="POSIXACCOUNT")",
-			      lu_ldap_user_attributes, lu_user, error);
+			      lu_ldap_user_attributes, FALSE, error);
 }
 
 /* Look up a user by ID. */
@@ -728,10 +2220,10 @@ lu_ldap_user_lookup_id(struct lu_module *module, uid_t uid,
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
 	sprintf(uid_string, "%jd", (intmax_t)uid);
-	return lu_ldap_lookup(module, "uidNumber", uid_string, ent, NULL,
+	return lu_ldap_lookup(module, "uidNumber", uid_string, ent,
 			      ctx->user_branch,
 			      "("OBJECTCLASS"="POSIXACCOUNT")",
-			      lu_ldap_user_attributes, lu_user, error);
+			      lu_ldap_user_attributes, TRUE, error);
 }
 
 /* Look up a group by name. */
@@ -743,9 +2235,12 @@ lu_ldap_group_lookup_name(struct lu_module *module, const char *name,
 
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
-	return lu_ldap_lookup(module, "cn", name, ent, NULL, ctx->group_branch,
+	if (lu_ldap_lookup_chained(module, name, ent,
+				   lu_ldap_group_attributes))
+		return TRUE;
+	return lu_ldap_lookup(module, "cn", name, ent, ctx->group_branch,
 			      "("OBJECTCLASS"="POSIXGROUP")",
-			      lu_ldap_group_attributes, lu_group, error);
+			      lu_ldap_group_attributes, FALSE, error);
 }
 
 /* Look up a group by ID. */
@@ -759,10 +2254,232 @@ lu_ldap_group_lookup_id(struct lu_module *module, gid_t gid,
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
 	sprintf(gid_string, "%jd", (intmax_t)gid);
-	return lu_ldap_lookup(module, "gidNumber", gid_string, ent, NULL,
+	return lu_ldap_lookup(module, "gidNumber", gid_string, ent,
 			      ctx->group_branch,
 			      "("OBJECTCLASS"="POSIXGROUP")",
-			      lu_ldap_group_attributes, lu_group, error);
+			      lu_ldap_group_attributes, TRUE, error);
+}
+
+/* Look up entities under BASE with values of NAMING_ATTR in KEYS in the
+ * replica of MODULE, as lu_ldap_lookup_many() does. */
+static GPtrArray *
+replica_lookup_many(struct lu_module *module, const char *naming_attr,
+		    GValueArray *keys, gboolean ids, const char *base,
+		    const char *const *attributes, enum lu_entity_type type)
+{
+	struct lu_ldap_context *ctx;
+	GHashTable *found;
+	GPtrArray *ret;
+	size_t i;
+
+	ctx = module->module_context;
+	ret = g_ptr_array_new();
+	/* Each entry is returned once, as by a single search. */
+	found = g_hash_table_new(NULL, NULL);
+	for (i = 0; i < keys->n_values; i++) {
+		struct replica_entry *entry;
+		struct lu_ent *ent;
+		GValue *value;
+		char id_key[sizeof (id_t) * CHAR_BIT + 1];
+		const char *key;
+
+		value = g_value_array_get_nth(keys, i);
+		if (ids) {
+			id_t id;
+
+			id = lu_value_get_id(value);
+			if (id == LU_VALUE_INVALID_ID)
+				continue;
+			sprintf(id_key, "%jd", (intmax_t)id);
+			key = id_key;
+		} else {
+			key = g_value_get_string(value);
+			if (key == NULL)
+				continue;
+		}
+		entry = replica_find(ctx, base,
+				     attributes == lu_ldap_user_attributes,
+				     naming_attr, key);
+		if (entry == NULL
+		    || g_hash_table_lookup_extended(found, entry, NULL, NULL))
+			continue;
+		g_hash_table_insert(found, entry, NULL);
+		ent = lu_ent_new_typed_in(ctx->global_context->ent_arena,
+					  type);
+		replica_read_entry(entry, attributes,
+				   mapped_attributes_of(ctx, attributes), ent);
+		g_ptr_array_add(ret, ent);
+	}
+	g_hash_table_destroy(found);
+	return ret;
+}
+
+/* Look up entities with values of NAMING_ATTR in KEYS, strings, or IDs if
+ * IDS, using one search for each LOOKUP_CHUNK keys instead of one for each
+ * key.  Return the entities, or NULL on error. */
+static GPtrArray *
+lu_ldap_lookup_many(struct lu_module *module, const char *naming_attr,
+		    GValueArray *keys, gboolean ids, const char *branch,
+		    const char *filter, const char *const *attributes,
+		    enum lu_entity_type type, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+	char **mapped_attributes;
+	const char *base;
+	GPtrArray *ret;
+	GString *filt;
+	size_t i;
+
+	g_assert(module != NULL);
+	g_assert(keys != NULL);
+	LU_ERROR_CHECK(error);
+
+	ctx = module->module_context;
+	base = lu_ldap_base(module, branch);
+	if (attributes == lu_ldap_user_attributes)
+		mapped_attributes = ctx->mapped_user_attributes;
+	else
+		mapped_attributes = ctx->mapped_group_attributes;
+
+	if (replica_ready(module))
+		return replica_lookup_many(module, naming_attr, keys, ids,
+					   base, attributes, type);
+	if (!lu_ldap_connection(ctx, error))
+		return NULL;
+
+	ret = g_ptr_array_new();
+	filt = g_string_new(NULL);
+	for (i = 0; i < keys->n_values; ) {
+		LDAPMessage *messages, *entry;
+		size_t n;
+		int err;
+
+		g_string_assign(filt, "(&");
+		g_string_append(filt, filter);
+		g_string_append(filt, "(|");
+		for (n = 0; n < LOOKUP_CHUNK && i < keys->n_values; i++) {
+			GValue *value;
+			char key[sizeof (id_t) * CHAR_BIT + 1];
+			struct berval bv, escaped;
+
+			value = g_value_array_get_nth(keys, i);
+			if (ids) {
+				id_t id;
+
+				id = lu_value_get_id(value);
+				if (id == LU_VALUE_INVALID_ID)
+					continue;
+				sprintf(key, "%jd", (intmax_t)id);
+				bv.bv_val = key;
+			} else {
+				bv.bv_val = (char *)g_value_get_string(value);
+				if (bv.bv_val == NULL)
+					continue;
+			}
+			bv.bv_len = strlen(bv.bv_val);
+			if (ldap_bv2escaped_filter_value(&bv, &escaped) != 0)
+				continue;
+			g_string_append_printf(filt, "(%s=%s)", naming_attr,
+					       escaped.bv_val);
+			ldap_memfree(escaped.bv_val);
+			n++;
+		}
+		g_string_append(filt, "))");
+		if (n == 0)
+			continue;
+
+#ifdef DEBUG
+		g_print("Looking under `%s' with filter `%s'.\n", base,
+			filt->str);
+#endif
+		messages = NULL;
+		err = ldap_search_ext_s(ctx->ldap, base, LDAP_SCOPE_SUBTREE,
+					filt->str, mapped_attributes, FALSE,
+					NULL, NULL, NULL, LDAP_NO_LIMIT,
+					&messages);
+		if (err != LDAP_SUCCESS) {
+			lu_error_new(error, lu_error_generic,
+				     _("error searching LDAP directory: %s"),
+				     ldap_err2string(err));
+			if (messages != NULL)
+				ldap_msgfree(messages);
+			for (i = 0; i < ret->len; i++)
+				lu_ent_free(g_ptr_array_index(ret, i));
+			g_ptr_array_free(ret, TRUE);
+			ret = NULL;
+			break;
+		}
+		for (entry = ldap_first_entry(ctx->ldap, messages);
+		     entry != NULL; entry = ldap_next_entry(ctx->ldap, entry)) {
+			struct lu_ent *ent;
+
+			ent = lu_ent_new_typed_in(ctx->global_context->ent_arena,
+						  type);
+			lu_ldap_read_entry(module, entry, attributes,
+					   mapped_attributes, ent);
+			g_ptr_array_add(ret, ent);
+		}
+		ldap_msgfree(messages);
+	}
+	g_string_free(filt, TRUE);
+
+	return ret;
+}
+
+/* Look up users by name. */
+static GPtrArray *
+lu_ldap_users_lookup_names(struct lu_module *module, GValueArray *names,
+			   struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	return lu_ldap_lookup_many(module, "uid", names, FALSE,
+				   ctx->user_branch,
+				   "("OBJECTCLASS"="POSIXACCOUNT")",
+				   lu_ldap_user_attributes, lu_user, error);
+}
+
+/* Look up users by ID. */
+static GPtrArray *
+lu_ldap_users_lookup_ids(struct lu_module *module, GValueArray *ids,
+			 struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	return lu_ldap_lookup_many(module, "uidNumber", ids, TRUE,
+				   ctx->user_branch,
+				   "("OBJECTCLASS"="POSIXACCOUNT")",
+				   lu_ldap_user_attributes, lu_user, error);
+}
+
+/* Look up groups by name. */
+static GPtrArray *
+lu_ldap_groups_lookup_names(struct lu_module *module, GValueArray *names,
+			    struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	return lu_ldap_lookup_many(module, "cn", names, FALSE,
+				   ctx->group_branch,
+				   "("OBJECTCLASS"="POSIXGROUP")",
+				   lu_ldap_group_attributes, lu_group, error);
+}
+
+/* Look up groups by ID. */
+static GPtrArray *
+lu_ldap_groups_lookup_ids(struct lu_module *module, GValueArray *ids,
+			  struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	return lu_ldap_lookup_many(module, "gidNumber", ids, TRUE,
+				   ctx->group_branch,
+				   "("OBJECTCLASS"="POSIXGROUP")",
+				   lu_ldap_group_attributes, lu_group, error);
 }
 
 /* Compare the contents of two GValueArrays, and return TRUE if they contain
@@ -980,7 +2697,8 @@ get_ent_adds(const char *dn, struct lu_ent *ent)
 			vals = lu_ent_get(ent, attribute);
 			if (vals == NULL)
 				continue;
-			attribute = map_to_ldap(ent->cache, attribute);
+			attribute = map_to_ldap(lu_ent_string_cache(ent),
+						attribute);
 
 			mod = g_malloc0(sizeof(*mod));
 			mod->mod_op = LDAP_MOD_ADD;
@@ -1088,7 +2806,8 @@ get_ent_mods(struct lu_ent *ent, const char *namingAttr)
 			pending = lu_ent_get(ent, attribute) ?: empty;
 			additions = g_value_array_new(0);
 			deletions = g_value_array_new(0);
-			attribute = (char *)map_to_ldap(ent->cache, attribute);
+			attribute = (char *)map_to_ldap(lu_ent_string_cache(ent),
+							attribute);
 
 			/* Create a pair of modification request structures,
 			 * using the LDAP name for the attribute, using
@@ -1277,7 +2996,218 @@ lu_ldap_fudge_objectclasses(struct lu_ldap_context *ctx,
 	}
 	ldap_value_free_len(old_values);
 
-	ldap_msgfree(res);
+	ldap_msgfree(res);
+}
+
+/* Kinds of write operations. */
+enum write_kind { WRITE_ADD, WRITE_MODIFY, WRITE_RENAME, WRITE_DELETE };
+
+/* A write operation sent to the server, or about to be sent. */
+struct write_op {
+	enum write_kind kind;
+	int msgid;
+	char *dn;
+	LDAPMod **mods;		/* WRITE_ADD, WRITE_MODIFY */
+	struct lu_ent *ent;	/* WRITE_MODIFY, to fix up object classes */
+	char *new_rdn;		/* WRITE_RENAME */
+};
+
+static struct write_op *
+write_op_new(enum write_kind kind, const char *dn)
+{
+	struct write_op *op;
+
+	op = g_malloc0(sizeof(*op));
+	op->kind = kind;
+	op->dn = g_strdup(dn);
+	return op;
+}
+
+static void
+write_op_free(struct write_op *op)
+{
+	g_free(op->dn);
+	if (op->mods != NULL)
+		free_ent_mods(op->mods);
+	if (op->ent != NULL)
+		lu_ent_free(op->ent);
+	g_free(op->new_rdn);
+	g_free(op);
+}
+
+/* Send OP without waiting for the result.  Return an LDAP error code. */
+static int
+write_op_send(struct lu_ldap_context *ctx, struct write_op *op)
+{
+	switch (op->kind) {
+	case WRITE_ADD:
+		return ldap_add_ext(ctx->ldap, op->dn, op->mods, NULL, NULL,
+				    &op->msgid);
+	case WRITE_MODIFY:
+		return ldap_modify_ext(ctx->ldap, op->dn, op->mods, NULL, NULL,
+				       &op->msgid);
+	case WRITE_RENAME:
+		return ldap_rename(ctx->ldap, op->dn, op->new_rdn, NULL, TRUE,
+				   NULL, NULL, &op->msgid);
+	case WRITE_DELETE:
+		return ldap_delete_ext(ctx->ldap, op->dn, NULL, NULL,
+				       &op->msgid);
+	}
+	g_assert_not_reached();
+	return LDAP_OTHER;
+}
+
+/* Record that OP failed with ERR, to be reported by write_take_errors(). */
+static void
+write_op_failed(struct lu_ldap_context *ctx, const struct write_op *op,
+		int err)
+{
+	const char *format;
+
+	switch (op->kind) {
+	case WRITE_ADD:
+		format = _("error creating a LDAP directory entry: %s");
+		break;
+	case WRITE_MODIFY:
+		format = _("error modifying LDAP directory entry: %s");
+		break;
+	case WRITE_RENAME:
+		format = _("error renaming LDAP directory entry: %s");
+		break;
+	case WRITE_DELETE:
+		format = _("error removing LDAP directory entry: %s");
+		break;
+	default:
+		g_assert_not_reached();
+		format = NULL;
+	}
+	if (ctx->write_errors == NULL)
+		ctx->write_errors = g_string_new(NULL);
+	else
+		g_string_append_c(ctx->write_errors, '\n');
+	g_string_append_printf(ctx->write_errors, "%s: ", op->dn);
+	g_string_append_printf(ctx->write_errors, format,
+			       ldap_err2string(err));
+}
+
+/* Wait for the result of the oldest write sent to the server. */
+static void
+write_wait_one(struct lu_ldap_context *ctx)
+{
+	struct write_op *op;
+	LDAPMessage *result;
+	int err;
+
+	op = g_queue_pop_head(ctx->writes);
+	result = NULL;
+	err = LDAP_OTHER;
+	if (ldap_result(ctx->ldap, op->msgid, LDAP_MSG_ALL, NULL, &result)
+	    <= 0)
+		ldap_get_option(ctx->ldap, LDAP_OPT_RESULT_CODE, &err);
+	else if (ldap_parse_result(ctx->ldap, result, &err, NULL, NULL, NULL,
+				   NULL, TRUE) != LDAP_SUCCESS)
+		ldap_get_option(ctx->ldap, LDAP_OPT_RESULT_CODE, &err);
+	if (err == LDAP_OBJECT_CLASS_VIOLATION && op->kind == WRITE_MODIFY) {
+		/* AAAARGH!  The application decided it wanted to add some
+		 * new attributes!  Damage control.... */
+		lu_ldap_fudge_objectclasses(ctx, op->dn, op->ent);
+		err = ldap_modify_ext_s(ctx->ldap, op->dn, op->mods, NULL,
+					NULL);
+	}
+	if (err != LDAP_SUCCESS)
+		write_op_failed(ctx, op, err);
+	else if (op->kind == WRITE_RENAME || op->kind == WRITE_DELETE)
+		g_hash_table_remove_all(ctx->dn_cache);
+	g_hash_table_remove_all(ctx->memberships);
+	write_op_free(op);
+}
+
+/* Wait for all writes sent to the server. */
+static void
+write_drain(struct lu_ldap_context *ctx)
+{
+	while (ctx->writes->length != 0)
+		write_wait_one(ctx);
+}
+
+/* Send OP, taking ownership of it, with at most ctx->write_window writes
+ * waiting for results.  The server may process outstanding operations in
+ * any order, so an operation on an entry waits for earlier operations on
+ * the same entry, and a rename waits for everything. */
+static void
+write_submit(struct lu_ldap_context *ctx, struct write_op *op)
+{
+	GList *l;
+	int err;
+
+	if (op->kind == WRITE_RENAME)
+		write_drain(ctx);
+	for (l = ctx->writes->head; l != NULL; l = l->next) {
+		const struct write_op *other;
+
+		other = l->data;
+		if (other->kind == WRITE_RENAME
+		    || g_ascii_strcasecmp(other->dn, op->dn) == 0) {
+			write_drain(ctx);
+			break;
+		}
+	}
+	while (ctx->writes->length >= ctx->write_window)
+		write_wait_one(ctx);
+	if (ctx->replica != NULL)
+		ctx->replica->fresh = FALSE;
+	err = write_op_send(ctx, op);
+	if (err != LDAP_SUCCESS) {
+		write_op_failed(ctx, op, err);
+		write_op_free(op);
+		return;
+	}
+	g_queue_push_tail(ctx->writes, op);
+}
+
+/* Report writes which failed since the last call, if any, in ERROR.  Return
+ * TRUE if there were none. */
+static gboolean
+write_take_errors(struct lu_ldap_context *ctx, struct lu_error **error)
+{
+	if (ctx->write_errors == NULL)
+		return TRUE;
+	lu_error_new(error, lu_error_write, "%s", ctx->write_errors->str);
+	g_string_free(ctx->write_errors, TRUE);
+	ctx->write_errors = NULL;
+	return FALSE;
+}
+
+/* Finish writes of CTX unless a transaction is in progress, in which case
+ * they are only waited for when needed.  Return TRUE unless a write
+ * failed. */
+static gboolean
+write_finish(struct lu_ldap_context *ctx, struct lu_error **error)
+{
+	if (ctx->in_transaction)
+		return TRUE;
+	write_drain(ctx);
+	return write_take_errors(ctx, error);
+}
+
+/* Return the DN of ENT if read from the directory and still matching the
+ * current NAME in NAMING_ATTR, or NULL. */
+static const char *
+lu_ldap_known_dn(struct lu_module *module, struct lu_ent *ent,
+		 const char *namingAttr, const char *name)
+{
+	const char *dn;
+	char *prefix;
+	gboolean ok;
+
+	dn = lu_ent_get_first_string_current(ent, DISTINGUISHED_NAME);
+	if (dn == NULL)
+		return NULL;
+	prefix = g_strconcat(map_to_ldap(module->scache, namingAttr), "=",
+			     name, ",", NULL);
+	ok = g_ascii_strncasecmp(dn, prefix, strlen(prefix)) == 0;
+	g_free(prefix);
+	return ok ? dn : NULL;
 }
 
 /* Apply the changes to a given entity structure, or add a new entitty. */
@@ -1290,9 +3220,8 @@ lu_ldap_set(struct lu_module *module, enum lu_entity_type type, int add,
 	GValue *value;
 	char *name_string;
 	const char *dn, *namingAttr;
-	int err;
-	gboolean ret;
 	struct lu_ldap_context *ctx;
+	struct write_op *op;
 
 	g_assert(module != NULL);
 	g_assert((type == lu_user) || (type == lu_group));
@@ -1301,6 +3230,8 @@ lu_ldap_set(struct lu_module *module, enum lu_entity_type type, int add,
 	LU_ERROR_CHECK(error);
 
 	ctx = module->module_context;
+	if (!lu_ldap_connect(ctx, error))
+		return FALSE;
 
 	/* Get the user/group's pending name, which may be different from the
 	 * current name.  If so, we want to change it seperately, because it
@@ -1326,10 +3257,15 @@ lu_ldap_set(struct lu_module *module, enum lu_entity_type type, int add,
 		return FALSE;
 	}
 
-	/* Get the object's current object name. */
+	/* Get the object's current object name, without a search if the
+	 * entity was read from the directory. */
 	value = g_value_array_get_nth(add ? name : old_name, 0);
 	name_string = lu_value_strdup(value);
-	dn = lu_ldap_ent_to_dn(module, namingAttr, name_string, branch);
+	dn = add ? NULL : lu_ldap_known_dn(module, ent, namingAttr,
+					   name_string);
+	if (dn == NULL)
+		dn = lu_ldap_ent_to_dn(module, namingAttr, name_string,
+				       branch);
 	g_free(name_string);
 
 	if (add) {
@@ -1338,14 +3274,9 @@ lu_ldap_set(struct lu_module *module, enum lu_entity_type type, int add,
 		dump_mods(mods);
 		g_message("Adding `%s'.\n", dn);
 #endif
-		err = ldap_add_ext_s(ctx->ldap, dn, mods, NULL, NULL);
-		if (err != LDAP_SUCCESS) {
-			lu_error_new(error, lu_error_write,
-				     _("error creating a LDAP directory "
-				       "entry: %s"), ldap_err2string(err));
-			ret = FALSE;
-			goto err_mods;
-		}
+		op = write_op_new(WRITE_ADD, dn);
+		op->mods = mods;
+		write_submit(ctx, op);
 	} else {
 		mods = get_ent_mods(ent, namingAttr);
 #ifdef DEBUG
@@ -1355,57 +3286,31 @@ lu_ldap_set(struct lu_module *module, enum lu_entity_type type, int add,
 		/* Attempt the modify operation.  The Fedora Directory server
 		   rejects modify operations with no modifications. */
 		if (mods != NULL && mods[0] != NULL) {
-			err = ldap_modify_ext_s(ctx->ldap, dn, mods, NULL,
-						NULL);
-			if (err == LDAP_OBJECT_CLASS_VIOLATION) {
-				/* AAAARGH!  The application decided it wanted
-				 * to add some new attributes!  Damage
-				 * control.... */
-				lu_ldap_fudge_objectclasses(ctx, dn, ent);
-				err = ldap_modify_ext_s(ctx->ldap, dn, mods,
-							NULL, NULL);
-			}
-			if (err != LDAP_SUCCESS) {
-				lu_error_new(error, lu_error_write,
-					     _("error modifying LDAP "
-					       "directory entry: %s"),
-					     ldap_err2string(err));
-				ret = FALSE;
-				goto err_mods;
-			}
-		}
+			op = write_op_new(WRITE_MODIFY, dn);
+			op->mods = mods;
+			op->ent = lu_ent_new();
+			lu_ent_copy(ent, op->ent);
+			write_submit(ctx, op);
+		} else if (mods != NULL)
+			free_ent_mods(mods);
 
 		/* If the name has changed, process a rename (modrdn). */
 		if (arrays_equal(name, old_name) == FALSE) {
-			char *tmp1, *tmp2;
+			char *tmp;
 
 			/* Format the name to rename it to. */
 			value = g_value_array_get_nth(name, 0);
-			tmp1 = lu_value_strdup(value);
-			tmp2 = g_strconcat(map_to_ldap(module->scache,
-						       namingAttr), "=",
-					   tmp1, NULL);
-			g_free (tmp1);
-			/* Attempt the rename. */
-			err = ldap_rename_s(ctx->ldap, dn, tmp2, NULL, TRUE,
-					    NULL, NULL);
-			g_free(tmp2);
-			if (err != LDAP_SUCCESS) {
-				lu_error_new(error, lu_error_write,
-					     _("error renaming LDAP directory "
-					       "entry: %s"),
-					     ldap_err2string(err));
-				ret = FALSE;
-				goto err_mods;
-			}
+			tmp = lu_value_strdup(value);
+			op = write_op_new(WRITE_RENAME, dn);
+			op->new_rdn = g_strconcat(map_to_ldap(module->scache,
+							      namingAttr),
+						  "=", tmp, NULL);
+			g_free(tmp);
+			write_submit(ctx, op);
 		}
 	}
-	ret = TRUE;
-
- err_mods:
-	free_ent_mods(mods);
 
-	return ret;
+	return write_finish(ctx, error);
 }
 
 /* Remove an entry from the directory. */
@@ -1415,8 +3320,6 @@ lu_ldap_del(struct lu_module *module, enum lu_entity_type type,
 {
 	char *name;
 	const char *dn, *namingAttr;
-	int err;
-	gboolean ret = FALSE;
 	struct lu_ldap_context *ctx;
 
 	g_assert(module != NULL);
@@ -1426,6 +3329,8 @@ lu_ldap_del(struct lu_module *module, enum lu_entity_type type,
 	LU_ERROR_CHECK(error);
 
 	ctx = module->module_context;
+	if (!lu_ldap_connect(ctx, error))
+		return FALSE;
 
 	/* Get the user or group's name. */
 	if (type == lu_user) {
@@ -1442,23 +3347,16 @@ lu_ldap_del(struct lu_module *module, enum lu_entity_type type,
 	}
 
 	/* Convert the name to a distinguished name. */
-	dn = lu_ldap_ent_to_dn(module, namingAttr, name, branch);
+	dn = lu_ldap_known_dn(module, ent, namingAttr, name);
+	if (dn == NULL)
+		dn = lu_ldap_ent_to_dn(module, namingAttr, name, branch);
 	g_free(name);
 	/* Process the removal. */
 #ifdef DEBUG
 	g_message("Removing `%s'.\n", dn);
 #endif
-	err = ldap_delete_ext_s(ctx->ldap, dn, NULL, NULL);
-	if (err == LDAP_SUCCESS) {
-		ret = TRUE;
-	} else {
-		lu_error_new(error, lu_error_write,
-			     _("error removing LDAP directory entry: %s"),
-			     ldap_err2string(err));
-		return FALSE;
-	}
-
-	return ret;
+	write_submit(ctx, write_op_new(WRITE_DELETE, dn));
+	return write_finish(ctx, error);
 }
 
 /* Return TRUE if pw starts with a valid scheme specification */
@@ -1498,6 +3396,8 @@ lu_ldap_handle_lock(struct lu_module *module, struct lu_ent *ent,
 	g_assert(strlen(namingAttr) > 0);
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
+	if (!lu_ldap_connection(ctx, error))
+		return FALSE;
 
 	/* Get the entry's name. */
 	name = lu_ent_get_first_value_strdup(ent, namingAttr);
@@ -1545,9 +3445,9 @@ lu_ldap_handle_lock(struct lu_module *module, struct lu_ent *ent,
 			return FALSE;
 		}
 	} else
-		tmp = ent->cache->cache(ent->cache,
-					oldpassword + strlen(LU_CRYPTED));
-	result = ent->cache->cache(ent->cache, tmp);
+		tmp = lu_ent_cache_string(ent,
+					  oldpassword + strlen(LU_CRYPTED));
+	result = lu_ent_cache_string(ent, tmp);
 
 	/* Generate a new string with the modification applied. */
 	switch (op) {
@@ -1579,14 +3479,15 @@ lu_ldap_handle_lock(struct lu_module *module, struct lu_ent *ent,
 	}
 	/* Set up the LDAP modify operation. */
 	mod[0].mod_op = LDAP_MOD_DELETE;
-	mod[0].mod_type = (char *)map_to_ldap(ent->cache, attribute);
-	values[0][0] = ent->cache->cache(ent->cache, oldpassword);
+	mod[0].mod_type = (char *)map_to_ldap(lu_ent_string_cache(ent),
+					      attribute);
+	values[0][0] = lu_ent_cache_string(ent, oldpassword);
 	values[0][1] = NULL;
 	mod[0].mod_values = values[0];
 
 	mod[1].mod_op = LDAP_MOD_ADD;
 	mod[1].mod_type = mod[0].mod_type;
-	values[1][0] = ent->cache->cache(ent->cache, result);
+	values[1][0] = lu_ent_cache_string(ent, result);
 	values[1][1] = NULL;
 	mod[1].mod_values = values[1];
 	g_free(result);
@@ -1628,6 +3529,9 @@ lu_ldap_is_locked(struct lu_module *module, struct lu_ent *ent,
 	int i;
 	gboolean locked;
 
+	if (!lu_ldap_connection(ctx, error))
+		return FALSE;
+
 	/* Get the name of the user or group. */
 	name = lu_ent_get_first_value_strdup(ent, namingAttr);
 	if (name == NULL) {
@@ -1720,6 +3624,9 @@ lu_ldap_setpass(struct lu_module *module, const char *namingAttr,
 	LDAPMod *mods[3];
 	char filter[LINE_MAX];
 
+	if (!lu_ldap_connection(ctx, error))
+		return FALSE;
+
 	/* Get the user or group's name. */
 #ifdef DEBUG
 	g_print("Setting password to `%s'.\n", password);
@@ -1872,16 +3779,99 @@ lu_ldap_group_removepass(struct lu_module *module, struct lu_ent *ent,
 			       LU_CRYPTED, error);
 }
 
+/* Values of an attribute collected by lu_ldap_enumerate(). */
+struct enumerate {
+	const char *attribute;
+	GValueArray *values;
+	GValue value;
+};
+
+/* Add the values of an attribute in ENTRY to DATA, a struct enumerate. */
+static gboolean
+enumerate_entry(struct lu_module *module, LDAPMessage *entry, gpointer data)
+{
+	struct lu_ldap_context *ctx;
+	struct enumerate *enumerate;
+	BerValue **values;
+	size_t i;
+
+	ctx = module->module_context;
+	enumerate = data;
+	values = ldap_get_values_len(ctx->ldap, entry, enumerate->attribute);
+	for (i = 0; values != NULL && values[i] != NULL; i++) {
+		char *val;
+
+		val = g_strndup(values[i]->bv_val, values[i]->bv_len);
+#ifdef DEBUG
+		g_print("Got `%s' = `%s'.\n", enumerate->attribute, val);
+#endif
+		g_value_take_string(&enumerate->value, val);
+		g_value_array_append(enumerate->values, &enumerate->value);
+	}
+	if (values != NULL)
+		ldap_value_free_len(values);
+	return TRUE;
+}
+
+/* Return TRUE if REPLICA, which may be NULL, keeps ATTR. */
+static gboolean
+replica_has_attribute(const struct replica *replica, const char *attr)
+{
+	size_t i;
+
+	if (replica == NULL)
+		return FALSE;
+	for (i = 0; replica->attributes[i] != NULL; i++) {
+		if (g_ascii_strcasecmp(replica->attributes[i], attr) == 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+/* Return the values of RETURN_ATTR of entries under BASE in the replica of
+ * CTX with SEARCH_ATTR matching PATTERN, as lu_ldap_enumerate() does. */
+static GValueArray *
+replica_enumerate(struct lu_ldap_context *ctx, const char *searchAttr,
+		  const char *pattern, const char *returnAttr,
+		  const char *base)
+{
+	GHashTableIter iter;
+	GValueArray *ret;
+	GValue value;
+	gpointer v;
+
+	ret = g_value_array_new(0);
+	memset(&value, 0, sizeof(value));
+	g_value_init(&value, G_TYPE_STRING);
+	g_hash_table_iter_init(&iter, ctx->replica->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &v)) {
+		struct replica_entry *entry;
+		GPtrArray *values;
+		size_t i;
+
+		entry = v;
+		if (!replica_entry_in(entry, base)
+		    || !replica_entry_matches(entry, searchAttr, pattern))
+			continue;
+		values = g_hash_table_lookup(entry->attrs, returnAttr);
+		for (i = 0; values != NULL && i < values->len; i++) {
+			g_value_set_string(&value,
+					   g_ptr_array_index(values, i));
+			g_value_array_append(ret, &value);
+		}
+	}
+	g_value_unset(&value);
+	return ret;
+}
+
 static GValueArray *
 lu_ldap_enumerate(struct lu_module *module,
 		  const char *searchAttr, const char *pattern,
 		  const char *returnAttr, const char *branch,
 		  struct lu_error **error)
 {
-	LDAPMessage *messages = NULL;
+	struct enumerate enumerate;
 	char *base, *filt;
-	GValue value;
-	GValueArray *ret;
 	struct lu_ldap_context *ctx;
 	char *attributes[] = { (char *) returnAttr, NULL };
 
@@ -1900,6 +3890,21 @@ lu_ldap_enumerate(struct lu_module *module,
 			       ctx->prompts[LU_LDAP_BASEDN].value &&
 			       strlen(ctx->prompts[LU_LDAP_BASEDN].value) ?
 			       ctx->prompts[LU_LDAP_BASEDN].value : "*");
+
+	if (replica_has_attribute(ctx->replica, searchAttr)
+	    && replica_has_attribute(ctx->replica, returnAttr)
+	    && replica_ready(module)) {
+		GValueArray *ret;
+
+		ret = replica_enumerate(ctx, searchAttr, pattern ?: "*",
+					returnAttr, base);
+		g_free(base);
+		return ret;
+	}
+	if (!lu_ldap_connection(ctx, error)) {
+		g_free(base);
+		return NULL;
+	}
 	/* Generate the filter to search with. */
 	filt = g_strdup_printf("(%s=%s)", searchAttr, pattern ?: "*");
 
@@ -1908,54 +3913,18 @@ lu_ldap_enumerate(struct lu_module *module,
 #endif
 
 	/* Perform the search. */
-	ret = g_value_array_new(0);
-	memset(&value, 0, sizeof(value));
-	g_value_init(&value, G_TYPE_STRING);
-	if (ldap_search_ext_s(ctx->ldap, base, LDAP_SCOPE_SUBTREE, filt,
-			      attributes, FALSE, NULL, NULL, NULL,
-			      LDAP_NO_LIMIT, &messages) == LDAP_SUCCESS) {
-		LDAPMessage *entry;
-
-		entry = ldap_first_entry(ctx->ldap, messages);
-		if (entry != NULL) {
-			while (entry != NULL) {
-				BerValue **values;
-				size_t i;
-
-				values = ldap_get_values_len(ctx->ldap, entry,
-							     returnAttr);
-				for (i = 0;
-				     (values != NULL) && (values[i] != NULL);
-				     i++) {
-					char *val;
-
-					val = g_strndup(values[i]->bv_val,
-							values[i]->bv_len);
-#ifdef DEBUG
-					g_print("Got `%s' = `%s'.\n",
-						returnAttr, val);
-#endif
-					g_value_take_string(&value, val);
-					g_value_array_append(ret, &value);
-				}
-				ldap_value_free_len(values);
-				entry = ldap_next_entry(ctx->ldap, entry);
-			}
-#ifdef DEBUG
-		} else {
-			g_print("No such entry found in LDAP, continuing.\n");
-#endif
-		}
-	}
-	if (messages != NULL) {
-		ldap_msgfree(messages);
-	}
-
-	g_value_unset(&value);
+	enumerate.attribute = returnAttr;
+	enumerate.values = g_value_array_new(0);
+	memset(&enumerate.value, 0, sizeof(enumerate.value));
+	g_value_init(&enumerate.value, G_TYPE_STRING);
+	lu_ldap_search(module, base, filt, attributes, enumerate_entry,
+		       &enumerate);
+
+	g_value_unset(&enumerate.value);
 	g_free(base);
 	g_free(filt);
 
-	return ret;
+	return enumerate.values;
 }
 
 /* Add a user to the directory. */
@@ -2221,6 +4190,14 @@ lu_ldap_users_enumerate(struct lu_module *module, const char *pattern,
 				 ctx->user_branch, error);
 }
 
+/* Add ENT to DATA, a GPtrArray.  A lu_ent_fn. */
+static gboolean
+add_to_array(struct lu_ent *ent, gpointer data)
+{
+	g_ptr_array_add(data, ent);
+	return TRUE;
+}
+
 static GPtrArray *
 lu_ldap_users_enumerate_full(struct lu_module *module, const char *pattern,
 			     struct lu_error **error)
@@ -2230,12 +4207,29 @@ lu_ldap_users_enumerate_full(struct lu_module *module, const char *pattern,
 
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
-	lu_ldap_lookup(module, "uid", pattern, NULL, array, ctx->user_branch,
-		       "("OBJECTCLASS"="POSIXACCOUNT")",
-		       lu_ldap_user_attributes, lu_user, error);
+	lu_ldap_lookup_all(module, "uid", pattern, ctx->user_branch,
+			   "("OBJECTCLASS"="POSIXACCOUNT")",
+			   lu_ldap_user_attributes, lu_user, add_to_array,
+			   array, error);
 	return array;
 }
 
+/* Pass all users matching a pattern to CALLBACK as they arrive. */
+static gboolean
+lu_ldap_users_enumerate_full_stream(struct lu_module *module,
+				    const char *pattern, lu_ent_fn *callback,
+				    gpointer data, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	LU_ERROR_CHECK(error);
+	ctx = module->module_context;
+	return lu_ldap_lookup_all(module, "uid", pattern, ctx->user_branch,
+				  "("OBJECTCLASS"="POSIXACCOUNT")",
+				  lu_ldap_user_attributes, lu_user, callback,
+				  data, error);
+}
+
 /* Get a listing of all group names. */
 static GValueArray *
 lu_ldap_groups_enumerate(struct lu_module *module, const char *pattern,
@@ -2258,12 +4252,29 @@ lu_ldap_groups_enumerate_full(struct lu_module *module, const char *pattern,
 	GPtrArray *array = g_ptr_array_new();
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
-	lu_ldap_lookup(module, "cn", pattern, NULL, array, ctx->group_branch,
-		       "("OBJECTCLASS"="POSIXGROUP")",
-		       lu_ldap_group_attributes, lu_group, error);
+	lu_ldap_lookup_all(module, "cn", pattern, ctx->group_branch,
+			   "("OBJECTCLASS"="POSIXGROUP")",
+			   lu_ldap_group_attributes, lu_group, add_to_array,
+			   array, error);
 	return array;
 }
 
+/* Pass all groups matching a pattern to CALLBACK as they arrive. */
+static gboolean
+lu_ldap_groups_enumerate_full_stream(struct lu_module *module,
+				     const char *pattern, lu_ent_fn *callback,
+				     gpointer data, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	LU_ERROR_CHECK(error);
+	ctx = module->module_context;
+	return lu_ldap_lookup_all(module, "cn", pattern, ctx->group_branch,
+				  "("OBJECTCLASS"="POSIXGROUP")",
+				  lu_ldap_group_attributes, lu_group, callback,
+				  data, error);
+}
+
 /* Get a list of all users in a group, either via their primary or supplemental
  * group memberships. */
 static GValueArray *
@@ -2294,6 +4305,189 @@ lu_ldap_users_enumerate_by_group(struct lu_module *module,
 	return ret;
 }
 
+/* Append "(ATTR=VALUE)" to FILT, escaping VALUE. */
+static void
+append_filter_term(GString *filt, const char *attr, const char *value)
+{
+	struct berval bv, escaped;
+
+	bv.bv_val = (char *)value;
+	bv.bv_len = strlen(value);
+	if (ldap_bv2escaped_filter_value(&bv, &escaped) != 0)
+		return;
+	g_string_append_printf(filt, "(%s=%s)", attr, escaped.bv_val);
+	ldap_memfree(escaped.bv_val);
+}
+
+/* The user entry found by lu_ldap_groups_enumerate_by_user(). */
+struct member_user {
+	char *dn;
+	GPtrArray *gids;	/* Strings, the primary GIDs */
+};
+
+/* Read the DN and primary GIDs of ENTRY into DATA, a struct member_user.
+ * An entry_fn. */
+static gboolean
+member_user_entry(struct lu_module *module, LDAPMessage *entry,
+		  gpointer data)
+{
+	struct lu_ldap_context *ctx;
+	struct member_user *user;
+	BerValue **values;
+	size_t i;
+
+	ctx = module->module_context;
+	user = data;
+	if (user->dn == NULL) {
+		char *dn;
+
+		dn = ldap_get_dn(ctx->ldap, entry);
+		user->dn = g_strdup(dn);
+		ldap_memfree(dn);
+	}
+	values = ldap_get_values_len(ctx->ldap, entry,
+				     map_to_ldap(module->scache, LU_GIDNUMBER));
+	for (i = 0; values != NULL && values[i] != NULL; i++)
+		g_ptr_array_add(user->gids, g_strndup(values[i]->bv_val,
+						      values[i]->bv_len));
+	if (values != NULL)
+		ldap_value_free_len(values);
+	return TRUE;
+}
+
+/* The groups found by lu_ldap_groups_enumerate_by_user(). */
+struct member_groups {
+	GPtrArray *gids;	/* The user's primary GIDs */
+	GHashTable *found_gids;	/* Primary GIDs of found groups -> NULL */
+	GValueArray *primary, *secondary; /* Group names */
+	GValue value;
+};
+
+/* Add the name of the group in ENTRY to DATA, a struct member_groups.
+ * An entry_fn. */
+static gboolean
+member_group_entry(struct lu_module *module, LDAPMessage *entry,
+		   gpointer data)
+{
+	struct lu_ldap_context *ctx;
+	struct member_groups *groups;
+	GValueArray *dest;
+	BerValue **values;
+	size_t i;
+
+	ctx = module->module_context;
+	groups = data;
+	dest = groups->secondary;
+	values = ldap_get_values_len(ctx->ldap, entry,
+				     map_to_ldap(module->scache, LU_GIDNUMBER));
+	for (i = 0; values != NULL && values[i] != NULL; i++) {
+		char *gid;
+		size_t j;
+
+		gid = g_strndup(values[i]->bv_val, values[i]->bv_len);
+		for (j = 0; j < groups->gids->len; j++) {
+			if (strcmp(g_ptr_array_index(groups->gids, j), gid)
+			    == 0) {
+				g_hash_table_replace(groups->found_gids, gid,
+						     NULL);
+				gid = NULL;
+				dest = groups->primary;
+				break;
+			}
+		}
+		g_free(gid);
+	}
+	if (values != NULL)
+		ldap_value_free_len(values);
+
+	values = ldap_get_values_len(ctx->ldap, entry,
+				     map_to_ldap(module->scache, LU_GROUPNAME));
+	for (i = 0; values != NULL && values[i] != NULL; i++) {
+		g_value_take_string(&groups->value,
+				    g_strndup(values[i]->bv_val,
+					      values[i]->bv_len));
+		g_value_array_append(dest, &groups->value);
+	}
+	if (values != NULL)
+		ldap_value_free_len(values);
+	return TRUE;
+}
+
+/* Fill USER and GROUPS for lu_ldap_groups_enumerate_by_user() from the
+ * replica of MODULE instead of searching the directory. */
+static void
+replica_member_groups(struct lu_module *module, const char *name,
+		      struct member_user *user, struct member_groups *groups)
+{
+	struct lu_ldap_context *ctx;
+	struct replica_entry *entry;
+	GHashTableIter iter;
+	GPtrArray *values;
+	const char *gid_attr, *name_attr, *member_attr;
+	gpointer v;
+	size_t i;
+
+	ctx = module->module_context;
+	gid_attr = map_to_ldap(module->scache, LU_GIDNUMBER);
+	name_attr = map_to_ldap(module->scache, LU_GROUPNAME);
+	member_attr = map_to_ldap(module->scache, LU_MEMBERNAME);
+
+	entry = replica_find(ctx, lu_ldap_base(module, ctx->user_branch), TRUE,
+			     map_to_ldap(module->scache, LU_USERNAME), name);
+	if (entry != NULL) {
+		user->dn = g_strdup(entry->dn);
+		values = g_hash_table_lookup(entry->attrs, gid_attr);
+		for (i = 0; values != NULL && i < values->len; i++)
+			g_ptr_array_add(user->gids,
+					g_strdup(g_ptr_array_index(values,
+								   i)));
+	}
+
+	g_hash_table_iter_init(&iter, ctx->replica->entries);
+	while (g_hash_table_iter_next(&iter, NULL, &v)) {
+		GValueArray *dest;
+
+		entry = v;
+		if (!entry->group
+		    || !replica_entry_in(entry,
+					 lu_ldap_base(module,
+						      ctx->group_branch)))
+			continue;
+		dest = NULL;
+		values = g_hash_table_lookup(entry->attrs, gid_attr);
+		for (i = 0; values != NULL && i < values->len; i++) {
+			const char *gid;
+			size_t j;
+
+			gid = g_ptr_array_index(values, i);
+			for (j = 0; j < user->gids->len; j++) {
+				if (strcmp(g_ptr_array_index(user->gids, j),
+					   gid) == 0) {
+					g_hash_table_replace
+						(groups->found_gids,
+						 g_strdup(gid), NULL);
+					dest = groups->primary;
+					break;
+				}
+			}
+		}
+		if (dest == NULL
+		    && (replica_entry_matches(entry, member_attr, name)
+			|| (ctx->member_dn && user->dn != NULL
+			    && replica_entry_matches(entry, "member",
+						     user->dn))))
+			dest = groups->secondary;
+		if (dest == NULL)
+			continue;
+		values = g_hash_table_lookup(entry->attrs, name_attr);
+		for (i = 0; values != NULL && i < values->len; i++) {
+			g_value_set_string(&groups->value,
+					   g_ptr_array_index(values, i));
+			g_value_array_append(dest, &groups->value);
+		}
+	}
+}
+
 /* Get a list of all groups to which the user belongs, via either primary or
  * supplemental group memberships. */
 static GValueArray *
@@ -2303,53 +4497,121 @@ lu_ldap_groups_enumerate_by_user(struct lu_module *module,
 				 struct lu_error **error)
 {
 	struct lu_ldap_context *ctx;
-	GValueArray *ret, *gids;
-	GValue *value;
+	struct membership *cached;
+	struct member_user member_user;
+	struct member_groups groups;
+	GValueArray *ret;
+	GString *filt;
+	char *attributes[3];
+	gboolean use_replica;
 	size_t i;
+	int err, group_err;
 
 	(void)uid;
 	LU_ERROR_CHECK(error);
 	ctx = module->module_context;
 
-	/* Create an array to hold the values returned. */
-	ret = g_value_array_new(0);
+	cached = g_hash_table_lookup(ctx->memberships, user);
+	if (cached != NULL && cached->expires > g_get_monotonic_time())
+		return g_value_array_copy(cached->groups);
 
-	/* Get the user's primary GID(s). */
-	gids = lu_ldap_enumerate(module, "uid", user, "gidNumber",
-				 ctx->user_branch, error);
-	/* For each GID, look up the group.  Which has this GID. */
-	for (i = 0; (gids != NULL) && (i < gids->n_values); i++) {
-		gid_t gid;
+	use_replica = replica_ready(module);
+	if (!use_replica && !lu_ldap_connection(ctx, error))
+		return NULL;
+
+	member_user.dn = NULL;
+	member_user.gids = g_ptr_array_new_with_free_func(g_free);
+	groups.gids = member_user.gids;
+	groups.found_gids = g_hash_table_new_full(g_str_hash, g_str_equal,
+						  g_free, NULL);
+	groups.primary = g_value_array_new(0);
+	groups.secondary = g_value_array_new(0);
+	memset(&groups.value, 0, sizeof(groups.value));
+	g_value_init(&groups.value, G_TYPE_STRING);
+
+	if (use_replica) {
+		replica_member_groups(module, user, &member_user, &groups);
+		err = LDAP_SUCCESS;
+		goto primary;
+	}
+
+	/* Find the user's DN and primary GID(s). */
+	filt = g_string_new("(&("OBJECTCLASS"="POSIXACCOUNT")");
+	append_filter_term(filt, map_to_ldap(module->scache, LU_USERNAME),
+			   user);
+	g_string_append_c(filt, ')');
+	attributes[0] = (char *)map_to_ldap(module->scache, LU_GIDNUMBER);
+	attributes[1] = NULL;
+	err = lu_ldap_search(module, lu_ldap_base(module, ctx->user_branch),
+			     filt->str, attributes, member_user_entry,
+			     &member_user);
+
+	/* Find the primary and supplemental groups with one search. */
+	g_string_assign(filt, "(&("OBJECTCLASS"="POSIXGROUP")(|");
+	append_filter_term(filt, map_to_ldap(module->scache, LU_MEMBERNAME),
+			   user);
+	for (i = 0; i < member_user.gids->len; i++)
+		append_filter_term(filt,
+				   map_to_ldap(module->scache, LU_GIDNUMBER),
+				   g_ptr_array_index(member_user.gids, i));
+	if (ctx->member_dn && member_user.dn != NULL)
+		append_filter_term(filt, "member", member_user.dn);
+	g_string_append(filt, "))");
+	attributes[0] = (char *)map_to_ldap(module->scache, LU_GROUPNAME);
+	attributes[1] = (char *)map_to_ldap(module->scache, LU_GIDNUMBER);
+	attributes[2] = NULL;
+	group_err = lu_ldap_search(module,
+				   lu_ldap_base(module, ctx->group_branch),
+				   filt->str, attributes, member_group_entry,
+				   &groups);
+	if (err == LDAP_SUCCESS)
+		err = group_err;
+	g_string_free(filt, TRUE);
+
+primary:
+	/* A primary group may be stored by another module. */
+	for (i = 0; i < member_user.gids->len; i++) {
+		const char *gid_string;
 		struct lu_ent *ent;
+		char *end;
+		intmax_t gid;
 
-		value = g_value_array_get_nth(gids, i);
-		gid = lu_value_get_id(value);
-		if (gid == LU_VALUE_INVALID_ID)
+		gid_string = g_ptr_array_index(member_user.gids, i);
+		if (g_hash_table_lookup_extended(groups.found_gids, gid_string,
+						 NULL, NULL))
+			continue;
+		errno = 0;
+		gid = strtoimax(gid_string, &end, 10);
+		if (errno != 0 || *end != 0 || end == gid_string
+		    || (gid_t)gid != gid || (gid_t)gid == LU_VALUE_INVALID_ID)
 			continue;
 		ent = lu_ent_new();
-		if (lu_group_lookup_id(module->lu_context, gid,
-				       ent, error))
-			/* Get the group's names and add them to the list
-			 * of values to return. */
-			lu_util_append_values(ret,
+		if (lu_group_lookup_id(module->lu_context, gid, ent, error))
+			lu_util_append_values(groups.primary,
 					      lu_ent_get(ent, LU_GROUPNAME));
 		lu_ent_free(ent);
 	}
-	g_value_array_free(gids);
-	/* Search for the supplemental groups which list this user as
-	 * a member. */
-	if (*error == NULL) {
-		GValueArray *secondaries;
 
-		secondaries = lu_ldap_enumerate(module, "memberUid", user,
-						"cn", ctx->group_branch,
-						error);
-		lu_util_append_values(ret, secondaries);
-		g_value_array_free(secondaries);
+	ret = groups.primary;
+	lu_util_append_values(ret, groups.secondary);
+	g_value_array_free(groups.secondary);
+	g_value_unset(&groups.value);
+	g_hash_table_destroy(groups.found_gids);
+	g_ptr_array_free(member_user.gids, TRUE);
+	g_free(member_user.dn);
+
+	if (ctx->membership_ttl != 0 && err == LDAP_SUCCESS
+	    && *error == NULL) {
+		cached = g_malloc(sizeof(*cached));
+		cached->groups = g_value_array_copy(ret);
+		cached->expires = g_get_monotonic_time() + ctx->membership_ttl;
+		g_hash_table_replace(ctx->memberships, g_strdup(user), cached);
 	}
 
 #ifdef DEBUG
 	for (i = 0; i < ret->n_values; i++) {
+		GValue *value;
+
 		value = g_value_array_get_nth(ret, i);
 		g_print("`%s' is in `%s'\n", user,
 			g_value_get_string(value));
@@ -2359,6 +4621,49 @@ lu_ldap_groups_enumerate_by_user(struct lu_module *module,
 	return ret;
 }
 
+/* Start a transaction: send writes without waiting for their results until
+ * needed. */
+static gboolean
+lu_ldap_transaction_begin(struct lu_module *module, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	(void)error;
+	ctx = module->module_context;
+	g_assert(!ctx->in_transaction);
+	ctx->in_transaction = TRUE;
+	return TRUE;
+}
+
+/* Wait for all writes in the current transaction, and report those which
+ * failed. */
+static gboolean
+lu_ldap_transaction_commit(struct lu_module *module, struct lu_error **error)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	g_assert(ctx->in_transaction);
+	ctx->in_transaction = FALSE;
+	write_drain(ctx);
+	return write_take_errors(ctx, error);
+}
+
+/* End the current transaction.  Writes already sent can not be undone. */
+static void
+lu_ldap_transaction_abort(struct lu_module *module)
+{
+	struct lu_ldap_context *ctx;
+
+	ctx = module->module_context;
+	ctx->in_transaction = FALSE;
+	write_drain(ctx);
+	if (ctx->write_errors != NULL) {
+		g_string_free(ctx->write_errors, TRUE);
+		ctx->write_errors = NULL;
+	}
+}
+
 static gboolean
 lu_ldap_close_module(struct lu_module *module)
 {
@@ -2368,7 +4673,20 @@ lu_ldap_close_module(struct lu_module *module)
 	g_assert(module != NULL);
 
 	ctx = module->module_context;
-	close_server(ctx->ldap);
+	lu_ldap_transaction_abort(module);
+	g_queue_free(ctx->writes);
+	if (ctx->replica != NULL)
+		replica_free(ctx->replica);
+	chain_forget(ctx);
+	g_hash_table_destroy(ctx->dn_cache);
+	g_hash_table_destroy(ctx->memberships);
+	if (ctx->ldap != NULL) {
+		if (ctx->pool_size != 0)
+			pool_release(ctx, ctx->ldap);
+		else
+			close_server(ctx->ldap);
+	}
+	g_free(ctx->pool_key);
 
 	module->scache->free(module->scache);
 	for (i = 0; i < sizeof(ctx->prompts) / sizeof(ctx->prompts[0]);
@@ -2429,10 +4747,10 @@ libuser_ldap_init(struct lu_context *context, struct lu_error **error)
 	struct lu_module *ret;
 	struct lu_ldap_context *ctx;
 	struct lu_prompt prompts[G_N_ELEMENTS(ctx->prompts)];
-	const char *bind_type;
-	char **bind_types;
+	const char *bind_type, *value;
+	char **bind_types, *end;
+	unsigned long pool_size, page_size, write_window;
 	size_t i;
-	LDAP *ldap;
 
 	g_assert(context != NULL);
 	g_assert(context->prompter != NULL);
@@ -2542,15 +4860,60 @@ libuser_ldap_init(struct lu_context *context, struct lu_error **error)
 	ctx->group_branch = lu_cfg_read_single(context, "ldap/groupBranch",
 					       GROUPBRANCH);
 
-	/* Try to bind to the server to verify that we can. */
-	ldap = bind_server(ctx, error);
-	if (ldap == NULL) {
-		ret->scache->free(ret->scache);
-		g_free(ret);
-		g_free(ctx);
-		return NULL;
+	/* The connection is created when first needed. */
+	ctx->pool_key = connection_key_new(ctx, TRUE);
+	value = lu_cfg_read_single(context, "ldap/pool_size", "4");
+	errno = 0;
+	pool_size = strtoul(value, &end, 10);
+	if (errno != 0 || *end != 0 || end == value) {
+		g_warning("Invalid %s value '%s'", "ldap/pool_size", value);
+		pool_size = 0;
 	}
-	ctx->ldap = ldap;
+	ctx->pool_size = MIN(pool_size, UINT_MAX);
+
+	value = lu_cfg_read_single(context, "ldap/page_size", "500");
+	errno = 0;
+	page_size = strtoul(value, &end, 10);
+	if (errno != 0 || *end != 0 || end == value) {
+		g_warning("Invalid %s value '%s'", "ldap/page_size", value);
+		page_size = 0;
+	}
+	ctx->page_size = MIN(page_size, G_MAXINT32);
+
+	ctx->dn_cache = g_hash_table_new_full(g_str_hash, g_str_equal, g_free,
+					      g_free);
+
+	/* Remember memberships as long as entities would be remembered. */
+	value = lu_cfg_read_single(context, "defaults/entity_cache", "no");
+	if (g_ascii_strcasecmp(value, "yes") == 0) {
+		unsigned long seconds;
+
+		value = lu_cfg_read_single(context, "ldap/cache_ttl", "60");
+		errno = 0;
+		seconds = strtoul(value, &end, 10);
+		if (errno != 0 || *end != 0 || end == value) {
+			g_warning("Invalid %s value '%s'", "ldap/cache_ttl",
+				  value);
+			seconds = 0;
+		}
+		ctx->membership_ttl = (gint64)MIN(seconds, G_MAXINT32)
+			* G_USEC_PER_SEC;
+	}
+	ctx->memberships = g_hash_table_new_full(g_str_hash, g_str_equal,
+						 g_free, membership_free);
+
+	value = lu_cfg_read_single(context, "ldap/member_dn", "no");
+	ctx->member_dn = g_ascii_strcasecmp(value, "yes") == 0;
+
+	value = lu_cfg_read_single(context, "ldap/write_window", "32");
+	errno = 0;
+	write_window = strtoul(value, &end, 10);
+	if (errno != 0 || *end != 0 || end == value) {
+		g_warning("Invalid %s value '%s'", "ldap/write_window", value);
+		write_window = 1;
+	}
+	ctx->write_window = CLAMP(write_window, 1, UINT_MAX);
+	ctx->writes = g_queue_new();
 
 	ctx->mapped_user_attributes
 		= g_malloc0_n(G_N_ELEMENTS(lu_ldap_user_attributes),
@@ -2576,6 +4939,10 @@ libuser_ldap_init(struct lu_context *context, struct lu_error **error)
 			ctx->mapped_group_attributes[i] = NULL;
 	}
 
+	value = lu_cfg_read_single(context, "ldap/replica", "");
+	if (*value != 0)
+		ctx->replica = replica_new(ctx, value);
+
 	/* Set the method pointers. */
 	ret->valid_module_combination = lu_ldap_valid_module_combination;
 	ret->uses_elevated_privileges = lu_ldap_uses_elevated_privileges;
@@ -2614,6 +4981,19 @@ libuser_ldap_init(struct lu_context *context, struct lu_error **error)
 	ret->groups_enumerate_by_user = lu_ldap_groups_enumerate_by_user;
 	ret->groups_enumerate_full = lu_ldap_groups_enumerate_full;
 
+	ret->users_enumerate_full_stream = lu_ldap_users_enumerate_full_stream;
+	ret->groups_enumerate_full_stream
+		= lu_ldap_groups_enumerate_full_stream;
+
+	ret->transaction_begin = lu_ldap_transaction_begin;
+	ret->transaction_commit = lu_ldap_transaction_commit;
+	ret->transaction_abort = lu_ldap_transaction_abort;
+
+	ret->users_lookup_names = lu_ldap_users_lookup_names;
+	ret->users_lookup_ids = lu_ldap_users_lookup_ids;
+	ret->groups_lookup_names = lu_ldap_groups_lookup_names;
+	ret->groups_lookup_ids = lu_ldap_groups_lookup_ids;
+
 	ret->close = lu_ldap_close_module;
 
 	/* Done. */
@@ -269,6 +269,125 @@ libuser_admin_lookup_group_id(PyObject *self, PyObject *args,
 	}
 }
 
+/* Look up a list of users or groups of ENTTYPE by name, or by ID if BY_ID. */
+static PyObject *
+libuser_admin_lookup_many(PyObject *self, PyObject *args, PyObject *kwargs,
+			  enum lu_entity_type enttype, gboolean by_id)
+{
+	PyObject *list, *seq, *ret;
+	GValueArray *keys;
+	GPtrArray *results;
+	Py_ssize_t i, count;
+	struct lu_error *error = NULL;
+	char *keywords[] = { "keys", NULL };
+	struct libuser_admin *me = (struct libuser_admin *) self;
+
+	DEBUG_ENTRY;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", keywords,
+					 &list)) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	seq = PySequence_Fast(list, by_id ? "expected a sequence of IDs"
+			      : "expected a sequence of strings");
+	if (seq == NULL) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	count = PySequence_Fast_GET_SIZE(seq);
+	keys = g_value_array_new(count);
+	for (i = 0; i < count; i++) {
+		PyObject *item;
+		GValue value;
+
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		memset(&value, 0, sizeof(value));
+		if (by_id) {
+			PY_LONG_LONG ll;
+
+			ll = PyLong_AsLongLong(item);
+			if (PyErr_Occurred())
+				goto err;
+			if ((id_t)ll != ll || (id_t)ll == LU_VALUE_INVALID_ID) {
+				PyErr_SetString(PyExc_OverflowError,
+						"ID out of range");
+				goto err;
+			}
+			lu_value_init_set_id(&value, ll);
+		} else {
+			const char *name;
+
+			if (!PYSTRTYPE_CHECK(item)) {
+				PyErr_SetString(PyExc_TypeError,
+						"expected a sequence of strings");
+				goto err;
+			}
+			name = PYSTRTYPE_ASSTRING(item);
+			if (name == NULL)
+				goto err;
+			g_value_init(&value, G_TYPE_STRING);
+			g_value_set_string(&value, name);
+		}
+		g_value_array_append(keys, &value);
+		g_value_unset(&value);
+	}
+
+	if (enttype == lu_user)
+		results = by_id ? lu_users_lookup_ids(me->ctx, keys, &error)
+			: lu_users_lookup_names(me->ctx, keys, &error);
+	else
+		results = by_id ? lu_groups_lookup_ids(me->ctx, keys, &error)
+			: lu_groups_lookup_names(me->ctx, keys, &error);
+	/* Like lookupUserByName, missing entities are not an error. */
+	if (error != NULL)
+		lu_error_free(&error);
+	ret = convert_ent_array_pylist(results);
+	if (results != NULL)
+		g_ptr_array_free(results, TRUE);
+	g_value_array_free(keys);
+	Py_DECREF(seq);
+	DEBUG_EXIT;
+	return ret;
+
+err:
+	g_value_array_free(keys);
+	Py_DECREF(seq);
+	DEBUG_EXIT;
+	return NULL;
+}
+
+/* Look up a list of users by name. */
+static PyObject *
+libuser_admin_lookup_users_names(PyObject *self, PyObject *args,
+				 PyObject *kwargs)
+{
+	return libuser_admin_lookup_many(self, args, kwargs, lu_user, FALSE);
+}
+
+/* Look up a list of users by UID. */
+static PyObject *
+libuser_admin_lookup_users_ids(PyObject *self, PyObject *args,
+			       PyObject *kwargs)
+{
+	return libuser_admin_lookup_many(self, args, kwargs, lu_user, TRUE);
+}
+
+/* Look up a list of groups by name. */
+static PyObject *
+libuser_admin_lookup_groups_names(PyObject *self, PyObject *args,
+				  PyObject *kwargs)
+{
+	return libuser_admin_lookup_many(self, args, kwargs, lu_group, FALSE);
+}
+
+/* Look up a list of groups by GID. */
+static PyObject *
+libuser_admin_lookup_groups_ids(PyObject *self, PyObject *args,
+				PyObject *kwargs)
+{
+	return libuser_admin_lookup_many(self, args, kwargs, lu_group, TRUE);
+}
+
 /* Create a template user object. */
 static PyObject *
 libuser_admin_init_user(PyObject *self, PyObject *args,
@@ -1219,6 +1338,91 @@ libuser_admin_enumerate_groups_full(PyObject *self, PyObject *args,
 	return ret;
 }
 
+/* A lu_ent_fn calling a Python callable in DATA with a copy of ENT.  A Python
+ * exception stops the enumeration. */
+static gboolean
+libuser_admin_stream_one(struct lu_ent *ent, gpointer data)
+{
+	PyObject *callback, *wrapped, *res;
+	struct lu_ent *copy;
+	gboolean ret;
+
+	callback = data;
+	/* The Python object may outlive ENT. */
+	copy = lu_ent_new();
+	lu_ent_copy(ent, copy);
+	wrapped = libuser_wrap_ent(copy);
+	if (wrapped == NULL)
+		return FALSE;
+	res = PyObject_CallFunctionObjArgs(callback, wrapped, NULL);
+	Py_DECREF(wrapped);
+	if (res == NULL)
+		return FALSE;
+	/* Anything but an explicit False continues. */
+	ret = res != Py_False;
+	Py_DECREF(res);
+	return ret;
+}
+
+/* Pass all users or groups of ENTTYPE matching a pattern to a callable, as
+ * they are found. */
+static PyObject *
+libuser_admin_enumerate_full_stream(PyObject *self, PyObject *args,
+				    PyObject *kwargs,
+				    enum lu_entity_type enttype)
+{
+	PyObject *callback;
+	const char *pattern = NULL;
+	struct lu_error *error = NULL;
+	char *keywords[] = { "callback", "pattern", NULL };
+	struct libuser_admin *me = (struct libuser_admin *) self;
+
+	DEBUG_ENTRY;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O|s", keywords,
+					 &callback, &pattern)) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	if (!PyCallable_Check(callback)) {
+		PyErr_SetString(PyExc_TypeError, "expected a callable object");
+		DEBUG_EXIT;
+		return NULL;
+	}
+	if (enttype == lu_user)
+		lu_users_enumerate_full_stream(me->ctx, pattern,
+					       libuser_admin_stream_one,
+					       callback, &error);
+	else
+		lu_groups_enumerate_full_stream(me->ctx, pattern,
+						libuser_admin_stream_one,
+						callback, &error);
+	/* Like enumerateUsersFull, ignore errors. */
+	if (error != NULL)
+		lu_error_free(&error);
+	DEBUG_EXIT;
+	if (PyErr_Occurred())
+		return NULL;
+	Py_RETURN_NONE;
+}
+
+/* Pass all users matching a pattern to a callable. */
+static PyObject *
+libuser_admin_enumerate_users_full_stream(PyObject *self, PyObject *args,
+					  PyObject *kwargs)
+{
+	return libuser_admin_enumerate_full_stream(self, args, kwargs,
+						   lu_user);
+}
+
+/* Pass all groups matching a pattern to a callable. */
+static PyObject *
+libuser_admin_enumerate_groups_full_stream(PyObject *self, PyObject *args,
+					   PyObject *kwargs)
+{
+	return libuser_admin_enumerate_full_stream(self, args, kwargs,
+						   lu_group);
+}
+
 /* Get the list of users who belong to a group. */
 static PyObject *
 libuser_admin_enumerate_users_by_group_full(PyObject *self, PyObject *args,
@@ -1277,18 +1481,13 @@ libuser_admin_enumerate_groups_by_user_full(PyObject *self, PyObject *args,
 	return ret;
 }
 
-static PyObject *
-libuser_admin_get_first_unused_id_type(struct libuser_admin *me,
-				       PyObject * args, PyObject * kwargs,
-				       enum lu_entity_type enttype)
+/* Return the configured first ID of ENTTYPE, or DEFAULT_ID. */
+static PY_LONG_LONG
+libuser_admin_default_first_id(struct libuser_admin *me,
+			       enum lu_entity_type enttype,
+			       PY_LONG_LONG default_id)
 {
 	const char *key, *key_string, *val;
-	char *keywords[] = { "start", NULL };
-	PY_LONG_LONG start = 500;
-
-	g_return_val_if_fail(me != NULL, NULL);
-
-	DEBUG_ENTRY;
 
 	switch (enttype) {
 	case lu_user:
@@ -1312,9 +1511,24 @@ libuser_admin_get_first_unused_id_type(struct libuser_admin *me,
 		errno = 0;
 		imax = strtoimax(val, &end, 10);
 		if (errno == 0 && *end == 0 && end != val && (id_t)imax == imax)
-			start = imax;
+			return imax;
 	}
+	return default_id;
+}
+
+static PyObject *
+libuser_admin_get_first_unused_id_type(struct libuser_admin *me,
+				       PyObject * args, PyObject * kwargs,
+				       enum lu_entity_type enttype)
+{
+	char *keywords[] = { "start", NULL };
+	PY_LONG_LONG start;
+
+	g_return_val_if_fail(me != NULL, NULL);
+
+	DEBUG_ENTRY;
 
+	start = libuser_admin_default_first_id(me, enttype, 500);
 	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|L", keywords,
 					 &start)) {
 		DEBUG_EXIT;
@@ -1330,6 +1544,40 @@ libuser_admin_get_first_unused_id_type(struct libuser_admin *me,
 							  start));
 }
 
+static PyObject *
+libuser_admin_reserve_unused_ids_type(struct libuser_admin *me,
+				      PyObject * args, PyObject * kwargs,
+				      enum lu_entity_type enttype)
+{
+	char *keywords[] = { "count", "start", NULL };
+	PY_LONG_LONG count, start;
+
+	g_return_val_if_fail(me != NULL, NULL);
+
+	DEBUG_ENTRY;
+
+	start = libuser_admin_default_first_id(me, enttype, 500);
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "L|L", keywords,
+					 &count, &start)) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	if (count <= 0) {
+		PyErr_SetString(PyExc_ValueError, "count must be positive");
+		DEBUG_EXIT;
+		return NULL;
+	}
+	if ((id_t)start != start || (id_t)count != count) {
+		PyErr_SetString(PyExc_OverflowError, "ID out of range");
+		DEBUG_EXIT;
+		return NULL;
+	}
+
+	DEBUG_EXIT;
+	return PyLong_FromLongLong(lu_reserve_unused_ids(me->ctx, enttype,
+							 start, count));
+}
+
 static PyObject *
 libuser_admin_get_first_unused_uid(PyObject *self, PyObject * args,
 				   PyObject *kwargs)
@@ -1346,6 +1594,164 @@ libuser_admin_get_first_unused_gid(PyObject *self, PyObject * args,
 		((struct libuser_admin *)self, args, kwargs, lu_group);
 }
 
+static PyObject *
+libuser_admin_reserve_unused_uids(PyObject *self, PyObject * args,
+				  PyObject *kwargs)
+{
+	return libuser_admin_reserve_unused_ids_type
+		((struct libuser_admin *)self, args, kwargs, lu_user);
+}
+
+static PyObject *
+libuser_admin_reserve_unused_gids(PyObject *self, PyObject * args,
+				  PyObject *kwargs)
+{
+	return libuser_admin_reserve_unused_ids_type
+		((struct libuser_admin *)self, args, kwargs, lu_group);
+}
+
+/* Encrypt a list of passwords. */
+static PyObject *
+libuser_admin_crypt_passwords(PyObject *self, PyObject *args,
+			      PyObject *kwargs)
+{
+	PyObject *list, *seq, *ret;
+	const char **passwords;
+	char **crypted;
+	Py_ssize_t i, count;
+	struct lu_error *error = NULL;
+	char *keywords[] = { "passwords", NULL };
+	struct libuser_admin *me = (struct libuser_admin *) self;
+
+	DEBUG_ENTRY;
+	if (!PyArg_ParseTupleAndKeywords(args, kwargs, "O", keywords,
+					 &list)) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	seq = PySequence_Fast(list, "expected a sequence of strings");
+	if (seq == NULL) {
+		DEBUG_EXIT;
+		return NULL;
+	}
+	count = PySequence_Fast_GET_SIZE(seq);
+	passwords = g_new(const char *, count + 1);
+	for (i = 0; i < count; i++) {
+		PyObject *item;
+
+		item = PySequence_Fast_GET_ITEM(seq, i);
+		if (!PYSTRTYPE_CHECK(item)) {
+			PyErr_SetString(PyExc_TypeError,
+					"expected a sequence of strings");
+			goto err;
+		}
+		passwords[i] = PYSTRTYPE_ASSTRING(item);
+		if (passwords[i] == NULL)
+			goto err;
+	}
+	passwords[count] = NULL;
+
+	/* Hashing can take a long time, let other Python threads run. */
+	Py_BEGIN_ALLOW_THREADS
+	crypted = lu_crypt_passwords(me->ctx, passwords, count, &error);
+	Py_END_ALLOW_THREADS
+	if (crypted == NULL) {
+		PyErr_SetString(PyExc_RuntimeError, lu_strerror(error));
+		if (error)
+			lu_error_free(&error);
+		goto err;
+	}
+
+	ret = PyList_New(0);
+	for (i = 0; i < count; i++) {
+		PyObject *str;
+
+		str = PYSTRTYPE_FROMSTRING(crypted[i]);
+		if (str == NULL) {
+			Py_DECREF(ret);
+			ret = NULL;
+			break;
+		}
+		PyList_Append(ret, str);
+		Py_DECREF(str);
+	}
+	g_strfreev(crypted);
+	g_free(passwords);
+	Py_DECREF(seq);
+	DEBUG_EXIT;
+	return ret;
+
+err:
+	g_free(passwords);
+	Py_DECREF(seq);
+	DEBUG_EXIT;
+	return NULL;
+}
+
+/* Run a transaction function which takes no arguments besides the context.
+ * If the function fails, raise an error. */
+static PyObject *
+libuser_admin_transaction_wrap(PyObject *self,
+			       gboolean (*fn) (struct lu_context *,
+					       struct lu_error ** error))
+{
+	struct lu_error *error = NULL;
+	struct libuser_admin *me = (struct libuser_admin *)self;
+
+	DEBUG_ENTRY;
+	if (fn(me->ctx, &error)) {
+		DEBUG_EXIT;
+		return PYINTTYPE_FROMLONG(1);
+	}
+	PyErr_SetString(PyExc_RuntimeError, lu_strerror(error));
+	if (error)
+		lu_error_free(&error);
+	DEBUG_EXIT;
+	return NULL;
+}
+
+static PyObject *
+libuser_admin_begin_transaction(PyObject *self, PyObject *ignored)
+{
+	(void)ignored;
+	return libuser_admin_transaction_wrap(self, lu_transaction_begin);
+}
+
+static PyObject *
+libuser_admin_commit_transaction(PyObject *self, PyObject *ignored)
+{
+	(void)ignored;
+	return libuser_admin_transaction_wrap(self, lu_transaction_commit);
+}
+
+static PyObject *
+libuser_admin_abort_transaction(PyObject *self, PyObject *ignored)
+{
+	struct libuser_admin *me = (struct libuser_admin *)self;
+
+	(void)ignored;
+	DEBUG_ENTRY;
+	lu_transaction_abort(me->ctx);
+	DEBUG_EXIT;
+	Py_RETURN_NONE;
+}
+
+static PyObject *
+libuser_admin_get_cache_statistics(PyObject *self, PyObject *ignored)
+{
+	struct libuser_admin *me = (struct libuser_admin *)self;
+	unsigned long hits, misses;
+
+	(void)ignored;
+	DEBUG_ENTRY;
+	if (!lu_get_cache_statistics(me->ctx, &hits, &misses)) {
+		DEBUG_EXIT;
+		Py_RETURN_NONE;
+	}
+	DEBUG_EXIT;
+	return Py_BuildValue("(kk)", hits, misses);
+}
+
 static struct PyMethodDef libuser_admin_methods[] = {
 	{"lookupUserByName", (PyCFunction) libuser_admin_lookup_user_name,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -1360,6 +1766,20 @@ static struct PyMethodDef libuser_admin_methods[] = {
 	{"lookupGroupById", (PyCFunction) libuser_admin_lookup_group_id,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "search for a group with the given gid"},
+	{"lookupUsersByNames",
+	 (PyCFunction) libuser_admin_lookup_users_names,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "search for users with the given names at once"},
+	{"lookupUsersByIds", (PyCFunction) libuser_admin_lookup_users_ids,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "search for users with the given uids at once"},
+	{"lookupGroupsByNames",
+	 (PyCFunction) libuser_admin_lookup_groups_names,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "search for groups with the given names at once"},
+	{"lookupGroupsByIds", (PyCFunction) libuser_admin_lookup_groups_ids,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "search for groups with the given gids at once"},
 
 	{"initUser", (PyCFunction) libuser_admin_init_user,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -1421,6 +1841,9 @@ static struct PyMethodDef libuser_admin_methods[] = {
 	{"removepassGroup", (PyCFunction) libuser_admin_removepass_group,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "remove the password for the group account associated with the object"},
+	{"cryptPasswords", (PyCFunction) libuser_admin_crypt_passwords,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "encrypt a list of passwords in parallel, for use with setpassUser"},
 
 	{"enumerateUsers", (PyCFunction) libuser_admin_enumerate_users,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -1443,6 +1866,14 @@ static struct PyMethodDef libuser_admin_methods[] = {
 	{"enumerateGroupsFull", (PyCFunction) libuser_admin_enumerate_groups_full,
 	 METH_VARARGS | METH_KEYWORDS,
 	 "get a list of groups matching a pattern, in listed databases"},
+	{"enumerateUsersFullStream",
+	 (PyCFunction) libuser_admin_enumerate_users_full_stream,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "call a function for each user matching a pattern, as they are found"},
+	{"enumerateGroupsFullStream",
+	 (PyCFunction) libuser_admin_enumerate_groups_full_stream,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "call a function for each group matching a pattern, as they are found"},
 	{"enumerateUsersByGroupFull",
 	 (PyCFunction) libuser_admin_enumerate_users_by_group_full,
 	 METH_VARARGS | METH_KEYWORDS,
@@ -1494,6 +1925,27 @@ static struct PyMethodDef libuser_admin_methods[] = {
 	 METH_VARARGS | METH_KEYWORDS,
 	 "return the first available gid"},
 
+	{"reserveUnusedUids",
+	 (PyCFunction) libuser_admin_reserve_unused_uids,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "reserve a range of available uids, return the first one"},
+
+	{"reserveUnusedGids",
+	 (PyCFunction) libuser_admin_reserve_unused_gids,
+	 METH_VARARGS | METH_KEYWORDS,
+	 "reserve a range of available gids, return the first one"},
+
+	{"beginTransaction", libuser_admin_begin_transaction, METH_NOARGS,
+	 "start collecting changes to write them out together"},
+	{"commitTransaction", libuser_admin_commit_transaction, METH_NOARGS,
+	 "write out all changes made since beginTransaction"},
+	{"abortTransaction", libuser_admin_abort_transaction, METH_NOARGS,
+	 "discard all changes made since beginTransaction"},
+
+	{"getCacheStatistics", libuser_admin_get_cache_statistics,
+	 METH_NOARGS,
+	 "return numbers of lookups answered from the entity cache and not"},
+
 	{NULL, NULL, 0, NULL},
 };
 
@@ -0,0 +1,175 @@
+/* Copyright (C) 2026 Red Hat, Inc.
+ *
+ * This is free software; you can redistribute it and/or modify it under
+ * the terms of the GNU Library General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * General Public License for more details.
+ *
+ * You should have received a copy of the GNU Library General Public
+ * License along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA 02110-1301, USA.
+ */
+
+#include <config.h>
+#include <glib.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "../lib/user_private.h"
+#undef NDEBUG
+#include <assert.h>
+
+/* Append STRING to current values of ATTRIBUTE in ENT, the way modules
+   parsing many entities do. */
+static void
+append_string(struct lu_ent *ent, const char *attribute, const char *string)
+{
+	GValue value;
+
+	memset(&value, 0, sizeof(value));
+	lu_ent_value_init_string_len(ent, &value, string, strlen(string));
+	lu_ent_append_current_q(ent, lu_ent_attribute_quark(attribute),
+				&value);
+}
+
+/* Create a group entity in ARENA with members MEMBER1 and MEMBER2. */
+static struct lu_ent *
+new_group(struct lu_ent_arena *arena, const char *member1,
+	  const char *member2)
+{
+	struct lu_ent *ent;
+
+	ent = lu_ent_new_typed_in(arena, lu_group);
+	append_string(ent, LU_GROUPNAME, "group1");
+	append_string(ent, LU_MEMBERNAME, member1);
+	append_string(ent, LU_MEMBERNAME, member2);
+	lu_ent_revert(ent);
+	return ent;
+}
+
+/* Check that current values of ATTRIBUTE in ENT are the NULL-terminated list
+   of strings that follows, and that they are not shared with current values
+   of ATTRIBUTE in OTHER, if not NULL. */
+static void
+verify_values(struct lu_ent *ent, struct lu_ent *other,
+	      const char *attribute, ...)
+{
+	GValueArray *values, *other_values;
+	va_list ap;
+	const char *expected;
+	size_t i;
+
+	values = lu_ent_get_current(ent, attribute);
+	assert(values != NULL);
+	other_values = NULL;
+	if (other != NULL) {
+		other_values = lu_ent_get_current(other, attribute);
+		assert(other_values != NULL);
+		assert(other_values != values);
+	}
+	i = 0;
+	va_start(ap, attribute);
+	while ((expected = va_arg(ap, const char *)) != NULL) {
+		const char *value;
+
+		assert(i < values->n_values);
+		value = g_value_get_string(g_value_array_get_nth(values, i));
+		assert(strcmp(value, expected) == 0);
+		if (other_values != NULL) {
+			assert(i < other_values->n_values);
+			assert(value != g_value_get_string
+			       (g_value_array_get_nth(other_values, i)));
+		}
+		i++;
+	}
+	va_end(ap);
+	assert(i == values->n_values);
+}
+
+/* Entities copied out of an arena remain valid after it is freed. */
+static void
+test_copy_from_arena(void)
+{
+	struct lu_ent_arena *arena;
+	struct lu_ent *ent, *shared, *copy, *merged, *changed;
+
+	arena = lu_ent_arena_new();
+	ent = new_group(arena, "member1", "member2");
+	/* Make the values of ENT shared within the arena, so that appending
+	   to them has to copy them first. */
+	shared = lu_ent_new_typed_in(arena, lu_invalid);
+	lu_ent_copy(ent, shared);
+	append_string(ent, LU_MEMBERNAME, "member3");
+
+	copy = lu_ent_new();
+	lu_ent_copy(ent, copy);
+	verify_values(copy, ent, LU_GROUPNAME, "group1", NULL);
+	verify_values(copy, ent, LU_MEMBERNAME, "member1", "member2",
+		      "member3", NULL);
+
+	merged = lu_ent_new();
+	lu_ent_merge(merged, shared);
+
+	changed = lu_ent_new();
+	lu_ent_apply_changes(changed, merged, ent);
+
+	verify_values(merged, shared, LU_MEMBERNAME, "member1", "member2",
+		      NULL);
+	verify_values(changed, ent, LU_MEMBERNAME, "member1", "member2",
+		      "member3", NULL);
+	lu_ent_free(shared);
+	lu_ent_arena_free(arena);
+
+	verify_values(copy, NULL, LU_GROUPNAME, "group1", NULL);
+	verify_values(copy, NULL, LU_MEMBERNAME, "member1", "member2",
+		      "member3", NULL);
+	assert(strcmp(lu_ent_get_first_string(copy, LU_GROUPNAME), "group1")
+	       == 0);
+	verify_values(merged, NULL, LU_MEMBERNAME, "member1", "member2",
+		      NULL);
+	verify_values(changed, NULL, LU_MEMBERNAME, "member1", "member2",
+		      "member3", NULL);
+	lu_ent_free(copy);
+	lu_ent_free(merged);
+	lu_ent_free(changed);
+}
+
+/* Entities in an arena don't refer to entities outside of it. */
+static void
+test_copy_into_arena(void)
+{
+	struct lu_ent_arena *arena;
+	struct lu_ent *ent, *copy;
+
+	ent = new_group(NULL, "member4", "member5");
+	lu_ent_set_string(ent, LU_GECOS, "gecos1");
+
+	arena = lu_ent_arena_new();
+	copy = lu_ent_new_typed_in(arena, lu_invalid);
+	lu_ent_copy(ent, copy);
+	lu_ent_free(ent);
+
+	assert(strcmp(lu_ent_get_first_string(copy, LU_GECOS), "gecos1")
+	       == 0);
+	lu_ent_add(copy, LU_GECOS, g_value_array_get_nth
+		   (lu_ent_get(copy, LU_GROUPNAME), 0));
+	lu_ent_set_string(copy, LU_GROUPNAME, "group2");
+	assert(strcmp(lu_ent_cache_string(copy, "cached"), "cached") == 0);
+	verify_values(copy, NULL, LU_MEMBERNAME, "member4", "member5", NULL);
+	assert(lu_ent_get(copy, LU_GECOS)->n_values == 2);
+	lu_ent_arena_free(arena);
+}
+
+int
+main(void)
+{
+	test_copy_from_arena();
+	test_copy_into_arena();
+	return EXIT_SUCCESS;
+}
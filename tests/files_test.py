@@ -14,6 +14,23 @@ LARGE_ID = 2147483648
 
 workdir = os.environ['workdir']
 
+def admin_with_defaults(**options):
+    '''Return a libuser.admin using the test configuration with OPTIONS set
+    in [defaults].'''
+    conf = os.environ['LIBUSER_CONF']
+    with open(conf) as f:
+        text = f.read()
+    settings = ''.join(['%s = %s\n' % (name, value)
+                        for (name, value) in sorted(options.items())])
+    variant_conf = conf + '.' + '.'.join(sorted(options.keys()))
+    with open(variant_conf, 'w') as f:
+        f.write(text.replace('[defaults]\n', '[defaults]\n' + settings, 1))
+    os.environ['LIBUSER_CONF'] = variant_conf
+    try:
+        return libuser.admin()
+    finally:
+        os.environ['LIBUSER_CONF'] = conf
+
 # Test case order matches the order of function pointers in struct lu_module
 class Tests(unittest.TestCase):
     def setUp(self):
@@ -90,6 +107,48 @@ class Tests(unittest.TestCase):
         e = self.a.lookupUserById(LARGE_ID + 310)
         self.assertEqual(e, None)
 
+    def testUserLookupIndex(self):
+        # Repeated lookups of an unchanged file use an index; changes made
+        # behind libuser's back must still be noticed.
+        e = self.a.initUser('user3_2')
+        self.a.addUser(e, False, False)
+        uid = e[libuser.UIDNUMBER][0]
+        del e
+        for _ in range(3):
+            e = self.a.lookupUserById(uid)
+            self.assertEqual(e[libuser.USERNAME], ['user3_2'])
+            e = self.a.lookupUserByName('user3_2')
+            self.assertEqual(e[libuser.UIDNUMBER], [uid])
+        with open(os.path.join(workdir, 'files/passwd'), 'a') as f:
+            f.write('user3_3::3303:3303:::\n')
+        e = self.a.lookupUserByName('user3_3')
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.UIDNUMBER], [3303])
+        e = self.a.lookupUserById(3303)
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.USERNAME], ['user3_3'])
+        e = self.a.lookupUserByName('user3_2')
+        self.assertEqual(e[libuser.UIDNUMBER], [uid])
+
+    def testUsersLookupMany(self):
+        e = self.a.initUser('user3_20')
+        self.a.addUser(e, False, False)
+        uid = e[libuser.UIDNUMBER][0]
+        del e
+        # Results are in the order of the arguments, missing users are
+        # skipped.
+        v = self.a.lookupUsersByNames(['user3_20', 'user3_does_not_exist',
+                                       'empty_user', 'user3_20'])
+        self.assertEqual([e[libuser.USERNAME] for e in v],
+                         [['user3_20'], ['empty_user']])
+        self.assertEqual(v[0][libuser.UIDNUMBER], [uid])
+        self.assertEqual(v[1][libuser.SHADOWNAME], ['empty_user'])
+        v = self.a.lookupUsersByIds([42, 999999, uid, LARGE_ID + 320])
+        self.assertEqual([e[libuser.USERNAME] for e in v],
+                         [['empty_user'], ['user3_20']])
+        self.assertEqual(v[1][libuser.SHADOWNAME], ['user3_20'])
+        self.assertEqual(self.a.lookupUsersByNames([]), [])
+
     def testUserDefault(self):
         # Test the default/LU_USERNAME = %n preserves usernames that appear to
         # be numbers
@@ -486,6 +545,27 @@ class Tests(unittest.TestCase):
         e[libuser.UIDNUMBER] = e_uid
         self.assertRaises(RuntimeError, self.a.modifyUser, e, False)
 
+    def testUserMod10(self):
+        # A backup is refreshed after an edit which keeps the size and mtime
+        e = self.a.initUser('user7_10')
+        self.a.addUser(e, False, False)
+        e = self.a.initUser('user7_10_does_not_exist')
+        # A failed modification leaves an up to date backup
+        self.assertRaises(RuntimeError, self.a.modifyUser, e, False)
+        passwd = os.path.join(workdir, 'files/passwd')
+        with open(passwd, 'rb') as f:
+            contents = f.read()
+        with open(passwd + '-', 'rb') as f:
+            self.assertEqual(f.read(), contents)
+        st = os.stat(passwd)
+        contents = contents.replace(b'\nuser7_10:', b'\nuser7_1x:')
+        with open(passwd, 'r+b') as f:
+            f.write(contents)
+        os.utime(passwd, ns = (st.st_atime_ns, st.st_mtime_ns))
+        self.assertRaises(RuntimeError, self.a.modifyUser, e, False)
+        with open(passwd + '-', 'rb') as f:
+            self.assertEqual(f.read(), contents)
+
     def testUserDel(self):
         e = self.a.initUser('user8_1')
         self.a.addUser(e, False, False)
@@ -497,6 +577,81 @@ class Tests(unittest.TestCase):
         e = self.a.lookupUserByName('user8_1')
         self.assertEqual(e, None)
 
+    def testUserDel2(self):
+        # Duplicate entries, and modifications of the entries around them
+        with open(os.path.join(workdir, 'files/passwd'), 'a') as f:
+            f.write('user8_2:x:1802:1802::/home/user8_2:/bin/true\n'
+                    'user8_3:x:1803:1803::/home/user8_3:/bin/true\n'
+                    'user8_2:x:1802:1802::/home/user8_2:/bin/false\n'
+                    'user8_4:x:1804:1804::/home/user8_4:/bin/true\n')
+        with open(os.path.join(workdir, 'files/shadow'), 'a') as f:
+            for name in ('user8_2', 'user8_3', 'user8_2', 'user8_4'):
+                f.write('%s:!!:19000:0:99999:7:::\n' % name)
+        e = self.a.lookupUserByName('user8_3')
+        self.assertIsNotNone(e)
+        e[libuser.GECOS] = 'A much longer GECOS field than before'
+        self.a.modifyUser(e, False)
+        del e
+        e = self.a.lookupUserByName('user8_2')
+        self.assertIsNotNone(e)
+        self.a.deleteUser(e, False, False)
+        del e
+        self.assertIsNone(self.a.lookupUserByName('user8_2'))
+        with open(os.path.join(workdir, 'files/passwd')) as f:
+            contents = f.read()
+        self.assertNotIn('user8_2:', contents)
+        self.assertIn('\nuser8_3:x:1803:1803:A much longer GECOS field than '
+                      'before:/home/user8_3:/bin/true\n'
+                      'user8_4:x:1804:1804::/home/user8_4:/bin/true\n',
+                      contents)
+        e = self.a.lookupUserByName('user8_3')
+        e[libuser.GECOS] = ''
+        self.a.modifyUser(e, False)
+        del e
+        e = self.a.lookupUserByName('user8_4')
+        self.assertEqual(e[libuser.LOGINSHELL], ['/bin/true'])
+
+    def testUserEntity(self):
+        # Attributes are case-insensitive and keep their order, whether they
+        # have a fixed slot in the entity or not
+        e = self.a.initUser('user8_5')
+        self.assertEqual(e['PW_NAME'], ['user8_5'])
+        e['customAttribute'] = ['a', 'b']
+        e[libuser.GIVENNAME] = 'Given'
+        self.assertEqual(e['customattribute'], ['a', 'b'])
+        self.assertEqual(e['givenname'], ['Given'])
+        keys = e.keys()
+        self.assertLess(keys.index('customattribute'), keys.index('givenname'))
+        e.add('CustomAttribute', 'a')
+        e.add(libuser.GIVENNAME, 'Other')
+        self.assertEqual(e['customAttribute'], ['a', 'b'])
+        self.assertEqual(e[libuser.GIVENNAME], ['Given', 'Other'])
+        e.clear('customAttribute')
+        self.assertFalse(e.has_key('customAttribute'))
+        self.assertEqual(e.keys(), [k for k in keys if k != 'customattribute'])
+        self.assertEqual(e['pw_name'], ['user8_5'])
+
+    def testUserEntity2(self):
+        # Pending changes don't affect the current values they were copied
+        # from
+        e = self.a.initUser('user8_6')
+        self.a.addUser(e, False, False)
+        del e
+        e = self.a.lookupUserByName('user8_6')
+        shell = e[libuser.LOGINSHELL]
+        e[libuser.USERNAME] = 'user8_6b'
+        e.add(libuser.LOGINSHELL, '/bin/other')
+        self.assertEqual(e[libuser.LOGINSHELL], shell + ['/bin/other'])
+        e.revert()
+        self.assertEqual(e[libuser.USERNAME], ['user8_6'])
+        self.assertEqual(e[libuser.LOGINSHELL], shell)
+        e[libuser.USERNAME] = 'user8_6b'
+        self.a.modifyUser(e, False)
+        del e
+        self.assertIsNone(self.a.lookupUserByName('user8_6'))
+        e = self.a.lookupUserByName('user8_6b')
+        self.assertEqual(e[libuser.LOGINSHELL], shell)
+
     def testUserLock1(self):
         e = self.a.initUser('user9_1')
         self.a.addUser(e, False, False)
@@ -772,6 +927,39 @@ class Tests(unittest.TestCase):
         # Data set up in files_test
         self.assertEqual(self.a.enumerateUsersByGroup('group15_4'), [])
 
+    def testUsersEnumerateByGroup5(self):
+        # Repeated queries use an index; changes made behind libuser's back
+        # must still be noticed.
+        gid = 1505 # Hopefully unique
+        e = self.a.initGroup('group15_5')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addGroup(e)
+        e = self.a.initUser('user15_5')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addUser(e, False, False)
+        for _ in range(2):
+            self.assertEqual(self.a.enumerateUsersByGroup('group15_5'),
+                             ['user15_5'])
+            self.assertEqual(self.a.enumerateGroupsByUser('user15_5'),
+                             ['group15_5'])
+        with open(os.path.join(workdir, 'files/group'), 'a') as f:
+            f.write('group15_6::1506:user15_5,user15_6\n')
+        self.assertEqual(sorted(self.a.enumerateGroupsByUser('user15_5')),
+                         ['group15_5', 'group15_6'])
+        e = self.a.initUser('user15_6')
+        self.a.addUser(e, False, False)
+        self.assertEqual(self.a.enumerateUsersByGroup('group15_6'),
+                         ['user15_5', 'user15_6'])
+
+    def testUsersEnumerateByGroup6(self):
+        # Only the fourth field lists members
+        with open(os.path.join(workdir, 'files/group'), 'a') as f:
+            f.write('group15_7::1507:user15_7,user15_8:user15_9\n')
+        self.assertEqual(self.a.enumerateUsersByGroup('group15_7'),
+                         ['user15_7', 'user15_8'])
+        self.assertEqual(self.a.lookupGroupByName('group15_7')
+                         [libuser.MEMBERNAME], ['user15_7', 'user15_8'])
+
     def testUsersEnumerateByGroupFull1(self):
         gid = 3401 # Hopefully unique
         e = self.a.initGroup('group34_1')
@@ -834,6 +1022,41 @@ class Tests(unittest.TestCase):
         self.a.addUser(e, False, False)
         self.assertEqual(self.a.enumerateUsersFull('user16_3:*'), [])
 
+    def testUsersEnumerateFull4(self):
+        # Entries returned by both modules, or repeated in a file, are merged
+        e = self.a.initUser('user16_4')
+        e[libuser.GECOS] = 'Merged'
+        self.a.addUser(e, False, False)
+        with open(os.path.join(workdir, 'files/passwd'), 'a') as f:
+            f.write('user16_4:x:1604:1604:Other:/home/user16_4:/bin/sh\n')
+        self.assertEqual(self.a.enumerateUsers('user16_4'), ['user16_4'])
+        v = self.a.enumerateUsersFull('user16_4')
+        self.assertEqual(len(v), 1)
+        self.assertEqual(v[0][libuser.USERNAME], ['user16_4'])
+        self.assertEqual(v[0][libuser.SHADOWNAME], ['user16_4'])
+        self.assertEqual(v[0][libuser.GECOS], ['Merged', 'Other'])
+
+    def testUsersEnumerateFullStream(self):
+        # With more than one module, entities are merged before they are
+        # passed on
+        e = self.a.initUser('user38_1')
+        self.a.addUser(e, False, False)
+        e = self.a.initUser('user38_2')
+        self.a.addUser(e, False, False)
+        v = []
+        self.a.enumerateUsersFullStream(v.append, 'user38_*')
+        self.assertEqual(sorted([x[libuser.USERNAME] for x in v]),
+                         [['user38_1'], ['user38_2']])
+        self.assertEqual(v[0][libuser.SHADOWNAME], v[0][libuser.USERNAME])
+        v = []
+        self.a.enumerateUsersFullStream(lambda e: v.append(e) and False,
+                                        'user38_*')
+        self.assertEqual(len(v), 2)
+        v = []
+        self.a.enumerateUsersFullStream(lambda e: v.append(e) or False,
+                                        'user38_*')
+        self.assertEqual(len(v), 1)
+
     def testGroupLookupName1(self):
         e = self.a.initGroup('group17_1')
         self.a.addGroup(e)
@@ -867,6 +1090,111 @@ class Tests(unittest.TestCase):
         self.assertEqual(e[libuser.SHADOWPASSWORD], ['077'])
         self.assertEqual(e[libuser.ADMINISTRATORNAME], ['077'])
 
+    def testGroupLookupName4(self):
+        # Empty and duplicate member names are dropped, order is preserved
+        members = ['m%d' % i for i in range(20)]
+        with open(os.path.join(workdir, 'files/group'), 'a') as f:
+            f.write('group17_2:x:1732:b,,a,b,a,\n')
+            f.write('group17_3:x:1733:%s,%s\n'
+                    % (','.join(members), ','.join(reversed(members))))
+        e = self.a.lookupGroupByName('group17_2')
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.GIDNUMBER], [1732])
+        self.assertEqual(e[libuser.MEMBERNAME], ['b', 'a'])
+        e = self.a.lookupGroupByName('group17_3')
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.MEMBERNAME], members)
+
+    def testLookupCache1(self):
+        # Without entity_cache, nothing is cached
+        e = self.a.initUser('user17_4')
+        self.a.addUser(e, False, False)
+        self.a.lookupUserByName('user17_4')
+        self.a.lookupUserByName('user17_4')
+        self.assertIsNone(self.a.getCacheStatistics())
+
+    def testLookupCache2(self):
+        a = admin_with_defaults(entity_cache = 'yes')
+        e = a.initUser('user17_5')
+        a.addUser(e, False, False)
+        uid = e[libuser.UIDNUMBER][0]
+        (hits, misses) = a.getCacheStatistics()
+        e = a.lookupUserByName('user17_5')
+        self.assertEqual(e[libuser.UIDNUMBER], [uid])
+        e = a.lookupUserByName('user17_5')
+        self.assertEqual(e[libuser.UIDNUMBER], [uid])
+        self.assertEqual(a.getCacheStatistics(), (hits + 1, misses + 1))
+        e = a.lookupUserById(uid)
+        e = a.lookupUserById(uid)
+        self.assertEqual(e[libuser.USERNAME], ['user17_5'])
+        self.assertEqual(a.getCacheStatistics(), (hits + 2, misses + 2))
+        # Changes made behind libuser's back are noticed
+        with open(os.path.join(workdir, 'files/passwd'), 'a') as f:
+            f.write('user17_6::1706:1706:::\n')
+        e = a.lookupUserByName('user17_5')
+        self.assertEqual(e[libuser.UIDNUMBER], [uid])
+        self.assertEqual(a.getCacheStatistics(), (hits + 2, misses + 3))
+        del a
+
+    def testLookupCache3(self):
+        # Writes through the library invalidate cached entities
+        a = admin_with_defaults(entity_cache = 'yes')
+        e = a.initUser('user17_7')
+        a.addUser(e, False, False)
+        e = a.initGroup('group17_7')
+        a.addGroup(e)
+        e = a.lookupUserByName('user17_7')
+        e = a.lookupUserByName('user17_7')
+        self.assertEqual(e[libuser.GECOS], [])
+        e[libuser.GECOS] = 'gecos17_7'
+        a.modifyUser(e, False)
+        (hits, misses) = a.getCacheStatistics()
+        e = a.lookupUserByName('user17_7')
+        self.assertEqual(e[libuser.GECOS], ['gecos17_7'])
+        self.assertEqual(a.getCacheStatistics(), (hits, misses + 1))
+        a.lockUser(e)
+        self.assertEqual(a.userIsLocked(a.lookupUserByName('user17_7')), 1)
+        e = a.lookupGroupByName('group17_7')
+        e[libuser.MEMBERNAME] = 'user17_7'
+        a.modifyGroup(e)
+        e = a.lookupGroupByName('group17_7')
+        self.assertEqual(e[libuser.MEMBERNAME], ['user17_7'])
+        a.deleteGroup(e)
+        self.assertIsNone(a.lookupGroupByName('group17_7'))
+        e = a.lookupUserByName('user17_7')
+        a.deleteUser(e, False, False)
+        self.assertIsNone(a.lookupUserByName('user17_7'))
+        del a
+
+    def testParallelReads(self):
+        a = admin_with_defaults(parallel_reads = 'yes')
+        e = self.a.initUser('user17_8')
+        self.a.addUser(e, False, False)
+        uid = e[libuser.UIDNUMBER][0]
+        e = self.a.initGroup('group17_8')
+        e[libuser.MEMBERNAME] = 'user17_8'
+        self.a.addGroup(e)
+        gid = e[libuser.GIDNUMBER][0]
+        # The results combine the files and shadow modules as in a
+        # sequential lookup.
+        for admin in (self.a, a):
+            e = admin.lookupUserByName('user17_8')
+            self.assertEqual(e[libuser.UIDNUMBER], [uid])
+            self.assertEqual(e[libuser.SHADOWNAME], ['user17_8'])
+            e = admin.lookupUserById(uid)
+            self.assertEqual(e[libuser.USERNAME], ['user17_8'])
+            self.assertEqual(admin.userIsLocked(e), 0)
+            e = admin.lookupGroupById(gid)
+            self.assertEqual(e[libuser.GROUPNAME], ['group17_8'])
+            self.assertEqual(e[libuser.MEMBERNAME], ['user17_8'])
+            self.assertIn('user17_8', admin.enumerateUsers('user17_*'))
+            self.assertEqual(admin.enumerateUsersByGroup('group17_8'),
+                             ['user17_8'])
+            self.assertEqual(admin.enumerateGroupsByUser('user17_8'),
+                             ['group17_8'])
+            self.assertIsNone(admin.lookupUserByName('user17_does_not_exist'))
+        del a
+
     def testGroupLookupId(self):
         e = self.a.initGroup('group18_1')
         self.a.addGroup(e)
@@ -882,6 +1210,23 @@ class Tests(unittest.TestCase):
         e = self.a.lookupGroupById(LARGE_ID + 1810)
         self.assertEqual(e, None)
 
+    def testGroupsLookupMany(self):
+        e = self.a.initGroup('group18_20')
+        self.a.addGroup(e)
+        gid = e[libuser.GIDNUMBER][0]
+        del e
+        e = self.a.initGroup('group18_21')
+        self.a.addGroup(e)
+        gid2 = e[libuser.GIDNUMBER][0]
+        del e
+        v = self.a.lookupGroupsByNames(['group18_21', 'group18_20',
+                                        'group18_does_not_exist'])
+        self.assertEqual([e[libuser.GROUPNAME] for e in v],
+                         [['group18_21'], ['group18_20']])
+        v = self.a.lookupGroupsByIds([gid, 999999, gid2])
+        self.assertEqual([e[libuser.GIDNUMBER] for e in v], [[gid], [gid2]])
+        self.assertEqual(v[0][libuser.GROUPNAME], ['group18_20'])
+
     def testGroupDefault(self):
         # Test the default/LU_GROUPNAME = %n preserves groupnames that appear
         # to be numbers
@@ -1476,6 +1821,127 @@ class Tests(unittest.TestCase):
         self.a.addGroup(e)
         self.assertEqual(self.a.enumerateGroupsFull('group31_3:*'), [])
 
+    def testFirstUnusedId(self):
+        base = LARGE_ID + 4100
+        for i in (0, 1, 3):
+            e = self.a.initUser('user41_%d' % i)
+            e[libuser.UIDNUMBER] = base + i
+            self.a.addUser(e, False, False)
+            del e
+        self.assertEqual(self.a.getFirstUnusedUid(start=base), base + 2)
+        # IDs allocated behind libuser's back are still noticed
+        with open(os.path.join(workdir, 'files/passwd'), 'a') as f:
+            f.write('user41_2::%d:%d:::\n' % (base + 2, base + 2))
+        self.assertEqual(self.a.getFirstUnusedUid(start=base), base + 4)
+        e = self.a.lookupUserByName('user41_1')
+        self.a.deleteUser(e, False, False)
+        del e
+        self.assertEqual(self.a.getFirstUnusedUid(start=base), base + 1)
+        # base + 1 is unused, but base + 2 is not
+        self.assertEqual(self.a.reserveUnusedUids(3, start=base), base + 4)
+        self.assertEqual(self.a.getFirstUnusedUid(start=base), base + 1)
+        self.assertEqual(self.a.getFirstUnusedUid(start=base + 2), base + 7)
+        # Reservations are private to the context
+        self.assertEqual(libuser.admin().getFirstUnusedUid(start=base + 2),
+                         base + 4)
+        self.assertRaises(ValueError, self.a.reserveUnusedUids, 0)
+
+    def testCryptPasswords(self):
+        passwords = ['password%d' % i for i in range(8)]
+        crypted = self.a.cryptPasswords(passwords)
+        self.assertEqual(len(crypted), len(passwords))
+        for (p, c) in zip(passwords, crypted):
+            self.assertEqual(c[:3], '$1$')
+            self.assertEqual(crypt.crypt(p, c), c)
+        self.assertEqual(len(set(crypted)), len(crypted))
+        self.assertEqual(self.a.cryptPasswords([]), [])
+        self.assertRaises(TypeError, self.a.cryptPasswords, [1])
+        e = self.a.initUser('user39_1')
+        self.a.addUser(e, False, False)
+        self.a.setpassUser(e, crypted[0], True)
+        del e
+        e = self.a.lookupUserByName('user39_1')
+        self.assertEqual(e[libuser.SHADOWPASSWORD], [crypted[0]])
+
+    def testTransactionCommit(self):
+        self.a.beginTransaction()
+        self.assertRaises(RuntimeError, self.a.beginTransaction)
+        g = self.a.initGroup('group40_1')
+        self.a.addGroup(g)
+        gid = g[libuser.GIDNUMBER][0]
+        for name in ('user40_1', 'user40_2', 'user40_3'):
+            e = self.a.initUser(name)
+            e[libuser.GIDNUMBER] = gid
+            self.a.addUser(e, False, False)
+            self.a.setpassUser(e, 'password', False)
+            del e
+        # Changes are visible to this context before commit...
+        e = self.a.lookupUserByName('user40_2')
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.GIDNUMBER], [gid])
+        self.assertEqual(sorted(self.a.enumerateUsersByGroup('group40_1')),
+                         ['user40_1', 'user40_2', 'user40_3'])
+        # ... but not written out.
+        with open(os.path.join(workdir, 'files/passwd')) as f:
+            self.assertNotIn('user40_1:', f.read())
+        self.a.commitTransaction()
+        with open(os.path.join(workdir, 'files/passwd')) as f:
+            self.assertIn('user40_3:', f.read())
+        a2 = libuser.admin()
+        e = a2.lookupUserByName('user40_1')
+        self.assertIsNotNone(e)
+        self.assertTrue(crypt.crypt('password', e[libuser.SHADOWPASSWORD][0])
+                        == e[libuser.SHADOWPASSWORD][0])
+        self.assertIsNotNone(a2.lookupGroupById(gid))
+        self.assertRaises(RuntimeError, self.a.commitTransaction)
+
+    def testTransactionAbort(self):
+        self.a.beginTransaction()
+        e = self.a.initUser('user40_4')
+        self.a.addUser(e, False, False)
+        del e
+        self.assertIsNotNone(self.a.lookupUserByName('user40_4'))
+        # A failed operation leaves the transaction usable
+        e = self.a.initUser('user40_4')
+        self.assertRaises(RuntimeError, self.a.addUser, e, False, False)
+        del e
+        self.a.abortTransaction()
+        self.assertIsNone(self.a.lookupUserByName('user40_4'))
+        self.a.abortTransaction()
+        # The context is usable without a transaction afterwards
+        e = self.a.initUser('user40_5')
+        self.a.addUser(e, False, False)
+        del e
+        self.assertIsNotNone(libuser.admin().lookupUserByName('user40_5'))
+
+    def testTransactionRename(self):
+        e = self.a.initUser('user40_6')
+        e[libuser.UIDNUMBER] = 4061
+        self.a.addUser(e, False, False)
+        del e
+        self.a.beginTransaction()
+        # Look the user up twice so that the file gets indexed
+        self.assertIsNotNone(self.a.lookupUserByName('user40_6'))
+        e = self.a.lookupUserByName('user40_6')
+        self.assertIsNotNone(self.a.lookupUserById(4061))
+        # Changes of the same length leave the file size unchanged
+        e[libuser.USERNAME] = 'user40_7'
+        e[libuser.UIDNUMBER] = 4071
+        self.a.modifyUser(e, False)
+        del e
+        self.assertIsNone(self.a.lookupUserByName('user40_6'))
+        self.assertIsNone(self.a.lookupUserById(4061))
+        e = self.a.lookupUserByName('user40_7')
+        self.assertIsNotNone(e)
+        self.assertEqual(e[libuser.UIDNUMBER], [4071])
+        self.assertEqual(self.a.lookupUserById(4071)[libuser.USERNAME],
+                         ['user40_7'])
+        e = self.a.initUser('user40_7')
+        self.assertRaises(RuntimeError, self.a.addUser, e, False, False)
+        del e
+        self.a.commitTransaction()
+        self.assertIsNotNone(libuser.admin().lookupUserByName('user40_7'))
+
     # ValidateIdValue is unrelated to the files module.
     def testValidateIdValue(self):
         libuser.validateIdValue(0)
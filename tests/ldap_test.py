@@ -1,4 +1,6 @@
 import libuser
+import os
+import re
 import unittest
 
 # crypt was dropped from Python standard library in 3.13
@@ -56,6 +58,25 @@ class Tests(unittest.TestCase):
         e = self.a.lookupUserById(LARGE_ID + 310)
         self.assertEqual(e, None)
 
+    def testUserLookupId2(self):
+        # Distinguished names remembered by earlier lookups are checked
+        e = self.a.initUser('user3_2')
+        self.a.addUser(e, False, False)
+        uid = e[libuser.UIDNUMBER][0]
+        del e
+        e = self.a.lookupUserById(uid)
+        self.assertEqual(e[libuser.USERNAME], ['user3_2'])
+        self.assertEqual(e[libuser.HOMEDIRECTORY], ['/home/user3_2'])
+        e[libuser.USERNAME] = 'user3_2new'
+        self.a.modifyUser(e, False)
+        del e
+        self.assertEqual(self.a.lookupUserByName('user3_2'), None)
+        e = self.a.lookupUserById(uid)
+        self.assertEqual(e[libuser.USERNAME], ['user3_2new'])
+        del e
+        e = self.a.lookupUserByName('user3_2new')
+        self.assertEqual(e[libuser.UIDNUMBER], [uid])
+
     # testUserDefault
     # There is little to test, in addition most is configurable
 
@@ -628,6 +649,20 @@ class Tests(unittest.TestCase):
                     for x in self.a.enumerateUsersFull('user16*')])
         self.assertEqual(v, [['user16_1'], ['user16_2']])
 
+    def testUsersEnumerateFullStream(self):
+        for i in range(3, 8):
+            e = self.a.initUser('user37_%d' % i)
+            self.a.addUser(e, False, False)
+        # More entries than ldap/page_size
+        v = []
+        self.a.enumerateUsersFullStream(v.append, 'user37_*')
+        self.assertEqual(sorted([x[libuser.USERNAME] for x in v]),
+                         [['user37_%d' % i] for i in range(3, 8)])
+        v = []
+        self.a.enumerateUsersFullStream(lambda e: v.append(e) or False,
+                                        'user37_*')
+        self.assertEqual(len(v), 1)
+
     def testUsersEnumerateByGroupFull1(self):
         gid = 3401 # Hopefully unique
         e = self.a.initGroup('group34_1')
@@ -1103,6 +1138,71 @@ class Tests(unittest.TestCase):
         self.assertEqual(self.a.enumerateGroupsByUser('user30_3'),
                          ['group30_4'])
 
+    def testGroupsEnumerateByUser4(self):
+        # The primary group comes first, also if it lists the user
+        gid = 3004 # Hopefully unique
+        e = self.a.initUser('user30_4')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addUser(e, False, False)
+        e = self.a.initGroup('group30_5')
+        e[libuser.GIDNUMBER] = gid + 10
+        e[libuser.MEMBERNAME] = 'user30_4'
+        self.a.addGroup(e)
+        e = self.a.initGroup('group30_6')
+        e[libuser.GIDNUMBER] = gid
+        e[libuser.MEMBERNAME] = 'user30_4'
+        self.a.addGroup(e)
+        self.assertEqual(self.a.enumerateGroupsByUser('user30_4'),
+                         ['group30_6', 'group30_5'])
+        e = self.a.lookupGroupByName('group30_5')
+        e[libuser.MEMBERNAME] = []
+        self.a.modifyGroup(e)
+        self.assertEqual(self.a.enumerateGroupsByUser('user30_4'),
+                         ['group30_6'])
+
+    def testGroupsEnumerateByUser5(self):
+        # With parallel_reads, the lookup of the primary group made by the
+        # ldap module runs while the files module is in use by another thread
+        gid = 3005 # Hopefully unique
+        conf = os.environ['LIBUSER_CONF']
+        files = os.path.join(os.path.dirname(conf), 'files30_5')
+        parallel_conf = conf + '.parallel'
+        os.mkdir(files)
+        with open(os.path.join(files, 'passwd'), 'w') as f:
+            pass
+        with open(os.path.join(files, 'group'), 'w') as f:
+            f.write('group30_7:x:%d:\n' % gid)
+            f.write('group30_8:x:%d:user30_5\n' % (gid + 20))
+        with open(conf) as f:
+            text = f.read()
+        text = re.sub('^modules = ldap$',
+                      'modules = ldap files\nparallel_reads = yes', text,
+                      count = 1, flags = re.M)
+        with open(parallel_conf, 'w') as f:
+            f.write(text + '\n[files]\ndirectory = %s\nnonroot = yes\n'
+                    % files)
+        e = self.a.initUser('user30_5')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addUser(e, False, False)
+        e = self.a.initGroup('group30_9')
+        e[libuser.GIDNUMBER] = gid + 10
+        e[libuser.MEMBERNAME] = 'user30_5'
+        self.a.addGroup(e)
+        del e
+        os.environ['LIBUSER_CONF'] = parallel_conf
+        try:
+            a = libuser.admin(prompt = prompt_callback)
+            for i in range(20):
+                self.assertEqual(a.enumerateGroupsByUser('user30_5'),
+                                 ['group30_7', 'group30_9', 'group30_8'])
+                e = a.lookupUserByName('user30_5')
+                self.assertEqual(e[libuser.GIDNUMBER], [gid])
+                e = a.lookupGroupById(gid)
+                self.assertEqual(e[libuser.GROUPNAME], ['group30_7'])
+            del a
+        finally:
+            os.environ['LIBUSER_CONF'] = conf
+
     def testGroupsEnumerateFull(self):
         e = self.a.initGroup('group31_1')
         self.a.addGroup(e)
@@ -1153,6 +1253,106 @@ class Tests(unittest.TestCase):
              for x in self.a.enumerateGroupsByUserFull('user35_3')]
         self.assertEqual(v, [['group35_4']])
 
+    def testConnectionPool(self):
+        e = self.a.initUser('user36_1')
+        self.a.addUser(e, False, False)
+        del e
+        # Contexts are connected when first used; later contexts reuse the
+        # connection of earlier ones.
+        for _ in range(3):
+            a = libuser.admin(prompt = prompt_callback)
+            e = a.lookupUserByName('user36_1')
+            self.assertIsNotNone(e)
+            self.assertEqual(e[libuser.USERNAME], ['user36_1'])
+            del e
+            del a
+
+    def testTransactionCommit(self):
+        for name in ('group40_1', 'group40_2', 'group40_3', 'group40_4'):
+            e = self.a.initGroup(name)
+            self.a.addGroup(e)
+        groups = [self.a.lookupGroupByName(name)
+                  for name in ('group40_1', 'group40_2', 'group40_3',
+                               'group40_4')]
+        a2 = libuser.admin(prompt = prompt_callback)
+        a2.deleteGroup(a2.lookupGroupByName('group40_4'))
+        del a2
+        self.a.beginTransaction()
+        for e in groups:
+            e[libuser.MEMBERNAME] = 'user40_1'
+            self.a.modifyGroup(e)
+        # Changes are visible to this context before commit
+        e = self.a.lookupGroupByName('group40_2')
+        self.assertEqual(e[libuser.MEMBERNAME], ['user40_1'])
+        del e
+        # The failed modification is reported by the commit
+        self.assertRaises(RuntimeError, self.a.commitTransaction)
+        for name in ('group40_1', 'group40_2', 'group40_3'):
+            e = self.a.lookupGroupByName(name)
+            self.assertEqual(e[libuser.MEMBERNAME], ['user40_1'])
+
+    def testReplica(self):
+        gid = 4101 # Hopefully unique
+        conf = os.environ['LIBUSER_CONF']
+        replica = os.path.join(os.path.dirname(conf), 'replica')
+        replica_conf = conf + '.replica'
+        with open(conf) as f:
+            text = f.read()
+        # [ldap] is the last section
+        with open(replica_conf, 'w') as f:
+            f.write(text + 'replica = %s\n' % replica)
+        e = self.a.initUser('user41_1')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addUser(e, False, False)
+        e = self.a.initGroup('group41_1')
+        e[libuser.GIDNUMBER] = gid
+        self.a.addGroup(e)
+        e = self.a.initGroup('group41_2')
+        e[libuser.GIDNUMBER] = gid + 10
+        e[libuser.MEMBERNAME] = 'user41_1'
+        self.a.addGroup(e)
+        del e
+        os.environ['LIBUSER_CONF'] = replica_conf
+        try:
+            a = libuser.admin(prompt = prompt_callback)
+            e = a.lookupUserByName('user41_1')
+            if not os.path.exists(replica):
+                self.skipTest('The server does not support synchronization')
+            st = os.lstat(replica)
+            self.assertEqual(st.st_mode & 0o7777, 0o600)
+            self.assertEqual(st.st_uid, os.geteuid())
+            self.assertEqual(e[libuser.GIDNUMBER], [gid])
+            uid = e[libuser.UIDNUMBER][0]
+            self.assertEqual(a.lookupUserById(uid)[libuser.USERNAME],
+                             ['user41_1'])
+            self.assertEqual(a.lookupGroupById(gid + 10)[libuser.MEMBERNAME],
+                             ['user41_1'])
+            self.assertEqual(a.lookupUserByName('user41_does_not_exist'),
+                             None)
+            self.assertEqual(a.enumerateUsers('user41*'), ['user41_1'])
+            self.assertEqual(sorted(a.enumerateGroupsByUser('user41_1')),
+                             ['group41_1', 'group41_2'])
+            self.assertEqual(sorted(a.enumerateUsersByGroup('group41_2')),
+                             ['user41_1'])
+            # Changes by this context are seen immediately
+            e[libuser.GECOS] = 'Changed'
+            a.modifyUser(e, False)
+            self.assertEqual(a.lookupUserByName('user41_1')[libuser.GECOS],
+                             ['Changed'])
+            del e
+            del a
+            # Changes by other contexts are seen by new contexts
+            self.a.deleteGroup(self.a.lookupGroupByName('group41_2'))
+            a = libuser.admin(prompt = prompt_callback)
+            self.assertEqual(a.lookupGroupByName('group41_2'), None)
+            self.assertEqual(a.enumerateGroupsByUser('user41_1'),
+                             ['group41_1'])
+            self.assertEqual(a.lookupUserByName('user41_1')[libuser.GECOS],
+                             ['Changed'])
+            del a
+        finally:
+            os.environ['LIBUSER_CONF'] = conf
+
     def tearDown(self):
         del self.a
 